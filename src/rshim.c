@@ -4,13 +4,26 @@
  *
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <arpa/inet.h>
 #include <getopt.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+#include <setjmp.h>
 #include <signal.h>
 #include <stdio.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/param.h>
 #include <sys/poll.h>
@@ -23,8 +36,14 @@
 
 #include "rshim.h"
 
-/* Maximum number of devices supported. */
-#define RSHIM_MAX_DEV 64
+/* Largest /dev/rshim<N> index, the device slots are allocated on demand. */
+#define RSHIM_MAX_INDEX 4095
+
+/* Highest NUMA node the device buffers can be bound to, plus one. */
+#define RSHIM_NUMA_MAX_NODES 1024
+
+/* Buckets of the device registry hash tables. */
+#define RSHIM_HASH_SIZE 256
 
 /* RShim timer interval in milliseconds. */
 #define RSHIM_TIMER_INTERVAL 1
@@ -32,6 +51,12 @@
 /* Cycles to poll the network initialization before timeout. */
 #define RSHIM_NET_INIT_DELAY (60000 / RSHIM_TIMER_INTERVAL)
 
+/* Console poll period in timer ticks when idle. */
+#define RSHIM_CONS_POLL_TICKS 100
+
+/* Network poll period in timer ticks when idle. */
+#define RSHIM_NET_POLL_TICKS 100
+
 /* Keepalive period in milliseconds. */
 static int rshim_keepalive_period = 300;
 
@@ -49,73 +74,94 @@ static int rshim_keepalive_period = 300;
     int n = ((head) + end) & ((size)-1); \
     n < end ? n : end; })
 
+/*
+ * Atomic CIRC indices of the channel FIFOs: the producer only moves the head
+ * and the consumer only the tail. Indices are published with release and
+ * read with acquire semantics, so the data copied in or out before an index
+ * update is visible to the other side once it sees the new index, and the
+ * copies don't need ringlock. The channel side of a FIFO is serialized by
+ * its own lock, which keeps one producer and one consumer per ring; only
+ * the TMFIFO drain and fill, rshim_fifo_input() and rshim_fifo_output(),
+ * run under bd->mutex and ringlock. The condvars are only used to sleep,
+ * see rshim_fifo_sleep().
+ */
+#define fifo_idx(idx) __atomic_load_n(&(idx), __ATOMIC_ACQUIRE)
+#define fifo_set_idx(idx, val) __atomic_store_n(&(idx), (val), __ATOMIC_RELEASE)
+
 #define read_empty(bd, chan) \
-  (CIRC_CNT((bd)->read_fifo[chan].head, \
-    (bd)->read_fifo[chan].tail, READ_FIFO_SIZE) == 0)
+  (CIRC_CNT(fifo_idx((bd)->read_fifo[chan].head), \
+    fifo_idx((bd)->read_fifo[chan].tail), (bd)->read_fifo[chan].size) == 0)
 #define read_full(bd, chan) \
-  (CIRC_SPACE((bd)->read_fifo[chan].head, \
-    (bd)->read_fifo[chan].tail, READ_FIFO_SIZE) == 0)
+  (CIRC_SPACE(fifo_idx((bd)->read_fifo[chan].head), \
+    fifo_idx((bd)->read_fifo[chan].tail), (bd)->read_fifo[chan].size) == 0)
 #define read_space(bd, chan) \
-  CIRC_SPACE((bd)->read_fifo[chan].head, \
-    (bd)->read_fifo[chan].tail, READ_FIFO_SIZE)
+  CIRC_SPACE(fifo_idx((bd)->read_fifo[chan].head), \
+    fifo_idx((bd)->read_fifo[chan].tail), (bd)->read_fifo[chan].size)
 #define read_cnt(bd, chan) \
-  CIRC_CNT((bd)->read_fifo[chan].head, \
-    (bd)->read_fifo[chan].tail, READ_FIFO_SIZE)
+  CIRC_CNT(fifo_idx((bd)->read_fifo[chan].head), \
+    fifo_idx((bd)->read_fifo[chan].tail), (bd)->read_fifo[chan].size)
 #define read_cnt_to_end(bd, chan) \
-  CIRC_CNT_TO_END((bd)->read_fifo[chan].head, \
-    (bd)->read_fifo[chan].tail, READ_FIFO_SIZE)
+  CIRC_CNT_TO_END(fifo_idx((bd)->read_fifo[chan].head), \
+    fifo_idx((bd)->read_fifo[chan].tail), (bd)->read_fifo[chan].size)
 #define read_data_ptr(bd, chan) \
   ((bd)->read_fifo[chan].data + \
-    ((bd)->read_fifo[chan].tail & (READ_FIFO_SIZE - 1)))
+    (fifo_idx((bd)->read_fifo[chan].tail) & ((bd)->read_fifo[chan].size - 1)))
 #define read_consume_bytes(bd, chan, nbytes) \
-  ((bd)->read_fifo[chan].tail = \
-    ((bd)->read_fifo[chan].tail + (nbytes)) & (READ_FIFO_SIZE - 1))
+  fifo_set_idx((bd)->read_fifo[chan].tail, \
+    ((bd)->read_fifo[chan].tail + (nbytes)) & ((bd)->read_fifo[chan].size - 1))
 #define read_space_to_end(bd, chan) \
-  CIRC_SPACE_TO_END((bd)->read_fifo[chan].head, \
-    (bd)->read_fifo[chan].tail, READ_FIFO_SIZE)
+  CIRC_SPACE_TO_END(fifo_idx((bd)->read_fifo[chan].head), \
+    fifo_idx((bd)->read_fifo[chan].tail), (bd)->read_fifo[chan].size)
 #define read_space_offset(bd, chan) \
-  ((bd)->read_fifo[chan].head & (READ_FIFO_SIZE - 1))
+  (fifo_idx((bd)->read_fifo[chan].head) & ((bd)->read_fifo[chan].size - 1))
 #define read_space_ptr(bd, chan) \
   ((bd)->read_fifo[chan].data + read_space_offset(bd, (chan)))
 #define read_add_bytes(bd, chan, nbytes) \
-  ((bd)->read_fifo[chan].head = \
-    ((bd)->read_fifo[chan].head + (nbytes)) & (READ_FIFO_SIZE - 1))
+  fifo_set_idx((bd)->read_fifo[chan].head, \
+    ((bd)->read_fifo[chan].head + (nbytes)) & ((bd)->read_fifo[chan].size - 1))
 #define read_reset(bd, chan) \
-  ((bd)->read_fifo[chan].head = (bd)->read_fifo[chan].tail = 0)
+  (fifo_set_idx((bd)->read_fifo[chan].head, 0), \
+   fifo_set_idx((bd)->read_fifo[chan].tail, 0))
 
 #define write_empty(bd, chan) \
-  (CIRC_CNT((bd)->write_fifo[chan].head, \
-    (bd)->write_fifo[chan].tail, WRITE_FIFO_SIZE) == 0)
+  (CIRC_CNT(fifo_idx((bd)->write_fifo[chan].head), \
+    fifo_idx((bd)->write_fifo[chan].tail), (bd)->write_fifo[chan].size) == 0)
 #define write_full(bd, chan) \
-  (CIRC_SPACE((bd)->write_fifo[chan].head, \
-    (bd)->write_fifo[chan].tail, WRITE_FIFO_SIZE) == 0)
+  (CIRC_SPACE(fifo_idx((bd)->write_fifo[chan].head), \
+    fifo_idx((bd)->write_fifo[chan].tail), (bd)->write_fifo[chan].size) == 0)
 #define write_space(bd, chan) \
-  CIRC_SPACE((bd)->write_fifo[chan].head, \
-    (bd)->write_fifo[chan].tail, WRITE_FIFO_SIZE)
+  CIRC_SPACE(fifo_idx((bd)->write_fifo[chan].head), \
+    fifo_idx((bd)->write_fifo[chan].tail), (bd)->write_fifo[chan].size)
 #define write_cnt(bd, chan) \
-  CIRC_CNT((bd)->write_fifo[chan].head, \
-    (bd)->write_fifo[chan].tail, WRITE_FIFO_SIZE)
+  CIRC_CNT(fifo_idx((bd)->write_fifo[chan].head), \
+    fifo_idx((bd)->write_fifo[chan].tail), (bd)->write_fifo[chan].size)
 #define write_cnt_to_end(bd, chan) \
-  CIRC_CNT_TO_END((bd)->write_fifo[chan].head, \
-    (bd)->write_fifo[chan].tail, WRITE_FIFO_SIZE)
+  CIRC_CNT_TO_END(fifo_idx((bd)->write_fifo[chan].head), \
+    fifo_idx((bd)->write_fifo[chan].tail), (bd)->write_fifo[chan].size)
 #define write_data_offset(bd, chan) \
-  ((bd)->write_fifo[chan].tail & (WRITE_FIFO_SIZE - 1))
+  (fifo_idx((bd)->write_fifo[chan].tail) & ((bd)->write_fifo[chan].size - 1))
 #define write_data_ptr(bd, chan) \
   ((bd)->write_fifo[chan].data + write_data_offset(bd, (chan)))
 #define write_consume_bytes(bd, chan, nbytes) \
-  ((bd)->write_fifo[chan].tail = \
-    ((bd)->write_fifo[chan].tail + (nbytes)) & (WRITE_FIFO_SIZE - 1))
+  fifo_set_idx((bd)->write_fifo[chan].tail, \
+    ((bd)->write_fifo[chan].tail + (nbytes)) & ((bd)->write_fifo[chan].size - 1))
 #define write_space_to_end(bd, chan) \
-  CIRC_SPACE_TO_END((bd)->write_fifo[chan].head, \
-    (bd)->write_fifo[chan].tail, WRITE_FIFO_SIZE)
+  CIRC_SPACE_TO_END(fifo_idx((bd)->write_fifo[chan].head), \
+    fifo_idx((bd)->write_fifo[chan].tail), (bd)->write_fifo[chan].size)
 #define write_space_ptr(bd, chan) \
   ((bd)->write_fifo[chan].data + \
-    ((bd)->write_fifo[chan].head & (WRITE_FIFO_SIZE - 1)))
+    (fifo_idx((bd)->write_fifo[chan].head) & ((bd)->write_fifo[chan].size - 1)))
 #define write_add_bytes(bd, chan, nbytes) \
-  ((bd)->write_fifo[chan].head = \
-    ((bd)->write_fifo[chan].head + (nbytes)) & (WRITE_FIFO_SIZE - 1))
+  fifo_set_idx((bd)->write_fifo[chan].head, \
+    ((bd)->write_fifo[chan].head + (nbytes)) & ((bd)->write_fifo[chan].size - 1))
 #define write_reset(bd, chan) \
-  ((bd)->write_fifo[chan].head = (bd)->write_fifo[chan].tail = 0)
+  (fifo_set_idx((bd)->write_fifo[chan].head, 0), \
+   fifo_set_idx((bd)->write_fifo[chan].tail, 0))
+
+/* Trace the head and tail of a FIFO after they moved. */
+#define trace_fifo(bd, event, fifo, chan) \
+  RSHIM_TRACE(bd, event, chan, ((uint64_t)(fifo)[chan].head << 32) | \
+              (fifo)[chan].tail)
 
 /*
  * Tile-to-host bits (UART 0 scratchpad).
@@ -157,11 +203,26 @@ static struct termios init_console_termios = {
 /* RShim global mutex. */
 static pthread_mutex_t rshim_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-/* Current timer ticks. */
-static int rshim_timer_ticks;
+/*
+ * Device timers ordered by deadline in a min-heap. The timerfd is armed
+ * once for the earliest deadline instead of ticking while idle.
+ */
+static pthread_mutex_t rshim_timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static rshim_backend_t **rshim_timer_heap;
+static int rshim_timer_cnt;
+static int rshim_timer_size;
+static int rshim_timer_fd = -1;
+static uint64_t rshim_timer_armed_ns;
+static uint64_t rshim_timer_start_ns;
+
+/* Current timer ticks since the daemon started. */
+static inline int rshim_timer_now(void)
+{
+  return (int)((rshim_get_time_ns() - rshim_timer_start_ns) / 1000000 /
+               RSHIM_TIMER_INTERVAL);
+}
 
-/* File handler for the worker function. */
-static int rshim_work_fd[2];
+static void rshim_timer_schedule(rshim_backend_t *bd, int ms);
 
 /* Current RShim backend name. */
 static char *rshim_backend_name;
@@ -176,10 +237,48 @@ char *rshim_static_dev_name;
 /* Default configuration file. */
 char *rshim_cfg_file = "/etc/rshim.conf";
 
-/* Array of devices and device names. */
-rshim_backend_t *rshim_devs[RSHIM_MAX_DEV];
-char *rshim_dev_names[RSHIM_MAX_DEV];
-char *rshim_blocked_dev_names[RSHIM_MAX_DEV];
+/* Device name entry of the registry hash tables. */
+typedef struct rshim_name {
+  struct rshim_name *next;
+  char *name;
+  int index;
+} rshim_name_t;
+
+/*
+ * Device registry, protected by rshim_devs_lock:
+ * - rshim_devs[] and rshim_dev_names[] by index, grown on demand;
+ * - rshim_live[], the registered devices packed for iteration;
+ * - hash tables of the device names, backend devices and blocked names.
+ */
+static pthread_rwlock_t rshim_devs_lock = PTHREAD_RWLOCK_INITIALIZER;
+static rshim_backend_t **rshim_devs;
+static char **rshim_dev_names;
+static int rshim_devs_size;
+static rshim_backend_t **rshim_live;
+static int rshim_live_cnt;
+static int rshim_live_size;
+
+/* SIGHUP wake-up fd of the main loop, see rshim_sig_hup(). */
+static int rshim_hup_fd = -1;
+static rshim_name_t *rshim_name_hash[RSHIM_HASH_SIZE];
+static rshim_name_t *rshim_blocked_hash[RSHIM_HASH_SIZE];
+static rshim_backend_t *rshim_dev_hash[RSHIM_HASH_SIZE];
+
+/* Generic configuration entries ("KEY value [rshim-name|device-name]"). */
+#define RSHIM_MAX_CFG 128
+typedef struct {
+  char key[32];
+  char value[64];
+  char dev_name[RSHIM_DEV_NAME_LEN];
+} rshim_cfg_t;
+static rshim_cfg_t rshim_cfgs[RSHIM_MAX_CFG];
+static int rshim_cfg_num;
+
+/* Polling policy, see rshim_poll_wait(). */
+static int rshim_poll_spin_count = 100;
+static int rshim_poll_sleep_min_us = 1;
+static int rshim_poll_sleep_max_us = 1000;
+volatile uint64_t rshim_poll_stats[RSH_POLL_STAGES];
 
 int rshim_log_level = LOG_NOTICE;
 bool rshim_daemon_mode = true;
@@ -242,11 +341,208 @@ static int rshim_fd_full_write(int fd, void *data, int len)
   return total;
 }
 
-/* Wake up the worker function. */
+/*
+ * Wake up the worker function. Signals are coalesced until the work handler
+ * runs, and the eventfd counter coalesces the rest.
+ */
 void rshim_work_signal(rshim_backend_t *bd)
 {
-  if (__sync_bool_compare_and_swap(&bd->work_pending, false, true))
-    rshim_fd_full_write(rshim_work_fd[1], &bd->index, sizeof(bd->index));
+  uint64_t one = 1;
+
+  if (!bd->registered || bd->work_fd < 0)
+    return;
+
+  if (__sync_bool_compare_and_swap(&bd->work_pending, false, true)) {
+    RSHIM_TRACE(bd, RSH_TRACE_WORK_SIGNAL, 0, 0);
+    bd->work_signal_time = rshim_get_time_ns();
+    rshim_fd_full_write(bd->work_fd, &one, sizeof(one));
+  }
+}
+
+/* Read a one-line sysfs attribute, returns its length or -errno. */
+int rshim_sysfs_read(const char *path, char *buf, int size)
+{
+  int fd, n;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -errno;
+
+  n = read(fd, buf, size - 1);
+  if (n < 0)
+    n = -errno;
+  close(fd);
+  if (n < 0)
+    return n;
+
+  while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == ' '))
+    n--;
+  buf[n] = 0;
+
+  return n;
+}
+
+/*
+ * Apply NUMA_AFFINITY and NUMA_NODE on top of the placement found by the
+ * backend. Called from rshim_register() before the buffers are allocated.
+ */
+static void rshim_numa_setup(rshim_backend_t *bd)
+{
+  char path[64], buf[RSHIM_CPULIST_LEN];
+  int node;
+
+  if (!rshim_cfg_get_int(bd, "NUMA_AFFINITY", 1)) {
+    bd->has_numa = false;
+    free(bd->local_cpus);
+    bd->local_cpus = NULL;
+    return;
+  }
+
+  node = rshim_cfg_get_int(bd, "NUMA_NODE", -1);
+  if (node >= 0 && (!bd->has_numa || node != bd->numa_node)) {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    if (rshim_sysfs_read(path, buf, sizeof(buf)) < 0) {
+      RSHIM_WARN("rshim%d: no NUMA node %d\n", bd->index, node);
+    } else {
+      free(bd->local_cpus);
+      bd->local_cpus = strdup(buf);
+      bd->numa_node = node;
+      bd->has_numa = true;
+    }
+  }
+
+  if (bd->has_numa)
+    RSHIM_INFO("rshim%d: NUMA node %d, CPUs %s\n", bd->index, bd->numa_node,
+               bd->local_cpus ? bd->local_cpus : "none");
+}
+
+/*
+ * Allocate a zeroed per-device buffer. Each one has its own mapping on
+ * Linux, so that it can be bound to the NUMA node of the device before
+ * the pages are faulted in.
+ */
+static void *rshim_buf_alloc(rshim_backend_t *bd, size_t size)
+{
+#ifdef __linux__
+  unsigned long mask[RSHIM_NUMA_MAX_NODES / (8 * sizeof(unsigned long))];
+  int bits = 8 * sizeof(unsigned long);
+  void *buf;
+
+  buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+             -1, 0);
+  if (buf == MAP_FAILED)
+    return NULL;
+
+  if (bd->has_numa && bd->numa_node < RSHIM_NUMA_MAX_NODES) {
+    memset(mask, 0, sizeof(mask));
+    mask[bd->numa_node / bits] = 1UL << (bd->numa_node % bits);
+    /* The kernel takes the number of mask bits plus one. */
+    if (syscall(SYS_mbind, buf, size, MPOL_PREFERRED, mask,
+                RSHIM_NUMA_MAX_NODES + 1, 0))
+      RSHIM_DBG("rshim%d: mbind failed: %m\n", bd->index);
+  }
+
+  return buf;
+#else
+  return calloc(1, size);
+#endif
+}
+
+static void rshim_buf_free(void *buf, size_t size)
+{
+  if (!buf)
+    return;
+
+#ifdef __linux__
+  munmap(buf, size);
+#else
+  free(buf);
+#endif
+}
+
+#ifdef __linux__
+/* Parse a CPU list like "0-3,6", returns the number of CPUs in it. */
+static int rshim_parse_cpus(const char *cpus, cpu_set_t *set)
+{
+  int cpu, last;
+  char *end;
+
+  CPU_ZERO(set);
+  while (*cpus) {
+    cpu = strtol(cpus, &end, 0);
+    if (end == cpus)
+      break;
+    last = cpu;
+    if (*end == '-')
+      last = strtol(end + 1, &end, 0);
+    for (; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+      CPU_SET(cpu, set);
+    cpus = (*end == ',') ? end + 1 : end;
+  }
+
+  return CPU_COUNT(set);
+}
+#endif
+
+/*
+ * Initialize the attributes of a thread serving the device, pinned to the
+ * CPUs of the config key if set or else to the CPUs local to the device.
+ */
+void rshim_thread_attr(rshim_backend_t *bd, const char *key,
+                       pthread_attr_t *attr)
+{
+  const char *cpus = key ? rshim_cfg_get(bd, key) : NULL;
+#ifdef __linux__
+  cpu_set_t set, allowed;
+#endif
+
+  pthread_attr_init(attr);
+
+#ifdef __linux__
+  if (!cpus || !*cpus)
+    cpus = bd->local_cpus;
+  if (!cpus || !rshim_parse_cpus(cpus, &set))
+    return;
+
+  /* A set outside of the allowed CPUs would fail the thread creation. */
+  if (!sched_getaffinity(0, sizeof(allowed), &allowed))
+    CPU_AND(&set, &set, &allowed);
+  if (!CPU_COUNT(&set) ||
+      pthread_attr_setaffinity_np(attr, sizeof(set), &set))
+    RSHIM_WARN("rshim%d: failed to set CPU affinity %s\n", bd->index, cpus);
+#endif
+}
+
+/* Default burst read which goes through read_rshim() word by word. */
+static int rshim_read_rshim_burst_default(rshim_backend_t *bd, int chan,
+                                          int addr, uint64_t *values, int n)
+{
+  int i, rc;
+
+  for (i = 0; i < n; i++) {
+    rc = bd->read_rshim(bd, chan, addr, &values[i]);
+    if (rc < 0)
+      return rc;
+  }
+
+  return 0;
+}
+
+/* Default burst write which goes through write_rshim() word by word. */
+static int rshim_write_rshim_burst_default(rshim_backend_t *bd, int chan,
+                                           int addr, const uint64_t *values,
+                                           int n)
+{
+  int i, rc;
+
+  for (i = 0; i < n; i++) {
+    rc = bd->write_rshim(bd, chan, addr, le64toh(values[i]));
+    if (rc < 0)
+      return rc;
+  }
+
+  return 0;
 }
 
 /*
@@ -259,8 +555,8 @@ void rshim_work_signal(rshim_backend_t *bd)
 static ssize_t rshim_read_default(rshim_backend_t *bd, int devtype,
                                   char *buf, size_t count)
 {
-  int rc, total = 0, avail = 0;
-  uint64_t reg;
+  int i, n, rc, total = 0, avail = 0;
+  uint64_t *words, reg;
 
   /* Read is only supported for RShim TMFIFO. */
   if (devtype != RSH_DEV_TYPE_TMFIFO) {
@@ -280,27 +576,38 @@ static ssize_t rshim_read_default(rshim_backend_t *bd, int devtype,
       if (avail == 0)
         break;
     }
+
+    /* Read all the available whole words in one burst. */
+    n = MIN(avail, (count - total) / sizeof(reg));
+    if (n > 0) {
+      words = (uint64_t *)buf;
+      rc = bd->read_rshim_burst(bd, RSHIM_CHANNEL, RSH_TM_TILE_TO_HOST_DATA,
+                                words, n);
+      if (rc < 0)
+        break;
+
+      /*
+       * Convert it to little endian before sending to RShim. The other side
+       * should decode it as little endian as well which is usually the
+       * default case.
+       */
+      for (i = 0; i < n; i++)
+        words[i] = le64toh(words[i]);
+      buf += n * sizeof(reg);
+      total += n * sizeof(reg);
+      avail -= n;
+      continue;
+    }
+
     rc = bd->read_rshim(bd, RSHIM_CHANNEL, RSH_TM_TILE_TO_HOST_DATA, &reg);
     if (rc < 0)
       break;
 
-    /*
-     * Convert it to little endian before sending to RShim. The other side
-     * should decode it as little endian as well which is usually the default
-     * case.
-     */
+    /* Copy the rest data which is less than 8 bytes. */
     reg = le64toh(reg);
-    if (total + sizeof(reg) <= count) {
-      *(uint64_t *)buf = reg;
-      buf += sizeof(reg);
-      total += sizeof(reg);
-    } else {
-      /* Copy the rest data which is less than 8 bytes. */
-      memcpy(buf, &reg, count - total);
-      total = count;
-      break;
-    }
-    avail--;
+    memcpy(buf, &reg, count - total);
+    total = count;
+    break;
   }
 
   return total;
@@ -316,9 +623,9 @@ static ssize_t rshim_write_delayed(rshim_backend_t *bd, int devtype,
                                    const uint8_t *buf, size_t count)
 {
   int size_addr, size_mask, data_addr, max_size;
-  uint8_t pad_buf[sizeof(uint64_t)] = { 0 };
-  int rc, avail = 0, byte_cnt = 0;
-  time_t t0, t1;
+  uint64_t *words = bd->write_words;
+  int i, n, rc, avail = 0, byte_cnt = 0;
+  rshim_poll_t poll;
   uint64_t reg;
 
   switch (devtype) {
@@ -354,52 +661,54 @@ static ssize_t rshim_write_delayed(rshim_backend_t *bd, int devtype,
     if (devtype == RSH_DEV_TYPE_BOOT && !bd->boot_work_buf)
       break;
 
-    /* Add padding if less than 8 bytes left. */
-    if (byte_cnt + sizeof(uint64_t) > count) {
-      memcpy(pad_buf, buf, count - byte_cnt);
-      buf = (const uint8_t *)pad_buf;
-    }
-
-    time(&t0);
+    rshim_poll_init(&poll, 3000);
     while (avail <= 0) {
       /* Calculate available space in words. */
       rc = bd->read_rshim(bd, RSHIM_CHANNEL, size_addr, &reg);
       if (rc < 0) {
         RSHIM_ERR("read_rshim error %d\n", rc);
-        break;
+        return byte_cnt ? byte_cnt : rc;
       }
       avail = max_size - (int)(reg & size_mask) - 8;
       if (avail > 0)
         break;
+      rshim_stats_add(bd, RSH_STAT_FIFO_FULL, 1);
 
       if (devtype == RSH_DEV_TYPE_BOOT)
         return (byte_cnt > count) ? count : byte_cnt;
 
-      time(&t1);
-      if (difftime(t1, t0) > 3) {
+      if (rshim_poll_wait(&poll)) {
         if (devtype == RSH_DEV_TYPE_TMFIFO && bd->is_booting)
           return count;
-        else
-          return -ETIMEDOUT;
+        rshim_stats_add(bd, RSH_STAT_TIMEOUTS, 1);
+        return -ETIMEDOUT;
       }
     }
 
-    reg = *(uint64_t *)buf;
     /*
-     * Convert to little endian before sending to RShim. The
-     * receiving side should call le64toh() to convert it back.
+     * Write as many words as the FIFO can take in one burst. The last
+     * word is padded with zeros if less than 8 bytes left. The words keep
+     * the byte order of the stream, which is what the burst takes.
      */
-    reg = htole64(reg);
-    rc = bd->write_rshim(bd, RSHIM_CHANNEL, data_addr, reg);
+    n = MIN(avail, (count - byte_cnt + sizeof(reg) - 1) / sizeof(reg));
+    n = MIN(n, RSH_BOOT_FIFO_SIZE);
+    for (i = 0; i < n; i++) {
+      if (byte_cnt + (i + 1) * sizeof(reg) > count) {
+        words[i] = 0;
+        memcpy(&words[i], buf, count - byte_cnt - i * sizeof(reg));
+      } else {
+        memcpy(&words[i], buf, sizeof(reg));
+        buf += sizeof(reg);
+      }
+    }
+
+    rc = bd->write_rshim_burst(bd, RSHIM_CHANNEL, data_addr, words, n);
     if (rc < 0) {
       RSHIM_ERR("write_rshim error %d\n", rc);
       break;
     }
-    byte_cnt += sizeof(reg);
-    if (buf == pad_buf)
-      break;
-    buf += sizeof(reg);
-    avail--;
+    byte_cnt += n * sizeof(reg);
+    avail -= n;
   }
 
   /* Return number shouldn't count the padded bytes. */
@@ -448,6 +757,15 @@ static ssize_t rshim_write_default(rshim_backend_t *bd, int devtype,
 
 /* Boot file operations routines */
 
+static int rshim_got_peer_signal(void)
+{
+#ifdef HAVE_RSHIM_FUSE
+  return rshim_fuse_got_peer_signal();
+#else
+  return -1;
+#endif
+}
+
 /*
  * Wait for boot to complete, if necessary.  Return 0 if the boot is done
  * and it's safe to continue, an error code if something went wrong.  Note
@@ -491,17 +809,23 @@ static int wait_for_boot_done(rshim_backend_t *bd)
   return 0;
 }
 
+/* Wait for the response count to move, for up to 1s. */
 static int rshim_reg_indirect_wait(rshim_backend_t *bd, uint64_t resp_count)
 {
-  int rc, retries = 1000;
+  rshim_poll_t poll;
   uint64_t count;
+  int rc;
 
-  while (retries--) {
+  rshim_poll_init(&poll, 1000);
+  while (true) {
     rc = bd->read_rshim(bd, RSHIM_CHANNEL, RSH_MEM_ACC_RSP_CNT, &count);
     if (rc)
       return rc;
     if (count != resp_count)
       return 0;
+
+    if (rshim_poll_wait(&poll))
+      break;
   }
   RSHIM_ERR("Rshim byte access widget timeout\n");
   return -1;
@@ -618,6 +942,7 @@ int rshim_reset_control(rshim_backend_t *bd)
    * in theory this should not impact the behavior of the RShim
    * driver.
    */
+  rshim_info_invalidate(bd);
   rc = bd->write_rshim(bd, RSHIM_CHANNEL, RSH_RESET_CONTROL, reg);
   if (rc < 0) {
     RSHIM_ERR("failed to write rshim reset control error %d\n", rc);
@@ -637,22 +962,30 @@ int rshim_boot_open(rshim_backend_t *bd)
 {
   int rc;
 
+  /* The TMFIFO is reset below. */
+  rshim_fifo_lock(bd);
   pthread_mutex_lock(&bd->mutex);
 
   if (bd->is_boot_open) {
     RSHIM_INFO("can't boot, boot file already open\n");
     pthread_mutex_unlock(&bd->mutex);
+    rshim_fifo_unlock(bd);
     return -EBUSY;
   }
 
   if (!bd->has_rshim) {
     pthread_mutex_unlock(&bd->mutex);
+    rshim_fifo_unlock(bd);
     return -ENODEV;
   }
 
   RSHIM_INFO("begin booting\n");
   bd->is_booting = 1;
   bd->boot_rem_cnt = 0;
+  bd->boot_queue_head = 0;
+  bd->boot_queue_cnt = 0;
+  bd->boot_queue_off = 0;
+  bd->boot_queue_err = 0;
 
   /*
    * Before we reset the chip, make sure we don't have any
@@ -667,16 +1000,19 @@ int rshim_boot_open(rshim_backend_t *bd)
   rshim_fifo_reset(bd);
 
   /* Set RShim (external) boot mode. */
+  rshim_info_invalidate(bd);
   rc = bd->write_rshim(bd, RSHIM_CHANNEL, RSH_BOOT_CONTROL,
                        RSH_BOOT_CONTROL__BOOT_MODE_VAL_NONE);
   if (rc) {
     RSHIM_ERR("boot_open: error %d writing boot control\n", rc);
     bd->is_booting = 0;
     pthread_mutex_unlock(&bd->mutex);
+    rshim_fifo_unlock(bd);
     return rc;
   }
 
   bd->is_boot_open = 1;
+  rshim_stats_boot_start(bd);
 
   /*
    * Disable the watchdog. The channel and offset are the same on all
@@ -709,6 +1045,7 @@ int rshim_boot_open(rshim_backend_t *bd)
     RSHIM_ERR("boot_open: error %d writing reset control\n", rc);
     bd->is_boot_open = 0;
     pthread_mutex_unlock(&bd->mutex);
+    rshim_fifo_unlock(bd);
     return rc;
   }
 
@@ -718,14 +1055,194 @@ int rshim_boot_open(rshim_backend_t *bd)
 boot_open_done:
   rshim_ref(bd);
   pthread_mutex_unlock(&bd->mutex);
+  rshim_fifo_unlock(bd);
 
   /* Add a small delay for the reset. */
-  sleep(!bd->has_reprobe ? 10 : 1);
+  if (!bd->has_fast_reset)
+    sleep(!bd->has_reprobe ? 10 : 1);
 
   time(&bd->boot_write_time);
   return 0;
 }
 
+/*
+ * Wait until no more than 'max_cnt' boot buffers are queued. Called with
+ * the mutex held, which is dropped while waiting.
+ */
+static int rshim_boot_queue_wait(rshim_backend_t *bd, int max_cnt)
+{
+  struct timespec ts;
+  time_t tm;
+
+  while (bd->boot_queue_cnt > max_cnt) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += 1;
+    pthread_cond_timedwait(&bd->boot_write_complete_cond, &bd->mutex, &ts);
+
+    if (bd->boot_queue_cnt <= max_cnt)
+      break;
+
+    if (rshim_got_peer_signal() == 0)
+      return -EINTR;
+
+    time(&tm);
+    if (difftime(tm, bd->boot_write_time) > bd->boot_timeout) {
+      RSHIM_INFO("boot timeout\n");
+      rshim_stats_add(bd, RSH_STAT_TIMEOUTS, 1);
+      return -ETIMEDOUT;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Push some of the head boot buffer into the boot FIFO. Called from the
+ * work handler with the mutex held.
+ */
+static void rshim_boot_queue_drain(rshim_backend_t *bd)
+{
+  int slot = bd->boot_queue_head, len, rc;
+  rshim_poll_t poll;
+
+  /* Push the head buffer, waiting up to a timer tick when the FIFO is full. */
+  rshim_poll_init(&poll, RSHIM_TIMER_INTERVAL);
+  while (bd->boot_queue_off < bd->boot_queue_len[slot]) {
+    len = bd->boot_queue_len[slot] - bd->boot_queue_off;
+    bd->boot_work_buf = (uint8_t *)bd->boot_buf[slot] + bd->boot_queue_off;
+    rc = rshim_write_delayed(bd, RSH_DEV_TYPE_BOOT, bd->boot_work_buf, len);
+    bd->boot_work_buf = NULL;
+
+    if (rc < 0) {
+      /* Drop the queued data and report it to the next write. */
+      bd->boot_queue_err = rc;
+      bd->boot_queue_cnt = 0;
+      bd->boot_queue_off = 0;
+      pthread_cond_broadcast(&bd->boot_write_complete_cond);
+      return;
+    }
+
+    if (rc > 0) {
+      time(&bd->boot_write_time);
+      bd->boot_queue_off += rc;
+      rshim_poll_init(&poll, RSHIM_TIMER_INTERVAL);
+    } else if (rshim_poll_wait(&poll)) {
+      /* Still full; let the timer bring us back instead of spinning. */
+      __sync_fetch_and_add(&rshim_poll_stats[RSH_POLL_DEFER], 1);
+      bd->boot_queue_defer = 1;
+      rshim_timer_schedule(bd, RSHIM_TIMER_INTERVAL);
+      return;
+    }
+  }
+
+  bd->boot_queue_head = (slot + 1) % bd->boot_queue_depth;
+  bd->boot_queue_cnt--;
+  bd->boot_queue_off = 0;
+  pthread_cond_broadcast(&bd->boot_write_complete_cond);
+
+  /* Come back for the next one. */
+  if (bd->boot_queue_cnt)
+    rshim_work_signal(bd);
+}
+
+/*
+ * Queue boot data for the work handler. The next buffer is copied in
+ * without the mutex, so it's filled while the work handler drains the
+ * previous ones into the boot FIFO. Called with the mutex held and
+ * is_in_boot_write set; returns the bytes consumed or an error.
+ */
+static ssize_t rshim_boot_write_queued(rshim_backend_t *bd,
+                                       const char *user_buffer, size_t count,
+                                       int (*copy_in)(void *dest,
+                                                      const void *src,
+                                                      int count))
+{
+  size_t bytes_written = 0, buf_bytes;
+  int rc = 0, slot, next, len;
+  bool dropped = false;
+  char *buf;
+
+  while (count + bd->boot_rem_cnt >= sizeof(uint64_t)) {
+    if (bd->boot_queue_err) {
+      rc = bd->boot_queue_err;
+      bd->boot_queue_err = 0;
+      dropped = true;
+      break;
+    }
+
+    /* Backpressure only when the whole queue is in use. */
+    if (bd->boot_queue_cnt == bd->boot_queue_depth) {
+      rc = rshim_boot_queue_wait(bd, bd->boot_queue_depth - 1);
+      if (rc)
+        break;
+      continue;
+    }
+
+    slot = (bd->boot_queue_head + bd->boot_queue_cnt) % bd->boot_queue_depth;
+    buf = bd->boot_buf[slot];
+    buf_bytes = MIN(bd->boot_buf_size,
+                    (count + bd->boot_rem_cnt) & (-((size_t)8)));
+
+    /* Copy the previous remaining data first. */
+    if (bd->boot_rem_cnt)
+      memcpy(buf, &bd->boot_rem_data, bd->boot_rem_cnt);
+
+    /* The slot isn't queued yet, so nothing else touches it. */
+    pthread_mutex_unlock(&bd->mutex);
+    rc = copy_in(buf + bd->boot_rem_cnt, user_buffer,
+                 buf_bytes - bd->boot_rem_cnt);
+    pthread_mutex_lock(&bd->mutex);
+    if (rc < 0)
+      break;
+    rc = 0;
+
+    /* The queue was dropped meanwhile; don't queue behind it. */
+    if (bd->boot_queue_err) {
+      rc = bd->boot_queue_err;
+      bd->boot_queue_err = 0;
+      dropped = true;
+      break;
+    }
+
+    /*
+     * Queue at the tail as it is now. If it moved, the buffer filled is
+     * swapped in there; neither slot is queued, so both are free.
+     */
+    next = (bd->boot_queue_head + bd->boot_queue_cnt) % bd->boot_queue_depth;
+    if (next != slot) {
+      bd->boot_buf[slot] = bd->boot_buf[next];
+      bd->boot_buf[next] = buf;
+      slot = next;
+    }
+    bd->boot_queue_len[slot] = buf_bytes;
+    bd->boot_queue_cnt++;
+    rshim_work_signal(bd);
+
+    len = buf_bytes - bd->boot_rem_cnt;
+    count -= len;
+    user_buffer += len;
+    bytes_written += len;
+    bd->boot_rem_cnt = 0;
+  }
+
+  /* Buffer the remaining data. */
+  if (!rc && count + bd->boot_rem_cnt < sizeof(bd->boot_rem_data)) {
+    rc = copy_in((uint8_t *)&bd->boot_rem_data + bd->boot_rem_cnt,
+                 user_buffer, count);
+    if (rc >= 0) {
+      rc = 0;
+      bd->boot_rem_cnt += count;
+      bytes_written += count;
+    }
+  }
+
+  /* Data already taken was dropped with the queue, so report that. */
+  if (dropped)
+    return rc;
+
+  return bytes_written ? (ssize_t)bytes_written : rc;
+}
+
 int rshim_boot_write(rshim_backend_t *bd, const char *user_buffer, size_t count,
                      int (*copy_in)(void *dest, const void *src, int count))
 {
@@ -753,8 +1270,17 @@ int rshim_boot_write(rshim_backend_t *bd, const char *user_buffer, size_t count,
    */
   bd->is_in_boot_write = 1;
 
+  if (bd->boot_queue_depth > 1) {
+    rc = rshim_boot_write_queued(bd, user_buffer, count, copy_in);
+    if (rc > 0)
+      rshim_stats_boot(bd, rc);
+    bd->is_in_boot_write = 0;
+    pthread_mutex_unlock(&bd->mutex);
+    return rc;
+  }
+
   while (count + bd->boot_rem_cnt >= sizeof(uint64_t)) {
-    size_t buf_bytes = MIN(BOOT_BUF_SIZE,
+    size_t buf_bytes = MIN(bd->boot_buf_size,
                            (count + bd->boot_rem_cnt) & (-((size_t)8)));
     char *buf = bd->boot_buf[whichbuf];
 
@@ -781,6 +1307,7 @@ int rshim_boot_write(rshim_backend_t *bd, const char *user_buffer, size_t count,
       if (difftime(tm, bd->boot_write_time) > bd->boot_timeout) {
         rc = -ETIMEDOUT;
         RSHIM_INFO("boot timeout\n");
+        rshim_stats_add(bd, RSH_STAT_TIMEOUTS, 1);
       } else {
         rc = -EINTR;
       }
@@ -801,6 +1328,8 @@ int rshim_boot_write(rshim_backend_t *bd, const char *user_buffer, size_t count,
     bytes_written += count;
   }
 
+  if (bytes_written)
+    rshim_stats_boot(bd, bytes_written);
   bd->is_in_boot_write = 0;
   pthread_mutex_unlock(&bd->mutex);
 
@@ -810,21 +1339,48 @@ int rshim_boot_write(rshim_backend_t *bd, const char *user_buffer, size_t count,
     return rc;
 }
 
-void rshim_boot_release(rshim_backend_t *bd)
+/*
+ * Close the boot stream. Returns an error if the queued boot data couldn't
+ * be pushed out, in which case the rest of the stream is dropped.
+ */
+int rshim_boot_release(rshim_backend_t *bd)
 {
-  int rc;
+  int rc, err = 0;
 
   pthread_mutex_lock(&bd->mutex);
 
+  /* Let the queued boot data out before anything else. */
+  if (bd->boot_queue_cnt) {
+    err = rshim_boot_queue_wait(bd, 0);
+    if (err) {
+      RSHIM_ERR("boot_release: boot queue not drained, err %d\n", err);
+      /* Fail the stream; the work handler only drains while it's queued. */
+      bd->boot_queue_cnt = 0;
+      bd->boot_queue_off = 0;
+    }
+  }
+  if (!err)
+    err = bd->boot_queue_err;
+  bd->boot_queue_err = 0;
+  if (bd->flush) {
+    rc = bd->flush(bd, RSH_DEV_TYPE_BOOT);
+    if (rc) {
+      RSHIM_ERR("boot_release: flush failed, err %d\n", rc);
+      if (!err)
+        err = rc;
+    }
+  }
+
   /* Restore the boot mode register. */
+  rshim_info_invalidate(bd);
   rc = bd->write_rshim(bd, RSHIM_CHANNEL,
                            RSH_BOOT_CONTROL,
                            RSH_BOOT_CONTROL__BOOT_MODE_VAL_EMMC);
   if (rc)
     RSHIM_ERR("couldn't set boot_control, err %d\n", rc);
 
-  /* Flush the leftover data with zeros padded. */
-  if (bd->boot_rem_cnt) {
+  /* Flush the leftover data with zeros padded, unless the stream failed. */
+  if (bd->boot_rem_cnt && !err) {
     memset((uint8_t *)&bd->boot_rem_data + bd->boot_rem_cnt, 0,
            sizeof(uint64_t) - bd->boot_rem_cnt);
     bd->write_rshim(bd, RSHIM_CHANNEL, RSH_BOOT_FIFO_DATA,
@@ -836,33 +1392,789 @@ void rshim_boot_release(rshim_backend_t *bd)
   pthread_mutex_unlock(&bd->mutex);
 
   rshim_deref(bd);
+
+  return err;
 }
 
-/* FIFO common routines */
+/* Size of each rshim_boot_write() call when streaming from a file. */
+#define RSHIM_BOOT_FILE_CHUNK  (1024 * 1024)
+
+/* Number of unused boot images kept mapped. */
+#define RSHIM_BOOT_IMAGE_CACHE 4
 
 /*
- * Signal an error on the FIFO, and wake up anyone who might need to know
- * about it.
+ * Boot image mapped once and shared by all the devices pushing it. Images
+ * are looked up by file identity, then by content, so the same BFB under
+ * another path is still mapped only once. The content hash is computed only
+ * when an image of the same size is found, and kept once it is.
  */
-static void rshim_fifo_err(rshim_backend_t *bd, int err)
+typedef struct rshim_boot_image {
+  struct rshim_boot_image *next;
+  char *path;
+  dev_t dev;
+  ino_t ino;
+  time_t mtime;
+  uint64_t size;
+  uint64_t hash;
+  bool hashed;
+  const uint8_t *data;
+  int refcnt;
+} rshim_boot_image_t;
+
+static pthread_mutex_t rshim_boot_image_lock = PTHREAD_MUTEX_INITIALIZER;
+static rshim_boot_image_t *rshim_boot_images;
+
+/*
+ * Where a thread reading a mapped image goes on SIGBUS, which it gets if
+ * the file is truncated meanwhile. Set only around the reads themselves,
+ * which hold no lock, so that just the one push fails.
+ */
+static __thread sigjmp_buf * volatile rshim_boot_image_jmp;
+
+/*
+ * Broadcast push state, shared by the devices in the last BOOT_BCAST.
+ * rshim_boot_bcast_lock is a leaf lock: it guards the path against the
+ * misc show path and is taken after rshim_lock and any device mutex.
+ */
+static pthread_mutex_t rshim_boot_bcast_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+  char *path;
+  int total;
+  volatile int done;
+  volatile int failed;
+  volatile uint64_t bytes;
+  uint64_t start_ns;
+  volatile uint64_t end_ns;
+} rshim_boot_bcast;
+
+/* 64-bit FNV-1a hash. */
+static uint64_t rshim_fnv_hash(const uint8_t *p, uint64_t len)
 {
-  int i;
+  uint64_t hash = 0xcbf29ce484222325ULL;
 
-  bd->tmfifo_error = err;
-  pthread_cond_broadcast(&bd->fifo_write_complete_cond);
-  for (i = 0; i < TMFIFO_MAX_CHAN; i++) {
-    pthread_cond_broadcast(&bd->read_fifo[i].operable);
-    pthread_cond_broadcast(&bd->write_fifo[i].operable);
+  while (len--) {
+    hash ^= *p++;
+    hash *= 0x100000001b3ULL;
   }
+
+  return hash;
 }
 
-static int rshim_fifo_tx_avail(rshim_backend_t *bd)
+static void rshim_boot_image_free(rshim_boot_image_t *img)
 {
-  uint64_t word;
-  int ret, max_size, avail;
+  if (img->size)
+    munmap((void *)img->data, img->size);
+  free(img->path);
+  free(img);
+}
 
-  /* Get FIFO max size. */
-  ret = bd->read_rshim(bd, RSHIM_CHANNEL, RSH_TM_HOST_TO_TILE_CTL, &word);
+/* Drop unused images beyond the cache size. Called with the lock held. */
+static void rshim_boot_image_trim(void)
+{
+  rshim_boot_image_t **pp, *img;
+  int unused = 0;
+
+  for (pp = &rshim_boot_images; (img = *pp) != NULL; ) {
+    if (!img->refcnt && ++unused > RSHIM_BOOT_IMAGE_CACHE) {
+      *pp = img->next;
+      rshim_boot_image_free(img);
+    } else {
+      pp = &img->next;
+    }
+  }
+}
+
+static void rshim_boot_image_ref(rshim_boot_image_t *img)
+{
+  pthread_mutex_lock(&rshim_boot_image_lock);
+  img->refcnt++;
+  pthread_mutex_unlock(&rshim_boot_image_lock);
+}
+
+static void rshim_boot_image_put(rshim_boot_image_t *img)
+{
+  pthread_mutex_lock(&rshim_boot_image_lock);
+  img->refcnt--;
+  rshim_boot_image_trim();
+  pthread_mutex_unlock(&rshim_boot_image_lock);
+}
+
+/*
+ * Look up an image by file identity, dropping an unused one which was
+ * mapped from an older version of the file. Called with the lock held.
+ */
+static rshim_boot_image_t *rshim_boot_image_find(const char *path,
+                                                 struct stat *st)
+{
+  rshim_boot_image_t **pp, *img;
+
+  for (pp = &rshim_boot_images; (img = *pp) != NULL; pp = &img->next) {
+    if (img->dev == st->st_dev && img->ino == st->st_ino &&
+        img->mtime == st->st_mtime && img->size == st->st_size)
+      return img;
+
+    /* The file was modified since it was mapped. */
+    if (!img->refcnt && !strcmp(img->path, path)) {
+      *pp = img->next;
+      rshim_boot_image_free(img);
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Open a boot image named in the misc file, which the daemon reads as root.
+ * Only a regular file is taken, not through a symlink, and only under
+ * BOOT_FILE_DIR if that's configured. Returns the fd or a negative errno.
+ */
+static int rshim_boot_image_open(const char *path, struct stat *st)
+{
+  const char *dir = rshim_cfg_get(NULL, "BOOT_FILE_DIR");
+  char *real = NULL, *real_dir = NULL;
+  struct stat real_st;
+  int fd, len, rc = 0;
+
+  /* Non-blocking, so that a FIFO doesn't hang the open. */
+  fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+  if (fd < 0)
+    return -errno;
+
+  if (fstat(fd, st) < 0) {
+    rc = -errno;
+    goto done;
+  }
+  if (!S_ISREG(st->st_mode)) {
+    rc = -EINVAL;
+    goto done;
+  }
+
+  if (dir) {
+    /* The checked path must still be the file which was opened. */
+    real = realpath(path, NULL);
+    real_dir = realpath(dir, NULL);
+    len = real_dir ? strlen(real_dir) : 0;
+    if (!real || !real_dir || strncmp(real, real_dir, len) ||
+        (real[len] != '/' && real_dir[len - 1] != '/') ||
+        stat(real, &real_st) < 0 || real_st.st_dev != st->st_dev ||
+        real_st.st_ino != st->st_ino) {
+      RSHIM_WARN("boot file %s is not under %s\n", path, dir);
+      rc = -EACCES;
+    }
+  }
+
+done:
+  free(real);
+  free(real_dir);
+  if (rc) {
+    close(fd);
+    return rc;
+  }
+
+  return fd;
+}
+
+/* Map a boot image from its open file, without the lock. */
+static int rshim_boot_image_map(const char *path, int fd, struct stat *st,
+                                rshim_boot_image_t **pimg)
+{
+  rshim_boot_image_t *img;
+  int rc = 0;
+
+  img = calloc(1, sizeof(*img));
+  if (!img)
+    return -ENOMEM;
+
+  img->path = strdup(path);
+  if (!img->path) {
+    rc = -ENOMEM;
+    goto fail;
+  }
+
+  if (st->st_size) {
+    img->data = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (img->data == MAP_FAILED) {
+      rc = -errno;
+      goto fail;
+    }
+    madvise((void *)img->data, st->st_size, MADV_SEQUENTIAL);
+  }
+
+  img->dev = st->st_dev;
+  img->ino = st->st_ino;
+  img->mtime = st->st_mtime;
+  img->size = st->st_size;
+  *pimg = img;
+
+  return 0;
+
+fail:
+  free(img->path);
+  free(img);
+  return rc;
+}
+
+static void rshim_boot_image_sigbus(int sig)
+{
+  if (rshim_boot_image_jmp)
+    siglongjmp(*rshim_boot_image_jmp, 1);
+
+  /* Not ours; fault again with the default action. */
+  signal(SIGBUS, SIG_DFL);
+}
+
+/*
+ * Content hash of a boot image, FNV-1a over 64-bit words. The mapping is
+ * page aligned, and the last partial word is padded with zeros. Computed
+ * on first use without the lock, by the holder of a reference; racing
+ * callers store the same value.
+ */
+static uint64_t rshim_boot_image_hash(rshim_boot_image_t *img)
+{
+  const uint64_t *p = (const uint64_t *)img->data;
+  uint64_t hash = 0xcbf29ce484222325ULL, tail = 0, i, n = img->size / 8;
+
+  if (__atomic_load_n(&img->hashed, __ATOMIC_ACQUIRE))
+    return __atomic_load_n(&img->hash, __ATOMIC_RELAXED);
+
+  for (i = 0; i < n; i++)
+    hash = (hash ^ p[i]) * 0x100000001b3ULL;
+  if (img->size % 8) {
+    memcpy(&tail, p + n, img->size % 8);
+    hash = (hash ^ tail) * 0x100000001b3ULL;
+  }
+
+  __atomic_store_n(&img->hash, hash, __ATOMIC_RELAXED);
+  __atomic_store_n(&img->hashed, true, __ATOMIC_RELEASE);
+  return hash;
+}
+
+/* Compare two images of the same size; a truncated file never matches. */
+static bool rshim_boot_image_same(rshim_boot_image_t *a,
+                                  rshim_boot_image_t *b)
+{
+  sigjmp_buf jmp;
+  bool same;
+
+  if (sigsetjmp(jmp, 1)) {
+    rshim_boot_image_jmp = NULL;
+    return false;
+  }
+  rshim_boot_image_jmp = &jmp;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  same = rshim_boot_image_hash(a) == rshim_boot_image_hash(b) &&
+         !memcmp(a->data, b->data, a->size);
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  rshim_boot_image_jmp = NULL;
+
+  return same;
+}
+
+/*
+ * Get a mapped boot image, from the cache if possible. The file is mapped,
+ * hashed and compared without the lock, which other devices need to get an
+ * image meanwhile. The candidates of the same size are referenced while
+ * they're compared so that they can't go away.
+ */
+static int rshim_boot_image_get(const char *path, rshim_boot_image_t **pimg)
+{
+  rshim_boot_image_t *img, *new = NULL, **cands = NULL;
+  struct stat st;
+  int i, n = 0, fd, rc;
+
+  fd = rshim_boot_image_open(path, &st);
+  if (fd < 0)
+    return fd;
+
+  pthread_mutex_lock(&rshim_boot_image_lock);
+  img = rshim_boot_image_find(path, &st);
+  if (img) {
+    close(fd);
+    goto found;
+  }
+  pthread_mutex_unlock(&rshim_boot_image_lock);
+
+  rc = rshim_boot_image_map(path, fd, &st, &new);
+  close(fd);
+  if (rc)
+    return rc;
+
+  /* Same content under another name. */
+  pthread_mutex_lock(&rshim_boot_image_lock);
+  for (img = rshim_boot_images; img; img = img->next)
+    if (img->size == new->size)
+      n++;
+  if (n)
+    cands = calloc(n, sizeof(*cands));
+  n = 0;
+  for (img = rshim_boot_images; img && cands; img = img->next) {
+    if (img->size == new->size) {
+      img->refcnt++;
+      cands[n++] = img;
+    }
+  }
+  pthread_mutex_unlock(&rshim_boot_image_lock);
+
+  img = NULL;
+  for (i = 0; i < n; i++) {
+    if (!img && rshim_boot_image_same(cands[i], new))
+      img = cands[i];
+    else
+      rshim_boot_image_put(cands[i]);
+  }
+  free(cands);
+
+  pthread_mutex_lock(&rshim_boot_image_lock);
+  if (img) {
+    /* Follow the file it's now pushed from. */
+    img->refcnt--;
+    free(img->path);
+    img->path = new->path;
+    new->path = NULL;
+    img->dev = new->dev;
+    img->ino = new->ino;
+    img->mtime = new->mtime;
+  } else {
+    /* Mapped by another device meanwhile. */
+    img = rshim_boot_image_find(path, &st);
+    if (!img) {
+      img = new;
+      new = NULL;
+      img->next = rshim_boot_images;
+      rshim_boot_images = img;
+    }
+  }
+
+found:
+  img->refcnt++;
+  *pimg = img;
+  rshim_boot_image_trim();
+  pthread_mutex_unlock(&rshim_boot_image_lock);
+
+  if (new)
+    rshim_boot_image_free(new);
+
+  return 0;
+}
+
+/* Copy from a mapped image, failing the push if the file was truncated. */
+static int rshim_boot_file_copy_in(void *dest, const void *src, int count)
+{
+  sigjmp_buf jmp;
+
+  if (sigsetjmp(jmp, 1)) {
+    rshim_boot_image_jmp = NULL;
+    return -EIO;
+  }
+  rshim_boot_image_jmp = &jmp;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  memcpy(dest, src, count);
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  rshim_boot_image_jmp = NULL;
+
+  return 0;
+}
+
+/* Wait up to a timer tick for the boot data to drain before a retry. */
+static void rshim_boot_file_backoff(rshim_backend_t *bd)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_nsec += RSHIM_TIMER_INTERVAL * 1000000L;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&bd->mutex);
+  pthread_cond_timedwait(&bd->boot_write_complete_cond, &bd->mutex, &ts);
+  pthread_mutex_unlock(&bd->mutex);
+}
+
+/*
+ * Push a cached boot image through the normal boot write path. The image
+ * is handed over by the starter if it has one, such as for a BOOT_BCAST.
+ */
+static void *rshim_boot_file_thread(void *arg)
+{
+  rshim_backend_t *bd = arg;
+  rshim_boot_image_t *img = bd->boot_file_img;
+  int rc = 0, n;
+
+  bd->boot_file_img = NULL;
+  if (!img) {
+    rc = rshim_boot_image_get(bd->boot_file_path, &img);
+    if (rc)
+      goto done;
+  }
+  bd->boot_file_size = img->size;
+
+  rc = rshim_boot_open(bd);
+  if (rc)
+    goto done;
+
+  while (bd->boot_file_done < bd->boot_file_size) {
+    rc = rshim_boot_write(bd, (const char *)img->data + bd->boot_file_done,
+                          MIN(bd->boot_file_size - bd->boot_file_done,
+                              RSHIM_BOOT_FILE_CHUNK),
+                          rshim_boot_file_copy_in);
+    /* Retry while the boot FIFO is full, as a writer would. */
+    if (rc == -EINTR) {
+      rshim_boot_file_backoff(bd);
+      continue;
+    }
+    if (rc < 0)
+      break;
+    bd->boot_file_done += rc;
+    if (bd->boot_file_bcast)
+      __sync_fetch_and_add(&rshim_boot_bcast.bytes, rc);
+    rc = 0;
+  }
+
+  n = rshim_boot_release(bd);
+  if (!rc)
+    rc = n;
+
+done:
+  if (rc)
+    RSHIM_ERR("%s: boot from %s failed, err %d\n", bd->dev_name,
+              bd->boot_file_path, rc);
+  else
+    RSHIM_INFO("%s: boot from %s done, %llu bytes\n", bd->dev_name,
+               bd->boot_file_path, (unsigned long long)bd->boot_file_size);
+  if (img)
+    rshim_boot_image_put(img);
+
+  bd->boot_file_err = rc;
+  bd->boot_file_end_ns = rshim_get_time_ns();
+  if (bd->boot_file_bcast) {
+    bd->boot_file_bcast = false;
+    if (__sync_add_and_fetch(rc ? &rshim_boot_bcast.failed :
+                             &rshim_boot_bcast.done, 1) +
+        (rc ? rshim_boot_bcast.done : rshim_boot_bcast.failed) >=
+        rshim_boot_bcast.total)
+      rshim_boot_bcast.end_ns = bd->boot_file_end_ns;
+  }
+  __sync_synchronize();
+  bd->boot_file_busy = false;
+  rshim_deref(bd);
+
+  return NULL;
+}
+
+/* Start a push of 'path', or of 'img' which is then referenced for it. */
+static int rshim_boot_file_start_one(rshim_backend_t *bd, const char *path,
+                                     rshim_boot_image_t *img)
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+  char *p;
+  int rc;
+
+  if (!__sync_bool_compare_and_swap(&bd->boot_file_busy, false, true))
+    return -EBUSY;
+
+  p = strdup(path);
+  if (!p) {
+    bd->boot_file_busy = false;
+    return -ENOMEM;
+  }
+
+  /* Swapped under the mutex, which the misc output shows it with. */
+  pthread_mutex_lock(&bd->mutex);
+  free(bd->boot_file_path);
+  bd->boot_file_path = p;
+  pthread_mutex_unlock(&bd->mutex);
+  bd->boot_file_bcast = img != NULL;
+  bd->boot_file_img = img;
+  if (img)
+    rshim_boot_image_ref(img);
+  bd->boot_file_err = 0;
+  bd->boot_file_size = 0;
+  bd->boot_file_done = 0;
+  bd->boot_file_start_ns = rshim_get_time_ns();
+  bd->boot_file_end_ns = 0;
+
+  rshim_ref(bd);
+  rshim_thread_attr(bd, "WORKER_CPUS", &attr);
+  rc = pthread_create(&thread, &attr, rshim_boot_file_thread, bd);
+  pthread_attr_destroy(&attr);
+  if (rc) {
+    rshim_deref(bd);
+    if (img)
+      rshim_boot_image_put(img);
+    bd->boot_file_img = NULL;
+    bd->boot_file_bcast = false;
+    bd->boot_file_busy = false;
+    return -rc;
+  }
+  pthread_detach(thread);
+
+  return 0;
+}
+
+int rshim_boot_file_start(rshim_backend_t *bd, const char *path)
+{
+  return rshim_boot_file_start_one(bd, path, NULL);
+}
+
+/* Check whether 'bd' is in the comma separated list of rshimN/device names. */
+static bool rshim_boot_bcast_match(rshim_backend_t *bd, const char *devs)
+{
+  char name[RSHIM_DEV_NAME_LEN];
+  const char *p = devs;
+  int len;
+
+  if (!strcmp(devs, "all"))
+    return true;
+
+  snprintf(name, sizeof(name), "rshim%d", bd->index);
+  while (*p) {
+    len = strcspn(p, ",");
+    if ((len == strlen(name) && !strncmp(p, name, len)) ||
+        (len == strlen(bd->dev_name) && !strncmp(p, bd->dev_name, len)))
+      return true;
+    p += len;
+    if (*p == ',')
+      p++;
+  }
+
+  return false;
+}
+
+/*
+ * Push one image to several devices. The image is mapped once, before the
+ * global lock is taken, and every device thread gets a reference to it
+ * instead of looking it up on its own.
+ */
+int rshim_boot_bcast_start(const char *devs, const char *path)
+{
+  rshim_backend_t *bd, **list;
+  rshim_boot_image_t *img;
+  int i, n, rc = 0, started = 0;
+  char *p;
+
+  rc = rshim_boot_image_get(path, &img);
+  if (rc)
+    return rc;
+
+  rshim_lock();
+
+  if (rshim_boot_bcast.path && rshim_boot_bcast.done +
+      rshim_boot_bcast.failed < rshim_boot_bcast.total) {
+    rshim_unlock();
+    rshim_boot_image_put(img);
+    return -EBUSY;
+  }
+
+  p = strdup(path);
+  if (!p) {
+    rshim_unlock();
+    rshim_boot_image_put(img);
+    return -ENOMEM;
+  }
+  pthread_mutex_lock(&rshim_boot_bcast_lock);
+  free(rshim_boot_bcast.path);
+  rshim_boot_bcast.path = p;
+  rshim_boot_bcast.total = 0;
+  rshim_boot_bcast.done = 0;
+  rshim_boot_bcast.failed = 0;
+  rshim_boot_bcast.bytes = 0;
+  rshim_boot_bcast.end_ns = 0;
+  rshim_boot_bcast.start_ns = rshim_get_time_ns();
+  pthread_mutex_unlock(&rshim_boot_bcast_lock);
+
+  n = rshim_devs_get(&list);
+  if (n < 0) {
+    rshim_unlock();
+    rshim_boot_image_put(img);
+    return n;
+  }
+
+  /* Count the devices first so completions can't finish it early. */
+  rshim_boot_bcast.total = 0;
+  for (i = 0; i < n; i++) {
+    bd = list[i];
+    if (bd->registered && !bd->boot_file_busy &&
+        rshim_boot_bcast_match(bd, devs))
+      rshim_boot_bcast.total++;
+  }
+
+  for (i = 0; i < n && started < rshim_boot_bcast.total; i++) {
+    bd = list[i];
+    if (!bd->registered || bd->boot_file_busy ||
+        !rshim_boot_bcast_match(bd, devs))
+      continue;
+    rc = rshim_boot_file_start_one(bd, path, img);
+    if (rc) {
+      RSHIM_ERR("%s: failed to start boot, err %d\n", bd->dev_name, rc);
+      __sync_fetch_and_add(&rshim_boot_bcast.failed, 1);
+    }
+    started++;
+  }
+
+  if (rshim_boot_bcast.failed >= rshim_boot_bcast.total)
+    rshim_boot_bcast.end_ns = rshim_get_time_ns();
+  rc = rshim_boot_bcast.total ? 0 : -ENODEV;
+
+  rshim_unlock();
+  rshim_devs_put(list, n);
+  rshim_boot_image_put(img);
+  return rc;
+}
+
+/*
+ * Show the progress of the last BOOT_FILE push. Called with the device
+ * mutex held, which keeps boot_file_path from being replaced meanwhile.
+ */
+int rshim_boot_file_show(rshim_backend_t *bd, char *buf, int size)
+{
+  uint64_t done = bd->boot_file_done, ns, end;
+  const char *state;
+  int n = 0;
+
+  if (size <= 0)
+    return 0;
+
+  if (bd->boot_file_path) {
+    ns = (bd->boot_file_busy ? rshim_get_time_ns() : bd->boot_file_end_ns) -
+         bd->boot_file_start_ns;
+    if (bd->boot_file_busy)
+      state = "running";
+    else if (bd->boot_file_err)
+      state = "failed";
+    else
+      state = "done";
+
+    n = snprintf(buf, size, "%-16s%s %s %llu/%llu bytes (%llu KB/s)\n",
+                 "BOOT_FILE", bd->boot_file_path, state,
+                 (unsigned long long)done,
+                 (unsigned long long)bd->boot_file_size,
+                 (unsigned long long)(ns ? done * 1000000 / ns : 0));
+    n = MIN(n, size - 1);
+  }
+
+  /* Aggregate of the last broadcast push. */
+  pthread_mutex_lock(&rshim_boot_bcast_lock);
+  if (rshim_boot_bcast.path && n < size) {
+    end = rshim_boot_bcast.end_ns;
+    ns = (end ? end : rshim_get_time_ns()) - rshim_boot_bcast.start_ns;
+    n += snprintf(buf + n, size - n,
+                  "%-16s%s %d/%d done, %d failed (%llu KB/s)\n",
+                  "BOOT_BCAST", rshim_boot_bcast.path, rshim_boot_bcast.done,
+                  rshim_boot_bcast.total, rshim_boot_bcast.failed,
+                  (unsigned long long)(ns ? rshim_boot_bcast.bytes *
+                                       1000000 / ns : 0));
+    n = MIN(n, size - 1);
+  }
+  pthread_mutex_unlock(&rshim_boot_bcast_lock);
+
+  return MAX(n, 0);
+}
+
+/* FIFO common routines */
+
+/*
+ * Wake up the threads sleeping on a FIFO, if any, after its index or the
+ * device state they wait for was changed.
+ */
+static void rshim_fifo_wake(rshim_fifo_t *fifo)
+{
+  /* Pairs with the fence in rshim_fifo_sleep(). */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&fifo->waiters, __ATOMIC_RELAXED))
+    return;
+
+  pthread_mutex_lock(&fifo->wait_lock);
+  pthread_cond_broadcast(&fifo->operable);
+  pthread_mutex_unlock(&fifo->wait_lock);
+}
+
+/*
+ * Sleep on a FIFO until woken up, or until 'ts' if given, unless 'ready'
+ * is true once the waiter is counted. Then a rshim_fifo_wake() after the
+ * caller's own check is never missed. Called with the FIFO lock held, which
+ * is dropped while sleeping so that a reset or release can get in; the
+ * caller checks the FIFO again afterwards. Returns the pthread_cond_*wait()
+ * result.
+ */
+static int rshim_fifo_sleep(rshim_backend_t *bd, rshim_fifo_t *fifo, int chan,
+                            bool (*ready)(rshim_backend_t *bd, int chan),
+                            const struct timespec *ts)
+{
+  int rc = 0;
+
+  pthread_mutex_unlock(&fifo->lock);
+  pthread_mutex_lock(&fifo->wait_lock);
+  __atomic_add_fetch(&fifo->waiters, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!ready(bd, chan))
+    rc = ts ? pthread_cond_timedwait(&fifo->operable, &fifo->wait_lock, ts) :
+              pthread_cond_wait(&fifo->operable, &fifo->wait_lock);
+  __atomic_sub_fetch(&fifo->waiters, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&fifo->wait_lock);
+  pthread_mutex_lock(&fifo->lock);
+
+  return rc;
+}
+
+static bool rshim_fifo_readable(rshim_backend_t *bd, int chan)
+{
+  return !read_empty(bd, chan) || !bd->has_tm || bd->tmfifo_error;
+}
+
+static bool rshim_fifo_writable(rshim_backend_t *bd, int chan)
+{
+  return !write_full(bd, chan) || !bd->has_tm || bd->tmfifo_error;
+}
+
+static bool rshim_fifo_drained(rshim_backend_t *bd, int chan)
+{
+  return write_empty(bd, chan) || !bd->has_tm || bd->tmfifo_error;
+}
+
+/*
+ * Signal an error on the FIFO, and wake up anyone who might need to know
+ * about it.
+ */
+static void rshim_fifo_err(rshim_backend_t *bd, int err)
+{
+  int i;
+
+  bd->tmfifo_error = err;
+  pthread_cond_broadcast(&bd->fifo_write_complete_cond);
+  for (i = 0; i < TMFIFO_MAX_CHAN; i++) {
+    rshim_fifo_wake(&bd->read_fifo[i]);
+    rshim_fifo_wake(&bd->write_fifo[i]);
+  }
+}
+
+/* Wake up the FIFO sleepers of all the devices, on SIGHUP. */
+static void rshim_fifo_wake_all(void)
+{
+  rshim_backend_t **list;
+  int i, j, n;
+
+  n = rshim_devs_get(&list);
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < TMFIFO_MAX_CHAN; j++) {
+      rshim_fifo_wake(&list[i]->read_fifo[j]);
+      rshim_fifo_wake(&list[i]->write_fifo[j]);
+    }
+  }
+  if (n >= 0)
+    rshim_devs_put(list, n);
+}
+
+static int rshim_fifo_tx_avail(rshim_backend_t *bd)
+{
+  uint64_t word;
+  int ret, max_size, avail;
+
+  /* Get FIFO max size. */
+  ret = bd->read_rshim(bd, RSHIM_CHANNEL, RSH_TM_HOST_TO_TILE_CTL, &word);
   if (ret) {
     RSHIM_ERR("read_rshim error %d\n", ret);
     return ret;
@@ -883,8 +2195,9 @@ static int rshim_fifo_tx_avail(rshim_backend_t *bd)
 
 static int rshim_fifo_sync(rshim_backend_t *bd)
 {
+  uint64_t *words = bd->write_words;
   rshim_tmfifo_msg_hdr_t hdr;
-  int i, avail, ret;
+  int i, avail;
 
   avail = rshim_fifo_tx_avail(bd);
   if (avail < 0)
@@ -893,14 +2206,12 @@ static int rshim_fifo_sync(rshim_backend_t *bd)
   hdr.data = 0;
   hdr.type = VIRTIO_ID_NET;
 
-  for (i = 0; i < avail; i++) {
-    ret = bd->write_rshim(bd, RSHIM_CHANNEL, RSH_TM_HOST_TO_TILE_DATA,
-                          hdr.data);
-    if (ret)
-      return ret;
-  }
+  avail = MIN(avail, RSH_BOOT_FIFO_SIZE);
+  for (i = 0; i < avail; i++)
+    words[i] = hdr.data;
 
-  return 0;
+  return bd->write_rshim_burst(bd, RSHIM_CHANNEL, RSH_TM_HOST_TO_TILE_DATA,
+                               words, avail);
 }
 
 /* Just adds up all the bytes of the header. */
@@ -915,7 +2226,7 @@ static uint8_t rshim_fifo_ctrl_checksum(rshim_tmfifo_msg_hdr_t *hdr)
   return checksum;
 }
 
-static void rshim_fifo_ctrl_update_checksum(rshim_tmfifo_msg_hdr_t *hdr)
+void rshim_fifo_ctrl_update_checksum(rshim_tmfifo_msg_hdr_t *hdr)
 {
   uint8_t checksum;
 
@@ -931,8 +2242,18 @@ static bool rshim_fifo_ctrl_verify_checksum(rshim_tmfifo_msg_hdr_t *hdr)
   return checksum ? false : true;
 }
 
+/* Local network MTU from the configuration. */
+static int rshim_net_mtu(rshim_backend_t *bd)
+{
+  int mtu = rshim_cfg_get_int(bd, "NET_MTU", RSHIM_NET_MTU_DEFAULT);
+
+  return MAX(MIN(mtu, RSHIM_NET_MTU_MAX), RSHIM_NET_MTU_DEFAULT);
+}
+
 static void rshim_fifo_ctrl_rx(rshim_backend_t *bd, rshim_tmfifo_msg_hdr_t *hdr)
 {
+  int mtu;
+
   if (!rshim_fifo_ctrl_verify_checksum(hdr))
     return;
 
@@ -947,10 +2268,23 @@ static void rshim_fifo_ctrl_rx(rshim_backend_t *bd, rshim_tmfifo_msg_hdr_t *hdr)
     bd->vlan[0] = ntohs(hdr->vlan[0]);
     bd->vlan[1] = ntohs(hdr->vlan[1]);
     break;
+  case TMFIFO_MSG_MTU:
+    /* Peer response to the MTU proposal, use the smaller one. */
+    if (!bd->peer_mtu_set)
+      break;
+    bd->peer_mtu_set = 0;
+    mtu = MIN(ntohs(hdr->mtu), rshim_net_mtu(bd));
+    if (mtu >= RSHIM_NET_MTU_DEFAULT && mtu != bd->net_mtu) {
+      bd->net_mtu = mtu;
+      bd->net_mtu_changed = 1;
+      rshim_work_signal(bd);
+    }
+    break;
   case TMFIFO_MSG_PXE_ID:
     bd->pxe_client_id = ntohl(hdr->pxe_id);
     /* Last info to receive, set the flag. */
     bd->peer_ctrl_resp = 1;
+    bd->peer_mtu_set = 0;
     pthread_cond_broadcast(&bd->ctrl_wait_cond);
     break;
   default:
@@ -996,6 +2330,15 @@ static int rshim_fifo_ctrl_tx(rshim_backend_t *bd)
     bd->peer_ctrl_req = 0;
     hdr.data = 0;
     hdr.type = TMFIFO_MSG_CTRL_REQ;
+    /*
+     * Propose jumbo frames in the request. Peers which support it answer
+     * with a TMFIFO_MSG_MTU before the PXE id which ends the response;
+     * the others ignore the field.
+     */
+    if (rshim_net_mtu(bd) > RSHIM_NET_MTU_DEFAULT) {
+      hdr.mtu = htons(rshim_net_mtu(bd));
+      bd->peer_mtu_set = 1;
+    }
     rshim_fifo_ctrl_update_checksum(&hdr);
     memcpy(bd->write_buf, &hdr.data, sizeof(hdr.data));
     len = sizeof(hdr.data);
@@ -1004,20 +2347,53 @@ static int rshim_fifo_ctrl_tx(rshim_backend_t *bd)
   return len;
 }
 
-static int rshim_got_peer_signal(void)
+static void rshim_input_notify(rshim_backend_t *bd)
 {
 #ifdef HAVE_RSHIM_FUSE
-  return rshim_fuse_got_peer_signal();
-#else
-  return -1;
+    rshim_fuse_input_notify(bd);
 #endif
 }
 
-static void rshim_input_notify(rshim_backend_t *bd)
+/*
+ * Write a network packet straight from the read buffer to the tap if nothing
+ * is queued ahead of it, which skips the copy through the read FIFO. Called
+ * with ringlock held at the start of a packet.
+ *
+ * The frame is reserved by net_rx_direct while ringlock is dropped for the
+ * tap write. No other rshim_fifo_input() can then move past it, and no new
+ * read is started into read_buf since it still holds data, so the frames
+ * stay in order. A FIFO reset meanwhile, seen from read_buf_gen, has
+ * dropped the whole read buffer, the frame with it, which then counts as
+ * taken too.
+ */
+static bool rshim_fifo_net_direct(rshim_backend_t *bd,
+                                  rshim_tmfifo_msg_hdr_t *hdr)
 {
-#ifdef HAVE_RSHIM_FUSE
-    rshim_fuse_input_notify(bd);
-#endif
+  unsigned int gen = bd->read_buf_gen;
+  int len = ntohs(hdr->len);
+  struct iovec iov;
+
+  if (bd->net_notify_fd < 0 || bd->net_rx_busy ||
+      !read_empty(bd, TMFIFO_NET_CHAN) ||
+      bd->read_buf_next + sizeof(*hdr) + len > bd->read_buf_bytes)
+    return false;
+
+  if (len) {
+    iov.iov_base = hdr + 1;
+    iov.iov_len = len;
+    bd->net_rx_direct = true;
+    pthread_mutex_unlock(&bd->ringlock);
+    rshim_net_rx_deliver(bd, &iov, 1);
+    pthread_mutex_lock(&bd->ringlock);
+    bd->net_rx_direct = false;
+    if (bd->read_buf_gen != gen)
+      return true;
+  }
+
+  bd->read_buf_next += sizeof(*hdr) + len;
+  bd->read_buf_next += (8 - (bd->read_buf_next & 7)) & 7;
+
+  return true;
 }
 
 /* Drain the read buffer, and start another read/interrupt if needed. */
@@ -1027,7 +2403,8 @@ static void rshim_fifo_input(rshim_backend_t *bd)
   uint8_t rx_avail = 0;
   int rc;
 
-  if (bd->is_boot_open || !bd->has_rshim || !bd->has_tm)
+  /* A direct tap write owns the read buffer and continues from there. */
+  if (bd->is_boot_open || !bd->has_rshim || !bd->has_tm || bd->net_rx_direct)
     return;
 
 again:
@@ -1050,10 +2427,18 @@ again:
 
       bd->read_buf_pkt_rem = ntohs(hdr->len) + sizeof(*hdr);
       bd->read_buf_pkt_padding = (8 - (bd->read_buf_pkt_rem & 7)) & 7;
-      if (hdr->type == VIRTIO_ID_NET)
+      if (hdr->type == VIRTIO_ID_NET) {
         bd->rx_chan = TMFIFO_NET_CHAN;
-      else if (hdr->type == VIRTIO_ID_CONSOLE) {
+        bd->stats.rx_msgs[TMFIFO_NET_CHAN]++;
+        bd->stats.rx_bytes[TMFIFO_NET_CHAN] += ntohs(hdr->len);
+        if (rshim_fifo_net_direct(bd, hdr)) {
+          bd->read_buf_pkt_rem = 0;
+          continue;
+        }
+      } else if (hdr->type == VIRTIO_ID_CONSOLE) {
         bd->rx_chan = TMFIFO_CONS_CHAN;
+        bd->stats.rx_msgs[TMFIFO_CONS_CHAN]++;
+        bd->stats.rx_bytes[TMFIFO_CONS_CHAN] += ntohs(hdr->len);
         /* Strip off the message header for console. */
         bd->read_buf_next += sizeof(*hdr);
         bd->read_buf_pkt_rem -= sizeof(*hdr);
@@ -1069,6 +2454,7 @@ again:
           continue;
         } else {
           RSHIM_DBG("bad type %d, drop it", hdr->type);
+          rshim_stats_add(bd, RSH_STAT_DROPS, 1);
           bd->read_buf_next = bd->read_buf_bytes;
           break;
         }
@@ -1083,23 +2469,24 @@ again:
         !(bd->spin_flags & RSH_SFLG_CONS_OPEN)) {
       /*
        * If data is coming in for a closed console channel, we want to just
-       * throw it away. Resetting the channel every time through this loop is
-       * a relatively cheap way to do that.  Note that this works because the
-       * read buffer is no larger than the read FIFO; thus, we know that if
-       * we reset it here, we will always be able to drain the read buffer of
-       * any console data, and will then launch another read.
+       * throw it away. It's skipped in the read buffer without going
+       * through the ring, whose tail belongs to the reader, so the read
+       * buffer is always drained and another read gets launched.
        */
-      read_reset(bd, TMFIFO_CONS_CHAN);
+      if (!bd->drop_pkt)
+        rshim_stats_add(bd, RSH_STAT_CONS_RESETS, 1);
       bd->drop_pkt = 1;
-    } else if (bd->rx_chan == TMFIFO_NET_CHAN && bd->net_notify_fd[0] < 0) {
+    } else if (bd->rx_chan == TMFIFO_NET_CHAN && bd->net_notify_fd < 0) {
       /* Drop if networking is not enabled. */
-      read_reset(bd, TMFIFO_NET_CHAN);
+      if (!bd->drop_pkt)
+        rshim_stats_add(bd, RSH_STAT_DROPS, 1);
       bd->drop_pkt = 1;
     }
 
     copysize = MIN(bd->read_buf_pkt_rem,
                    bd->read_buf_bytes - bd->read_buf_next);
-    copysize = MIN(copysize, read_space_to_end(bd, bd->rx_chan));
+    if (!bd->drop_pkt)
+      copysize = MIN(copysize, read_space_to_end(bd, bd->rx_chan));
 
     RSHIM_DBG("drain: copysize %d, head %d, tail %d, remaining %d\n",
               copysize,
@@ -1108,7 +2495,16 @@ again:
               bd->read_buf_pkt_rem);
 
     if (copysize == 0) {
-      /* We have data, but no space to put it in, so we're done. */
+      /*
+       * We have data, but no space to put it in, so we're done. Have the
+       * reader drain again once it made room, see rshim_fifo_drain(); if
+       * it already did meanwhile, go on right away.
+       */
+      __atomic_store_n(&bd->read_fifo[bd->rx_chan].stalled, true,
+                       __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (read_space_to_end(bd, bd->rx_chan))
+        continue;
       RSHIM_DBG("drain: no more space in channel %d\n",
                  bd->rx_chan);
       break;
@@ -1118,13 +2514,16 @@ again:
       memcpy(read_space_ptr(bd, bd->rx_chan), &bd->read_buf[bd->read_buf_next],
              copysize);
       read_add_bytes(bd, bd->rx_chan, copysize);
+      trace_fifo(bd, RSH_TRACE_FIFO_INPUT, bd->read_fifo, bd->rx_chan);
+      if (bd->rx_chan == TMFIFO_CONS_CHAN)
+        bd->cons_rx_active = true;
     }
 
     bd->read_buf_next += copysize;
     bd->read_buf_pkt_rem -= copysize;
 
     rshim_input_notify(bd);
-    pthread_cond_broadcast(&bd->read_fifo[bd->rx_chan].operable);
+    rshim_fifo_wake(&bd->read_fifo[bd->rx_chan]);
 
     if (bd->read_buf_pkt_rem <= 0) {
       bd->read_buf_next = bd->read_buf_next + bd->read_buf_pkt_padding;
@@ -1151,30 +2550,108 @@ again:
 
     /* Process it if more data is received. */
     len = bd->read(bd, RSH_DEV_TYPE_TMFIFO, (char *)bd->read_buf,
-                   READ_BUF_SIZE);
+                   bd->read_buf_size);
     if (len > 0) {
       bd->read_buf_bytes = len;
       bd->read_buf_next = 0;
+      bd->read_buf_gen++;
       goto again;
     }
-  }
+  }
+
+  if (rx_avail && bd->rx_chan == TMFIFO_NET_CHAN) {
+    if (__sync_bool_compare_and_swap(&bd->net_rx_pending, false, true)) {
+      uint64_t one = 1;
+
+      pthread_mutex_lock(&bd->net_lock);
+      if (bd->net_notify_fd >= 0) {
+        do {
+          rc = write(bd->net_notify_fd, &one, sizeof(one));
+        } while (rc == -1 && errno == EINTR);
+      }
+      pthread_mutex_unlock(&bd->net_lock);
+    }
+  }
+}
+
+/* Drain the TMFIFO into the channel FIFOs on behalf of a reader. */
+static void rshim_fifo_poll(rshim_backend_t *bd)
+{
+  pthread_mutex_lock(&bd->mutex);
+  pthread_mutex_lock(&bd->ringlock);
+  rshim_fifo_input(bd);
+  pthread_mutex_unlock(&bd->ringlock);
+  pthread_mutex_unlock(&bd->mutex);
+}
+
+/*
+ * Go on with the TMFIFO drain after a reader made room in a read FIFO. On
+ * backends with input events that's only needed if the drain stopped on
+ * this FIFO being full, since the events keep it going otherwise; a read
+ * pass then takes neither the mutex nor ringlock. The other backends are
+ * polled here for more data, as before.
+ */
+static void rshim_fifo_drain(rshim_backend_t *bd, int chan)
+{
+  /* Pairs with the fence in rshim_fifo_input(). */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_exchange_n(&bd->read_fifo[chan].stalled, false,
+                          __ATOMIC_RELAXED) || !bd->has_input_events)
+    rshim_fifo_poll(bd);
+}
+
+/*
+ * Wait until a read FIFO has data, with the FIFO lock held. Returns 0 when
+ * there is data or a negative errno.
+ */
+static int rshim_fifo_read_wait(rshim_backend_t *bd, int chan, bool nonblock)
+{
+  struct timespec ts;
+
+  while (true) {
+    /*
+     * We check this each time through the loop since the
+     * device could get disconnected while we're waiting for
+     * more data in the read FIFO.
+     */
+    if (!bd->has_tm) {
+      RSHIM_DBG("fifo_read: ENODEV\n");
+      return -ENODEV;
+    }
+
+    if (bd->tmfifo_error) {
+      RSHIM_DBG("fifo_read: error %d\n", bd->tmfifo_error);
+      return bd->tmfifo_error;
+    }
 
-  if (rx_avail && bd->rx_chan == TMFIFO_NET_CHAN) {
-    if (__sync_bool_compare_and_swap(&bd->net_rx_pending, false, true)) {
-      do {
-        rc = write(bd->net_notify_fd[1], &rx_avail, sizeof(rx_avail));
-      } while (rc == -1 && (errno == EINTR || errno == EAGAIN));
+    if (!read_empty(bd, chan))
+      return 0;
+
+    RSHIM_DBG("fifo_read: fifo empty\n");
+    if (nonblock)
+      return -EAGAIN;
+
+    RSHIM_DBG("fifo_read: waiting for readable chan %d\n", chan);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += 1;
+    if (rshim_fifo_sleep(bd, &bd->read_fifo[chan], chan, rshim_fifo_readable,
+                         &ts)) {
+      RSHIM_DBG("fifo_read: ERESTARTSYS\n");
+      return -EINTR;
     }
+
+    if (rshim_got_peer_signal() == 0)
+      return -EINTR;
   }
 }
 
 ssize_t rshim_fifo_read(rshim_backend_t *bd, char *buffer, size_t count,
                         int chan, bool nonblock)
 {
-  struct timespec ts;
   size_t rd_cnt = 0;
+  int rc;
 
-  pthread_mutex_lock(&bd->mutex);
+  pthread_mutex_lock(&bd->read_fifo[chan].lock);
 
   while (count) {
     size_t readsize;
@@ -1183,66 +2660,20 @@ ssize_t rshim_fifo_read(rshim_backend_t *bd, char *buffer, size_t count,
 
     RSHIM_DBG("fifo_read, top of loop, remaining count %zd\n", count);
 
-    /*
-     * We check this each time through the loop since the
-     * device could get disconnected while we're waiting for
-     * more data in the read FIFO.
-     */
-    if (!bd->has_tm) {
-      pthread_mutex_unlock(&bd->mutex);
-      RSHIM_DBG("fifo_read: returning %zd/ENODEV\n", rd_cnt);
-      return rd_cnt ? rd_cnt : -ENODEV;
-    }
-
-    if (bd->tmfifo_error) {
-      pthread_mutex_unlock(&bd->mutex);
-      RSHIM_DBG("fifo_read: returning %zd/%d\n", rd_cnt, bd->tmfifo_error);
-      return rd_cnt ? rd_cnt : bd->tmfifo_error;
-    }
-
-    if (read_empty(bd, chan)) {
-      RSHIM_DBG("fifo_read: fifo empty\n");
-      if (rd_cnt || nonblock) {
-        if (rd_cnt == 0) {
-          pthread_mutex_lock(&bd->ringlock);
-          rshim_fifo_input(bd);
-          pthread_mutex_unlock(&bd->ringlock);
-        }
-        pthread_mutex_unlock(&bd->mutex);
-        RSHIM_DBG("fifo_read: returning %zd/EAGAIN\n", rd_cnt);
-        return rd_cnt ? rd_cnt : -EAGAIN;
-      }
-
-      RSHIM_DBG("fifo_read: waiting for readable chan %d\n", chan);
-      while (read_empty(bd, chan)) {
-        clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_sec += 1;
-        if (pthread_cond_timedwait(&bd->read_fifo[chan].operable,
-            &bd->mutex, &ts)) {
-          RSHIM_DBG("fifo_read: returning ERESTARTSYS\n");
-          pthread_mutex_unlock(&bd->mutex);
-          return -EINTR;
-        }
-
-	if (rshim_got_peer_signal() == 0) {
-          pthread_mutex_unlock(&bd->mutex);
-          return -EINTR;
-	}
-      }
-
-      /*
-       * Since we dropped the mutex, we must make sure our interface is still
-       * there before we do anything else.
-       */
-      continue;
+    /* Only wait for the first bytes; return what we have after that. */
+    rc = rshim_fifo_read_wait(bd, chan, nonblock || rd_cnt);
+    if (rc) {
+      if (rc == -EAGAIN && !rd_cnt)
+        rshim_fifo_poll(bd);
+      pthread_mutex_unlock(&bd->read_fifo[chan].lock);
+      RSHIM_DBG("fifo_read: returning %zd/%d\n", rd_cnt, rc);
+      return rd_cnt ? rd_cnt : rc;
     }
 
     /* Figure out how many bytes we will transfer on this pass. */
-    pthread_mutex_lock(&bd->ringlock);
     readsize = MIN(count, (size_t)read_cnt(bd, chan));
     pass1 = MIN(readsize, (size_t)read_cnt_to_end(bd, chan));
     pass2 = readsize - pass1;
-    pthread_mutex_unlock(&bd->ringlock);
 
     RSHIM_DBG("fifo_read: readsize %zd, head %d, tail %d\n",
               readsize, bd->read_fifo[chan].head,
@@ -1251,13 +2682,11 @@ ssize_t rshim_fifo_read(rshim_backend_t *bd, char *buffer, size_t count,
     memcpy(buffer, read_data_ptr(bd, chan), pass1);
     if (pass2)
       memcpy(buffer + pass1, bd->read_fifo[chan].data, pass2);
-
-    pthread_mutex_lock(&bd->ringlock);
     read_consume_bytes(bd, chan, readsize);
+    trace_fifo(bd, RSH_TRACE_FIFO_READ, bd->read_fifo, chan);
 
     /* Check if there is any more incoming data. */
-    rshim_fifo_input(bd);
-    pthread_mutex_unlock(&bd->ringlock);
+    rshim_fifo_drain(bd, chan);
 
     count -= readsize;
     buffer += readsize;
@@ -1265,23 +2694,145 @@ ssize_t rshim_fifo_read(rshim_backend_t *bd, char *buffer, size_t count,
     RSHIM_DBG("fifo_read: transferred %zd bytes\n", readsize);
   }
 
-  pthread_mutex_unlock(&bd->mutex);
+  pthread_mutex_unlock(&bd->read_fifo[chan].lock);
 
   RSHIM_DBG("fifo_read: returning %zd\n", rd_cnt);
   return rd_cnt;
 }
 
+ssize_t rshim_fifo_read_iov(rshim_backend_t *bd, size_t count, int chan,
+                            bool nonblock,
+                            int (*deliver)(void *arg, const struct iovec *iov,
+                                           int cnt),
+                            void *arg)
+{
+  struct iovec iov[2];
+  size_t readsize;
+  int rc, niov = 1;
+
+  pthread_mutex_lock(&bd->read_fifo[chan].lock);
+
+  rc = rshim_fifo_read_wait(bd, chan, nonblock);
+  if (rc) {
+    if (rc == -EAGAIN)
+      rshim_fifo_poll(bd);
+    pthread_mutex_unlock(&bd->read_fifo[chan].lock);
+    return rc;
+  }
+
+  /* The input side only adds bytes behind these; it never moves the tail. */
+  readsize = MIN(count, (size_t)read_cnt(bd, chan));
+  iov[0].iov_base = read_data_ptr(bd, chan);
+  iov[0].iov_len = MIN(readsize, (size_t)read_cnt_to_end(bd, chan));
+  if (readsize > iov[0].iov_len) {
+    iov[1].iov_base = bd->read_fifo[chan].data;
+    iov[1].iov_len = readsize - iov[0].iov_len;
+    niov = 2;
+  }
+
+  if (deliver(arg, iov, niov)) {
+    pthread_mutex_unlock(&bd->read_fifo[chan].lock);
+    return 0;
+  }
+
+  read_consume_bytes(bd, chan, readsize);
+  trace_fifo(bd, RSH_TRACE_FIFO_READ, bd->read_fifo, chan);
+
+  /* Check if there is any more incoming data. */
+  rshim_fifo_drain(bd, chan);
+
+  pthread_mutex_unlock(&bd->read_fifo[chan].lock);
+
+  RSHIM_DBG("fifo_read_iov: returning %zd\n", readsize);
+  return readsize;
+}
+
+bool rshim_fifo_net_rx(rshim_backend_t *bd)
+{
+  int chan = TMFIFO_NET_CHAN, size = bd->read_fifo[chan].size;
+  int cnt, len, off, pass1, niov;
+  rshim_tmfifo_msg_hdr_t hdr;
+  struct iovec iov[2];
+  bool progress, slow = false;
+
+  pthread_mutex_lock(&bd->read_fifo[chan].lock);
+
+  do {
+    progress = false;
+
+    while (bd->has_tm && !bd->tmfifo_error) {
+      cnt = read_cnt(bd, chan);
+      if (cnt < sizeof(hdr))
+        break;
+
+      /* The header itself might wrap around the end of the ring. */
+      pass1 = MIN(sizeof(hdr), (size_t)read_cnt_to_end(bd, chan));
+      memcpy(&hdr, read_data_ptr(bd, chan), pass1);
+      if (pass1 < sizeof(hdr))
+        memcpy((char *)&hdr + pass1, bd->read_fifo[chan].data,
+               sizeof(hdr) - pass1);
+
+      len = ntohs(hdr.len);
+      if (sizeof(hdr) + len > cnt) {
+        /* Never completes in the ring; let the caller copy it out. */
+        if (sizeof(hdr) + len >= size) {
+          bd->net_rx_busy = true;
+          slow = true;
+        }
+        break;
+      }
+
+      /* Point at the payload, which might be split in two pieces. */
+      niov = 0;
+      off = (bd->read_fifo[chan].tail + sizeof(hdr)) & (size - 1);
+      pass1 = MIN(len, size - off);
+      if (pass1) {
+        iov[niov].iov_base = bd->read_fifo[chan].data + off;
+        iov[niov++].iov_len = pass1;
+      }
+      if (len > pass1) {
+        iov[niov].iov_base = bd->read_fifo[chan].data;
+        iov[niov++].iov_len = len - pass1;
+      }
+
+      /*
+       * The producer only moves the head, so the frame stays put during
+       * the tap write. Keeping it in the ring until then also keeps
+       * rshim_fifo_net_direct() from reordering frames.
+       */
+      if (niov)
+        rshim_net_rx_deliver(bd, iov, niov);
+
+      read_consume_bytes(bd, chan, sizeof(hdr) + len);
+      trace_fifo(bd, RSH_TRACE_FIFO_READ, bd->read_fifo, chan);
+      progress = true;
+    }
+
+    /* Check if there is any more incoming data. */
+    if (progress && !slow)
+      rshim_fifo_drain(bd, chan);
+  } while (progress && !slow);
+
+  pthread_mutex_unlock(&bd->read_fifo[chan].lock);
+
+  return slow;
+}
+
 static void rshim_fifo_output(rshim_backend_t *bd)
 {
-  int writesize, write_buf_next = 0;
-  int write_avail = WRITE_BUF_SIZE - write_buf_next;
+  int writesize, write_buf_next;
+  int write_avail;
   int numchan = TMFIFO_MAX_CHAN;
   int chan, chan_offset;
 
+again:
   /* If we're already writing, we have nowhere to put data. */
   if (bd->spin_flags & RSH_SFLG_WRITING)
     return;
 
+  write_buf_next = 0;
+  write_avail = bd->write_buf_size;
+
   if (!bd->write_buf_pkt_rem) {
     /* Send control messages. */
     writesize = rshim_fifo_ctrl_tx(bd);
@@ -1334,6 +2885,8 @@ static void rshim_fifo_output(rshim_backend_t *bd)
       }
 
       bd->write_buf_pkt_rem = ntohs(hdr->len) + sizeof(*hdr);
+      bd->stats.tx_msgs[chan]++;
+      bd->stats.tx_bytes[chan] += ntohs(hdr->len);
     }
 
     /* Send out the packet header for the console data. */
@@ -1385,14 +2938,15 @@ static void rshim_fifo_output(rshim_backend_t *bd)
              bd->write_fifo[chan].data, pass2);
 
       write_consume_bytes(bd, chan, writesize);
+      trace_fifo(bd, RSH_TRACE_FIFO_OUTPUT, bd->write_fifo, chan);
       write_buf_next += writesize;
       bd->write_buf_pkt_rem -= writesize;
       /* Add padding at the end. */
       if (bd->write_buf_pkt_rem == 0)
         write_buf_next = (write_buf_next + 7) & -8;
-      write_avail = WRITE_BUF_SIZE - write_buf_next;
+      write_avail = bd->write_buf_size - write_buf_next;
 
-      pthread_cond_broadcast(&bd->write_fifo[chan].operable);
+      rshim_fifo_wake(&bd->write_fifo[chan]);
       RSHIM_DBG("fifo_output: woke up writable chan %d\n", chan);
     }
   }
@@ -1402,38 +2956,134 @@ static void rshim_fifo_output(rshim_backend_t *bd)
     return;
 
   /* If we actually put anything in the buffer, send it. */
-  if (write_buf_next)
-    bd->write(bd, RSH_DEV_TYPE_TMFIFO, (char *)bd->write_buf, write_buf_next);
+  if (!write_buf_next ||
+      bd->write(bd, RSH_DEV_TYPE_TMFIFO, (char *)bd->write_buf,
+                write_buf_next) < 0 ||
+      bd->write_buf_cnt <= 1)
+    return;
+
+  /* Fill the next buffer while this one is on the wire. */
+  bd->write_buf_idx = (bd->write_buf_idx + 1) % bd->write_buf_cnt;
+  bd->write_buf = bd->write_bufs[bd->write_buf_idx];
+  goto again;
+}
+
+/*
+ * Get a size from the configuration, rounded up to a power of 2 within
+ * [min, max] which are powers of 2 as well.
+ */
+static int rshim_cfg_get_size(rshim_backend_t *bd, const char *key, int def,
+                              int min, int max)
+{
+  int size = rshim_cfg_get_int(bd, key, def), n = min;
+
+  if (size <= 0)
+    return def;
+
+  while (n < size && n < max)
+    n <<= 1;
+  if (n != size)
+    RSHIM_WARN("%s %d adjusted to %d\n", key, size, n);
+
+  return n;
 }
 
 int rshim_fifo_alloc(rshim_backend_t *bd)
 {
-  int i;
+  static const char * const read_keys[TMFIFO_MAX_CHAN] = {
+    "CONS_READ_FIFO_SIZE", "NET_READ_FIFO_SIZE"
+  };
+  static const char * const write_keys[TMFIFO_MAX_CHAN] = {
+    "CONS_WRITE_FIFO_SIZE", "NET_WRITE_FIFO_SIZE"
+  };
+  int i, min_read = INT_MAX, min_write = INT_MAX;
 
   for (i = 0; i < TMFIFO_MAX_CHAN; i++) {
-    if (!bd->read_fifo[i].data)
-      bd->read_fifo[i].data = malloc(READ_FIFO_SIZE);
+    if (!bd->read_fifo[i].data) {
+      bd->read_fifo[i].size = rshim_cfg_get_size(bd, read_keys[i],
+                                                 READ_FIFO_SIZE,
+                                                 RSHIM_FIFO_SIZE_MIN,
+                                                 RSHIM_FIFO_SIZE_MAX);
+      bd->read_fifo[i].data = rshim_buf_alloc(bd, bd->read_fifo[i].size);
+    }
+
+    if (!bd->write_fifo[i].data) {
+      bd->write_fifo[i].size = rshim_cfg_get_size(bd, write_keys[i],
+                                                  WRITE_FIFO_SIZE,
+                                                  RSHIM_FIFO_SIZE_MIN,
+                                                  RSHIM_FIFO_SIZE_MAX);
+      bd->write_fifo[i].data = rshim_buf_alloc(bd, bd->write_fifo[i].size);
+    }
+
+    if (!bd->read_fifo[i].data || !bd->write_fifo[i].data)
+      return -ENOMEM;
 
-    if (!bd->write_fifo[i].data)
-      bd->write_fifo[i].data = malloc(WRITE_FIFO_SIZE);
+    min_read = MIN(min_read, bd->read_fifo[i].size);
+    min_write = MIN(min_write, bd->write_fifo[i].size);
   }
 
+  /* The read and write buffers are no larger than the FIFOs. */
+  if (!bd->read_buf)
+    bd->read_buf_size = MIN(rshim_cfg_get_size(bd, "READ_BUF_SIZE",
+                                               READ_BUF_SIZE,
+                                               RSHIM_BUF_SIZE_MIN,
+                                               RSHIM_BUF_SIZE_MAX),
+                            min_read);
+  if (!bd->write_buf)
+    bd->write_buf_size = MIN(rshim_cfg_get_size(bd, "WRITE_BUF_SIZE",
+                                                WRITE_BUF_SIZE,
+                                                RSHIM_BUF_SIZE_MIN,
+                                                RSHIM_BUF_SIZE_MAX),
+                             min_write);
+
   return 0;
 }
 
+/*
+ * Keep the readers and writers off all the channel FIFOs, for a reset. The
+ * FIFO locks come before bd->mutex; see rshim_fifo_release() for the order.
+ */
+void rshim_fifo_lock(rshim_backend_t *bd)
+{
+  int i;
+
+  for (i = 0; i < TMFIFO_MAX_CHAN; i++) {
+    pthread_mutex_lock(&bd->read_fifo[i].lock);
+    pthread_mutex_lock(&bd->write_fifo[i].lock);
+  }
+}
+
+void rshim_fifo_unlock(rshim_backend_t *bd)
+{
+  int i;
+
+  for (i = TMFIFO_MAX_CHAN - 1; i >= 0; i--) {
+    pthread_mutex_unlock(&bd->write_fifo[i].lock);
+    pthread_mutex_unlock(&bd->read_fifo[i].lock);
+  }
+}
+
+/* Called with the FIFO locks, see rshim_fifo_lock(), and the mutex held. */
 void rshim_fifo_reset(rshim_backend_t *bd)
 {
   int i;
 
+  pthread_mutex_lock(&bd->ringlock);
   bd->read_buf_bytes = 0;
   bd->read_buf_pkt_rem = 0;
   bd->read_buf_next = 0;
   bd->read_buf_pkt_padding = 0;
+  bd->read_buf_gen++;
   bd->write_buf_pkt_rem = 0;
   bd->rx_chan = bd->tx_chan = 0;
 
-  pthread_mutex_lock(&bd->ringlock);
-  bd->spin_flags &= ~(RSH_SFLG_WRITING | RSH_SFLG_READING);
+  /*
+   * Writes already handed to the backend still complete through its
+   * callback, so keep them accounted and don't reuse their buffers.
+   */
+  bd->spin_flags &= ~RSH_SFLG_READING;
+  if (bd->write_inflight < bd->write_buf_cnt)
+    bd->spin_flags &= ~RSH_SFLG_WRITING;
   for (i = 0; i < TMFIFO_MAX_CHAN; i++) {
     read_reset(bd, i);
     write_reset(bd, i);
@@ -1446,22 +3096,70 @@ void rshim_fifo_free(rshim_backend_t *bd)
   int i;
 
   for (i = 0; i < TMFIFO_MAX_CHAN; i++) {
-    free(bd->read_fifo[i].data);
+    rshim_buf_free(bd->read_fifo[i].data, bd->read_fifo[i].size);
     bd->read_fifo[i].data = NULL;
-    free(bd->write_fifo[i].data);
+    rshim_buf_free(bd->write_fifo[i].data, bd->write_fifo[i].size);
     bd->write_fifo[i].data = NULL;
   }
 
+  /*
+   * The channel devices are gone by now, so nobody else can hold the FIFO
+   * locks; taking them here would invert the order with the mutex.
+   */
   rshim_fifo_reset(bd);
   bd->has_tm = 0;
 }
 
+/*
+ * Period of the console poll on backends without input events. In event
+ * mode it drops to one tick while console data flows, and backs off to
+ * RSHIM_CONS_POLL_TICKS once it has been idle for a while.
+ */
+static int rshim_cons_poll_period(rshim_backend_t *bd)
+{
+  if (!bd->cons_event_mode)
+    return RSHIM_CONS_POLL_TICKS;
+
+  if (bd->cons_rx_active) {
+    bd->cons_rx_active = false;
+    bd->cons_poll = 1;
+  } else {
+    bd->cons_poll = MIN(MAX(bd->cons_poll, 1) * 2, RSHIM_CONS_POLL_TICKS);
+  }
+
+  return bd->cons_poll;
+}
+
+/* Poll the console right away after host input; the echo is due soon. */
+static void rshim_cons_kick(rshim_backend_t *bd)
+{
+  if (!bd->cons_event_mode || bd->has_reprobe || !bd->is_cons_open)
+    return;
+
+  bd->cons_rx_active = true;
+  bd->timer = rshim_timer_now() + 1;
+  rshim_timer_schedule(bd, RSHIM_TIMER_INTERVAL);
+}
+
+/*
+ * Nagle-style batching of console output: while writes are on the wire,
+ * let less than half a buffer of console data wait for their completion,
+ * which sends it then. A paste thus goes out in full buffers instead of
+ * a message per keystroke.
+ */
+static bool rshim_cons_batch(rshim_backend_t *bd, int chan)
+{
+  return bd->cons_event_mode && chan == TMFIFO_CONS_CHAN &&
+         bd->write_inflight > 0 &&
+         write_cnt(bd, chan) < bd->write_buf_size / 2;
+}
+
 ssize_t rshim_fifo_write(rshim_backend_t *bd, const char *buffer,
                          size_t count, int chan, bool nonblock)
 {
   size_t wr_cnt = 0;
 
-  pthread_mutex_lock(&bd->mutex);
+  pthread_mutex_lock(&bd->write_fifo[chan].lock);
 
   while (count) {
     size_t writesize;
@@ -1474,13 +3172,13 @@ ssize_t rshim_fifo_write(rshim_backend_t *bd, const char *buffer,
      * more space in the write buffer.
      */
     if (!bd->has_tm) {
-      pthread_mutex_unlock(&bd->mutex);
+      pthread_mutex_unlock(&bd->write_fifo[chan].lock);
       RSHIM_DBG("fifo_write: returning %zd/ENODEV\n", wr_cnt);
       return wr_cnt ? wr_cnt : -ENODEV;
     }
 
     if (bd->tmfifo_error) {
-      pthread_mutex_unlock(&bd->mutex);
+      pthread_mutex_unlock(&bd->write_fifo[chan].lock);
       RSHIM_DBG("fifo_write: returning %zd/%d\n", wr_cnt, bd->tmfifo_error);
       return wr_cnt ? wr_cnt : bd->tmfifo_error;
     }
@@ -1488,37 +3186,36 @@ ssize_t rshim_fifo_write(rshim_backend_t *bd, const char *buffer,
     if (write_full(bd, chan)) {
       RSHIM_DBG("fifo_write: fifo full\n");
       if (nonblock) {
-        pthread_mutex_unlock(&bd->mutex);
+        pthread_mutex_unlock(&bd->write_fifo[chan].lock);
         RSHIM_DBG("fifo_write: returning %zd/EAGAIN\n", wr_cnt);
         return wr_cnt ? wr_cnt : -EAGAIN;
       }
 
       RSHIM_DBG("fifo_write: waiting for writable chan %d\n", chan);
-      while (write_full(bd, chan)) {
-        if (pthread_cond_wait(&bd->write_fifo[chan].operable, &bd->mutex)) {
+      while (!rshim_fifo_writable(bd, chan)) {
+        if (rshim_fifo_sleep(bd, &bd->write_fifo[chan], chan,
+                             rshim_fifo_writable, NULL)) {
           RSHIM_DBG("fifo_write: returning %zd/ERESTARTSYS\n", wr_cnt);
-          pthread_mutex_unlock(&bd->mutex);
+          pthread_mutex_unlock(&bd->write_fifo[chan].lock);
           return wr_cnt ? wr_cnt : -EAGAIN;
         }
 
-	if (rshim_got_peer_signal() == 0) {
-          pthread_mutex_unlock(&bd->mutex);
+        if (rshim_got_peer_signal() == 0) {
+          pthread_mutex_unlock(&bd->write_fifo[chan].lock);
           return -EINTR;
-	}
+        }
       }
 
       /*
-       * Since we dropped the mutex, we must make sure our interface is still
-       * there before we do anything else.
+       * The interface might have gone away while we slept, so make sure
+       * it's still there before we do anything else.
        */
       continue;
     }
 
-    pthread_mutex_lock(&bd->ringlock);
     writesize = MIN(count, (size_t)write_space(bd, chan));
     pass1 = MIN(writesize, (size_t)write_space_to_end(bd, chan));
     pass2 = writesize - pass1;
-    pthread_mutex_unlock(&bd->ringlock);
 
     RSHIM_DBG("fifo_write: writesize %zd, head %d, tail %d\n",
               writesize, bd->write_fifo[chan].head,
@@ -1527,12 +3224,16 @@ ssize_t rshim_fifo_write(rshim_backend_t *bd, const char *buffer,
     memcpy(write_space_ptr(bd, chan), buffer, pass1);
     if (pass2)
       memcpy(bd->write_fifo[chan].data, buffer + pass1, pass2);
-
-    pthread_mutex_lock(&bd->ringlock);
     write_add_bytes(bd, chan, writesize);
+    trace_fifo(bd, RSH_TRACE_FIFO_WRITE, bd->write_fifo, chan);
+
     /* We have some new bytes, let's see if we can write any. */
-    rshim_fifo_output(bd);
+    pthread_mutex_lock(&bd->mutex);
+    pthread_mutex_lock(&bd->ringlock);
+    if (!rshim_cons_batch(bd, chan))
+      rshim_fifo_output(bd);
     pthread_mutex_unlock(&bd->ringlock);
+    pthread_mutex_unlock(&bd->mutex);
 
     count -= writesize;
     buffer += writesize;
@@ -1540,12 +3241,78 @@ ssize_t rshim_fifo_write(rshim_backend_t *bd, const char *buffer,
     RSHIM_DBG("fifo_write: transferred %zd bytes this pass\n", writesize);
   }
 
-  pthread_mutex_unlock(&bd->mutex);
+  if (chan == TMFIFO_CONS_CHAN && wr_cnt) {
+    pthread_mutex_lock(&bd->mutex);
+    rshim_cons_kick(bd);
+    pthread_mutex_unlock(&bd->mutex);
+  }
+
+  pthread_mutex_unlock(&bd->write_fifo[chan].lock);
 
   RSHIM_DBG("fifo_write: returning %zd\n", wr_cnt);
   return wr_cnt;
 }
 
+/*
+ * Period of the network poll in milliseconds, or -1 if it's not needed.
+ * A partially moved frame is polled every tick. Backends which don't
+ * notify TMFIFO input need the poll all the time, as it's the only poll
+ * of the tile-to-host FIFO with the console closed; it runs every tick
+ * while frames move and backs off to RSHIM_NET_POLL_TICKS when idle.
+ */
+static int rshim_net_poll(rshim_backend_t *bd)
+{
+  if (bd->net_fd < 0)
+    return -1;
+  if (rshim_net_pending(bd))
+    return RSHIM_TIMER_INTERVAL;
+  if (bd->has_input_events)
+    return -1;
+  return MAX(bd->net_poll, 1) * RSHIM_TIMER_INTERVAL;
+}
+
+/* Arm the timer for the next network poll if any. */
+static void rshim_net_poll_schedule(rshim_backend_t *bd)
+{
+  int ms = rshim_net_poll(bd);
+
+  if (ms >= 0)
+    rshim_timer_schedule(bd, ms);
+}
+
+/* Poll the network right away after host traffic; replies are due soon. */
+static void rshim_net_kick(rshim_backend_t *bd)
+{
+  bd->net_poll = 1;
+}
+
+/* Poll the network, reading the TMFIFO first if nothing else does. */
+static void rshim_net_poll_run(rshim_backend_t *bd)
+{
+  uint64_t bytes;
+
+  if (!bd->has_input_events) {
+    pthread_mutex_lock(&bd->mutex);
+    pthread_mutex_lock(&bd->ringlock);
+    rshim_fifo_input(bd);
+    pthread_mutex_unlock(&bd->ringlock);
+    pthread_mutex_unlock(&bd->mutex);
+  }
+
+  rshim_net_tx(bd);
+  rshim_net_rx(bd);
+
+  /* Back off while no frame moved since the last poll. */
+  bytes = bd->stats.tx_bytes[TMFIFO_NET_CHAN] +
+          bd->stats.rx_bytes[TMFIFO_NET_CHAN];
+  if (bytes != bd->net_poll_bytes) {
+    bd->net_poll_bytes = bytes;
+    bd->net_poll = 1;
+  } else {
+    bd->net_poll = MIN(MAX(bd->net_poll, 1) * 2, RSHIM_NET_POLL_TICKS);
+  }
+}
+
 static void rshim_work_handler(rshim_backend_t *bd)
 {
   int rc;
@@ -1553,6 +3320,19 @@ static void rshim_work_handler(rshim_backend_t *bd)
   pthread_mutex_lock(&bd->mutex);
 
   bd->work_pending = false;
+  RSHIM_TRACE(bd, RSH_TRACE_WORK_RUN, 0, 0);
+
+  /* Time to service since the last wake-up. */
+  if (bd->work_signal_time) {
+    uint64_t latency = rshim_get_time_ns() - bd->work_signal_time;
+
+    bd->work_signal_time = 0;
+    bd->work_wakeups++;
+    bd->work_latency_total += latency;
+    rshim_hist_add(&bd->stats.work_lat, latency);
+    if (latency > bd->work_latency_max)
+      bd->work_latency_max = latency;
+  }
 
   if (bd->keepalive && bd->has_rshim) {
     bd->write_rshim(bd, RSHIM_CHANNEL, RSH_SCRATCHPAD1,
@@ -1567,9 +3347,11 @@ static void rshim_work_handler(rshim_backend_t *bd)
                                                        bd->boot_work_buf_len);
     bd->boot_work_buf = NULL;
     pthread_cond_broadcast(&bd->boot_write_complete_cond);
+  } else if (bd->boot_queue_cnt) {
+    rshim_boot_queue_drain(bd);
   }
 
-  if (bd->net_fd < 0 && (rshim_timer_ticks - bd->net_init_time) <
+  if (bd->net_fd < 0 && (rshim_timer_now() - bd->net_init_time) <
       RSHIM_NET_INIT_DELAY) {
     rc = rshim_net_init(bd);
     if (!rc) {
@@ -1577,9 +3359,28 @@ static void rshim_work_handler(rshim_backend_t *bd)
       pthread_mutex_lock(&bd->ringlock);
       rshim_fifo_input(bd);
       pthread_mutex_unlock(&bd->ringlock);
+
+      /* Start polling the network if the backend needs it. */
+      rshim_net_kick(bd);
+      rshim_net_poll_schedule(bd);
+
+      /* Propose jumbo frames to the peer in a ctrl request if configured. */
+      bd->net_mtu = RSHIM_NET_MTU_DEFAULT;
+      if (rshim_net_mtu(bd) > RSHIM_NET_MTU_DEFAULT) {
+        bd->peer_ctrl_req = 1;
+        bd->has_cons_work = 1;
+      }
     }
   }
 
+  /* Apply the MTU negotiated with the peer. */
+  if (bd->net_mtu_changed && bd->net_fd >= 0) {
+    bd->net_mtu_changed = 0;
+    rc = rshim_net_set_mtu(bd, bd->net_mtu);
+    if (!rc)
+      RSHIM_INFO("rshim%d: network mtu %d\n", bd->index, bd->net_mtu);
+  }
+
   if (bd->is_boot_open || bd->is_booting) {
     pthread_mutex_unlock(&bd->mutex);
     return;
@@ -1612,16 +3413,167 @@ static void rshim_work_handler(rshim_backend_t *bd)
     rshim_fifo_input(bd);
     pthread_mutex_unlock(&bd->ringlock);
 
-    bd->has_cons_work = 0;
-  }
+    bd->has_cons_work = 0;
+  }
+
+  if (!bd->has_reprobe && bd->is_cons_open) {
+    int period = rshim_cons_poll_period(bd);
+
+    bd->has_cons_work = 1;
+    if (bd->timer - rshim_timer_now() > period) {
+      bd->timer = rshim_timer_now() + period;
+      rshim_timer_schedule(bd, period * RSHIM_TIMER_INTERVAL);
+    }
+  }
+
+  pthread_mutex_unlock(&bd->mutex);
+}
+
+/* Whether the worker thread serves the device, may be read from any thread. */
+static bool rshim_worker_running(rshim_backend_t *bd)
+{
+  return __atomic_load_n(&bd->worker_run, __ATOMIC_ACQUIRE);
+}
+
+/* Per-device worker thread handling the work and network fds. */
+static void *rshim_worker_thread(void *arg)
+{
+  rshim_backend_t *bd = (rshim_backend_t *)arg;
+  struct epoll_event events[8];
+  int i, num, period, ticks = rshim_timer_now();
+  rshim_epoll_t *ep;
+  uint64_t cnt;
+
+  while (rshim_worker_running(bd)) {
+    period = rshim_net_poll(bd);
+    num = epoll_wait(bd->epoll_fd, events,
+                     sizeof(events) / sizeof(events[0]), period);
+
+    for (i = 0; i < num && rshim_worker_running(bd); i++) {
+      ep = (rshim_epoll_t *)events[i].data.ptr;
+
+      switch (ep->kind) {
+      case RSH_EPOLL_WORK:
+        if (read(ep->fd, &cnt, sizeof(cnt)) == sizeof(cnt))
+          rshim_work_handler(bd);
+        break;
+
+      case RSH_EPOLL_NET_RX:
+        if (read(ep->fd, &cnt, sizeof(cnt)) == sizeof(cnt))
+          rshim_net_rx(bd);
+        rshim_net_kick(bd);
+        break;
+
+      case RSH_EPOLL_NET_TX:
+        rshim_net_tx(bd);
+        rshim_net_kick(bd);
+        break;
+      }
+    }
+
+    /* Push out remaining data once per poll period. */
+    period = MAX(period / RSHIM_TIMER_INTERVAL, 1);
+    if (rshim_worker_running(bd) && bd->net_fd >= 0 &&
+        rshim_timer_now() - ticks >= period) {
+      ticks = rshim_timer_now();
+      rshim_net_poll_run(bd);
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Move the network and work fds of the device over to another epoll fd.
+ * bd->epoll_fd is switched first, so that the work handler which runs once
+ * the work fd is in place registers any new fds there. The work fd stays
+ * the same eventfd, so a rshim_work_signal() in between is not lost.
+ */
+static int rshim_worker_move(rshim_backend_t *bd, int from, int to)
+{
+  rshim_epoll_t *eps[] = { &bd->net_tx_ep, &bd->net_rx_ep, &bd->work_ep };
+  int fds[] = { bd->net_fd, bd->net_notify_fd, bd->work_fd };
+  struct epoll_event event;
+  int i, rc = 0;
+
+  __atomic_store_n(&bd->epoll_fd, to, __ATOMIC_RELEASE);
+
+  for (i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+    if (fds[i] < 0)
+      continue;
+    memset(&event, 0, sizeof(event));
+    event.data.ptr = eps[i];
+    event.events = EPOLLIN;
+    if (epoll_ctl(to, EPOLL_CTL_ADD, fds[i], &event) == -1 && !rc) {
+      rc = -errno;
+      RSHIM_ERR("epoll_ctl failed: %m\n");
+    }
+    epoll_ctl(from, EPOLL_CTL_DEL, fds[i], NULL);
+  }
+
+  return rc;
+}
+
+static int rshim_worker_start(rshim_backend_t *bd)
+{
+  pthread_attr_t attr;
+  int fd, rc;
+
+  if (!rshim_cfg_get_int(bd, "WORKER_THREADS", 0))
+    return 0;
+
+  fd = epoll_create1(EPOLL_CLOEXEC);
+  if (fd == -1) {
+    RSHIM_ERR("epoll_create1 failed: %m\n");
+    return -errno;
+  }
+
+  /* Move the fds from the global loop to the worker. */
+  rc = rshim_worker_move(bd, rshim_epoll_fd, fd);
+  if (rc)
+    goto fail;
+
+  __atomic_store_n(&bd->worker_run, true, __ATOMIC_RELEASE);
+  rshim_thread_attr(bd, "WORKER_CPUS", &attr);
+  rc = pthread_create(&bd->worker_thread, &attr, rshim_worker_thread, bd);
+  pthread_attr_destroy(&attr);
+  if (rc) {
+    RSHIM_ERR("rshim%d: failed to create worker thread\n", bd->index);
+    __atomic_store_n(&bd->worker_run, false, __ATOMIC_RELEASE);
+    rc = -rc;
+    goto fail;
+  }
+
+  return 0;
+
+fail:
+  rshim_worker_move(bd, fd, rshim_epoll_fd);
+  close(fd);
+  return rc;
+}
+
+/*
+ * Stop the worker thread and hand its fds back to the global loop. Must be
+ * called without holding bd->mutex.
+ */
+static void rshim_worker_stop(rshim_backend_t *bd)
+{
+  uint64_t one = 1;
+  int fd = bd->epoll_fd;
+
+  if (!__atomic_exchange_n(&bd->worker_run, false, __ATOMIC_ACQ_REL))
+    return;
 
-  if (!bd->has_reprobe && bd->is_cons_open) {
-    bd->has_cons_work = 1;
-    if (bd->timer - rshim_timer_ticks > 100)
-      bd->timer = rshim_timer_ticks + 100;
-  }
+  rshim_fd_full_write(bd->work_fd, &one, sizeof(one));
+  if (!pthread_equal(pthread_self(), bd->worker_thread))
+    pthread_join(bd->worker_thread, NULL);
+  else
+    pthread_detach(bd->worker_thread);
 
-  pthread_mutex_unlock(&bd->mutex);
+  /* Let the global loop run the work the worker left behind. */
+  bd->work_pending = false;
+  rshim_worker_move(bd, fd, rshim_epoll_fd);
+  close(fd);
 }
 
 static int rshim_boot_done(rshim_backend_t *bd)
@@ -1659,15 +3611,15 @@ int rshim_fifo_fsync(rshim_backend_t *bd, int chan)
 {
   int rc = 0;
 
-  pthread_mutex_lock(&bd->mutex);
-
   /*
    * To ensure that all of our data has actually made it to the
    * device, we first wait until the channel is empty, then we wait
-   * until there is no outstanding write urb.
+   * until there are no outstanding write urbs.
    */
-  while (!write_empty(bd, chan)) {
-    if (pthread_cond_wait(&bd->write_fifo[chan].operable, &bd->mutex)) {
+  pthread_mutex_lock(&bd->write_fifo[chan].lock);
+  while (!rshim_fifo_drained(bd, chan)) {
+    if (rshim_fifo_sleep(bd, &bd->write_fifo[chan], chan, rshim_fifo_drained,
+                         NULL)) {
       rc = -EINTR;
       break;
     }
@@ -1677,8 +3629,12 @@ int rshim_fifo_fsync(rshim_backend_t *bd, int chan)
       break;
     }
   }
+  pthread_mutex_unlock(&bd->write_fifo[chan].lock);
 
-  while (!rc && (bd->spin_flags & RSH_SFLG_WRITING)) {
+  pthread_mutex_lock(&bd->mutex);
+
+  while (!rc && ((bd->spin_flags & RSH_SFLG_WRITING) ||
+                 bd->write_inflight > 0)) {
     if (pthread_cond_wait(&bd->fifo_write_complete_cond, &bd->mutex)) {
       rc = -EINTR;
       break;
@@ -1732,6 +3688,12 @@ static int rshim_fifo_release(rshim_backend_t *bd, int chan,
                               void (*poll_handle_destroy)(rshim_backend_t *bd,
                                                           int chan))
 {
+  /* The console rings are reset below; keep their readers and writers off. */
+  if (chan == TMFIFO_CONS_CHAN) {
+    pthread_mutex_lock(&bd->read_fifo[chan].lock);
+    pthread_mutex_lock(&bd->write_fifo[chan].lock);
+  }
+
   pthread_mutex_lock(&bd->mutex);
 
   if (chan == TMFIFO_CONS_CHAN) {
@@ -1740,10 +3702,8 @@ static int rshim_fifo_release(rshim_backend_t *bd, int chan,
      * fix the reference count.
      */
     bd->console_opens--;
-    if (bd->console_opens) {
-      pthread_mutex_unlock(&bd->mutex);
-      return 0;
-    }
+    if (bd->console_opens)
+      goto done;
 
     /*
      * We've told the host to stop using the TM FIFO console,
@@ -1785,8 +3745,14 @@ static int rshim_fifo_release(rshim_backend_t *bd, int chan,
   if (poll_handle_destroy)
     poll_handle_destroy(bd, chan);
 
+done:
   pthread_mutex_unlock(&bd->mutex);
 
+  if (chan == TMFIFO_CONS_CHAN) {
+    pthread_mutex_unlock(&bd->write_fifo[chan].lock);
+    pthread_mutex_unlock(&bd->read_fifo[chan].lock);
+  }
+
   return 0;
 }
 
@@ -1851,6 +3817,7 @@ int rshim_notify(rshim_backend_t *bd, int event, int code)
     break;
 
   case RSH_EVENT_ATTACH:
+    rshim_info_invalidate(bd);
     rshim_boot_done(bd);
 
     /* Sync-up the tmfifo if reprobe is not supported. */
@@ -1861,10 +3828,12 @@ int rshim_notify(rshim_backend_t *bd, int event, int code)
     bd->is_attach = 1;
 
     /* Init network interface. Moved to the work handler since it takes time. */
-    bd->net_init_time = rshim_timer_ticks;
+    bd->net_init_time = rshim_timer_now();
     break;
 
   case RSH_EVENT_DETACH:
+    rshim_info_invalidate(bd);
+
     /* Shutdown network interface. */
     __sync_synchronize();
     bd->is_attach = 0;
@@ -1876,8 +3845,146 @@ int rshim_notify(rshim_backend_t *bd, int event, int code)
   return rc;
 }
 
-static int rshim_find_index(char *dev_name)
+static unsigned int rshim_name_bucket(const char *name)
+{
+  return rshim_fnv_hash((const uint8_t *)name, strlen(name)) % RSHIM_HASH_SIZE;
+}
+
+static unsigned int rshim_dev_bucket(void *dev)
+{
+  uintptr_t value = (uintptr_t)dev;
+
+  return rshim_fnv_hash((const uint8_t *)&value, sizeof(value)) %
+         RSHIM_HASH_SIZE;
+}
+
+static rshim_name_t *rshim_name_lookup(rshim_name_t **table, const char *name)
+{
+  rshim_name_t *ent;
+
+  for (ent = table[rshim_name_bucket(name)]; ent; ent = ent->next) {
+    if (!strcmp(ent->name, name))
+      return ent;
+  }
+
+  return NULL;
+}
+
+static rshim_name_t *rshim_name_insert(rshim_name_t **table, const char *name,
+                                       int index)
+{
+  unsigned int bucket = rshim_name_bucket(name);
+  rshim_name_t *ent = rshim_name_lookup(table, name);
+
+  if (ent) {
+    ent->index = index;
+    return ent;
+  }
+
+  ent = calloc(1, sizeof(*ent));
+  if (!ent)
+    return NULL;
+  ent->name = strdup(name);
+  if (!ent->name) {
+    free(ent);
+    return NULL;
+  }
+  ent->index = index;
+  ent->next = table[bucket];
+  table[bucket] = ent;
+
+  return ent;
+}
+
+static void rshim_name_remove(rshim_name_t **table, const char *name)
+{
+  rshim_name_t **pp, *ent;
+
+  for (pp = &table[rshim_name_bucket(name)]; (ent = *pp); pp = &ent->next) {
+    if (!strcmp(ent->name, name)) {
+      *pp = ent->next;
+      free(ent->name);
+      free(ent);
+      return;
+    }
+  }
+}
+
+/* Make room for slot 'index'. Called with rshim_devs_lock held for write. */
+static int rshim_devs_grow(int index)
+{
+  rshim_backend_t **devs;
+  char **names;
+  int size;
+
+  if (index < rshim_devs_size)
+    return 0;
+  if (index > RSHIM_MAX_INDEX)
+    return -EINVAL;
+
+  size = rshim_devs_size ? rshim_devs_size : 16;
+  while (size <= index)
+    size *= 2;
+  size = MIN(size, RSHIM_MAX_INDEX + 1);
+
+  devs = realloc(rshim_devs, size * sizeof(*devs));
+  if (!devs)
+    return -ENOMEM;
+  rshim_devs = devs;
+  names = realloc(rshim_dev_names, size * sizeof(*names));
+  if (!names)
+    return -ENOMEM;
+  rshim_dev_names = names;
+
+  memset(devs + rshim_devs_size, 0,
+         (size - rshim_devs_size) * sizeof(*devs));
+  memset(names + rshim_devs_size, 0,
+         (size - rshim_devs_size) * sizeof(*names));
+  rshim_devs_size = size;
+
+  return 0;
+}
+
+/*
+ * Remember 'name' as the device of slot 'index', so that it gets the same
+ * slot when it comes back. Called with rshim_devs_lock held for write.
+ */
+static int rshim_dev_name_set(int index, const char *name)
 {
+  rshim_name_t *ent;
+  int rc;
+
+  rc = rshim_devs_grow(index);
+  if (rc)
+    return rc;
+
+  if (rshim_dev_names[index]) {
+    if (!strcmp(rshim_dev_names[index], name))
+      return 0;
+    rshim_name_remove(rshim_name_hash, rshim_dev_names[index]);
+    free(rshim_dev_names[index]);
+    rshim_dev_names[index] = NULL;
+  }
+
+  /* The name moves away from its previous slot, if any. */
+  ent = rshim_name_lookup(rshim_name_hash, name);
+  if (ent && ent->index != index && ent->index < rshim_devs_size) {
+    free(rshim_dev_names[ent->index]);
+    rshim_dev_names[ent->index] = NULL;
+  }
+
+  rshim_dev_names[index] = strdup(name);
+  if (!rshim_dev_names[index] ||
+      !rshim_name_insert(rshim_name_hash, name, index))
+    return -ENOMEM;
+
+  return 0;
+}
+
+/* Called with rshim_devs_lock held. */
+static int rshim_find_index_locked(char *dev_name)
+{
+  rshim_name_t *ent;
   int i;
 
   /* Need to match static device name if configured. */
@@ -1889,21 +3996,22 @@ static int rshim_find_index(char *dev_name)
     return rshim_static_index;
 
   /* First look for a match with a previous device name. */
-  for (i = 0; i < RSHIM_MAX_DEV; i++) {
-    if (rshim_dev_names[i] && !strcmp(dev_name, rshim_dev_names[i])) {
-      RSHIM_DBG("found match with previous at index %d\n", i);
-      return i;
-    }
+  ent = rshim_name_lookup(rshim_name_hash, dev_name);
+  if (ent) {
+    RSHIM_DBG("found match with previous at index %d\n", ent->index);
+    return ent->index;
   }
 
-  /* Then look for a never-used slot. */
-  for (i = 0; i < RSHIM_MAX_DEV; i++) {
+  /* Then look for a never-used slot, growing the table if needed. */
+  for (i = 0; i < rshim_devs_size; i++) {
     if (!rshim_dev_names[i])
       return i;
   }
+  if (rshim_devs_size <= RSHIM_MAX_INDEX)
+    return rshim_devs_size;
 
   /* Finally look for a currently-unused slot. */
-  for (i = 0; i < RSHIM_MAX_DEV; i++) {
+  for (i = 0; i < rshim_devs_size; i++) {
     if (!rshim_devs[i]) {
       RSHIM_DBG("found unused slot %d\n", i);
       return i;
@@ -1913,31 +4021,275 @@ static int rshim_find_index(char *dev_name)
   return -1;
 }
 
+static int rshim_find_index(char *dev_name)
+{
+  int index;
+
+  pthread_rwlock_rdlock(&rshim_devs_lock);
+  index = rshim_find_index_locked(dev_name);
+  pthread_rwlock_unlock(&rshim_devs_lock);
+
+  return index;
+}
+
 rshim_backend_t *rshim_find_by_name(char *dev_name)
 {
-  int index = rshim_find_index(dev_name);
+  rshim_backend_t *bd = NULL;
+  int index;
+
+  pthread_rwlock_rdlock(&rshim_devs_lock);
+  index = rshim_find_index_locked(dev_name);
+  if (index >= 0 && index < rshim_devs_size)
+    bd = rshim_devs[index];
+  pthread_rwlock_unlock(&rshim_devs_lock);
 
   /* If none of that worked, we fail. */
-  if (index < 0) {
+  if (index < 0)
     RSHIM_ERR("couldn't find slot for new device %s\n", dev_name);
-    return NULL;
-  }
 
-  return rshim_devs[index];
+  return bd;
 }
 
 rshim_backend_t *rshim_find_by_dev(void *dev)
 {
   rshim_backend_t *bd;
-  int index;
 
-  for (index = 0; index < RSHIM_MAX_DEV; index++) {
-    bd = rshim_devs[index];
-    if (bd && bd->dev == dev)
-      return bd;
+  pthread_rwlock_rdlock(&rshim_devs_lock);
+  for (bd = rshim_dev_hash[rshim_dev_bucket(dev)]; bd; bd = bd->dev_next) {
+    if (bd->dev == dev)
+      break;
   }
+  pthread_rwlock_unlock(&rshim_devs_lock);
 
-  return NULL;
+  return bd;
+}
+
+/* Put a backend into slot 'index' and the live list. */
+static int rshim_devs_add(rshim_backend_t *bd, int index)
+{
+  rshim_backend_t **live;
+  unsigned int bucket;
+  int rc, size;
+
+  pthread_rwlock_wrlock(&rshim_devs_lock);
+
+  rc = rshim_devs_grow(index);
+  if (rc)
+    goto done;
+
+  if (rshim_devs[index] && rshim_devs[index] != bd) {
+    rc = -ENODEV;
+    goto done;
+  }
+
+  if (rshim_live_cnt == rshim_live_size) {
+    size = rshim_live_size ? rshim_live_size * 2 : 16;
+    live = calloc(size, sizeof(*live));
+    if (!live) {
+      rc = -ENOMEM;
+      goto done;
+    }
+    if (rshim_live_cnt)
+      memcpy(live, rshim_live, rshim_live_cnt * sizeof(*live));
+    free(rshim_live);
+    rshim_live = live;
+    rshim_live_size = size;
+  }
+
+  rc = rshim_dev_name_set(index, bd->dev_name);
+  if (rc)
+    goto done;
+
+  bd->index = index;
+  rshim_devs[index] = bd;
+  bd->live_idx = rshim_live_cnt;
+  rshim_live[rshim_live_cnt] = bd;
+  rshim_live_cnt++;
+
+  if (bd->dev) {
+    bucket = rshim_dev_bucket(bd->dev);
+    bd->dev_next = rshim_dev_hash[bucket];
+    rshim_dev_hash[bucket] = bd;
+  }
+
+done:
+  pthread_rwlock_unlock(&rshim_devs_lock);
+  return rc;
+}
+
+static void rshim_devs_del(rshim_backend_t *bd)
+{
+  rshim_backend_t **pp;
+  int i;
+
+  pthread_rwlock_wrlock(&rshim_devs_lock);
+
+  if (bd->index < rshim_devs_size && rshim_devs[bd->index] == bd)
+    rshim_devs[bd->index] = NULL;
+
+  i = bd->live_idx;
+  if (i < rshim_live_cnt && rshim_live[i] == bd) {
+    rshim_live[i] = rshim_live[rshim_live_cnt - 1];
+    rshim_live[i]->live_idx = i;
+    rshim_live_cnt--;
+  }
+
+  if (bd->dev) {
+    for (pp = &rshim_dev_hash[rshim_dev_bucket(bd->dev)]; *pp;
+         pp = &(*pp)->dev_next) {
+      if (*pp == bd) {
+        *pp = bd->dev_next;
+        break;
+      }
+    }
+  }
+  bd->dev_next = NULL;
+
+  pthread_rwlock_unlock(&rshim_devs_lock);
+}
+
+/*
+ * Get a referenced copy of the live devices, to be released with
+ * rshim_devs_put(). Return the number of devices or a negative errno.
+ */
+int rshim_devs_get(rshim_backend_t ***list)
+{
+  int i, n;
+
+  pthread_rwlock_rdlock(&rshim_devs_lock);
+  n = rshim_live_cnt;
+  *list = malloc(MAX(n, 1) * sizeof(**list));
+  if (!*list) {
+    pthread_rwlock_unlock(&rshim_devs_lock);
+    return -ENOMEM;
+  }
+  for (i = 0; i < n; i++) {
+    (*list)[i] = rshim_live[i];
+    rshim_ref((*list)[i]);
+  }
+  pthread_rwlock_unlock(&rshim_devs_lock);
+
+  return n;
+}
+
+void rshim_devs_put(rshim_backend_t **list, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    rshim_deref(list[i]);
+  free(list);
+}
+
+/* Timer heap helpers, called with rshim_timer_lock held. */
+static void rshim_timer_swap(int i, int j)
+{
+  rshim_backend_t *bd = rshim_timer_heap[i];
+
+  rshim_timer_heap[i] = rshim_timer_heap[j];
+  rshim_timer_heap[j] = bd;
+  rshim_timer_heap[i]->timer_idx = i;
+  rshim_timer_heap[j]->timer_idx = j;
+}
+
+static void rshim_timer_sift_up(int i)
+{
+  while (i > 0 && rshim_timer_heap[(i - 1) / 2]->timer_due_ns >
+         rshim_timer_heap[i]->timer_due_ns) {
+    rshim_timer_swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static void rshim_timer_sift_down(int i)
+{
+  int j;
+
+  while ((j = 2 * i + 1) < rshim_timer_cnt) {
+    if (j + 1 < rshim_timer_cnt && rshim_timer_heap[j + 1]->timer_due_ns <
+        rshim_timer_heap[j]->timer_due_ns)
+      j++;
+    if (rshim_timer_heap[i]->timer_due_ns <= rshim_timer_heap[j]->timer_due_ns)
+      break;
+    rshim_timer_swap(i, j);
+    i = j;
+  }
+}
+
+static void rshim_timer_remove(rshim_backend_t *bd)
+{
+  int i = bd->timer_idx;
+
+  if (!bd->timer_queued)
+    return;
+
+  bd->timer_queued = false;
+  if (i == --rshim_timer_cnt)
+    return;
+
+  rshim_timer_heap[i] = rshim_timer_heap[rshim_timer_cnt];
+  rshim_timer_heap[i]->timer_idx = i;
+  rshim_timer_sift_up(i);
+  rshim_timer_sift_down(i);
+}
+
+/* Re-arm the one-shot timerfd if the earliest deadline changed. */
+static void rshim_timer_arm(void)
+{
+  uint64_t due = rshim_timer_cnt ? rshim_timer_heap[0]->timer_due_ns : 0;
+  struct itimerspec ts;
+
+  if (rshim_timer_fd < 0 || due == rshim_timer_armed_ns)
+    return;
+
+  /* A zero deadline disarms the timer. */
+  memset(&ts, 0, sizeof(ts));
+  ts.it_value.tv_sec = due / 1000000000;
+  ts.it_value.tv_nsec = due % 1000000000;
+  if (timerfd_settime(rshim_timer_fd, TFD_TIMER_ABSTIME, &ts, NULL) < 0)
+    RSHIM_ERR("timerfd_settime failed: %m\n");
+  rshim_timer_armed_ns = due;
+}
+
+/* Make the timer of a device fire within 'ms' milliseconds. */
+static void rshim_timer_schedule(rshim_backend_t *bd, int ms)
+{
+  uint64_t due = rshim_get_time_ns() + (uint64_t)MAX(ms, 0) * 1000000;
+
+  pthread_mutex_lock(&rshim_timer_lock);
+  if (!bd->timer_queued && rshim_timer_cnt == rshim_timer_size) {
+    int size = rshim_timer_size ? rshim_timer_size * 2 : 16;
+    rshim_backend_t **heap;
+
+    heap = realloc(rshim_timer_heap, size * sizeof(*heap));
+    if (!heap) {
+      pthread_mutex_unlock(&rshim_timer_lock);
+      RSHIM_ERR("failed to grow the timer heap\n");
+      return;
+    }
+    rshim_timer_heap = heap;
+    rshim_timer_size = size;
+  }
+  if (!bd->timer_queued) {
+    bd->timer_queued = true;
+    bd->timer_due_ns = due;
+    bd->timer_idx = rshim_timer_cnt++;
+    rshim_timer_heap[bd->timer_idx] = bd;
+    rshim_timer_sift_up(bd->timer_idx);
+  } else if (due < bd->timer_due_ns) {
+    bd->timer_due_ns = due;
+    rshim_timer_sift_up(bd->timer_idx);
+  }
+  rshim_timer_arm();
+  pthread_mutex_unlock(&rshim_timer_lock);
+}
+
+static void rshim_timer_cancel(rshim_backend_t *bd)
+{
+  pthread_mutex_lock(&rshim_timer_lock);
+  rshim_timer_remove(bd);
+  rshim_timer_arm();
+  pthread_mutex_unlock(&rshim_timer_lock);
 }
 
 /* House-keeping timer. */
@@ -1949,34 +4301,57 @@ static void rshim_timer_func(rshim_backend_t *bd)
     rshim_work_signal(bd);
 
   /* Request keepalive update and restart the ~300ms timer. */
-  if (rshim_timer_ticks - (bd->last_keepalive + period) > 0) {
+  if (rshim_timer_now() - (bd->last_keepalive + period) > 0) {
     bd->keepalive = 1;
-    bd->last_keepalive = rshim_timer_ticks;
+    bd->last_keepalive = rshim_timer_now();
     rshim_work_signal(bd);
   }
 
-  bd->timer = rshim_timer_ticks + period;
+  bd->timer = rshim_timer_now() + period;
 }
 
 static void rshim_timer_run(void)
 {
-  rshim_backend_t *bd;
-  int i;
+  rshim_backend_t *due = NULL, **tail = &due, *bd;
+  uint64_t now = rshim_get_time_ns();
+
+  /* Take the expired devices off the heap; the timerfd is disarmed now. */
+  pthread_mutex_lock(&rshim_timer_lock);
+  rshim_timer_armed_ns = 0;
+  while (rshim_timer_cnt && rshim_timer_heap[0]->timer_due_ns <= now) {
+    bd = rshim_timer_heap[0];
+    rshim_timer_remove(bd);
+    bd->timer_next = NULL;
+    *tail = bd;
+    tail = &bd->timer_next;
+  }
+  rshim_timer_arm();
+  pthread_mutex_unlock(&rshim_timer_lock);
 
-  rshim_timer_ticks++;
+  while (due) {
+    bd = due;
+    due = bd->timer_next;
 
-  for (i = 0; i < RSHIM_MAX_DEV; i++) {
-    bd = rshim_devs[i];
-    if (bd) {
-      if (rshim_timer_ticks - bd->timer > 0)
-        rshim_timer_func(bd);
+    if (rshim_timer_now() - bd->timer >= 0)
+      rshim_timer_func(bd);
 
-      /* Push out remaining data if not sent out in the epoll loop. */
-      if (bd->net_fd >= 0) {
-        rshim_net_tx(bd);
-        rshim_net_rx(bd);
-      }
+    /* Retry the boot queue which found the boot FIFO full. */
+    if (bd->boot_queue_defer) {
+      bd->boot_queue_defer = 0;
+      rshim_work_signal(bd);
+    }
+
+    /*
+     * Push out remaining data if not sent out in the epoll loop. It's
+     * done by the worker thread if there is one.
+     */
+    if (bd->net_fd >= 0 && !rshim_worker_running(bd)) {
+      rshim_net_poll_run(bd);
+      rshim_net_poll_schedule(bd);
     }
+
+    rshim_timer_schedule(bd, (bd->timer - rshim_timer_now()) *
+                         RSHIM_TIMER_INTERVAL);
   }
 }
 
@@ -2078,34 +4453,155 @@ static int rshim_bf2_a0_wa(rshim_backend_t *bd)
       return -1;
   }
 
-  /*
-   * yu.reset_mode_control.reset_modes.reset_mode[13].powerdown_bits[i].powerdown_bits =
-   *   yu.reset_mode_control.reset_modes.reset_mode[8].powerdown_bits[i].powerdown_bits
-   */
-  for (i = 0; i < YU_POWERDOWN_COUNT; ++i) {
-    if (rshim_mmio_read32(bd, RSHIM_YU_BASE_ADDR + YU_RESET_8_POWERDOWN +
-                          (i * 4), &powerdown))
-      return -1;
-    if (rshim_mmio_write32(bd, RSHIM_YU_BASE_ADDR + YU_RESET_13_POWERDOWN +
-                           (i * 4), powerdown))
-      return -1;
+  /*
+   * yu.reset_mode_control.reset_modes.reset_mode[13].powerdown_bits[i].powerdown_bits =
+   *   yu.reset_mode_control.reset_modes.reset_mode[8].powerdown_bits[i].powerdown_bits
+   */
+  for (i = 0; i < YU_POWERDOWN_COUNT; ++i) {
+    if (rshim_mmio_read32(bd, RSHIM_YU_BASE_ADDR + YU_RESET_8_POWERDOWN +
+                          (i * 4), &powerdown))
+      return -1;
+    if (rshim_mmio_write32(bd, RSHIM_YU_BASE_ADDR + YU_RESET_13_POWERDOWN +
+                           (i * 4), powerdown))
+      return -1;
+  }
+
+  /*
+   * yu.bootrecord.nic.power.power_clock_up_delay = 0x9
+   * yu.bootrecord.nic.power.power_clock_down_delay = 0x9
+   */
+  if (rshim_mmio_write32(bd, RSHIM_YU_BASE_ADDR + YU_POWER_CLK_DELAY,
+                         0x9 | (0x9 << 5)))
+      return -1;
+
+  return 0;
+}
+
+/*
+ * Backends in the middle of rshim_access_check() or checked but not yet
+ * registered, newest first and protected by the global lock. They are
+ * checked against like the registered ones so that backends of the same
+ * target probed in parallel still find each other.
+ */
+static rshim_backend_t *rshim_probing;
+
+/* Lock the device mutex around a register access, unless already held. */
+static void rshim_access_lock(rshim_backend_t *bd, bool locked)
+{
+  if (!locked)
+    pthread_mutex_lock(&bd->mutex);
+}
+
+static void rshim_access_unlock(rshim_backend_t *bd, bool locked)
+{
+  if (!locked)
+    pthread_mutex_unlock(&bd->mutex);
+}
+
+static void rshim_probing_del(rshim_backend_t *bd)
+{
+  rshim_backend_t **pp;
+
+  for (pp = &rshim_probing; *pp; pp = &(*pp)->probe_next) {
+    if (*pp == bd) {
+      *pp = bd->probe_next;
+      break;
+    }
+  }
+  bd->probe_next = NULL;
+}
+
+/*
+ * Check whether the target of 'bd' is already driven by another backend of
+ * this daemon. Each other backend gets a probe value written into its
+ * RSH_SCRATCHPAD1, which shows up in ours if it is the same register, and
+ * is then restored. Of two backends probing the same target, the one which
+ * started first wins: backends added to the probing list after 'bd' are
+ * skipped, they find 'bd' when they check themselves. Called with the
+ * global lock held, and the device mutex too if 'locked'.
+ */
+static int rshim_access_check_local(rshim_backend_t *bd, bool locked)
+{
+  rshim_backend_t *other_bd, **list, *probing;
+  uint64_t value, orig, token = RSHIM_KEEPALIVE_MAGIC_NUM + 1;
+  int i, n, rc = 0;
+
+  n = rshim_devs_get(&list);
+  if (n < 0)
+    return n;
+
+  rshim_access_lock(bd, locked);
+  rc = bd->read_rshim(bd, RSHIM_CHANNEL, RSH_SCRATCHPAD1, &orig);
+  if (rc >= 0)
+    rc = bd->write_rshim(bd, RSHIM_CHANNEL, RSH_SCRATCHPAD1, 0);
+  rshim_access_unlock(bd, locked);
+  if (rc < 0) {
+    rshim_devs_put(list, n);
+    return -ENODEV;
+  }
+  rc = 0;
+
+  /* The registered backends first, then the ones probing for longer. */
+  for (probing = rshim_probing; probing && probing != bd;
+       probing = probing->probe_next)
+    ;
+  if (probing)
+    probing = probing->probe_next;
+
+  for (i = 0; !rc; i++) {
+    if (i < n) {
+      other_bd = list[i];
+    } else {
+      if (!probing)
+        break;
+      other_bd = probing;
+      probing = probing->probe_next;
+    }
+    if (other_bd == bd)
+      continue;
+    pthread_mutex_lock(&other_bd->mutex);
+    other_bd->write_rshim(other_bd, RSHIM_CHANNEL, RSH_SCRATCHPAD1, token);
+    pthread_mutex_unlock(&other_bd->mutex);
+
+    rshim_access_lock(bd, locked);
+    if (bd->read_rshim(bd, RSHIM_CHANNEL, RSH_SCRATCHPAD1, &value) < 0)
+      rc = -ENODEV;
+    else if (value == token || value == RSHIM_KEEPALIVE_MAGIC_NUM)
+      rc = -EEXIST;
+    rshim_access_unlock(bd, locked);
+
+    /* Registered backends keep the magic value, probing ones expect 0. */
+    pthread_mutex_lock(&other_bd->mutex);
+    other_bd->write_rshim(other_bd, RSHIM_CHANNEL, RSH_SCRATCHPAD1,
+                          other_bd->registered ?
+                          RSHIM_KEEPALIVE_MAGIC_NUM : 0);
+    pthread_mutex_unlock(&other_bd->mutex);
+  }
+
+  rshim_devs_put(list, n);
+
+  /* Give the register back whatever it held if we don't take it over. */
+  if (rc) {
+    rshim_access_lock(bd, locked);
+    bd->write_rshim(bd, RSHIM_CHANNEL, RSH_SCRATCHPAD1, orig);
+    rshim_access_unlock(bd, locked);
   }
 
-  /*
-   * yu.bootrecord.nic.power.power_clock_up_delay = 0x9
-   * yu.bootrecord.nic.power.power_clock_down_delay = 0x9
-   */
-  if (rshim_mmio_write32(bd, RSHIM_YU_BASE_ADDR + YU_POWER_CLK_DELAY,
-                         0x9 | (0x9 << 5)))
-      return -1;
+  if (rc == -EEXIST)
+    RSHIM_INFO("another backend already attached\n");
 
-  return 0;
+  return rc;
 }
 
-/* Check whether backend is allowed to register or not. */
-static int rshim_access_check(rshim_backend_t *bd)
+/*
+ * Check whether backend is allowed to register or not. The device mutex
+ * and the global lock are either held by the caller over the whole check
+ * ('locked'), or only taken around the register accesses and the check
+ * against the other backends. On success the backend stays on the probing
+ * list until rshim_register() has added it to the registered ones.
+ */
+static int rshim_access_check_run(rshim_backend_t *bd, bool locked)
 {
-  rshim_backend_t *other_bd;
   uint64_t value;
   int i, rc;
 
@@ -2116,12 +4612,25 @@ static int rshim_access_check(rshim_backend_t *bd)
    * rshim device.
    */
   for (i = 0; i < 10; i++) {
+    rshim_access_lock(bd, locked);
     rc = bd->read_rshim(bd, RSHIM_CHANNEL, RSH_TM_HOST_TO_TILE_CTL, &value);
+    rshim_access_unlock(bd, locked);
     if (!rc && value)
       break;
     usleep(100000);
   }
 
+  if (!locked)
+    rshim_lock();
+  bd->probe_next = rshim_probing;
+  rshim_probing = bd;
+  rc = rshim_access_check_local(bd, locked);
+  if (!locked)
+    rshim_unlock();
+  if (rc)
+    goto done;
+
+  rshim_access_lock(bd, locked);
   rshim_boot_workaround_check(bd);
 
   if (bd->ver_id == RSHIM_BLUEFIELD_2 && rshim_is_livefish(bd)) {
@@ -2137,22 +4646,7 @@ static int rshim_access_check(rshim_backend_t *bd)
       rshim_bf2_a0_wa(bd);
     }
   }
-
-  /* Write value 0 to RSH_SCRATCHPAD1. */
-  rc = bd->write_rshim(bd, RSHIM_CHANNEL, RSH_SCRATCHPAD1, 0);
-  if (rc < 0)
-    return -ENODEV;
-
-  /* Write magic number to all the other backends. */
-  for (i = 0; i < RSHIM_MAX_DEV; i++) {
-    other_bd = rshim_devs[i];
-    if (!other_bd || other_bd == bd)
-      continue;
-    pthread_mutex_lock(&other_bd->mutex);
-    other_bd->write_rshim(other_bd, RSHIM_CHANNEL, RSH_SCRATCHPAD1,
-                    RSHIM_KEEPALIVE_MAGIC_NUM);
-    pthread_mutex_unlock(&other_bd->mutex);
-  }
+  rshim_access_unlock(bd, locked);
 
   /*
    * Poll RSH_SCRATCHPAD1 up to one second to check whether it's reset to
@@ -2160,50 +4654,96 @@ static int rshim_access_check(rshim_backend_t *bd)
    * already attached to this target.
    */
   for (i = 0; i < 10; i++) {
+    rshim_access_lock(bd, locked);
     rc = bd->read_rshim(bd, RSHIM_CHANNEL, RSH_SCRATCHPAD1, &value);
-    if (rc < 0)
-      return -ENODEV;
+    rshim_access_unlock(bd, locked);
+    if (rc < 0) {
+      rc = -ENODEV;
+      goto done;
+    }
 
     if (value == RSHIM_KEEPALIVE_MAGIC_NUM) {
       RSHIM_INFO("another backend already attached\n");
-      return -EEXIST;
+      rc = -EEXIST;
+      goto done;
     }
 
     usleep(100000);
   }
+  rc = 0;
+  bd->access_checked = 1;
 
-  return 0;
+done:
+  if (rc) {
+    if (!locked)
+      rshim_lock();
+    rshim_probing_del(bd);
+    if (!locked)
+      rshim_unlock();
+  }
+
+  return rc;
+}
+
+/*
+ * Check the access to the target ahead of rshim_register(), which then
+ * doesn't hold the global lock while doing it. Called without the global
+ * lock and the device mutex, and followed by rshim_register() right away.
+ */
+int rshim_access_check(rshim_backend_t *bd)
+{
+  if (bd->registered || bd->access_checked)
+    return 0;
+
+  return rshim_access_check_run(bd, false);
 }
 
+/*
+ * Register a backend, called with the global lock and the device mutex
+ * held. The access to the target is checked first unless the backend did
+ * it with rshim_access_check() before taking the locks.
+ */
 int rshim_register(rshim_backend_t *bd)
 {
-  int i, rc, index;
+  int i, n, rc, index;
 
   if (bd->registered)
     return 0;
 
   index = rshim_find_index(bd->dev_name);
-  if (index < 0)
-    return -ENODEV;
-
-  if (!bd->read_rshim || !bd->write_rshim) {
-    RSHIM_ERR("read_rshim/write_rshim missing\n");
-    return -EINVAL;
+  if (index < 0 || !bd->read_rshim || !bd->write_rshim) {
+    if (index >= 0)
+      RSHIM_ERR("read_rshim/write_rshim missing\n");
+    rc = index < 0 ? -ENODEV : -EINVAL;
+    goto fail;
   }
 
-  rc = rshim_access_check(bd);
-  if (rc)
-    return rc;
+  if (!bd->access_checked) {
+    rc = rshim_access_check_run(bd, true);
+    if (rc)
+      return rc;
+  }
 
   if (!bd->write)
     bd->write = rshim_write_default;
   if (!bd->read)
     bd->read = rshim_read_default;
+  /* Count the register accesses if asked; the default bursts use singles. */
+  rshim_stats_attach(bd);
+  if (!bd->read_rshim_burst)
+    bd->read_rshim_burst = rshim_read_rshim_burst_default;
+  if (!bd->write_rshim_burst)
+    bd->write_rshim_burst = rshim_write_rshim_burst_default;
 
   pthread_mutex_init(&bd->ringlock, NULL);
+  pthread_mutex_init(&bd->net_lock, NULL);
 
   for (i = 0; i < TMFIFO_MAX_CHAN; i++) {
+    pthread_mutex_init(&bd->read_fifo[i].lock, NULL);
+    pthread_mutex_init(&bd->read_fifo[i].wait_lock, NULL);
     pthread_cond_init(&bd->read_fifo[i].operable, NULL);
+    pthread_mutex_init(&bd->write_fifo[i].lock, NULL);
+    pthread_mutex_init(&bd->write_fifo[i].wait_lock, NULL);
     pthread_cond_init(&bd->write_fifo[i].operable, NULL);
   }
 
@@ -2211,42 +4751,120 @@ int rshim_register(rshim_backend_t *bd)
   pthread_cond_init(&bd->boot_complete_cond, NULL);
   pthread_cond_init(&bd->boot_write_complete_cond, NULL);
   pthread_cond_init(&bd->ctrl_wait_cond, NULL);
+  pthread_cond_init(&bd->log_cond, NULL);
   memcpy(&bd->cons_termios, &init_console_termios,
          sizeof(init_console_termios));
 
-  bd->index = index;
-  if (rshim_dev_names[index])
-    free(rshim_dev_names[index]);
-  rshim_dev_names[index] = strdup(bd->dev_name);
-  rshim_devs[index] = bd;
+  rc = rshim_devs_add(bd, index);
+  if (rc)
+    goto fail;
+
+  /* Found by the other backends as a registered one from now on. */
+  rshim_probing_del(bd);
+  bd->access_checked = 0;
 
+  rshim_numa_setup(bd);
+
+  bd->boot_buf_size = rshim_cfg_get_size(bd, "BOOT_BUF_SIZE", BOOT_BUF_SIZE,
+                                         RSHIM_BOOT_BUF_SIZE_MIN,
+                                         RSHIM_BOOT_BUF_SIZE_MAX);
   for (i = 0; i < 2; i++) {
-    bd->boot_buf[i] = malloc(BOOT_BUF_SIZE);
+    bd->boot_buf[i] = rshim_buf_alloc(bd, bd->boot_buf_size);
     if (!bd->boot_buf[i]) {
       if (i == 1) {
-        free(bd->boot_buf[0]);
+        rshim_buf_free(bd->boot_buf[0], bd->boot_buf_size);
         bd->boot_buf[0] = NULL;
       }
     }
   }
 
-  rshim_fifo_alloc(bd);
+  /* Pipelined boot writes through the work handler of the default write. */
+  bd->boot_queue_depth = 1;
+  if (bd->write == rshim_write_default && bd->boot_buf[0]) {
+    n = rshim_cfg_get_int(bd, "BOOT_QUEUE_DEPTH", 1);
+    if (n > RSHIM_MAX_BOOT_QUEUE) {
+      RSHIM_WARN("BOOT_QUEUE_DEPTH %d adjusted to %d\n", n,
+                 RSHIM_MAX_BOOT_QUEUE);
+      n = RSHIM_MAX_BOOT_QUEUE;
+    }
+    for (i = 2; i < n; i++) {
+      bd->boot_buf[i] = rshim_buf_alloc(bd, bd->boot_buf_size);
+      if (!bd->boot_buf[i])
+        break;
+    }
+    if (n > 1)
+      bd->boot_queue_depth = MIN(i, n);
+  }
+
+  rc = rshim_fifo_alloc(bd);
+  if (rc) {
+    RSHIM_ERR("%s: failed to allocate the FIFOs\n", bd->dev_name);
+    for (i = 0; i < RSHIM_MAX_BOOT_QUEUE; i++) {
+      rshim_buf_free(bd->boot_buf[i], bd->boot_buf_size);
+      bd->boot_buf[i] = NULL;
+    }
+    for (i = 0; i < TMFIFO_MAX_CHAN; i++) {
+      rshim_buf_free(bd->read_fifo[i].data, bd->read_fifo[i].size);
+      bd->read_fifo[i].data = NULL;
+      rshim_buf_free(bd->write_fifo[i].data, bd->write_fifo[i].size);
+      bd->write_fifo[i].data = NULL;
+    }
+    rshim_devs_del(bd);
+    goto fail;
+  }
 
   if (!bd->read_buf)
-    bd->read_buf = calloc(1, READ_BUF_SIZE);
+    bd->read_buf = rshim_buf_alloc(bd, bd->read_buf_size);
 
-  if (!bd->write_buf)
-    bd->write_buf = calloc(1, WRITE_BUF_SIZE);
+  if (bd->write_buf_cnt < 1 || bd->write_buf_cnt > RSHIM_MAX_WRITE_BUFS)
+    bd->write_buf_cnt = 1;
+  for (i = 0; i < bd->write_buf_cnt; i++) {
+    if (!bd->write_bufs[i])
+      bd->write_bufs[i] = rshim_buf_alloc(bd, bd->write_buf_size);
+  }
+  bd->write_buf_idx = 0;
+  bd->write_buf = bd->write_bufs[0];
 
   bd->net_fd = -1;
-  bd->net_notify_fd[0] = -1;
-  bd->net_notify_fd[1] = -1;
+  bd->net_notify_fd = -1;
+  bd->epoll_fd = rshim_epoll_fd;
+
+  /* Work wake-up fd in the global loop. */
+  bd->work_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (bd->work_fd < 0) {
+    RSHIM_ERR("eventfd failed: %m\n");
+  } else {
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    bd->work_ep.fd = bd->work_fd;
+    bd->work_ep.kind = RSH_EPOLL_WORK;
+    bd->work_ep.bd = bd;
+    event.data.ptr = &bd->work_ep;
+    event.events = EPOLLIN;
+    if (epoll_ctl(rshim_epoll_fd, EPOLL_CTL_ADD, bd->work_fd, &event) == -1)
+      RSHIM_ERR("epoll_ctl failed: %m\n");
+  }
+
   bd->registered = 1;
   bd->boot_timeout = 100;
+  bd->cons_event_mode = rshim_cfg_get_int(bd, "CONSOLE_EVENT_MODE", 1);
+  bd->cons_poll = RSHIM_CONS_POLL_TICKS;
+  bd->log_closing = false;
+  bd->info_ttl_ns = (uint64_t)rshim_cfg_get_int(bd, "INFO_CACHE_TTL",
+                                                RSHIM_INFO_CACHE_TTL) * 1000000;
+  rshim_info_invalidate(bd);
+  if (bd->has_rshim)
+    rshim_info_opn(bd);
+  bd->log_poll_interval = rshim_cfg_get_int(bd, "LOG_POLL_INTERVAL",
+                                            RSHIM_LOG_POLL_INTERVAL);
+  if (bd->log_poll_interval <= 0)
+    bd->log_poll_interval = RSHIM_LOG_POLL_INTERVAL;
 
   /* Start the keepalive timer. */
-  bd->last_keepalive = rshim_timer_ticks;
-  bd->timer = rshim_timer_ticks + 1;
+  bd->last_keepalive = rshim_timer_now();
+  bd->timer = rshim_timer_now() + 1;
+  rshim_timer_schedule(bd, RSHIM_TIMER_INTERVAL);
 
   /* create character devices. */
 #ifdef HAVE_RSHIM_FUSE
@@ -2257,7 +4875,64 @@ int rshim_register(rshim_backend_t *bd)
   }
 #endif
 
+  /* Start the worker thread if configured. */
+  rshim_worker_start(bd);
+
   return 0;
+
+fail:
+  rshim_probing_del(bd);
+  bd->access_checked = 0;
+  return rc;
+}
+
+typedef struct {
+  int (*probe)(void *dev);
+  void *dev;
+  pthread_t thread;
+} rshim_probe_job_t;
+
+static void *rshim_probe_thread(void *arg)
+{
+  rshim_probe_job_t *job = arg;
+
+  job->probe(job->dev);
+  return NULL;
+}
+
+/*
+ * Probe the devices found by a backend scan, each from its own thread unless
+ * PROBE_PARALLEL is 0, so that a slow device doesn't hold up the others.
+ * Return once all of them are done.
+ */
+void rshim_probe_devices(int (*probe)(void *dev), void **devs, int n)
+{
+  rshim_probe_job_t *jobs;
+  int i;
+
+  jobs = rshim_cfg_get_int(NULL, "PROBE_PARALLEL", 1) && n > 1 ?
+         calloc(n, sizeof(*jobs)) : NULL;
+  if (!jobs) {
+    for (i = 0; i < n; i++)
+      probe(devs[i]);
+    return;
+  }
+
+  for (i = 0; i < n; i++) {
+    jobs[i].probe = probe;
+    jobs[i].dev = devs[i];
+    if (pthread_create(&jobs[i].thread, NULL, rshim_probe_thread, &jobs[i])) {
+      RSHIM_WARN("failed to create probe thread: %m\n");
+      jobs[i].thread = 0;
+      probe(devs[i]);
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    if (jobs[i].thread)
+      pthread_join(jobs[i].thread, NULL);
+  }
+  free(jobs);
 }
 
 void rshim_deregister(rshim_backend_t *bd)
@@ -2267,24 +4942,49 @@ void rshim_deregister(rshim_backend_t *bd)
   if (!bd->registered)
     return;
 
+  rshim_worker_stop(bd);
+  rshim_log_close(bd);
+
 #ifdef HAVE_RSHIM_FUSE
   rshim_fuse_del(bd);
 #endif
 
-  for (i = 0; i < 2; i++) {
-    free(bd->boot_buf[i]);
+  if (bd->work_fd >= 0) {
+    epoll_ctl(bd->epoll_fd, EPOLL_CTL_DEL, bd->work_fd, NULL);
+    close(bd->work_fd);
+    bd->work_fd = -1;
+  }
+
+  for (i = 0; i < RSHIM_MAX_BOOT_QUEUE; i++) {
+    rshim_buf_free(bd->boot_buf[i], bd->boot_buf_size);
     bd->boot_buf[i] = NULL;
   }
 
-  free(bd->read_buf);
+  rshim_buf_free(bd->read_buf, bd->read_buf_size);
   bd->read_buf = NULL;
 
-  free(bd->write_buf);
+  for (i = 0; i < RSHIM_MAX_WRITE_BUFS; i++) {
+    rshim_buf_free(bd->write_bufs[i], bd->write_buf_size);
+    bd->write_bufs[i] = NULL;
+  }
   bd->write_buf = NULL;
 
   rshim_fifo_free(bd);
+  rshim_log_free(bd);
+
+  /* Looked up again by the backend and rshim_numa_setup() on re-register. */
+  free(bd->local_cpus);
+  bd->local_cpus = NULL;
+  bd->has_numa = false;
+
+  rshim_timer_cancel(bd);
+
+  if (!bd->boot_file_busy) {
+    free(bd->boot_file_path);
+    bd->boot_file_path = NULL;
+  }
 
-  rshim_devs[bd->index] = NULL;
+  rshim_devs_del(bd);
   bd->registered = 0;
 }
 
@@ -2303,18 +5003,16 @@ void rshim_deref(rshim_backend_t *bd)
 
 bool rshim_allow_device(const char *devname)
 {
-  int i;
+  bool blocked;
 
   if (rshim_static_dev_name && strcmp(rshim_static_dev_name, devname))
     return false;
 
-  for (i = 0; i < RSHIM_MAX_DEV; i++) {
-    if (rshim_blocked_dev_names[i] &&
-        !strcmp(rshim_blocked_dev_names[i], devname))
-      return false;
-  }
+  pthread_rwlock_rdlock(&rshim_devs_lock);
+  blocked = rshim_name_lookup(rshim_blocked_hash, devname) != NULL;
+  pthread_rwlock_unlock(&rshim_devs_lock);
 
-  return true;
+  return !blocked;
 }
 
 static void *rshim_stop_thread(void *arg)
@@ -2327,9 +5025,9 @@ static void *rshim_stop_thread(void *arg)
 
 static void rshim_stop(void)
 {
-  rshim_backend_t *bd;
+  rshim_backend_t *bd, **list;
   pthread_t thread;
-  int i, rc;
+  int i, n, rc;
 
   rc = pthread_create(&thread, NULL, rshim_stop_thread, NULL);
   if (rc) {
@@ -2339,31 +5037,43 @@ static void rshim_stop(void)
 
   rshim_lock();
 
-  for (i = 0; i < RSHIM_MAX_DEV; i++) {
-    bd = rshim_devs[i];
-    if (!bd)
-      continue;
+  n = rshim_devs_get(&list);
+  for (i = 0; i < n; i++) {
+    bd = list[i];
+    rshim_worker_stop(bd);
+
+    /* Stop the log node readers first, they return with the mutex. */
+    pthread_mutex_lock(&bd->mutex);
+    rshim_log_close(bd);
+    pthread_mutex_unlock(&bd->mutex);
+#ifdef HAVE_RSHIM_FUSE
+    rshim_fuse_del(bd);
+#endif
+
     pthread_mutex_lock(&bd->mutex);
     rshim_deregister(bd);
     pthread_mutex_unlock(&bd->mutex);
   }
 
+  /* Keep the references, the backends aren't destroyed on exit. */
+  if (n >= 0)
+    free(list);
+
   rshim_unlock();
 }
 
 static void rshim_main(int argc, char *argv[])
 {
-  int i, fd, num, rc, epoll_fd, timer_fd, index;
+  int i, fd, num, rc, epoll_fd, timer_fd;
 #ifdef __FreeBSD__
   const int MAXEVENTS = 16;
 #else
   const int MAXEVENTS = 64;
 #endif
   struct epoll_event events[MAXEVENTS];
+  rshim_epoll_t timer_ep, hup_ep, *ep;
   struct epoll_event event;
-  struct itimerspec ts;
-  rshim_backend_t *bd;
-  uint8_t tmp;
+  uint64_t cnt;
 
   memset(&event, 0, sizeof(event));
   memset(events, 0, sizeof(events));
@@ -2390,31 +5100,18 @@ static void rshim_main(int argc, char *argv[])
   }
   rshim_epoll_fd = epoll_fd;
 
-  /* Create and add work fd. */
-  if (pipe(rshim_work_fd) == -1) {
-    perror("Failed to create pipe %m");
-    exit(-1);
-  }
-  event.data.fd = rshim_work_fd[0];
-  event.events = EPOLLIN;
-  rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, rshim_work_fd[0], &event);
-  if (rc == -1) {
-    RSHIM_ERR("epoll_ctl failed: %m\n");
-    exit(-1);
-  }
-
-  /* Add timer fd. */
+  /* Add timer fd, armed on demand by rshim_timer_schedule(). */
   timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
   if (timer_fd == -1) {
     fprintf(stderr, "timerfd_create failed: %m\n");
     exit(1);
   }
-  ts.it_interval.tv_sec = 0;
-  ts.it_interval.tv_nsec = RSHIM_TIMER_INTERVAL * 1000000;
-  ts.it_value.tv_sec = 0;
-  ts.it_value.tv_nsec = ts.it_interval.tv_nsec;
-  timerfd_settime(timer_fd, 0, &ts, NULL);
-  event.data.fd = timer_fd;
+  rshim_timer_fd = timer_fd;
+  rshim_timer_start_ns = rshim_get_time_ns();
+  timer_ep.fd = timer_fd;
+  timer_ep.kind = RSH_EPOLL_TIMER;
+  timer_ep.bd = NULL;
+  event.data.ptr = &timer_ep;
   event.events = EPOLLIN | EPOLLOUT;
   rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event);
   if (rc == -1) {
@@ -2422,6 +5119,23 @@ static void rshim_main(int argc, char *argv[])
     exit(1);
   }
 
+  /* Add the SIGHUP wake-up fd. */
+  rshim_hup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (rshim_hup_fd == -1) {
+    fprintf(stderr, "eventfd failed: %m\n");
+    exit(1);
+  }
+  hup_ep.fd = rshim_hup_fd;
+  hup_ep.kind = RSH_EPOLL_HUP;
+  hup_ep.bd = NULL;
+  event.data.ptr = &hup_ep;
+  event.events = EPOLLIN;
+  rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, rshim_hup_fd, &event);
+  if (rc == -1) {
+    fprintf(stderr, "epoll_ctl failed: %m\n");
+    exit(1);
+  }
+
   /* Scan rshim backends. */
   rc = 0;
   if (!rshim_backend_name && rshim_static_dev_name) {
@@ -2431,6 +5145,8 @@ static void rshim_main(int argc, char *argv[])
       rshim_backend_name = "pcie";
     else if (!strncmp(rshim_static_dev_name, "pcie_lf", 7))
       rshim_backend_name = "pcie_lf";
+    else if (!strncmp(rshim_static_dev_name, "sim", 3))
+      rshim_backend_name = "sim";
   }
   if (!rshim_backend_name) {
     rshim_pcie_init();
@@ -2443,22 +5159,30 @@ static void rshim_main(int argc, char *argv[])
       rc = rshim_pcie_init();
     else if (!strcmp(rshim_backend_name, "pcie_lf"))
       rc = rshim_pcie_lf_init();
+    else if (!strcmp(rshim_backend_name, "sim"))
+      rc = rshim_sim_init();
   }
   if (rc) {
     RSHIM_ERR("failed to initialize rshim backend\n");
     exit(-1);
   }
 
+  rshim_stats_init();
+  rshim_trace_init(epoll_fd);
+
   while (rshim_run) {
-    num = epoll_wait(epoll_fd, events, MAXEVENTS, -1);
+    num = epoll_wait(epoll_fd, events, MAXEVENTS, rshim_usb_timeout());
     if (num <= 0) {
       if (num < 0)
         RSHIM_DBG("epoll_wait failed; %m\n");
+      else
+        rshim_usb_poll(true);
       continue;
     }
 
     for (i = 0; i < num; i++) {
-      fd = events[i].data.fd;
+      ep = (rshim_epoll_t *)events[i].data.ptr;
+      fd = ep->fd;
 
       if ((events[i].events & EPOLLERR) || (events[i].events & EPOLLHUP)) {
         RSHIM_DBG("epoll error\n");
@@ -2466,43 +5190,58 @@ static void rshim_main(int argc, char *argv[])
         continue;
       }
 
-      if (fd == timer_fd) {
-        uint64_t res;
-
-        rshim_fd_full_read(timer_fd, &res, sizeof(res));
-        rshim_timer_run();
-      } else if (fd == rshim_work_fd[0]) {
-        rc = rshim_fd_full_read(rshim_work_fd[0], &index, sizeof(index));
-        if (rc == sizeof(index) && index >=0 && index < RSHIM_MAX_DEV) {
-          bd = rshim_devs[index];
-          if (bd)
-            rshim_work_handler(bd);
-        }
-        continue;
-      } else {
-        /* Network. */
-        for (index = 0; index < RSHIM_MAX_DEV; index++) {
-          bd = rshim_devs[index];
-          if (!bd)
-            continue;
-
-          if (fd == bd->net_notify_fd[0]) {
-            /* Rx. */
-            if (read(fd, &tmp, sizeof(tmp)) == sizeof(tmp))
-              rshim_net_rx(bd);
-            break;
-          } else if (fd == rshim_devs[index]->net_fd) {
-            /* Tx. */
-            rshim_net_tx(bd);
-            break;
-          }
+      switch (ep->kind) {
+      case RSH_EPOLL_TIMER:
+        {
+          uint64_t res;
+
+          rshim_fd_full_read(timer_fd, &res, sizeof(res));
+          rshim_timer_run();
         }
-        if (index != RSHIM_MAX_DEV)
-          continue;
+        /* Check USB for timeout if libusb has no timer fd. */
+        rshim_usb_poll(true);
+        break;
+
+      case RSH_EPOLL_WORK:
+        if (read(fd, &cnt, sizeof(cnt)) == sizeof(cnt))
+          rshim_work_handler(ep->bd);
+        break;
+
+      case RSH_EPOLL_NET_RX:
+        if (read(fd, &cnt, sizeof(cnt)) == sizeof(cnt))
+          rshim_net_rx(ep->bd);
+        rshim_net_kick(ep->bd);
+        rshim_net_poll_schedule(ep->bd);
+        break;
+
+      case RSH_EPOLL_NET_TX:
+        rshim_net_tx(ep->bd);
+        rshim_net_kick(ep->bd);
+        rshim_net_poll_schedule(ep->bd);
+        break;
+
+      case RSH_EPOLL_USB:
+        rshim_usb_poll(false);
+        break;
+
+      case RSH_EPOLL_TRACE:
+        if (read(fd, &cnt, sizeof(cnt)) == sizeof(cnt))
+          rshim_trace_dump();
+        break;
+
+      case RSH_EPOLL_HUP:
+        if (read(fd, &cnt, sizeof(cnt)) == sizeof(cnt))
+          rshim_fifo_wake_all();
+        break;
       }
 
-      /* Check USB for timeout or unhandled fd. */
-      rshim_usb_poll();
+      /*
+       * USB events might have removed devices together with the records
+       * of the remaining events. Leave them to the next epoll_wait() which
+       * is level-triggered.
+       */
+      if (ep->kind == RSH_EPOLL_TIMER || ep->kind == RSH_EPOLL_USB)
+        break;
     }
   }
 
@@ -2548,6 +5287,7 @@ int rshim_set_opn(rshim_backend_t *bd, const char *opn, int len)
   if (bd->ver_id < RSHIM_BLUEFIELD_2)
     return -EOPNOTSUPP;
 
+  bd->info_valid &= ~RSH_INFO_OPN;
   for (i = 0; i < RSHIM_YU_BOOT_RECORD_OPN_SIZE && len >= 4; i += 4, len -= 4) {
     value = htole32((opn[i] << 24) | (opn[i + 1] << 16) | (opn[i + 2] << 8) |
                     opn[i + 3]);
@@ -2560,9 +5300,60 @@ int rshim_set_opn(rshim_backend_t *bd, const char *opn, int len)
   return 0;
 }
 
+/*
+ * Forget the cached device attributes. Called with the device mutex held on
+ * reset, boot and attach/detach, after which they might have changed.
+ */
+void rshim_info_invalidate(rshim_backend_t *bd)
+{
+  bd->info_valid = 0;
+}
+
+/*
+ * Boot control register for the misc output, re-read once it is older than
+ * INFO_CACHE_TTL. Called with the device mutex held.
+ */
+int rshim_info_boot_control(rshim_backend_t *bd, uint64_t *value)
+{
+  uint64_t now = rshim_get_time_ns();
+  int rc;
+
+  if (!(bd->info_valid & RSH_INFO_BOOT_CONTROL) ||
+      now - bd->info_boot_control_ns >= bd->info_ttl_ns) {
+    rc = bd->read_rshim(bd, RSHIM_CHANNEL, RSH_BOOT_CONTROL,
+                        &bd->info_boot_control);
+    if (rc) {
+      bd->info_valid &= ~RSH_INFO_BOOT_CONTROL;
+      return rc;
+    }
+    bd->info_boot_control_ns = now;
+    bd->info_valid |= RSH_INFO_BOOT_CONTROL;
+  }
+
+  *value = bd->info_boot_control;
+  return 0;
+}
+
+/*
+ * OPN string, which only changes with a new boot record and is thus kept
+ * until the next invalidation. Called with the device mutex held.
+ */
+const char *rshim_info_opn(rshim_backend_t *bd)
+{
+  if (!(bd->info_valid & RSH_INFO_OPN)) {
+    memset(bd->info_opn, 0, sizeof(bd->info_opn));
+    if (rshim_get_opn(bd, bd->info_opn, RSHIM_YU_BOOT_RECORD_OPN_SIZE))
+      return "";
+    bd->info_valid |= RSH_INFO_OPN;
+  }
+
+  return bd->info_opn;
+}
+
 static int rshim_load_cfg(void)
 {
-  char rshim_name[32] = "", dev_name[64] = "";
+  char rshim_name[32] = "", dev_name[64] = "", value[64] = "";
+  rshim_cfg_t *cfg;
   char *buf = NULL;
   size_t n = 0;
   FILE *file;
@@ -2573,6 +5364,19 @@ static int rshim_load_cfg(void)
     return -ENOENT;
 
   while (getline(&buf, &n, file) != -1) {
+    dev_name[0] = 0;
+    if (sscanf(buf, "%31s%63s%63s", rshim_name, value, dev_name) >= 2 &&
+        rshim_name[0] >= 'A' && rshim_name[0] <= 'Z') {
+      /* Generic "KEY value [rshim-name|device-name]" entry. */
+      if (rshim_cfg_num >= RSHIM_MAX_CFG)
+        continue;
+      cfg = &rshim_cfgs[rshim_cfg_num++];
+      snprintf(cfg->key, sizeof(cfg->key), "%s", rshim_name);
+      snprintf(cfg->value, sizeof(cfg->value), "%s", value);
+      snprintf(cfg->dev_name, sizeof(cfg->dev_name), "%s", dev_name);
+      continue;
+    }
+
     if (sscanf(buf, "%31s%63s", rshim_name, dev_name) != 2)
       continue;
 
@@ -2582,24 +5386,20 @@ static int rshim_load_cfg(void)
     if (strncmp(dev_name, "usb-", 4) && strncmp(dev_name, "pcie-", 5))
       continue;
 
+    pthread_rwlock_wrlock(&rshim_devs_lock);
+
     /* Blocked devices. */
     if (!strcmp(rshim_name, "none")) {
-      for (index = 0; index < RSHIM_MAX_DEV; index++) {
-        if (!rshim_blocked_dev_names[index]) {
-          rshim_blocked_dev_names[index] = strdup(dev_name);
-          break;
-        }
-      }
+      rshim_name_insert(rshim_blocked_hash, dev_name, -1);
+      pthread_rwlock_unlock(&rshim_devs_lock);
       continue;
     }
 
     /* Static mapping of rshim device to index. */
     index = atoi(rshim_name + 5);
-    if (index < 0 || index >= RSHIM_MAX_DEV)
-      continue;
-    if (rshim_dev_names[index])
-      free(rshim_dev_names[index]);
-    rshim_dev_names[index] = strdup(dev_name);
+    if (index >= 0 && index <= RSHIM_MAX_INDEX)
+      rshim_dev_name_set(index, dev_name);
+    pthread_rwlock_unlock(&rshim_devs_lock);
   }
 
   if (buf)
@@ -2609,21 +5409,102 @@ static int rshim_load_cfg(void)
   return 0;
 }
 
-void rshim_sig_hup(int sig)
+const char *rshim_cfg_get(rshim_backend_t *bd, const char *key)
 {
-  rshim_backend_t *bd;
-  int index;
+  const char *value = NULL;
+  rshim_cfg_t *cfg;
   int i;
 
-  for (index = 0; index != RSHIM_MAX_DEV; index++) {
-    bd = rshim_devs[index];
-    if (bd == NULL)
+  for (i = 0; i < rshim_cfg_num; i++) {
+    cfg = &rshim_cfgs[i];
+    if (strcmp(cfg->key, key))
+      continue;
+
+    /* Global setting, unless overridden by a device-specific one. */
+    if (!cfg->dev_name[0]) {
+      if (!value)
+        value = cfg->value;
       continue;
-    for (i = 0; i < TMFIFO_MAX_CHAN; i++) {
-      pthread_cond_broadcast(&bd->read_fifo[i].operable);
-      pthread_cond_broadcast(&bd->write_fifo[i].operable);
     }
+
+    if (!bd)
+      continue;
+    if (!strcmp(cfg->dev_name, bd->dev_name) ||
+        (bd->registered && !strncmp(cfg->dev_name, "rshim", 5) &&
+         atoi(cfg->dev_name + 5) == bd->index))
+      return cfg->value;
+  }
+
+  return value;
+}
+
+int rshim_cfg_get_int(rshim_backend_t *bd, const char *key, int def)
+{
+  const char *value = rshim_cfg_get(bd, key);
+
+  return value ? (int)strtol(value, NULL, 0) : def;
+}
+
+static void rshim_poll_setup(void)
+{
+  rshim_poll_spin_count = MAX(rshim_cfg_get_int(NULL, "POLL_SPIN_COUNT",
+                                                rshim_poll_spin_count), 0);
+  rshim_poll_sleep_min_us = MAX(rshim_cfg_get_int(NULL, "POLL_SLEEP_MIN_US",
+                                                  rshim_poll_sleep_min_us), 1);
+  rshim_poll_sleep_max_us = MAX(rshim_cfg_get_int(NULL, "POLL_SLEEP_MAX_US",
+                                                  rshim_poll_sleep_max_us),
+                                rshim_poll_sleep_min_us);
+}
+
+void rshim_poll_init(rshim_poll_t *poll, uint32_t timeout_ms)
+{
+  poll->start_ns = rshim_get_time_ns();
+  poll->timeout_ns = (uint64_t)timeout_ms * 1000000;
+  poll->iter = 0;
+  poll->sleep_us = 0;
+}
+
+/* Wait before polling again. Returns -ETIMEDOUT once the timeout passed. */
+int rshim_poll_wait(rshim_poll_t *poll)
+{
+  struct timespec ts;
+
+  if (rshim_get_time_ns() - poll->start_ns > poll->timeout_ns) {
+    __sync_fetch_and_add(&rshim_poll_stats[RSH_POLL_TIMEOUT], 1);
+    return -ETIMEDOUT;
+  }
+
+  if (poll->iter < rshim_poll_spin_count) {
+    if (!poll->iter++)
+      __sync_fetch_and_add(&rshim_poll_stats[RSH_POLL_SPIN], 1);
+    return 0;
   }
+
+  if (!poll->sleep_us) {
+    __sync_fetch_and_add(&rshim_poll_stats[RSH_POLL_SLEEP], 1);
+    poll->sleep_us = rshim_poll_sleep_min_us;
+  } else {
+    poll->sleep_us = MIN(poll->sleep_us * 2, rshim_poll_sleep_max_us);
+  }
+
+  ts.tv_sec = poll->sleep_us / 1000000;
+  ts.tv_nsec = (poll->sleep_us % 1000000) * 1000;
+  nanosleep(&ts, NULL);
+
+  return 0;
+}
+
+/*
+ * Wake up the FIFO sleepers so that they check for an interrupted request.
+ * The devices can't be walked from the signal handler, so it only asks the
+ * main loop to do it.
+ */
+void rshim_sig_hup(int sig)
+{
+  uint64_t one = 1;
+
+  if (rshim_hup_fd >= 0 && write(rshim_hup_fd, &one, sizeof(one)) < 0)
+    return;
 }
 
 static void rshim_sig_handler(int sig)
@@ -2636,6 +5517,10 @@ static void rshim_sig_handler(int sig)
   case SIGTERM:
     rshim_run = false;
     break;
+
+  case SIGUSR1:
+    rshim_trace_signal();
+    break;
   }
 }
 
@@ -2649,6 +5534,12 @@ static void set_signals(void)
   sigaction(SIGINT, &sa, NULL);
   sigaction(SIGTERM, &sa, NULL);
   sigaction(SIGPIPE, &sa, NULL);
+  sa.sa_handler = rshim_boot_image_sigbus;
+  sigaction(SIGBUS, &sa, NULL);
+  sa.sa_handler = rshim_sig_handler;
+#ifdef HAVE_RSHIM_TRACE
+  sigaction(SIGUSR1, &sa, NULL);
+#endif
 }
 
 static void print_help(void)
@@ -2656,7 +5547,7 @@ static void print_help(void)
   printf("Usage: rshim [options]\n");
   printf("\n");
   printf("OPTIONS:\n");
-  printf("  -b, --backend     backend name (usb, pcie or pcie_lf)\n");
+  printf("  -b, --backend     backend name (usb, pcie, pcie_lf or sim)\n");
   printf("  -d, --device      device to attach\n");
   printf("  -f, --foreground  run in foreground\n");
   printf("  -i, --index       use device path /dev/rshim<i>/\n");
@@ -2665,7 +5556,11 @@ static void print_help(void)
   printf("  -v, --version     version\n");
 }
 
+#ifdef RSHIM_BENCH
+int rshim_daemon_main(int argc, char *argv[])
+#else
 int main(int argc, char *argv[])
+#endif
 {
   static const char short_options[] = "b:d:fhi:l:v";
   static struct option long_options[] = {
@@ -2695,8 +5590,8 @@ int main(int argc, char *argv[])
       break;
     case 'i':
       rshim_static_index = atoi(optarg);
-      if (rshim_static_index >= RSHIM_MAX_DEV) {
-        fprintf(stderr, "Index exceeds max value %d\n", RSHIM_MAX_DEV - 1);
+      if (rshim_static_index > RSHIM_MAX_INDEX) {
+        fprintf(stderr, "Index exceeds max value %d\n", RSHIM_MAX_INDEX);
         return -EINVAL;
       }
       break;
@@ -2754,6 +5649,7 @@ int main(int argc, char *argv[])
 #endif
 
   rshim_load_cfg();
+  rshim_poll_setup();
 
   set_signals();
 
@@ -25,7 +25,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #ifdef HAVE_CONFIG_H
 #include <config.h>
@@ -41,6 +43,7 @@ extern int rshim_log_level;
 extern bool rshim_daemon_mode;
 extern int rshim_skip_boot_reset;
 extern int rshim_boot_timeout;
+extern char *rshim_cfg_file;
 
 #ifndef offsetof
 #define offsetof(TYPE, MEMBER)	((size_t)&((TYPE *)0)->MEMBER)
@@ -78,13 +81,14 @@ extern int rshim_boot_timeout;
 
 /* Spin flag values. */
 #define RSH_SFLG_READING    0x1  /* read is active. */
-#define RSH_SFLG_WRITING    0x2  /* write_urb is active. */
+#define RSH_SFLG_WRITING    0x2  /* No free write buffer. */
 #define RSH_SFLG_CONS_OPEN  0x4  /* console stream is open. */
 
 /*
- * Buffer/FIFO sizes.  Note that the FIFO sizes must be powers of 2; also,
- * the read and write buffers must be no larger than the corresponding
- * FIFOs.
+ * Default buffer/FIFO sizes, which could be changed per device and per
+ * channel in the configuration file.  Note that the FIFO sizes must be
+ * powers of 2; also, the read and write buffers must be no larger than
+ * the corresponding FIFOs.
  */
 #define READ_BUF_SIZE     2048
 #define WRITE_BUF_SIZE    2048
@@ -92,12 +96,41 @@ extern int rshim_boot_timeout;
 #define WRITE_FIFO_SIZE   (4 * 1024)
 #define BOOT_BUF_SIZE     (16 * 1024)
 
+/* Limits of the configurable sizes. */
+#define RSHIM_FIFO_SIZE_MIN       1024
+#define RSHIM_FIFO_SIZE_MAX       (1024 * 1024)
+#define RSHIM_BUF_SIZE_MIN        256
+#define RSHIM_BUF_SIZE_MAX        (64 * 1024)
+#define RSHIM_BOOT_BUF_SIZE_MIN   (4 * 1024)
+#define RSHIM_BOOT_BUF_SIZE_MAX   (1024 * 1024)
+
+/* Max number of TMFIFO write buffers in flight. */
+#define RSHIM_MAX_WRITE_BUFS      4
+
+/* Default lifetime of the cached volatile device attributes in ms. */
+#define RSHIM_INFO_CACHE_TTL      1000
+
+/* Cached device attributes, see rshim_info_*(). */
+#define RSH_INFO_BOOT_CONTROL     (1 << 0)
+#define RSH_INFO_OPN              (1 << 1)
+
+/* Bounds of the decoded log cache. */
+#define RSHIM_LOG_CACHE_MIN       4096
+#define RSHIM_LOG_CACHE_MAX       65536
+
+/* Default refresh interval of the log node in milliseconds. */
+#define RSHIM_LOG_POLL_INTERVAL   1000
+
+/* Max number of boot buffers queued to the work handler. */
+#define RSHIM_MAX_BOOT_QUEUE      8
+
 /* Sub-device types. */
 enum {
   RSH_DEV_TYPE_RSHIM,
   RSH_DEV_TYPE_BOOT,
   RSH_DEV_TYPE_TMFIFO,
   RSH_DEV_TYPE_MISC,
+  RSH_DEV_TYPE_LOG,
   RSH_DEV_TYPES
 };
 
@@ -112,6 +145,7 @@ enum {
 
 /* Internal message types in addition to the standard VIRTIO_ID_xxx types. */
 enum {
+  TMFIFO_MSG_MTU = 0xFA,          /* network mtu, in the ctrl response */
   TMFIFO_MSG_VLAN_ID = 0xFB,      /* vlan id */
   TMFIFO_MSG_PXE_ID = 0xFC,       /* pxe client identifier */
   TMFIFO_MSG_CTRL_REQ = 0xFD,     /* ctrl request */
@@ -128,6 +162,8 @@ typedef union {
       uint8_t mac[3];      /* 3-bytes of the MAC address */
       uint32_t pxe_id;     /* pxe identifier in network order */
       uint16_t vlan[2];    /* up to two vlan id */
+      uint16_t mtu;        /* network mtu in network order, also proposed
+                              in the ctrl request, 0 for none */
     };
     uint8_t checksum;      /* header checksum */
   } __attribute__((packed));
@@ -186,16 +222,24 @@ enum {
 /* FIFO structure. */
 typedef struct {
   unsigned char *data;
+  unsigned int size;
   unsigned int head;
   unsigned int tail;
+  pthread_mutex_t lock;       /* Serializes the readers or the writers. */
+  pthread_mutex_t wait_lock;  /* Goes with 'operable', taken last. */
   pthread_cond_t operable;
+  int waiters;                /* Threads sleeping on 'operable'. */
+  bool stalled;               /* TMFIFO drain stopped on the full ring. */
 } rshim_fifo_t;
 
-/* RShim network packet. */
+/* RShim network packet, large enough for jumbo frames. */
 #define ETH_PKT_SIZE 1536
+#define ETH_JUMBO_PKT_SIZE 9216
+#define RSHIM_NET_MTU_DEFAULT 1500
+#define RSHIM_NET_MTU_MAX 9000
 typedef struct {
   rshim_tmfifo_msg_hdr_t hdr;   /* message header */
-  char buf[ETH_PKT_SIZE];       /* packet buffer */
+  char buf[ETH_JUMBO_PKT_SIZE]; /* packet buffer */
 } rshim_net_pkt_t;
 
 #define RSHIM_DEV_NAME_LEN   64
@@ -206,6 +250,127 @@ typedef struct {
 
 /* RShim backend. */
 typedef struct rshim_backend rshim_backend_t;
+
+/* Kinds of fds in the epoll loop. */
+enum {
+  RSH_EPOLL_TIMER,    /* house-keeping timer */
+  RSH_EPOLL_WORK,     /* work handler wake-up */
+  RSH_EPOLL_NET_TX,   /* tap interface readable */
+  RSH_EPOLL_NET_RX,   /* network rx notification */
+  RSH_EPOLL_USB,      /* libusb fd */
+  RSH_EPOLL_TRACE,    /* trace dump request */
+  RSH_EPOLL_HUP,      /* SIGHUP wake-up of the FIFO sleepers */
+};
+
+/* Per-fd handler record pointed by epoll_event.data.ptr. */
+typedef struct {
+  int fd;
+  int kind;
+  rshim_backend_t *bd;
+} rshim_epoll_t;
+
+/* Per-device event counters in rshim_stats_t.cnt[]. */
+enum {
+  RSH_STAT_REG_READS,             /* Register reads, words of bursts. */
+  RSH_STAT_REG_WRITES,            /* Register writes, words of bursts. */
+  RSH_STAT_REG_ERRORS,            /* Failed register accesses. */
+  RSH_STAT_FIFO_FULL,             /* FIFO-full rounds of write_delayed. */
+  RSH_STAT_DROPS,                 /* Rx packets dropped. */
+  RSH_STAT_CONS_RESETS,           /* Rx packets for a closed console. */
+  RSH_STAT_USB_READ_RETRIES,      /* Read/interrupt urbs resubmitted. */
+  RSH_STAT_USB_WRITE_RETRIES,     /* Write urbs resubmitted. */
+  RSH_STAT_TIMEOUTS,              /* FIFO and boot writes timed out. */
+  RSH_STAT_BOOT_BYTES,            /* Boot stream bytes accepted. */
+  RSH_STAT_NUM
+};
+
+/* Latency histogram, bucket i counts samples below 2^i us. */
+#define RSH_HIST_BUCKETS 24
+
+typedef struct {
+  uint64_t bucket[RSH_HIST_BUCKETS];
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t max_ns;
+} rshim_hist_t;
+
+/* Performance counters of a backend, exported via misc and STATS_FILE. */
+typedef struct {
+  uint64_t cnt[RSH_STAT_NUM];
+
+  /* TMFIFO payload bytes and messages, updated under ringlock. */
+  uint64_t tx_bytes[TMFIFO_MAX_CHAN];
+  uint64_t tx_msgs[TMFIFO_MAX_CHAN];
+  uint64_t rx_bytes[TMFIFO_MAX_CHAN];
+  uint64_t rx_msgs[TMFIFO_MAX_CHAN];
+
+  /* Last boot session, from boot open to the last accepted write. */
+  uint64_t boot_bytes;
+  uint64_t boot_start_ns;
+  uint64_t boot_end_ns;
+
+  /* Register access (per call or burst) and work handler turnaround. */
+  rshim_hist_t reg_lat;
+  rshim_hist_t work_lat;
+
+  /* Backend register accessors behind the counting ones. */
+  bool attached;
+  int (*read_rshim)(rshim_backend_t *bd, int chan, int addr,
+                    uint64_t *value);
+  int (*write_rshim)(rshim_backend_t *bd, int chan, int addr,
+                     uint64_t value);
+  int (*read_rshim_burst)(rshim_backend_t *bd, int chan, int addr,
+                          uint64_t *values, int n);
+  int (*write_rshim_burst)(rshim_backend_t *bd, int chan, int addr,
+                           const uint64_t *values, int n);
+} rshim_stats_t;
+
+/* Hot-path events recorded by RSHIM_TRACE(), see rshim_trace.c. */
+enum {
+  RSH_TRACE_REG_READ,             /* Register burst read, a=chan b=words. */
+  RSH_TRACE_REG_WRITE,            /* Register burst write, a=chan b=words. */
+  RSH_TRACE_FIFO_INPUT,           /* Rx FIFO filled, a=chan b=head/tail. */
+  RSH_TRACE_FIFO_READ,            /* Rx FIFO drained, a=chan b=head/tail. */
+  RSH_TRACE_FIFO_WRITE,           /* Tx FIFO filled, a=chan b=head/tail. */
+  RSH_TRACE_FIFO_OUTPUT,          /* Tx FIFO drained, a=chan b=head/tail. */
+  RSH_TRACE_WORK_SIGNAL,          /* Work handler woken up. */
+  RSH_TRACE_WORK_RUN,             /* Work handler running. */
+  RSH_TRACE_URB_SUBMIT,           /* USB transfer submitted, a=type b=len. */
+  RSH_TRACE_URB_DONE,             /* USB transfer done, a=type b=status/len. */
+  RSH_TRACE_NUM
+};
+
+/* USB transfer types in the URB events. */
+enum {
+  RSH_TRACE_URB_READ,
+  RSH_TRACE_URB_INTR,
+  RSH_TRACE_URB_WRITE,
+  RSH_TRACE_URB_BOOT
+};
+
+#ifdef HAVE_RSHIM_TRACE
+/* Events kept per device, must be a power of 2. */
+#define RSH_TRACE_SIZE  4096
+
+/*
+ * A trace record. seq is the 1-based position of the record in the ring,
+ * zero while the record is being filled in, to spot overwritten ones.
+ */
+typedef struct {
+  uint32_t seq;
+  uint16_t event;
+  uint16_t a;
+  uint64_t ns;
+  uint64_t b;
+} rshim_trace_ev_t;
+
+/* Per-device trace ring, written without locks from any thread. */
+typedef struct {
+  uint64_t idx;
+  rshim_trace_ev_t ev[RSH_TRACE_SIZE];
+} rshim_trace_t;
+#endif
+
 struct rshim_backend {
   /* Device name. */
   char dev_name[RSHIM_DEV_NAME_LEN];
@@ -223,12 +388,21 @@ struct rshim_backend {
   void *fuse_poll_handle[TMFIFO_MAX_CHAN];
 
   /* Networking handler and packets. */
-  int net_fd, net_notify_fd[2];
+  int net_fd, net_notify_fd;
+  rshim_epoll_t net_tx_ep, net_rx_ep;
   rshim_net_pkt_t net_rx_pkt;
   rshim_net_pkt_t net_tx_pkt;
   int net_tx_len;
   int net_rx_len;
   bool net_rx_pending;
+  bool net_rx_busy;               /* Frame being copied via net_rx_pkt. */
+  bool net_rx_direct;             /* Frame being written from read_buf. */
+
+  /* Tap vnet header mode and the GSO frame being segmented. */
+  bool net_vnet_hdr;
+  uint8_t *net_gso_buf;
+  int net_gso_len;
+  int net_gso_off;
 
   /* State flags. */
   uint32_t is_booting : 1;        /* Waiting for device to come back. */
@@ -253,6 +427,11 @@ struct rshim_backend {
   uint32_t peer_vlan_set : 1;     /* A flag to set vlan IDs. */
   uint32_t drop_mode : 1;         /* A flag to drop all input/output. */
   uint32_t skip_boot_reset : 1;   /* Skip SW_RESET while pushing boot stream. */
+  uint32_t peer_mtu_set : 1;      /* MTU proposed, response pending. */
+  uint32_t net_mtu_changed : 1;   /* A flag to apply negotiated MTU. */
+  uint32_t has_fast_reset : 1;    /* SW reset takes effect right away. */
+  uint32_t has_input_events : 1;  /* Backend notifies TMFIFO input. */
+  uint32_t access_checked : 1;    /* Checked, registration to follow. */
 
   /* reference count. */
   volatile int ref;
@@ -263,10 +442,62 @@ struct rshim_backend {
 
   /* timer. */
   int timer;
+  uint64_t timer_due_ns;          /* Deadline on the timer heap. */
+  int timer_idx;                  /* Position on the timer heap. */
+  bool timer_queued;              /* On the timer heap. */
+  struct rshim_backend *timer_next; /* Expired list of rshim_timer_run(). */
+
+  /* Console polling of backends without input events, in ticks. */
+  bool cons_event_mode;           /* Adapt the poll period to traffic. */
+  bool cons_rx_active;            /* Console traffic since the last poll. */
+  int cons_poll;
+
+  /* Network polling of backends without input events, in ticks. */
+  int net_poll;
+  uint64_t net_poll_bytes;        /* Net bytes moved up to the last poll. */
+
+  /* Device attributes cached for the misc output. */
+  uint32_t info_valid;            /* RSH_INFO_xxx bits. */
+  uint64_t info_ttl_ns;
+  uint64_t info_boot_control;
+  uint64_t info_boot_control_ns;
+  char info_opn[RSHIM_YU_BOOT_RECORD_OPN_SIZE + 1];
+
+  /*
+   * Decoded rshim log, refreshed from the scratch buffer incrementally.
+   * Kept in a ring which drops the oldest text once RSHIM_LOG_CACHE_MAX
+   * is reached.
+   */
+  char *log_buf;
+  int log_len;
+  int log_size;
+  int log_head;                   /* Oldest byte in log_buf. */
+  uint64_t log_total;             /* Bytes appended since the restart. */
+  uint32_t log_idx;               /* Next scratch buffer word to decode. */
+  uint64_t log_hdr;               /* First header, to spot a new log. */
+  uint64_t log_sum;               /* Fold of the whole first entry. */
+  uint32_t log_last;              /* Index of the last entry decoded, */
+  uint64_t log_last_hdr;          /* and its header. */
+  uint32_t log_gen;               /* Bumped when the cache starts over. */
+  uint64_t log_poll_ns;           /* Last refresh. */
+  int log_poll_interval;          /* Refresh interval of the log node (ms). */
+  volatile bool log_closing;      /* Device going away, stop waiting. */
+  pthread_cond_t log_cond;        /* Used with the device mutex. */
 
   /* Last boot write time. */
   time_t boot_write_time;
 
+  /* Boot image streamed from a file via the misc BOOT_FILE command. */
+  char *boot_file_path;
+  volatile bool boot_file_busy;
+  bool boot_file_bcast;           /* Part of a BOOT_BCAST push. */
+  struct rshim_boot_image *boot_file_img; /* Image handed to the thread. */
+  int boot_file_err;
+  uint64_t boot_file_size;
+  volatile uint64_t boot_file_done;
+  uint64_t boot_file_start_ns;
+  uint64_t boot_file_end_ns;
+
   /* State flag bits from RSH_SFLG_xxx (see above). */
   int spin_flags;
 
@@ -278,6 +509,8 @@ struct rshim_backend {
   int read_buf_pkt_rem;
   /* Padded bytes in the read buffer. */
   int read_buf_pkt_padding;
+  /* Bumped under ringlock whenever the read buffer is refilled or reset. */
+  unsigned int read_buf_gen;
 
   /* Bytes left in the current packet pending to write. */
   int write_buf_pkt_rem;
@@ -293,9 +526,22 @@ struct rshim_backend {
 
   /* Read buffer. */
   unsigned char *read_buf;
+  int read_buf_size;
 
-  /* Write buffer. */
+  /*
+   * Write buffers. A backend which can have several writes outstanding sets
+   * write_buf_cnt before registering and counts them in write_inflight;
+   * write_buf is the one being filled.
+   */
   unsigned char *write_buf;
+  unsigned char *write_bufs[RSHIM_MAX_WRITE_BUFS];
+  int write_buf_cnt;
+  int write_buf_idx;
+  int write_buf_size;
+  int write_inflight;
+
+  /* Words of a FIFO data burst, used with the mutex held. */
+  uint64_t write_words[RSH_BOOT_FIFO_SIZE];
 
   /* Current Tx FIFO channel. */
   int tx_chan;
@@ -307,7 +553,20 @@ struct rshim_backend {
   int tmfifo_error;
 
   /* Buffers used for boot writes.  Allocated at startup. */
-  char *boot_buf[2];
+  char *boot_buf[RSHIM_MAX_BOOT_QUEUE];
+  int boot_buf_size;
+
+  /*
+   * Queue of boot buffers drained by the work handler, for backends using
+   * the default write. boot_queue_off is the progress of the head buffer.
+   */
+  int boot_queue_depth;
+  int boot_queue_head;
+  int boot_queue_cnt;
+  uint32_t boot_queue_len[RSHIM_MAX_BOOT_QUEUE];
+  uint32_t boot_queue_off;
+  int boot_queue_err;
+  bool boot_queue_defer;          /* Boot FIFO full, retry on the timer. */
 
   /* Buffer to store the remaining data when it's not 8B unaligned. */
   uint8_t boot_rem_cnt;
@@ -326,15 +585,45 @@ struct rshim_backend {
   /* Mutex to protect the ring buffer. */
   pthread_mutex_t ringlock;
 
+  /* Keeps the tap fds open while they're written, taken last. */
+  pthread_mutex_t net_lock;
+
   bool work_pending;
 
+  /* Work handler wake-up eventfd and its time-to-service statistics. */
+  int work_fd;
+  rshim_epoll_t work_ep;
+  uint64_t work_signal_time;
+  uint64_t work_wakeups;
+  uint64_t work_latency_total;
+  uint64_t work_latency_max;
+
+  /* Performance counters. */
+  rshim_stats_t stats;
+
+#ifdef HAVE_RSHIM_TRACE
+  /* Hot-path event trace. */
+  rshim_trace_t trace;
+#endif
+
+  /* Per-device worker thread (optional). */
+  pthread_t worker_thread;
+  bool worker_run;
+
+  /* NUMA node of the device and its local CPUs, set by the backend. */
+  bool has_numa;
+  int numa_node;
+  char *local_cpus;
+
+  /* Epoll handler for the work and network fds of this device. */
+  int epoll_fd;
+
   /* We'll signal completion on this when FLG_BOOTING is turned off. */
   pthread_cond_t boot_complete_cond;
 
   /*
    * This wait queue supports fsync; it's woken up whenever an
-   * outstanding USB write URB is done.  This will need to be more
-   * complex if we start doing write double-buffering.
+   * outstanding USB write URB is done.
    */
   pthread_cond_t fifo_write_complete_cond;
 
@@ -361,6 +650,11 @@ struct rshim_backend {
   /* Index in rshim_devs[]. */
   int index;
 
+  /* Registry links, see rshim_devs_lock. */
+  int live_idx;                   /* Position in rshim_live[]. */
+  struct rshim_backend *dev_next; /* Chain of the backend device hash. */
+  struct rshim_backend *probe_next; /* List of backends being probed. */
+
   /* Display level in the misc output. */
   int display_level;
 
@@ -376,6 +670,9 @@ struct rshim_backend {
   /* Up to two VLAN IDs for PXE purpose. */
   uint16_t vlan[2];
 
+  /* Network MTU negotiated with the peer. */
+  uint16_t net_mtu;
+
   /* APIs provided by backend. */
 
   /* API to write bulk data to RShim via the backend. */
@@ -388,6 +685,9 @@ struct rshim_backend {
   /* API to cancel a read / write request (optional). */
   void (*cancel)(rshim_backend_t *bd, int devtype, bool is_write);
 
+  /* API to wait for the queued writes to complete (optional). */
+  int (*flush)(rshim_backend_t *bd, int devtype);
+
   /* API to destroy the backend. */
   void (*destroy)(rshim_backend_t *bd);
 
@@ -399,6 +699,18 @@ struct rshim_backend {
   int (*write_rshim)(rshim_backend_t *bd, int chan, int addr,
                      uint64_t value);
 
+  /*
+   * API to read/write a burst of 8-byte words from/to the same RShim
+   * register, such as the TMFIFO or boot FIFO data register (optional).
+   * Fall back to read_rshim/write_rshim word by word if not provided.
+   * The words written are in the little-endian byte order of the data
+   * stream; backends which write register values convert them.
+   */
+  int (*read_rshim_burst)(rshim_backend_t *bd, int chan, int addr,
+                          uint64_t *values, int n);
+  int (*write_rshim_burst)(rshim_backend_t *bd, int chan, int addr,
+                           const uint64_t *values, int n);
+
   /* API to enable the device. */
   int (*enable_device)(rshim_backend_t *bd, bool enable);
 };
@@ -411,7 +723,9 @@ extern int rshim_epoll_fd;
 
 /* Register/unregister backend. */
 int rshim_register(rshim_backend_t *bd);
+int rshim_access_check(rshim_backend_t *bd);
 void rshim_deregister(rshim_backend_t *bd);
+void rshim_probe_devices(int (*probe)(void *dev), void **devs, int n);
 
 /* Find backend by name. */
 rshim_backend_t *rshim_find_by_name(char *dev_name);
@@ -419,6 +733,23 @@ rshim_backend_t *rshim_find_by_name(char *dev_name);
 /* Find backend by device. */
 rshim_backend_t *rshim_find_by_dev(void *dev);
 
+/* Longest CPU list read from sysfs. */
+#define RSHIM_CPULIST_LEN 1024
+
+/* Read a one-line sysfs attribute, returns its length or -errno. */
+int rshim_sysfs_read(const char *path, char *buf, int size);
+
+/*
+ * Initialize the attributes of a thread serving the device, pinned to the
+ * CPUs of the config key if set or else to the CPUs local to the device.
+ */
+void rshim_thread_attr(rshim_backend_t *bd, const char *key,
+                       pthread_attr_t *attr);
+
+/* Referenced copy of the registered backends, released by rshim_devs_put(). */
+int rshim_devs_get(rshim_backend_t ***list);
+void rshim_devs_put(rshim_backend_t **list, int n);
+
 /* RShim global lock. */
 void rshim_lock(void);
 void rshim_unlock(void);
@@ -439,6 +770,29 @@ ssize_t rshim_fifo_read(rshim_backend_t *bd, char *buffer,
 ssize_t rshim_fifo_write(rshim_backend_t *bd, const char *buffer,
                          size_t count, int chan, bool nonblock);
 
+/* Set the checksum of a control message header. */
+void rshim_fifo_ctrl_update_checksum(rshim_tmfifo_msg_hdr_t *hdr);
+
+/*
+ * Hand complete frames in the network read FIFO to the tap without copying.
+ * Returns true if the frame at the head can't fit in the FIFO and has to be
+ * read in pieces with rshim_fifo_read().
+ */
+bool rshim_fifo_net_rx(rshim_backend_t *bd);
+
+/*
+ * Read from the FIFO like rshim_fifo_read(), but hand the data to 'deliver'
+ * as iovecs pointing into the read FIFO instead of copying it out. The data
+ * is consumed only if 'deliver' returns 0. Returns the number of bytes
+ * delivered, 0 if 'deliver' failed, or a negative errno if no data could be
+ * read and 'deliver' wasn't called.
+ */
+ssize_t rshim_fifo_read_iov(rshim_backend_t *bd, size_t count, int chan,
+                            bool nonblock,
+                            int (*deliver)(void *arg, const struct iovec *iov,
+                                           int cnt),
+                            void *arg);
+
 /* Alloc/free the FIFO. */
 int rshim_fifo_alloc(rshim_backend_t *bd);
 void rshim_fifo_free(rshim_backend_t *bd);
@@ -453,6 +807,10 @@ int rshim_net_init(rshim_backend_t *bd);
 int rshim_net_del(rshim_backend_t *bd);
 void rshim_net_rx(rshim_backend_t *bd);
 void rshim_net_tx(rshim_backend_t *bd);
+int rshim_net_set_mtu(rshim_backend_t *bd, int mtu);
+int rshim_net_rx_deliver(rshim_backend_t *bd, const struct iovec *iov,
+                         int cnt);
+bool rshim_net_pending(rshim_backend_t *bd);
 #else
 static inline int rshim_net_init(rshim_backend_t *bd)
 {
@@ -468,6 +826,19 @@ static inline void rshim_net_rx(rshim_backend_t *bd)
 static inline void rshim_net_tx(rshim_backend_t *bd)
 {
 }
+static inline int rshim_net_set_mtu(rshim_backend_t *bd, int mtu)
+{
+  return 0;
+}
+static inline int rshim_net_rx_deliver(rshim_backend_t *bd,
+                                       const struct iovec *iov, int cnt)
+{
+  return 0;
+}
+static inline bool rshim_net_pending(rshim_backend_t *bd)
+{
+  return false;
+}
 #endif
 
 void rshim_ref(rshim_backend_t *bd);
@@ -475,7 +846,10 @@ void rshim_deref(rshim_backend_t *bd);
 int rshim_boot_open(rshim_backend_t *bd);
 int rshim_boot_write(rshim_backend_t *bd, const char *user_buffer, size_t count,
                      int (*copy_in)(void *dest, const void *src, int count));
-void rshim_boot_release(rshim_backend_t *bd);
+int rshim_boot_release(rshim_backend_t *bd);
+int rshim_boot_file_start(rshim_backend_t *bd, const char *path);
+int rshim_boot_bcast_start(const char *devs, const char *path);
+int rshim_boot_file_show(rshim_backend_t *bd, char *buf, int size);
 int rshim_console_open(rshim_backend_t *bd);
 int rshim_console_release(rshim_backend_t *bd,
                 void (*poll_handle_destroy)(rshim_backend_t *bd, int chan));
@@ -483,28 +857,54 @@ void rshim_fifo_check_poll(rshim_backend_t *bd, int chan, bool *poll_rx,
                            bool *poll_tx, bool *poll_err);
 int rshim_fifo_size(rshim_backend_t *bd, int chan, bool is_rx);
 void rshim_sig_hup(int sig);
+void rshim_fifo_lock(rshim_backend_t *bd);
+void rshim_fifo_unlock(rshim_backend_t *bd);
 void rshim_fifo_reset(rshim_backend_t *bd);
 int rshim_reset_control(rshim_backend_t *bd);
 void rshim_work_signal(rshim_backend_t *bd);
 int rshim_fifo_fsync(rshim_backend_t *bd, int chan);
 
+/* Read position of an open log node. */
+typedef struct {
+  uint32_t gen;
+  uint64_t pos;                   /* In the bytes appended since restart. */
+} rshim_log_cursor_t;
+
 /* Display the rshim logging buffer. */
 int rshim_log_show(rshim_backend_t *bd, char *buf, int len);
+int rshim_log_update(rshim_backend_t *bd);
+ssize_t rshim_log_read(rshim_backend_t *bd, char *buf, size_t count,
+                       rshim_log_cursor_t *cur, bool nonblock);
+void rshim_log_close(rshim_backend_t *bd);
+void rshim_log_free(rshim_backend_t *bd);
 
 bool rshim_allow_device(const char *devname);
 
+/*
+ * Get the value of a generic "KEY value [rshim-name|device-name]" entry
+ * from the configuration file. A device-specific entry takes precedence
+ * over the global one. 'bd' could be NULL to get the global value.
+ */
+const char *rshim_cfg_get(rshim_backend_t *bd, const char *key);
+int rshim_cfg_get_int(rshim_backend_t *bd, const char *key, int def);
+
 /* USB backend APIs. */
 #ifdef HAVE_RSHIM_USB
 int rshim_usb_init(int epoll_fd);
-void rshim_usb_poll(void);
+void rshim_usb_poll(bool timeout);
+int rshim_usb_timeout(void);
 #else
 static inline int rshim_usb_init(int epoll_fd)
 {
   return -1;
 }
-static inline void rshim_usb_poll(void)
+static inline void rshim_usb_poll(bool timeout)
 {
 }
+static inline int rshim_usb_timeout(void)
+{
+  return -1;
+}
 #endif
 
 /* PCIe & PCIe livefish backend APIs. */
@@ -524,6 +924,21 @@ static inline int rshim_pcie_lf_init(void)
 }
 #endif
 
+/* Simulated backend API. */
+#ifdef HAVE_RSHIM_SIM
+int rshim_sim_init(void);
+#else
+static inline int rshim_sim_init(void)
+{
+  return -1;
+}
+#endif
+
+#ifdef RSHIM_BENCH
+/* Daemon entry point, run in a thread by rshim-bench. */
+int rshim_daemon_main(int argc, char *argv[]);
+#endif
+
 #ifdef HAVE_RSHIM_FUSE
 int rshim_fuse_init(rshim_backend_t *bd);
 int rshim_fuse_del(rshim_backend_t *bd);
@@ -531,6 +946,42 @@ void rshim_fuse_input_notify(rshim_backend_t *bd);
 int rshim_fuse_got_peer_signal(void);
 #endif
 
+/* Monotonic time in nanoseconds. */
+static inline uint64_t rshim_get_time_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Adaptive wait for polling loops on status registers. rshim_poll_wait()
+ * spins for POLL_SPIN_COUNT rounds, then sleeps with exponential backoff
+ * between POLL_SLEEP_MIN_US and POLL_SLEEP_MAX_US until the timeout. Loops
+ * which can give up early hand the rest over to the timer instead.
+ */
+typedef struct {
+  uint64_t start_ns;
+  uint64_t timeout_ns;
+  uint32_t iter;
+  uint32_t sleep_us;
+} rshim_poll_t;
+
+/* Stages reached by the polling loops, counted in rshim_poll_stats[]. */
+enum {
+  RSH_POLL_SPIN,
+  RSH_POLL_SLEEP,
+  RSH_POLL_DEFER,
+  RSH_POLL_TIMEOUT,
+  RSH_POLL_STAGES
+};
+
+extern volatile uint64_t rshim_poll_stats[RSH_POLL_STAGES];
+
+void rshim_poll_init(rshim_poll_t *poll, uint32_t timeout_ms);
+int rshim_poll_wait(rshim_poll_t *poll);
+
 /* Allowed registers in drop mode. */
 static inline bool rshim_drop_mode_access(int addr)
 {
@@ -543,6 +994,67 @@ static inline bool rshim_drop_mode_access(int addr)
  * the value only persists during warm resets.
  */
 int rshim_get_opn(rshim_backend_t *bd, char *opn, int len);
+void rshim_info_invalidate(rshim_backend_t *bd);
+int rshim_info_boot_control(rshim_backend_t *bd, uint64_t *value);
+const char *rshim_info_opn(rshim_backend_t *bd);
 int rshim_set_opn(rshim_backend_t *bd, const char *opn, int len);
 
+/* Performance counters, see rshim_stats.c. */
+static inline void rshim_stats_add(rshim_backend_t *bd, int stat, uint64_t n)
+{
+  __sync_fetch_and_add(&bd->stats.cnt[stat], n);
+}
+
+void rshim_hist_add(rshim_hist_t *hist, uint64_t ns);
+void rshim_stats_attach(rshim_backend_t *bd);
+void rshim_stats_boot_start(rshim_backend_t *bd);
+void rshim_stats_boot(rshim_backend_t *bd, size_t bytes);
+int rshim_stats_show(rshim_backend_t *bd, char *buf, int size);
+void rshim_stats_init(void);
+
+/* Hot-path event trace, see rshim_trace.c. */
+#ifdef HAVE_RSHIM_TRACE
+static inline void rshim_trace(rshim_backend_t *bd, int event, int a,
+                               uint64_t b)
+{
+  uint64_t i = __sync_fetch_and_add(&bd->trace.idx, 1);
+  rshim_trace_ev_t *ev = &bd->trace.ev[i & (RSH_TRACE_SIZE - 1)];
+
+  __atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  ev->ns = rshim_get_time_ns();
+  ev->event = event;
+  ev->a = a;
+  ev->b = b;
+  __atomic_store_n(&ev->seq, (uint32_t)(i + 1), __ATOMIC_RELEASE);
+}
+
+#define RSHIM_TRACE(bd, event, a, b) rshim_trace(bd, event, a, b)
+
+int rshim_trace_init(int epoll_fd);
+int rshim_trace_show(rshim_backend_t *bd, char *buf, int size);
+void rshim_trace_dump(void);
+void rshim_trace_signal(void);
+#else
+#define RSHIM_TRACE(bd, event, a, b) do { } while (0)
+
+static inline int rshim_trace_init(int epoll_fd)
+{
+  return 0;
+}
+
+static inline int rshim_trace_show(rshim_backend_t *bd, char *buf, int size)
+{
+  return snprintf(buf, size, "trace not enabled\n");
+}
+
+static inline void rshim_trace_dump(void)
+{
+}
+
+static inline void rshim_trace_signal(void)
+{
+}
+#endif
+
 #endif /* _RSHIM_H */
@@ -0,0 +1,650 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2019 Mellanox Technologies. All Rights Reserved.
+ *
+ */
+
+/*
+ * Benchmark of the driver data paths on the simulated backend. The daemon
+ * runs in a thread attached to sim-0 while the tests drive it the same way
+ * the device files and the tap interface do, and the results are printed
+ * as JSON so that they can be compared between builds.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#endif
+
+#include "rshim.h"
+
+/* Duration of each throughput test in seconds. */
+#define BENCH_SECONDS         2
+
+/* Number of console round trips timed. */
+#define BENCH_ECHO_SAMPLES    1000
+
+/* Time to wait for the simulated device and its tap interface. */
+#define BENCH_ATTACH_TIMEOUT  10
+
+/* IEEE local experimental ethertype, ignored by the host stack. */
+#define BENCH_ETHERTYPE       0x88b5
+
+/* Frames the network test keeps in flight, within the tap queue. */
+#define BENCH_NET_WINDOW      32
+
+/* Time without any frame back after which those in flight are lost. */
+#define BENCH_NET_STALL_MS    100
+
+#define BENCH_BUF_SIZE        (1024 * 1024)
+
+/* Packet sizes written in turn by a framing test. */
+typedef struct {
+  const char *name;
+  const int *sizes;
+  int num;
+} bench_mix_t;
+
+static const int bench_sizes_64[] = { 64 };
+static const int bench_sizes_1500[] = { 1500 };
+static const int bench_sizes_4096[] = { 4096 };
+/* Simple IMIX, 7:4:1 of 64, 576 and 1500 bytes. */
+static const int bench_sizes_imix[] = {
+  64, 576, 64, 576, 64, 1500, 64, 576, 64, 576, 64, 64
+};
+
+#define BENCH_MIX(n, s) { n, s, sizeof(s) / sizeof((s)[0]) }
+
+static const bench_mix_t bench_mixes[] = {
+  BENCH_MIX("64", bench_sizes_64),
+  BENCH_MIX("1500", bench_sizes_1500),
+  BENCH_MIX("4096", bench_sizes_4096),
+  BENCH_MIX("imix", bench_sizes_imix),
+};
+
+/* Boot push chunk sizes; the odd ones go through boot_rem_data. */
+static const int bench_boot_chunks[] = { 65536, 1048576, 4093, 65533 };
+
+/* Frame sizes of the network test, without the FCS. */
+static const int bench_frame_sizes[] = { 64, 1514 };
+
+/* Background writer of the framing and network tests. */
+typedef struct {
+  rshim_backend_t *bd;
+  const bench_mix_t *mix;
+  int fd;
+  int size;
+  volatile bool run;
+  volatile bool done;
+  uint64_t bytes;
+  uint64_t msgs;
+  uint64_t rx;                    /* Network frames received back. */
+  uint64_t lost;                  /* Network frames given up on. */
+  int err;
+} bench_writer_t;
+
+static int bench_seconds = BENCH_SECONDS;
+static int bench_samples = BENCH_ECHO_SAMPLES;
+static int bench_net_window = BENCH_NET_WINDOW;
+static char bench_buf[BENCH_BUF_SIZE];
+static char bench_rx_buf[BENCH_BUF_SIZE];
+static FILE *bench_out;
+
+static double bench_elapsed(uint64_t start_ns, uint64_t end_ns)
+{
+  return (end_ns - start_ns) / 1e9;
+}
+
+static double bench_rate(uint64_t n, double secs)
+{
+  return secs > 0 ? n / secs : 0;
+}
+
+static int bench_copy_in(void *dest, const void *src, int count)
+{
+  memcpy(dest, src, count);
+  return count;
+}
+
+/* Discard whatever is left in the console read FIFO. */
+static void bench_cons_drain(rshim_backend_t *bd)
+{
+  while (rshim_fifo_read(bd, bench_rx_buf, sizeof(bench_rx_buf),
+                         TMFIFO_CONS_CHAN, true) > 0)
+    ;
+}
+
+static void *bench_cons_writer(void *arg)
+{
+  bench_writer_t *w = (bench_writer_t *)arg;
+  ssize_t rc;
+  int i = 0;
+
+  while (w->run) {
+    rc = rshim_fifo_write(w->bd, bench_buf, w->mix->sizes[i], TMFIFO_CONS_CHAN,
+                          false);
+    if (rc < 0) {
+      if (rc == -EINTR || rc == -EAGAIN)
+        continue;
+      w->err = rc;
+      break;
+    }
+    w->bytes += rc;
+    w->msgs++;
+    i = (i + 1) % w->mix->num;
+  }
+
+  w->done = true;
+  return NULL;
+}
+
+/*
+ * TMFIFO framing throughput: console data written on one side is framed by
+ * rshim_fifo_output(), looped back by the peer and parsed again by
+ * rshim_fifo_input() before it's read back here.
+ */
+static void bench_fifo(rshim_backend_t *bd, const bench_mix_t *mix,
+                       bool last)
+{
+  uint64_t start, end, rx = 0, reads, writes;
+  bench_writer_t w;
+  pthread_t thread;
+  double secs;
+  ssize_t rc;
+
+  bench_cons_drain(bd);
+
+  memset(&w, 0, sizeof(w));
+  w.bd = bd;
+  w.mix = mix;
+  w.run = true;
+
+  reads = bd->stats.cnt[RSH_STAT_REG_READS];
+  writes = bd->stats.cnt[RSH_STAT_REG_WRITES];
+  start = end = rshim_get_time_ns();
+  if (pthread_create(&thread, NULL, bench_cons_writer, &w)) {
+    fprintf(bench_out, "    { \"mix\": \"%s\", \"error\": \"%s\" }%s\n",
+            mix->name, strerror(errno), last ? "" : ",");
+    return;
+  }
+
+  /* Read for the test duration, then until the writer's data is all back. */
+  while (true) {
+    if (w.run && bench_elapsed(start, rshim_get_time_ns()) >= bench_seconds)
+      w.run = false;
+    if (!w.run && w.done && rx >= w.bytes)
+      break;
+
+    rc = rshim_fifo_read(bd, bench_rx_buf, sizeof(bench_rx_buf),
+                         TMFIFO_CONS_CHAN, false);
+    if (rc > 0) {
+      rx += rc;
+      end = rshim_get_time_ns();
+    } else if (!w.run && w.done) {
+      /* Nothing for a second after the writer stopped, the rest is lost. */
+      break;
+    }
+  }
+  w.run = false;
+  pthread_join(thread, NULL);
+
+  secs = bench_elapsed(start, end);
+  fprintf(bench_out, "    { \"mix\": \"%s\", \"seconds\": %.3f, "
+          "\"tx_bytes\": %llu, \"rx_bytes\": %llu, \"msgs\": %llu, "
+          "\"mb_per_s\": %.2f, \"msgs_per_s\": %.0f, "
+          "\"reg_reads\": %llu, \"reg_writes\": %llu, \"error\": %d }%s\n",
+          mix->name, secs, (unsigned long long)w.bytes,
+          (unsigned long long)rx, (unsigned long long)w.msgs,
+          bench_rate(rx, secs) / 1e6, bench_rate(w.msgs, secs),
+          (unsigned long long)(bd->stats.cnt[RSH_STAT_REG_READS] - reads),
+          (unsigned long long)(bd->stats.cnt[RSH_STAT_REG_WRITES] - writes),
+          w.err, last ? "" : ",");
+}
+
+static int bench_cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Round trip of a single console byte through the peer. */
+static void bench_echo(rshim_backend_t *bd)
+{
+  uint64_t *lat, start, total = 0;
+  int i, n = 0, timeouts = 0;
+  char c = 'x';
+  ssize_t rc;
+
+  lat = calloc(bench_samples, sizeof(*lat));
+  if (!lat) {
+    fprintf(bench_out, "  \"console_echo\": { \"error\": \"%s\" },\n",
+            strerror(ENOMEM));
+    return;
+  }
+
+  bench_cons_drain(bd);
+
+  for (i = 0; i < bench_samples; i++) {
+    start = rshim_get_time_ns();
+    rc = rshim_fifo_write(bd, &c, 1, TMFIFO_CONS_CHAN, false);
+    if (rc == 1)
+      rc = rshim_fifo_read(bd, bench_rx_buf, 1, TMFIFO_CONS_CHAN, false);
+    if (rc != 1) {
+      timeouts++;
+      continue;
+    }
+    lat[n] = rshim_get_time_ns() - start;
+    total += lat[n++];
+  }
+
+  qsort(lat, n, sizeof(*lat), bench_cmp_u64);
+  fprintf(bench_out, "  \"console_echo\": { \"samples\": %d, "
+          "\"timeouts\": %d, \"mean_us\": %.2f, \"p50_us\": %.2f, "
+          "\"p99_us\": %.2f, \"max_us\": %.2f },\n",
+          n, timeouts, n ? total / 1e3 / n : 0,
+          n ? lat[n / 2] / 1e3 : 0, n ? lat[n * 99 / 100] / 1e3 : 0,
+          n ? lat[n - 1] / 1e3 : 0);
+  free(lat);
+}
+
+#ifdef __linux__
+/*
+ * Send frames while fewer than bench_net_window are in flight, so that the
+ * tap queue never overflows. If nothing comes back for BENCH_NET_STALL_MS,
+ * the frames in flight are given up on and the window opens again.
+ */
+static void *bench_net_writer(void *arg)
+{
+  bench_writer_t *w = (bench_writer_t *)arg;
+  uint64_t now, wait = 0, wait_rx = 0, rx;
+  ssize_t rc;
+
+  while (w->run) {
+    rx = __atomic_load_n(&w->rx, __ATOMIC_RELAXED);
+    if ((int64_t)(w->msgs - w->lost - rx) >= bench_net_window) {
+      now = rshim_get_time_ns();
+      if (!wait || rx != wait_rx) {
+        wait = now;
+        wait_rx = rx;
+      }
+      if (now - wait < BENCH_NET_STALL_MS * 1000000ULL) {
+        sched_yield();
+        continue;
+      }
+      w->lost = w->msgs - rx;
+    }
+    wait = 0;
+
+    rc = send(w->fd, bench_buf, w->size, 0);
+    if (rc < 0) {
+      if (errno == ENOBUFS || errno == EAGAIN || errno == EINTR) {
+        sched_yield();
+        continue;
+      }
+      w->err = -errno;
+      break;
+    }
+    w->msgs++;
+  }
+
+  w->done = true;
+  return NULL;
+}
+
+/*
+ * Frames sent into the tap and looped back by the peer. The writer keeps a
+ * window of frames in flight, so the rate of the frames received back is
+ * the throughput at no or bounded loss, which is reported along with it.
+ */
+static void bench_net_size(rshim_backend_t *bd, int fd, int size, bool last)
+{
+  uint64_t start, stop, end, rx = 0, lost;
+  struct ether_header *eh;
+  struct sockaddr_ll sll;
+  socklen_t len;
+  bench_writer_t w;
+  pthread_t thread;
+  double secs;
+  ssize_t rc;
+
+  eh = (struct ether_header *)bench_buf;
+  memset(eh->ether_dhost, 0xff, ETH_ALEN);
+  memcpy(eh->ether_shost, "\x02\x00\x00\x00\x00\x01", ETH_ALEN);
+  eh->ether_type = htons(BENCH_ETHERTYPE);
+
+  memset(&w, 0, sizeof(w));
+  w.bd = bd;
+  w.fd = fd;
+  w.size = size;
+  w.run = true;
+
+  start = stop = end = rshim_get_time_ns();
+  if (pthread_create(&thread, NULL, bench_net_writer, &w)) {
+    fprintf(bench_out, "      { \"frame_size\": %d, \"error\": \"%s\" }%s\n",
+            size, strerror(errno), last ? "" : ",");
+    return;
+  }
+
+  while (true) {
+    if (w.run && bench_elapsed(start, rshim_get_time_ns()) >= bench_seconds) {
+      stop = rshim_get_time_ns();
+      w.run = false;
+    }
+    if (!w.run && w.done && rx >= w.msgs)
+      break;
+
+    len = sizeof(sll);
+    rc = recvfrom(fd, bench_rx_buf, sizeof(bench_rx_buf), 0,
+                  (struct sockaddr *)&sll, &len);
+    if (rc < 0) {
+      /* Receive timeout; whatever is missing after the writer is lost. */
+      if (!w.run && w.done)
+        break;
+      continue;
+    }
+    if (sll.sll_pkttype == PACKET_OUTGOING)
+      continue;
+    __atomic_store_n(&w.rx, ++rx, __ATOMIC_RELAXED);
+    end = rshim_get_time_ns();
+  }
+  w.run = false;
+  pthread_join(thread, NULL);
+
+  secs = bench_elapsed(start, end);
+  lost = w.msgs > rx ? w.msgs - rx : 0;
+  fprintf(bench_out, "      { \"frame_size\": %d, \"window\": %d, "
+          "\"seconds\": %.3f, \"tx_frames\": %llu, \"tx_pps\": %.0f, "
+          "\"rx_frames\": %llu, \"rx_pps\": %.0f, \"rx_mb_per_s\": %.2f, "
+          "\"lost_frames\": %llu, \"loss_pct\": %.3f, \"error\": %d }%s\n",
+          size, bench_net_window, secs, (unsigned long long)w.msgs,
+          bench_rate(w.msgs, bench_elapsed(start, stop)),
+          (unsigned long long)rx, bench_rate(rx, secs),
+          bench_rate(rx * size, secs) / 1e6, (unsigned long long)lost,
+          w.msgs ? lost * 100.0 / w.msgs : 0, w.err, last ? "" : ",");
+}
+
+static void bench_net(rshim_backend_t *bd)
+{
+  struct timeval tv = { .tv_sec = 1 };
+  struct sockaddr_ll sll;
+  char ifname[IFNAMSIZ];
+  int i, fd, n, ifindex;
+  const char *err;
+
+  for (i = 0; i < BENCH_ATTACH_TIMEOUT * 10 && bd->net_fd < 0; i++)
+    usleep(100000);
+
+  snprintf(ifname, sizeof(ifname), "tmfifo_net%d", bd->index);
+  ifindex = if_nametoindex(ifname);
+  if (bd->net_fd < 0 || !ifindex) {
+    err = "no tap interface";
+    goto skip;
+  }
+
+  fd = socket(AF_PACKET, SOCK_RAW, htons(BENCH_ETHERTYPE));
+  if (fd < 0) {
+    err = strerror(errno);
+    goto skip;
+  }
+
+  memset(&sll, 0, sizeof(sll));
+  sll.sll_family = AF_PACKET;
+  sll.sll_protocol = htons(BENCH_ETHERTYPE);
+  sll.sll_ifindex = ifindex;
+  if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+    err = strerror(errno);
+    close(fd);
+    goto skip;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  n = 4 * 1024 * 1024;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &n, sizeof(n));
+
+  fprintf(bench_out, "  \"net\": { \"interface\": \"%s\", \"results\": [\n",
+          ifname);
+  n = sizeof(bench_frame_sizes) / sizeof(bench_frame_sizes[0]);
+  for (i = 0; i < n; i++)
+    bench_net_size(bd, fd, bench_frame_sizes[i], i == n - 1);
+  fprintf(bench_out, "    ] },\n");
+  close(fd);
+  return;
+
+skip:
+  fprintf(bench_out, "  \"net\": { \"skipped\": \"%s\" },\n", err);
+}
+#else
+static void bench_net(rshim_backend_t *bd)
+{
+  fprintf(bench_out, "  \"net\": { \"skipped\": \"not supported\" },\n");
+}
+#endif
+
+/* Boot stream pushed with rshim_boot_write() in 'chunk' sized calls. */
+static void bench_boot(rshim_backend_t *bd, int chunk, bool last)
+{
+  uint64_t start, end, bytes = 0, reads, writes;
+  double secs;
+  int rc, n;
+
+  rc = rshim_boot_open(bd);
+  if (rc) {
+    fprintf(bench_out, "    { \"chunk\": %d, \"error\": %d }%s\n",
+            chunk, rc, last ? "" : ",");
+    return;
+  }
+
+  reads = bd->stats.cnt[RSH_STAT_REG_READS];
+  writes = bd->stats.cnt[RSH_STAT_REG_WRITES];
+  start = rshim_get_time_ns();
+  while (bench_elapsed(start, rshim_get_time_ns()) < bench_seconds) {
+    rc = rshim_boot_write(bd, bench_buf, chunk, bench_copy_in);
+    if (rc < 0)
+      break;
+    bytes += rc;
+    rc = 0;
+  }
+  n = rshim_boot_release(bd);
+  if (!rc)
+    rc = n;
+  end = rshim_get_time_ns();
+
+  secs = bench_elapsed(start, end);
+  fprintf(bench_out, "    { \"chunk\": %d, \"aligned\": %s, "
+          "\"seconds\": %.3f, \"bytes\": %llu, \"mb_per_s\": %.2f, "
+          "\"reg_reads\": %llu, \"reg_writes\": %llu, \"error\": %d }%s\n",
+          chunk, chunk % sizeof(uint64_t) ? "false" : "true", secs,
+          (unsigned long long)bytes, bench_rate(bytes, secs) / 1e6,
+          (unsigned long long)(bd->stats.cnt[RSH_STAT_REG_READS] - reads),
+          (unsigned long long)(bd->stats.cnt[RSH_STAT_REG_WRITES] - writes),
+          rc, last ? "" : ",");
+}
+
+/* Referenced sim-0 backend once it's attached, or NULL. */
+static rshim_backend_t *bench_find_dev(void)
+{
+  rshim_backend_t *bd = NULL, **list;
+  int i, n;
+
+  n = rshim_devs_get(&list);
+  if (n < 0)
+    return NULL;
+
+  for (i = 0; i < n; i++) {
+    if (!strcmp(list[i]->dev_name, "sim-0") && list[i]->has_tm) {
+      bd = list[i];
+      rshim_ref(bd);
+      break;
+    }
+  }
+  rshim_devs_put(list, n);
+
+  return bd;
+}
+
+static void *bench_daemon_thread(void *arg)
+{
+  char **argv = (char **)arg;
+  int argc = 0;
+
+  while (argv[argc])
+    argc++;
+
+  rshim_daemon_main(argc, argv);
+  return NULL;
+}
+
+static void print_help(void)
+{
+  printf("Usage: rshim-bench [options]\n");
+  printf("\n");
+  printf("OPTIONS:\n");
+  printf("  -c, --config      configuration file (default none)\n");
+  printf("  -i, --index       use device path /dev/rshim<i>/\n");
+  printf("  -l, --log-level   log level");
+  printf("(0:none, 1:error, 2:warning, 3:notice, 4:debug)\n");
+  printf("  -n, --samples     console echo round trips (default %d)\n",
+         BENCH_ECHO_SAMPLES);
+  printf("  -o, --output      write the JSON results to a file\n");
+  printf("  -t, --time        seconds of each throughput test (default %d)\n",
+         BENCH_SECONDS);
+  printf("  -w, --window      network frames in flight (default %d)\n",
+         BENCH_NET_WINDOW);
+}
+
+int main(int argc, char *argv[])
+{
+  static const char short_options[] = "c:hi:l:n:o:t:w:";
+  static struct option long_options[] = {
+    { "config", required_argument, NULL, 'c' },
+    { "help", no_argument, NULL, 'h' },
+    { "index", required_argument, NULL, 'i' },
+    { "log-level", required_argument, NULL, 'l' },
+    { "samples", required_argument, NULL, 'n' },
+    { "output", required_argument, NULL, 'o' },
+    { "time", required_argument, NULL, 't' },
+    { "window", required_argument, NULL, 'w' },
+    { NULL, 0, NULL, 0 }
+  };
+  char *daemon_argv[] = { argv[0], "-f", "-b", "sim", "-l", "0",
+                          NULL, NULL, NULL };
+  const char *output = NULL;
+  rshim_backend_t *bd = NULL;
+  pthread_t thread;
+  int c, i, n;
+
+  /* Keep the results reproducible unless a config is given. */
+  rshim_cfg_file = "/dev/null";
+
+  while ((c = getopt_long(argc, argv, short_options, long_options, NULL))
+         != -1) {
+    switch (c) {
+    case 'c':
+      rshim_cfg_file = optarg;
+      break;
+    case 'i':
+      daemon_argv[6] = "-i";
+      daemon_argv[7] = optarg;
+      break;
+    case 'l':
+      daemon_argv[5] = optarg;
+      break;
+    case 'n':
+      bench_samples = MAX(atoi(optarg), 1);
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case 't':
+      bench_seconds = MAX(atoi(optarg), 1);
+      break;
+    case 'w':
+      bench_net_window = MAX(atoi(optarg), 1);
+      break;
+    case 'h':
+    default:
+      print_help();
+      return 0;
+    }
+  }
+
+  bench_out = output ? fopen(output, "w") : stdout;
+  if (!bench_out) {
+    fprintf(stderr, "failed to open %s: %m\n", output);
+    return 1;
+  }
+
+  optind = 1;
+  if (pthread_create(&thread, NULL, bench_daemon_thread, daemon_argv)) {
+    fprintf(stderr, "failed to start the daemon: %m\n");
+    return 1;
+  }
+
+  for (i = 0; i < BENCH_ATTACH_TIMEOUT * 10 && !bd; i++) {
+    usleep(100000);
+    bd = bench_find_dev();
+  }
+  if (!bd) {
+    fprintf(stderr, "sim-0 didn't attach\n");
+    return 1;
+  }
+
+  /* The daemon ignores SIGINT; the benchmark shouldn't. */
+  signal(SIGINT, SIG_DFL);
+
+  for (i = 0; i < BENCH_BUF_SIZE; i++)
+    bench_buf[i] = 'a' + i % 26;
+
+  if (rshim_console_open(bd)) {
+    fprintf(stderr, "failed to open the console of sim-0\n");
+    return 1;
+  }
+
+  fprintf(bench_out, "{\n");
+#if defined(PACKAGE_NAME) && defined(VERSION)
+  fprintf(bench_out, "  \"version\": \"" VERSION "\",\n");
+#endif
+  fprintf(bench_out, "  \"device\": \"%s\",\n  \"seconds\": %d,\n",
+          bd->dev_name, bench_seconds);
+
+  fprintf(bench_out, "  \"fifo\": [\n");
+  n = sizeof(bench_mixes) / sizeof(bench_mixes[0]);
+  for (i = 0; i < n; i++)
+    bench_fifo(bd, &bench_mixes[i], i == n - 1);
+  fprintf(bench_out, "  ],\n");
+
+  bench_echo(bd);
+  bench_net(bd);
+
+  /* Last, the boot stream resets the FIFOs. */
+  fprintf(bench_out, "  \"boot\": [\n");
+  n = sizeof(bench_boot_chunks) / sizeof(bench_boot_chunks[0]);
+  for (i = 0; i < n; i++)
+    bench_boot(bd, bench_boot_chunks[i], i == n - 1);
+  fprintf(bench_out, "  ]\n}\n");
+  fflush(bench_out);
+
+  rshim_deref(bd);
+
+  /* Stop the daemon like SIGTERM does. */
+  pthread_kill(thread, SIGTERM);
+  pthread_join(thread, NULL);
+
+  if (output)
+    fclose(bench_out);
+
+  return 0;
+}
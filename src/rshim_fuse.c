@@ -39,6 +39,7 @@ char *rshim_dev_minor_names[RSH_DEV_TYPES] = {
     [RSH_DEV_TYPE_BOOT] = "boot",
     [RSH_DEV_TYPE_TMFIFO] = "console",
     [RSH_DEV_TYPE_MISC] = "misc",
+    [RSH_DEV_TYPE_LOG] = "log",
 };
 
 #ifdef __linux__
@@ -129,19 +130,19 @@ static int rshim_fuse_boot_write(struct cuse_dev *cdev, int fflags,
 static void rshim_fuse_boot_release(fuse_req_t req, struct fuse_file_info *fi)
 {
   rshim_backend_t *bd = fuse_req_userdata(req);
+  int rc = 0;
 
-  if (bd) 
-    rshim_boot_release(bd);
+  if (bd)
+    rc = rshim_boot_release(bd);
 
-  fuse_reply_err(req, 0);
+  fuse_reply_err(req, -rc);
 }
 #elif defined(__FreeBSD__)
 static int rshim_fuse_boot_release(struct cuse_dev *cdev, int fflags)
 {
   rshim_backend_t *bd = cuse_dev_get_priv0(cdev);
 
-  rshim_boot_release(bd);
-  return CUSE_ERR_NONE;
+  return rshim_boot_release(bd) ? CUSE_ERR_OTHER : CUSE_ERR_NONE;
 }
 #endif
 
@@ -208,11 +209,15 @@ static int rshim_fuse_console_open(struct cuse_dev *cdev, int fflags)
 #endif
 
 #ifdef __linux__
+static int rshim_fuse_reply_iov(void *arg, const struct iovec *iov, int cnt)
+{
+  return fuse_reply_iov((fuse_req_t)arg, iov, cnt);
+}
+
 static void rshim_fuse_console_read(fuse_req_t req, size_t size, off_t off,
                                     struct fuse_file_info *fi)
 {
   rshim_backend_t *bd = fuse_req_userdata(req);
-  char buf[512];
   int rc;
 
   if (!bd) {
@@ -225,15 +230,11 @@ static void rshim_fuse_console_read(fuse_req_t req, size_t size, off_t off,
     return;
   }
 
-  if (size > sizeof(buf))
-    size = sizeof(buf);
-
-  rc = rshim_fifo_read(bd, buf, size, TMFIFO_CONS_CHAN,
-                       fi->flags & O_NONBLOCK);
+  /* Reply straight from the read FIFO, the request is answered if rc >= 0. */
+  rc = rshim_fifo_read_iov(bd, size, TMFIFO_CONS_CHAN,
+                           fi->flags & O_NONBLOCK, rshim_fuse_reply_iov, req);
   if (rc < 0)
     fuse_reply_err(req, -rc);
-  else
-    fuse_reply_buf(req, buf, rc);
 }
 #elif defined(__FreeBSD__)
 static int rshim_fuse_console_read(struct cuse_dev *cdev, int fflags,
@@ -613,7 +614,7 @@ static int rshim_fuse_misc_read(struct cuse_dev *cdev, int fflags,
   struct rshim_misc *rm = cuse_dev_get_per_file_handle(cdev);
   off_t off;
 #endif
-  char opn[RSHIM_YU_BOOT_RECORD_OPN_SIZE + 1] = "";
+  const char *opn;
   uint8_t *mac = bd->peer_mac;
   int rc, len = sizeof(rm->buffer), n;
   struct timespec ts;
@@ -643,7 +644,7 @@ static int rshim_fuse_misc_read(struct cuse_dev *cdev, int fflags,
   pthread_mutex_lock(&bd->mutex);
 
   /* Boot mode. */
-  rc = bd->read_rshim(bd, RSHIM_CHANNEL, RSH_BOOT_CONTROL, &value);
+  rc = rshim_info_boot_control(bd, &value);
   if (rc) {
     pthread_mutex_unlock(&bd->mutex);
     RSHIM_ERR("couldn't read rshim register\n");
@@ -657,7 +658,7 @@ static int rshim_fuse_misc_read(struct cuse_dev *cdev, int fflags,
 
   p = rm->buffer;
 
-  n = snprintf(p, len, "%-16s%d (0:basic, 1:advanced, 2:log)\n",
+  n = snprintf(p, len, "%-16s%d (0:basic, 1:advanced, 2:log, 3:stats, 4:trace)\n",
                "DISPLAY_LEVEL", bd->display_level);
   p += n;
   len -= n;
@@ -696,14 +697,19 @@ static int rshim_fuse_misc_read(struct cuse_dev *cdev, int fflags,
 
   /* Display OPN info (for BlueField-2 and above). */
   if (bd->ver_id >= RSHIM_BLUEFIELD_2) {
-    rshim_get_opn(bd, opn, RSHIM_YU_BOOT_RECORD_OPN_SIZE);
+    opn = rshim_info_opn(bd);
     if (!strlen(opn))
-      strcpy(opn, "N/A");
+      opn = "N/A";
     n = snprintf(p, len, "%-16s%s\n", "OPN_STR", opn);
     p += n;
     len -= n;
   }
 
+  /* Progress of the boot stream pushed from a file. */
+  n = rshim_boot_file_show(bd, p, len);
+  p += n;
+  len -= n;
+
   if (bd->display_level == 1) {
     gettimeofday(&tp, NULL);
 
@@ -713,6 +719,30 @@ static int rshim_fuse_misc_read(struct cuse_dev *cdev, int fflags,
     p += n;
     len -= n;
 
+    n = snprintf(p, len, "%-16s%d\n", "NET_MTU", bd->net_mtu);
+    p += n;
+    len -= n;
+
+    /* Time to service the work handler wake-ups. */
+    n = snprintf(p, len, "%-16s%llu/%llu (us, avg/max of %llu wakeups)\n",
+                 "WORK_LATENCY",
+                 (unsigned long long)(bd->work_wakeups ?
+                   bd->work_latency_total / bd->work_wakeups / 1000 : 0),
+                 (unsigned long long)bd->work_latency_max / 1000,
+                 (unsigned long long)bd->work_wakeups);
+    p += n;
+    len -= n;
+
+    /* Polling loops that spun, slept, deferred to the timer or timed out. */
+    n = snprintf(p, len, "%-16s%llu/%llu/%llu/%llu (spin/sleep/defer/timeout)\n",
+                 "POLL_STATS",
+                 (unsigned long long)rshim_poll_stats[RSH_POLL_SPIN],
+                 (unsigned long long)rshim_poll_stats[RSH_POLL_SLEEP],
+                 (unsigned long long)rshim_poll_stats[RSH_POLL_DEFER],
+                 (unsigned long long)rshim_poll_stats[RSH_POLL_TIMEOUT]);
+    p += n;
+    len -= n;
+
     /*
      * Display the target-side information. Send a request and wait for
      * some time for the response.
@@ -744,6 +774,12 @@ static int rshim_fuse_misc_read(struct cuse_dev *cdev, int fflags,
   } else if (bd->display_level == 2) {
     n = rshim_log_show(bd, p, len);
     p += n;
+  } else if (bd->display_level == 3) {
+    n = rshim_stats_show(bd, p, len);
+    p += n;
+  } else if (bd->display_level == 4) {
+    n = rshim_trace_show(bd, p, len);
+    p += n;
   }
 
   rm->len = p - rm->buffer;
@@ -840,6 +876,7 @@ static int rshim_fuse_misc_write(struct cuse_dev *cdev, int fflags,
       goto invalid;
 
     pthread_mutex_lock(&bd->mutex);
+    rshim_info_invalidate(bd);
     rc = bd->write_rshim(bd, RSHIM_CHANNEL, RSH_BOOT_CONTROL,
                          value & RSH_BOOT_CONTROL__BOOT_MODE_MASK);
     pthread_mutex_unlock(&bd->mutex);
@@ -852,11 +889,13 @@ static int rshim_fuse_misc_write(struct cuse_dev *cdev, int fflags,
         /* Detach, which shouldn't hold bd->mutex. */
         rshim_notify(bd, RSH_EVENT_DETACH, 0);
 
+        rshim_fifo_lock(bd);
         pthread_mutex_lock(&bd->mutex);
         /* Reset the TmFifo. */
         rshim_fifo_reset(bd);
         bd->is_booting = 1;
         pthread_mutex_unlock(&bd->mutex);
+        rshim_fifo_unlock(bd);
       }
 
       /* SW reset. */
@@ -911,6 +950,27 @@ static int rshim_fuse_misc_write(struct cuse_dev *cdev, int fflags,
     if (sscanf(p, "%16s", opn) != 1)
       goto invalid;
     rshim_set_opn(bd, opn, RSHIM_YU_BOOT_RECORD_OPN_SIZE);
+  } else if (!strcmp(key, "BOOT_FILE")) {
+    /* The rest of the line is the path, which may contain spaces. */
+    while (*p == ' ' || *p == '\t')
+      p++;
+    buf[strcspn(buf, "\r\n")] = 0;
+    if (*p != '/')
+      goto invalid;
+    rc = rshim_boot_file_start(bd, p);
+  } else if (!strcmp(key, "BOOT_BCAST")) {
+    /* Device list ('all' or comma separated names), then the path. */
+    char devs[256];
+
+    buf[strcspn(buf, "\r\n")] = 0;
+    if (sscanf(p, "%255s", devs) != 1)
+      goto invalid;
+    p = strstr(p, devs) + strlen(devs);
+    while (*p == ' ' || *p == '\t')
+      p++;
+    if (*p != '/')
+      goto invalid;
+    rc = rshim_boot_bcast_start(devs, p);
   } else {
 invalid:
 #ifdef __linux__
@@ -971,6 +1031,102 @@ static const struct cuse_methods rshim_misc_fops = {
 };
 #endif
 
+/* Log file operations routines */
+
+#ifdef __linux__
+static void rshim_fuse_log_open(fuse_req_t req, struct fuse_file_info *fi)
+{
+  rshim_backend_t *bd = fuse_req_userdata(req);
+  rshim_log_cursor_t *cur;
+
+  if (!bd) {
+    fuse_reply_err(req, ENODEV);
+    return;
+  }
+
+  cur = calloc(1, sizeof(*cur));
+  if (!cur) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  fi->fh = (uintptr_t)cur;
+  fuse_reply_open(req, fi);
+  rshim_ref(bd);
+}
+
+static void rshim_fuse_log_read(fuse_req_t req, size_t size, off_t off,
+                                struct fuse_file_info *fi)
+{
+  rshim_backend_t *bd = fuse_req_userdata(req);
+  rshim_log_cursor_t *cur = (void *)(uintptr_t)fi->fh;
+  char buf[4096];
+  ssize_t rc;
+
+  if (!bd) {
+    fuse_reply_err(req, ENODEV);
+    return;
+  }
+
+  rc = rshim_log_read(bd, buf, MIN(size, sizeof(buf)), cur,
+                      fi->flags & O_NONBLOCK);
+  if (rc < 0)
+    fuse_reply_err(req, -rc);
+  else
+    fuse_reply_buf(req, buf, rc);
+}
+#elif defined(__FreeBSD__)
+static int rshim_fuse_log_open(struct cuse_dev *cdev, int fflags)
+{
+  rshim_backend_t *bd = cuse_dev_get_priv0(cdev);
+  rshim_log_cursor_t *cur = calloc(1, sizeof(*cur));
+
+  if (cur == NULL)
+    return CUSE_ERR_NO_MEMORY;
+  cuse_dev_set_per_file_handle(cdev, cur);
+  rshim_ref(bd);
+  return CUSE_ERR_NONE;
+}
+
+static int rshim_fuse_log_read(struct cuse_dev *cdev, int fflags,
+                               void *peer_ptr, int size)
+{
+  rshim_backend_t *bd = cuse_dev_get_priv0(cdev);
+  rshim_log_cursor_t *cur = cuse_dev_get_per_file_handle(cdev);
+  bool nonblock = fflags & CUSE_FFLAG_NONBLOCK;
+  char buf[4096];
+  ssize_t len;
+  int rc;
+
+  len = rshim_log_read(bd, buf, MIN(size, (int)sizeof(buf)), cur, nonblock);
+  if (len == -EAGAIN)
+    return CUSE_ERR_WOULDBLOCK;
+  else if (len == -EINTR)
+    return CUSE_ERR_SIGNAL;
+  else if (len < 0)
+    return CUSE_ERR_OTHER;
+
+  rc = cuse_copy_out(buf, peer_ptr, len);
+  if (rc != CUSE_ERR_NONE)
+    return rc;
+  return len;
+}
+#endif
+
+#ifdef __linux__
+static const struct cuse_lowlevel_ops rshim_log_fops = {
+  .open = rshim_fuse_log_open,
+  .read = rshim_fuse_log_read,
+  .release = rshim_fuse_misc_release,
+};
+#elif defined(__FreeBSD__)
+static const struct cuse_methods rshim_log_fops = {
+  .cm_open = rshim_fuse_log_open,
+  .cm_read = rshim_fuse_log_read,
+  .cm_close = rshim_fuse_misc_release,
+};
+#endif
+
 /* Rshim file operations routines */
 
 /* ioctl message header. */
@@ -1141,11 +1297,28 @@ static void *cuse_worker(void *arg)
 #endif
 }
 
+#ifdef __linux__
+/*
+ * Multi-threaded session loop, so that a read waiting for data doesn't hold
+ * up the other requests on the same node.
+ */
+static void *cuse_worker_mt(void *arg)
+{
+  struct fuse_session *se = arg;
+  int rc;
+
+  rc = fuse_session_loop_mt(se);
+  fuse_session_destroy(se);
+
+  return (void *)(unsigned long)rc;
+}
+#endif
+
 int rshim_fuse_init(rshim_backend_t *bd)
 {
   char buf[128], *name;
 #ifdef __linux__
-  time_t t0, t1;
+  rshim_poll_t poll;
   const char *bufp[] = {buf};
   struct cuse_info ci = {.dev_info_argc = 1,
                          .dev_info_argv = bufp,
@@ -1159,9 +1332,14 @@ int rshim_fuse_init(rshim_backend_t *bd)
                           [RSH_DEV_TYPE_TMFIFO] = &rshim_console_fops,
                           [RSH_DEV_TYPE_RSHIM] = &rshim_rshim_fops,
                           [RSH_DEV_TYPE_MISC] = &rshim_misc_fops,
+                          [RSH_DEV_TYPE_LOG] = &rshim_log_fops,
                           };
   static const char * const argv[] = {"./rshim", "-f"};
+  pthread_attr_t attr;
   int i, rc;
+#ifdef __linux__
+  bool mt = rshim_cfg_get_int(bd, "CUSE_MT", 0);
+#endif
 
 #if defined(__FreeBSD__)
   if (cuse_init() != CUSE_ERR_NONE)
@@ -1177,10 +1355,9 @@ int rshim_fuse_init(rshim_backend_t *bd)
      * device was re-ceated during SW_RESET.
      */
     snprintf(buf, sizeof(buf), "/dev/rshim%d/%s", bd->index, name);
-    time(&t0);
+    rshim_poll_init(&poll, 5000);
     while (!access(buf, F_OK)) {
-      time(&t1);
-      if (difftime(t1, t0) > 5) {
+      if (rshim_poll_wait(&poll)) {
         RSHIM_ERR("%s already exists\n", buf);
         return -1;
       }
@@ -1196,8 +1373,12 @@ int rshim_fuse_init(rshim_backend_t *bd)
       return -1;
     }
     fuse_remove_signal_handlers(bd->fuse_session[i]);
-    rc = pthread_create(&bd->fuse_thread[i], NULL, cuse_worker,
+    /* The threads of the multi-threaded loop inherit the affinity. */
+    rshim_thread_attr(bd, "FUSE_CPUS", &attr);
+    rc = pthread_create(&bd->fuse_thread[i], &attr,
+                        mt ? cuse_worker_mt : cuse_worker,
                         bd->fuse_session[i]);
+    pthread_attr_destroy(&attr);
     if (rc) {
       RSHIM_ERR("Failed to create cuse thread %m\n");
       return rc;
@@ -1214,8 +1395,10 @@ int rshim_fuse_init(rshim_backend_t *bd)
       RSHIM_ERR("Failed to setup CUSE %s\n", name);
       return -1;
     }
-    rc = pthread_create(&bd->fuse_thread[i], NULL, cuse_worker,
+    rshim_thread_attr(bd, "FUSE_CPUS", &attr);
+    rc = pthread_create(&bd->fuse_thread[i], &attr, cuse_worker,
                         bd->fuse_session[i]);
+    pthread_attr_destroy(&attr);
     if (rc) {
       RSHIM_ERR("Failed to create cuse thread %m");
       return rc;
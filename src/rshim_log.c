@@ -6,7 +6,9 @@
 
 #include <pthread.h>
 #include <stdarg.h>
+#include <sys/param.h>
 #include <time.h>
+#include <unistd.h>
 #include "rshim.h"
 
 /* Log module */
@@ -287,38 +289,116 @@ static int rshim_log_show_msg(rshim_backend_t *bd, uint64_t hdr, char *buf,
   return len;
 }
 
-int rshim_log_show(rshim_backend_t *bd, char *buf, int size)
+/* Copy 'n' bytes from offset 'off' of the log cache, oldest byte first. */
+static void rshim_log_copy(rshim_backend_t *bd, char *buf, int off, int n)
 {
-  uint64_t data, idx, hdr;
-  time_t t0, t1;
-  int i, n, rc, type, len;
-  char *p = buf;
+  int start = (bd->log_head + off) % bd->log_size;
+  int n1 = MIN(n, bd->log_size - start);
 
-  n = snprintf(p, size, "---------------------------------------\n");
-  p += n;
-  size -= n;
-  n = snprintf(p, size, "             Log Messages\n");
-  p += n;
-  size -= n;
-  n = snprintf(p, size, "---------------------------------------\n");
-  p += n;
-  size -= n;
+  memcpy(buf, bd->log_buf + start, n1);
+  if (n > n1)
+    memcpy(buf + n1, bd->log_buf, n - n1);
+}
+
+/*
+ * Append decoded text to the log cache. It grows up to RSHIM_LOG_CACHE_MAX
+ * and then wraps over the oldest text.
+ */
+static void rshim_log_append(rshim_backend_t *bd, const char *text, int len)
+{
+  int size, tail, n;
+  char *p;
+
+  if (len <= 0)
+    return;
+
+  bd->log_total += len;
+
+  if (bd->log_len + len > bd->log_size &&
+      bd->log_size < RSHIM_LOG_CACHE_MAX) {
+    size = MAX(bd->log_size * 2, RSHIM_LOG_CACHE_MIN);
+    while (size < bd->log_len + len)
+      size *= 2;
+    size = MIN(size, RSHIM_LOG_CACHE_MAX);
+    p = malloc(size);
+    if (p) {
+      if (bd->log_len)
+        rshim_log_copy(bd, p, 0, bd->log_len);
+      free(bd->log_buf);
+      bd->log_buf = p;
+      bd->log_size = size;
+      bd->log_head = 0;
+    } else if (!bd->log_size) {
+      return;
+    }
+  }
+
+  /* Only the end of the text fits if it's larger than the whole cache. */
+  if (len > bd->log_size) {
+    text += len - bd->log_size;
+    len = bd->log_size;
+  }
+
+  tail = (bd->log_head + bd->log_len) % bd->log_size;
+  n = MIN(len, bd->log_size - tail);
+  memcpy(bd->log_buf + tail, text, n);
+  if (len > n)
+    memcpy(bd->log_buf, text + n, len - n);
+
+  bd->log_len += len;
+  if (bd->log_len > bd->log_size) {
+    bd->log_head = (bd->log_head + bd->log_len - bd->log_size) %
+                   bd->log_size;
+    bd->log_len = bd->log_size;
+  }
+}
+
+/* Drop the cache so that the whole buffer is decoded again. */
+static void rshim_log_restart(rshim_backend_t *bd, uint64_t hdr,
+                              uint64_t sum)
+{
+  bd->log_len = 0;
+  bd->log_head = 0;
+  bd->log_total = 0;
+  bd->log_idx = 0;
+  bd->log_hdr = hdr;
+  bd->log_sum = sum;
+  bd->log_last = 0;
+  bd->log_last_hdr = hdr;
+  bd->log_gen++;
+}
+
+/*
+ * Bring the log cache up to date with the scratch buffer. Only the entries
+ * after the cached index are fetched and decoded; the cache is restarted if
+ * the buffer was cleared or a new log started. That's spotted by the index
+ * going backwards, or by a change in the first entry, header and words, or
+ * in the header of the last entry decoded. Called with the device mutex
+ * held.
+ */
+int rshim_log_update(rshim_backend_t *bd)
+{
+  uint64_t data, idx, hdr, sum;
+  rshim_poll_t poll;
+  char text[4096];
+  int i, n, rc, type, len, start;
+
+  bd->log_poll_ns = rshim_get_time_ns();
 
   /* Take the semaphore. */
-  time(&t0);
+  rshim_poll_init(&poll, 1000);
   while (true) {
     rc = bd->read_rshim(bd, RSHIM_CHANNEL, RSH_SEMAPHORE0, &data);
     if (rc) {
       RSHIM_ERR("couldn't read RSH_SEMAPHORE0\n");
-      return p - buf;
+      return rc;
     }
 
     if (!data)
       break;
 
     /* Add a timeout in case the semaphore is stuck. */
-    time(&t1);
-    if (difftime(t1, t0) > 1)
+    if (rshim_poll_wait(&poll))
       break;
   }
 
@@ -329,42 +409,88 @@ int rshim_log_show(rshim_backend_t *bd, char *buf, int size)
     goto done;
   }
   idx = (idx >> RSH_SCRATCH_BUF_CTL__IDX_SHIFT) & RSH_SCRATCH_BUF_CTL__IDX_MASK;
-  if (idx <= 1)
+  if (idx <= 1) {
+    if (bd->log_idx)
+      rshim_log_restart(bd, 0, 0);
     goto done;
+  }
 
-  /* Reset the index to 0. */
+  /* Reset the index to 0 and check the first entry. */
   rc = bd->write_rshim(bd, RSHIM_CHANNEL, RSH_SCRATCH_BUF_CTL, 0);
   if (rc) {
     RSHIM_ERR("couldn't write RSH_SCRATCH_BUF_CTL\n");
     goto done;
   }
+  rc = bd->read_rshim(bd, RSHIM_CHANNEL, RSH_SCRATCH_BUF_DAT, &hdr);
+  if (rc) {
+    RSHIM_ERR("couldn't read RSH_SCRATCH_BUF_DAT\n");
+    goto restore;
+  }
+  hdr = le64toh(hdr);
+
+  /* Fold the words of the first entry, as far as they are written. */
+  sum = hdr;
+  len = MIN((int)BF_RSH_LOG_HEADER_GET(LEN, hdr), (int)idx - 1);
+  for (i = 0; i < len; i++) {
+    rc = bd->read_rshim(bd, RSHIM_CHANNEL, RSH_SCRATCH_BUF_DAT, &data);
+    if (rc) {
+      RSHIM_ERR("couldn't read RSH_SCRATCH_BUF_DAT\n");
+      goto restore;
+    }
+    sum = (sum ^ le64toh(data)) * 0x100000001b3ULL;
+  }
+
+  if (idx < bd->log_idx || hdr != bd->log_hdr || sum != bd->log_sum) {
+    rshim_log_restart(bd, hdr, sum);
+  } else if (bd->log_last) {
+    /* The last entry decoded must still be where it was. */
+    rc = bd->write_rshim(bd, RSHIM_CHANNEL, RSH_SCRATCH_BUF_CTL,
+                         (uint64_t)bd->log_last <<
+                         RSH_SCRATCH_BUF_CTL__IDX_SHIFT);
+    if (!rc)
+      rc = bd->read_rshim(bd, RSHIM_CHANNEL, RSH_SCRATCH_BUF_DAT, &data);
+    if (rc) {
+      RSHIM_ERR("couldn't read RSH_SCRATCH_BUF_DAT\n");
+      goto restore;
+    }
+    if (le64toh(data) != bd->log_last_hdr)
+      rshim_log_restart(bd, hdr, sum);
+  }
+  if (idx == bd->log_idx)
+    goto restore;
+
+  /* Continue from the first entry not decoded yet. */
+  i = bd->log_idx;
+  rc = bd->write_rshim(bd, RSHIM_CHANNEL, RSH_SCRATCH_BUF_CTL,
+                       (uint64_t)i << RSH_SCRATCH_BUF_CTL__IDX_SHIFT);
+  if (rc) {
+    RSHIM_ERR("couldn't write RSH_SCRATCH_BUF_CTL\n");
+    goto restore;
+  }
 
-  i = 0;
   while (i < idx) {
     rc = bd->read_rshim(bd, RSHIM_CHANNEL, RSH_SCRATCH_BUF_DAT, &hdr);
     if (rc) {
       RSHIM_ERR("couldn't read RSH_SCRATCH_BUF_DAT\n");
-      goto done;
+      goto restore;
     }
     hdr = le64toh(hdr);
     type = BF_RSH_LOG_HEADER_GET(TYPE, hdr);
     len = BF_RSH_LOG_HEADER_GET(LEN, hdr);
+    start = i;
     i += 1 + len;
-    /* Ignore if wraparounded. */
+    /* Ignore if wraparounded, or retry next time if still being written. */
     if (i > idx)
       break;
 
+    n = 0;
     switch (type) {
     case BF_RSH_LOG_TYPE_PANIC:
     case BF_RSH_LOG_TYPE_EXCEPTION:
-      n = rshim_log_show_crash(bd, hdr, p, size);
-      p += n;
-      size -= n;
+      n = rshim_log_show_crash(bd, hdr, text, sizeof(text));
       break;
     case BF_RSH_LOG_TYPE_MSG:
-      n = rshim_log_show_msg(bd, hdr, p, size);
-      p += n;
-      size -= n;
+      n = rshim_log_show_msg(bd, hdr, text, sizeof(text));
       break;
     default:
       /* Drain this message. */
@@ -372,8 +498,13 @@ int rshim_log_show(rshim_backend_t *bd, char *buf, int size)
         bd->read_rshim(bd, RSHIM_CHANNEL, RSH_SCRATCH_BUF_DAT, &data);
       break;
     }
+    rshim_log_append(bd, text, MIN(n, (int)sizeof(text) - 1));
+    bd->log_idx = i;
+    bd->log_last = start;
+    bd->log_last_hdr = hdr;
   }
 
+restore:
   /* Restore the idx value. */
   bd->write_rshim(bd, RSHIM_CHANNEL, RSH_SCRATCH_BUF_CTL, idx);
 
@@ -381,5 +512,137 @@ done:
   /* Release the semaphore. */
   bd->write_rshim(bd, RSHIM_CHANNEL, RSH_SEMAPHORE0, 0);
 
+  return rc;
+}
+
+int rshim_log_show(rshim_backend_t *bd, char *buf, int size)
+{
+  char *p = buf;
+  int n;
+
+  n = snprintf(p, size, "---------------------------------------\n");
+  p += n;
+  size -= n;
+  n = snprintf(p, size, "             Log Messages\n");
+  p += n;
+  size -= n;
+  n = snprintf(p, size, "---------------------------------------\n");
+  p += n;
+  size -= n;
+
+  rshim_log_update(bd);
+
+  n = MIN(bd->log_len, size - 1);
+  if (n > 0) {
+    rshim_log_copy(bd, p, 0, n);
+    p += n;
+  }
+  *p = '\0';
+
   return p - buf;
 }
+
+/*
+ * Read the log from the cursor of an open log node. Without new text the
+ * cache is refreshed every LOG_POLL_INTERVAL, blocking until something
+ * shows up unless 'nonblock' is set. Return the number of bytes copied or
+ * a negative errno.
+ */
+ssize_t rshim_log_read(rshim_backend_t *bd, char *buf, size_t count,
+                       rshim_log_cursor_t *cur, bool nonblock)
+{
+  uint64_t now, due, oldest, wait;
+  struct timespec ts;
+  ssize_t n;
+  int rc;
+
+  pthread_mutex_lock(&bd->mutex);
+
+  while (true) {
+    if (!bd->registered || bd->log_closing) {
+      n = -ENODEV;
+      break;
+    }
+
+    now = rshim_get_time_ns();
+    due = bd->log_poll_ns + (uint64_t)bd->log_poll_interval * 1000000;
+    if (cur->gen != bd->log_gen || cur->pos >= bd->log_total) {
+      if (now >= due) {
+        rc = rshim_log_update(bd);
+        if (rc) {
+          n = rc;
+          break;
+        }
+        due = bd->log_poll_ns + (uint64_t)bd->log_poll_interval * 1000000;
+      }
+    }
+
+    /* Start over if the log was restarted on the device side. */
+    if (cur->gen != bd->log_gen) {
+      cur->gen = bd->log_gen;
+      cur->pos = 0;
+    }
+
+    /* Skip the text dropped from the cache meanwhile. */
+    oldest = bd->log_total - bd->log_len;
+    if (cur->pos < oldest)
+      cur->pos = oldest;
+
+    if (cur->pos < bd->log_total) {
+      n = MIN(count, (size_t)(bd->log_total - cur->pos));
+      rshim_log_copy(bd, buf, cur->pos - oldest, n);
+      cur->pos += n;
+      break;
+    }
+
+    if (nonblock) {
+      n = -EAGAIN;
+      break;
+    }
+
+    /* Sleep until the next refresh, or until the device goes away. */
+    now = rshim_get_time_ns();
+    if (due > now) {
+      clock_gettime(CLOCK_REALTIME, &ts);
+      wait = due - now;
+      ts.tv_sec += wait / 1000000000;
+      ts.tv_nsec += wait % 1000000000;
+      if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&bd->log_cond, &bd->mutex, &ts);
+    }
+
+#ifdef HAVE_RSHIM_FUSE
+    if (rshim_fuse_got_peer_signal() == 0) {
+      n = -EINTR;
+      break;
+    }
+#endif
+  }
+
+  pthread_mutex_unlock(&bd->mutex);
+
+  return n;
+}
+
+/*
+ * Wake up the log node readers and stop them from waiting again. They need
+ * the device mutex to return, so it mustn't be held while their threads
+ * are joined afterwards.
+ */
+void rshim_log_close(rshim_backend_t *bd)
+{
+  bd->log_closing = true;
+  pthread_cond_broadcast(&bd->log_cond);
+}
+
+void rshim_log_free(rshim_backend_t *bd)
+{
+  free(bd->log_buf);
+  bd->log_buf = NULL;
+  bd->log_len = 0;
+  bd->log_size = 0;
+  rshim_log_restart(bd, 0, 0);
+}
@@ -9,19 +9,27 @@
 #include <linux/if.h>
 #include <linux/if_arp.h>
 #include <linux/if_tun.h>
+#include <linux/virtio_net.h>
 #endif
 #ifdef __FreeBSD__
 #include <net/if.h>
 #include <net/if_tap.h>
 #endif
+#include <pthread.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/param.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "rshim.h"
 
 #define ETH_PKT_SIZE            1536 /* maximum non-jumbo ethernet frame size */
 
+/* Maximum size of a GSO frame from the tap interface with vnet header. */
+#define RSHIM_NET_GSO_BUF_SIZE  (65536 + 256)
+
 static uint8_t rshim_net_default_mac[6] = {0x00, 0x1A, 0xCA, 0xFF, 0xFF, 0x02};
 
 /* Set non-blocking. */
@@ -46,8 +54,11 @@ static int rshim_if_set_non_blocking(int fd)
 }
 
 #ifdef __linux__
-/* Open tun/tap interface. */
-static int rshim_if_open(char *ifname, int index)
+/*
+ * Open tun/tap interface. If 'vnet_hdr' is set, try to open it with the
+ * vnet header and TSO/checksum offloads, and clear it if not supported.
+ */
+static int rshim_if_open(char *ifname, int index, bool *vnet_hdr)
 {
   char cmd[128];
   struct ifreq ifr;
@@ -68,15 +79,32 @@ static int rshim_if_open(char *ifname, int index)
 
   memset(&ifr, 0, sizeof(ifr));
   ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+  if (*vnet_hdr)
+    ifr.ifr_flags |= IFF_VNET_HDR;
   snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
 
   rc = ioctl(fd, TUNSETIFF, (void *) &ifr);
+  if (rc < 0 && *vnet_hdr) {
+    RSHIM_WARN("%s: vnet header not supported\n", ifname);
+    *vnet_hdr = false;
+    ifr.ifr_flags &= ~IFF_VNET_HDR;
+    rc = ioctl(fd, TUNSETIFF, (void *) &ifr);
+  }
   if (rc < 0) {
     RSHIM_ERR("ioctl failed: errno=%d\n", errno);
     close(fd);
     return -1;
   }
 
+  /* Let the host hand over TSO frames and checksum-offloaded packets. */
+  if (*vnet_hdr) {
+    int hdr_size = sizeof(struct virtio_net_hdr);
+
+    if (ioctl(fd, TUNSETVNETHDRSZ, &hdr_size) < 0 ||
+        ioctl(fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6) < 0)
+      RSHIM_WARN("%s: failed to set offloads: %m\n", ifname);
+  }
+
   memcpy(ifr.ifr_hwaddr.sa_data, rshim_net_default_mac, 6);
   ifr.ifr_hwaddr.sa_family = ARPHRD_ETHER;
   ifr.ifr_hwaddr.sa_data[5] += index * 2;
@@ -108,12 +136,14 @@ static int rshim_if_open(char *ifname, int index)
   return fd;
 }
 #elif defined(__FreeBSD__)
-/* Open tun/tap interface. */
-static int rshim_if_open(char *ifname, int index)
+/* Open tun/tap interface. The vnet header is not supported. */
+static int rshim_if_open(char *ifname, int index, bool *vnet_hdr)
 {
   struct ifreq ifr;
   int s, fd;
 
+  *vnet_hdr = false;
+
   s = socket(AF_INET, SOCK_DGRAM, 0);
   if (s < 0) {
     RSHIM_ERR("socket failed: %m\n");
@@ -204,10 +234,234 @@ static int rshim_if_read(int fd, char *buf, size_t len)
   return read(fd, buf, len);
 }
 
-static int rshim_if_write(int fd, const char *buf, size_t len)
+static int rshim_net_rx_write(rshim_backend_t *bd, const struct iovec *iov,
+                              int cnt)
+{
+  if (bd->net_fd < 0)
+    return -1;
+
+#ifdef __linux__
+  /* Frames from the peer have no offload, so just add an empty header. */
+  if (bd->net_vnet_hdr) {
+    struct virtio_net_hdr vh;
+    struct iovec vec[3];
+    int i;
+
+    memset(&vh, 0, sizeof(vh));
+    vec[0].iov_base = &vh;
+    vec[0].iov_len = sizeof(vh);
+    for (i = 0; i < cnt && i < 2; i++)
+      vec[i + 1] = iov[i];
+    return writev(bd->net_fd, vec, i + 1);
+  }
+#endif
+
+  return writev(bd->net_fd, iov, cnt);
+}
+
+/*
+ * Write a frame from the peer to the tap. It's called without the device
+ * mutex, so the tap is kept open by net_lock against rshim_net_del().
+ */
+int rshim_net_rx_deliver(rshim_backend_t *bd, const struct iovec *iov,
+                         int cnt)
+{
+  int rc;
+
+  pthread_mutex_lock(&bd->net_lock);
+  rc = rshim_net_rx_write(bd, iov, cnt);
+  pthread_mutex_unlock(&bd->net_lock);
+
+  return rc;
+}
+
+static int rshim_if_write(rshim_backend_t *bd, const char *buf, size_t len)
+{
+  struct iovec iov;
+
+  iov.iov_base = (void *)buf;
+  iov.iov_len = len;
+  return rshim_net_rx_deliver(bd, &iov, 1);
+}
+
+#ifdef __linux__
+/* Add data to a 16-bit one's complement sum. */
+static uint32_t rshim_net_csum_add(const uint8_t *p, int len, uint32_t sum)
+{
+  while (len > 1) {
+    sum += (p[0] << 8) | p[1];
+    p += 2;
+    len -= 2;
+  }
+  if (len)
+    sum += p[0] << 8;
+
+  return sum;
+}
+
+/* Fold the sum, complement it and store it at 'p' in network order. */
+static void rshim_net_csum_store(uint8_t *p, uint32_t sum)
+{
+  uint16_t csum;
+
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  csum = ~sum;
+  if (!csum)
+    csum = 0xffff;
+  p[0] = csum >> 8;
+  p[1] = csum & 0xff;
+}
+
+/* Get the L3 header offset after the Ethernet and VLAN headers. */
+static int rshim_net_l3_offset(const uint8_t *frame, int len)
+{
+  int off = 12;
+  uint16_t type;
+
+  do {
+    if (off + 2 > len)
+      return -1;
+    type = (frame[off] << 8) | frame[off + 1];
+    off += 2;
+    if (type == 0x8100 || type == 0x88a8)
+      off += 2;
+  } while (type == 0x8100 || type == 0x88a8);
+
+  return off;
+}
+
+/*
+ * Build the next TCP segment of the pending GSO frame into 'buf', with
+ * the IP and TCP headers fixed up. Return the segment length, or 0 if
+ * the frame can't be segmented and is dropped.
+ */
+static int rshim_net_gso_next(rshim_backend_t *bd, uint8_t *buf, int size)
+{
+  struct virtio_net_hdr *vh = (struct virtio_net_hdr *)bd->net_gso_buf;
+  uint8_t *frame = bd->net_gso_buf + sizeof(*vh);
+  int l3, l4, hdr_len, seg_len, tcp_len, total = bd->net_gso_len;
+  int mss = vh->gso_size, off = bd->net_gso_off;
+  bool is_v6, first, last;
+  uint32_t seq, sum;
+  uint16_t id;
+
+  is_v6 = (vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) ==
+          VIRTIO_NET_HDR_GSO_TCPV6;
+  l3 = rshim_net_l3_offset(frame, total);
+  l4 = vh->csum_start;
+  if (l3 < 0 || l4 < l3 + (is_v6 ? 40 : 20) || l4 + 20 > total)
+    goto drop;
+  hdr_len = l4 + (frame[l4 + 12] >> 4) * 4;
+  if (!mss || hdr_len >= total || hdr_len + mss > size)
+    goto drop;
+
+  if (!off)
+    off = hdr_len;
+  seg_len = MIN(mss, total - off);
+  first = (off == hdr_len);
+  last = (off + seg_len >= total);
+
+  memcpy(buf, frame, hdr_len);
+  memcpy(buf + hdr_len, frame + off, seg_len);
+  tcp_len = hdr_len - l4 + seg_len;
+
+  /* IP header. */
+  if (!is_v6) {
+    *(uint16_t *)(buf + l3 + 2) = htons(hdr_len - l3 + seg_len);
+    id = ntohs(*(uint16_t *)(frame + l3 + 4)) + (off - hdr_len) / mss;
+    *(uint16_t *)(buf + l3 + 4) = htons(id);
+    buf[l3 + 10] = 0;
+    buf[l3 + 11] = 0;
+    rshim_net_csum_store(buf + l3 + 10,
+                         rshim_net_csum_add(buf + l3, (buf[l3] & 0xf) * 4, 0));
+    sum = rshim_net_csum_add(buf + l3 + 12, 8, 0);
+  } else {
+    *(uint16_t *)(buf + l3 + 4) = htons(hdr_len - l3 - 40 + seg_len);
+    sum = rshim_net_csum_add(buf + l3 + 8, 32, 0);
+  }
+
+  /* TCP header: sequence, flags (FIN/PSH on last, CWR on first only). */
+  seq = ntohl(*(uint32_t *)(frame + l4 + 4)) + (off - hdr_len);
+  *(uint32_t *)(buf + l4 + 4) = htonl(seq);
+  if (!last)
+    buf[l4 + 13] &= ~0x09;
+  if (!first)
+    buf[l4 + 13] &= ~0x80;
+
+  /* TCP checksum with the pseudo header. */
+  sum += IPPROTO_TCP + tcp_len;
+  buf[l4 + 16] = 0;
+  buf[l4 + 17] = 0;
+  rshim_net_csum_store(buf + l4 + 16, rshim_net_csum_add(buf + l4, tcp_len,
+                                                         sum));
+
+  bd->net_gso_off = off + seg_len;
+  if (last)
+    bd->net_gso_len = 0;
+  return hdr_len + seg_len;
+
+drop:
+  bd->net_gso_len = 0;
+  return 0;
+}
+
+/*
+ * Read the next frame to send from the tap interface with vnet header.
+ * GSO frames are segmented and checksums offloaded by the host are filled
+ * in, since the tmfifo peer can't take either of them.
+ */
+static int rshim_net_vnet_read(rshim_backend_t *bd, char *buf, int size)
 {
-  return write(fd, buf, len);
+  struct virtio_net_hdr *vh = (struct virtio_net_hdr *)bd->net_gso_buf;
+  uint8_t *frame = bd->net_gso_buf + sizeof(*vh);
+  int len;
+
+  for (;;) {
+    if (bd->net_gso_len) {
+      len = rshim_net_gso_next(bd, (uint8_t *)buf, size);
+      if (len > 0)
+        return len;
+      continue;
+    }
+
+    len = rshim_if_read(bd->net_fd, (char *)bd->net_gso_buf,
+                        RSHIM_NET_GSO_BUF_SIZE);
+    if (len <= 0)
+      return len;
+    len -= sizeof(*vh);
+    if (len <= 0)
+      continue;
+
+    switch (vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+    case VIRTIO_NET_HDR_GSO_NONE:
+      break;
+    case VIRTIO_NET_HDR_GSO_TCPV4:
+    case VIRTIO_NET_HDR_GSO_TCPV6:
+      bd->net_gso_len = len;
+      bd->net_gso_off = 0;
+      continue;
+    default:
+      RSHIM_DBG("drop gso type %d\n", vh->gso_type);
+      continue;
+    }
+
+    if (len > size)
+      continue;
+
+    /* The checksum field has the pseudo header sum already. */
+    if ((vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) &&
+        vh->csum_start + vh->csum_offset + 2 <= len) {
+      rshim_net_csum_store(frame + vh->csum_start + vh->csum_offset,
+                           rshim_net_csum_add(frame + vh->csum_start,
+                                              len - vh->csum_start, 0));
+    }
+
+    memcpy(buf, frame, len);
+    return len;
+  }
 }
+#endif
 
 #ifdef __linux__
 static void rshim_if_close(int fd)
@@ -262,44 +516,66 @@ int rshim_net_init(rshim_backend_t *bd)
 {
   struct epoll_event event;
   char ifname[IFNAMSIZ];
-  int rc, fd[2];
+  bool vnet_hdr;
+  int rc, fd;
 
   snprintf(ifname, sizeof(ifname), "tmfifo_net%d", bd->index);
-  bd->net_fd = rshim_if_open(ifname, bd->index);
+
+  /* Optional vnet header for TSO/checksum offloads from the host. */
+  vnet_hdr = rshim_cfg_get_int(bd, "NET_VNET_HDR", 0);
+  if (vnet_hdr && !bd->net_gso_buf) {
+    bd->net_gso_buf = malloc(RSHIM_NET_GSO_BUF_SIZE);
+    if (!bd->net_gso_buf)
+      vnet_hdr = false;
+  }
+
+  bd->net_fd = rshim_if_open(ifname, bd->index, &vnet_hdr);
 
   if (bd->net_fd < 0)
     return bd->net_fd;
 
+  bd->net_vnet_hdr = vnet_hdr;
+  bd->net_gso_len = 0;
+
   memset(&event, 0, sizeof(event));
 
-  event.data.fd = bd->net_fd;
+  bd->net_tx_ep.fd = bd->net_fd;
+  bd->net_tx_ep.kind = RSH_EPOLL_NET_TX;
+  bd->net_tx_ep.bd = bd;
+  event.data.ptr = &bd->net_tx_ep;
   event.events = EPOLLIN;
-  rc = epoll_ctl(rshim_epoll_fd, EPOLL_CTL_ADD, bd->net_fd, &event);
+  rc = epoll_ctl(bd->epoll_fd, EPOLL_CTL_ADD, bd->net_fd, &event);
   if (rc == -1) {
-    RSHIM_ERR("epoll_ctl failed: %d %d\n", rshim_epoll_fd, bd->net_fd);
+    RSHIM_ERR("epoll_ctl failed: %d %d\n", bd->epoll_fd, bd->net_fd);
     goto fail;
   }
 
-  rc = pipe(fd);
-  if (rc == -1) {
-    perror("Failed to create pipe %m");
+  fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd == -1) {
+    RSHIM_ERR("eventfd failed: %m\n");
+    rc = -1;
     goto fail;
   }
 
-  event.data.fd = fd[0];
+  bd->net_rx_ep.fd = fd;
+  bd->net_rx_ep.kind = RSH_EPOLL_NET_RX;
+  bd->net_rx_ep.bd = bd;
+  event.data.ptr = &bd->net_rx_ep;
   event.events = EPOLLIN;
-  rc = epoll_ctl(rshim_epoll_fd, EPOLL_CTL_ADD, fd[0], &event);
+  rc = epoll_ctl(bd->epoll_fd, EPOLL_CTL_ADD, fd, &event);
   if (rc == -1) {
-    RSHIM_ERR("epoll_ctl failed: %d %d\n", rshim_epoll_fd, fd[0]);
+    RSHIM_ERR("epoll_ctl failed: %d %d\n", bd->epoll_fd, fd);
+    close(fd);
     goto fail;
   }
-  bd->net_notify_fd[0] = fd[0];
-  bd->net_notify_fd[1] = fd[1];
+  bd->net_notify_fd = fd;
 
   return 0;
 fail:
+  pthread_mutex_lock(&bd->net_lock);
   rshim_if_close(bd->net_fd);
   bd->net_fd = -1;
+  pthread_mutex_unlock(&bd->net_lock);
   return rc;
 }
 
@@ -307,26 +583,57 @@ int rshim_net_del(rshim_backend_t *bd)
 {
   struct epoll_event event;
 
-  if (bd->net_notify_fd[0] >= 0) {
+  /* Wait for a frame being written to the tap. */
+  pthread_mutex_lock(&bd->net_lock);
+
+  if (bd->net_notify_fd >= 0) {
     memset(&event, 0, sizeof(event));
-    event.data.fd = bd->net_notify_fd[0];
-    epoll_ctl(rshim_epoll_fd, EPOLL_CTL_DEL, bd->net_notify_fd[0], &event);
-    close(bd->net_notify_fd[0]);
-    close(bd->net_notify_fd[1]);
-    bd->net_notify_fd[0] = -1;
-    bd->net_notify_fd[1] = -1;
+    epoll_ctl(bd->epoll_fd, EPOLL_CTL_DEL, bd->net_notify_fd, &event);
+    close(bd->net_notify_fd);
+    bd->net_notify_fd = -1;
   }
 
   if (bd->net_fd >= 0) {
     memset(&event, 0, sizeof(event));
-    event.data.fd = bd->net_fd;
-    epoll_ctl(rshim_epoll_fd, EPOLL_CTL_DEL, bd->net_fd, &event);
+    epoll_ctl(bd->epoll_fd, EPOLL_CTL_DEL, bd->net_fd, &event);
     rshim_if_close(bd->net_fd);
     bd->net_fd = -1;
   }
+
+  bd->net_vnet_hdr = false;
+  pthread_mutex_unlock(&bd->net_lock);
+
+  free(bd->net_gso_buf);
+  bd->net_gso_buf = NULL;
+  bd->net_gso_len = 0;
+
   return 0;
 }
 
+/* Set the MTU of the tmfifo_net interface. */
+int rshim_net_set_mtu(rshim_backend_t *bd, int mtu)
+{
+  struct ifreq ifr;
+  int s, rc = 0;
+
+  s = socket(AF_INET, SOCK_DGRAM, 0);
+  if (s < 0) {
+    RSHIM_ERR("socket failed: %m\n");
+    return -errno;
+  }
+
+  memset(&ifr, 0, sizeof(ifr));
+  snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "tmfifo_net%d", bd->index);
+  ifr.ifr_mtu = mtu;
+  if (ioctl(s, SIOCSIFMTU, &ifr) < 0) {
+    RSHIM_ERR("%s: failed to set mtu %d: %m\n", ifr.ifr_name, mtu);
+    rc = -errno;
+  }
+  close(s);
+
+  return rc;
+}
+
 void rshim_net_rx(rshim_backend_t *bd)
 {
   rshim_net_pkt_t *pkt = &bd->net_rx_pkt;
@@ -335,6 +642,10 @@ void rshim_net_rx(rshim_backend_t *bd)
   bd->net_rx_pending = false;
 
   for (;;) {
+    /* Complete frames go out straight from the FIFO. */
+    if (!bd->net_rx_busy && !rshim_fifo_net_rx(bd))
+      return;
+
     total_len = sizeof(pkt->hdr);
     while (bd->net_rx_len < total_len) {
       len = rshim_fifo_read(bd, (char *)pkt + bd->net_rx_len,
@@ -346,6 +657,25 @@ void rshim_net_rx(rshim_backend_t *bd)
     }
 
     total_len = ntohs(pkt->hdr.len) + sizeof(pkt->hdr);
+
+    /* Drop packets larger than the buffer. */
+    if (total_len > sizeof(*pkt)) {
+      while (bd->net_rx_len < total_len) {
+        len = rshim_fifo_read(bd, pkt->buf,
+                              MIN(total_len - bd->net_rx_len,
+                                  sizeof(pkt->buf)),
+                              TMFIFO_NET_CHAN, true);
+        if (len <= 0)
+          return;
+        bd->net_rx_len += len;
+      }
+      RSHIM_DBG("drop oversized packet %d\n", total_len);
+      pkt->hdr.len = 0;
+      bd->net_rx_len = 0;
+      bd->net_rx_busy = false;
+      continue;
+    }
+
     while (bd->net_rx_len < total_len) {
       len = rshim_fifo_read(bd, (char *)pkt + bd->net_rx_len,
                             total_len - bd->net_rx_len,
@@ -356,14 +686,31 @@ void rshim_net_rx(rshim_backend_t *bd)
     }
 
     if (pkt->hdr.len) {
-      rshim_if_write(bd->net_fd, pkt->buf, ntohs(pkt->hdr.len));
+      rshim_if_write(bd, pkt->buf, ntohs(pkt->hdr.len));
       pkt->hdr.len = 0;
     }
 
     bd->net_rx_len = 0;
+    bd->net_rx_busy = false;
   }
 }
 
+/* Whether a partially transferred frame needs polling to complete. */
+bool rshim_net_pending(rshim_backend_t *bd)
+{
+  rshim_net_pkt_t *pkt = &bd->net_tx_pkt;
+
+  if (pkt->hdr.len &&
+      bd->net_tx_len < sizeof(pkt->hdr) + ntohs(pkt->hdr.len))
+    return true;
+
+  /* Segments of a GSO frame still to be sent. */
+  if (bd->net_gso_len)
+    return true;
+
+  return bd->net_rx_len || bd->net_rx_busy;
+}
+
 void rshim_net_tx(rshim_backend_t *bd)
 {
   rshim_net_pkt_t *pkt = &bd->net_tx_pkt;
@@ -375,6 +722,11 @@ void rshim_net_tx(rshim_backend_t *bd)
       bd->net_tx_len = 0;
       pkt->hdr.len = 0;
 
+#ifdef __linux__
+      if (bd->net_vnet_hdr)
+        len = rshim_net_vnet_read(bd, pkt->buf, sizeof(pkt->buf));
+      else
+#endif
       len = rshim_if_read(bd->net_fd, pkt->buf, sizeof(pkt->buf));
       if (len <= 0)
         return;
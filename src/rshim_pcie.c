@@ -87,6 +87,9 @@ typedef struct {
   int pci_fd;
 } rshim_pcie_t;
 
+/* libpci isn't thread-safe, serialize its use from parallel probes. */
+static pthread_mutex_t rshim_pcie_pci_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static bool rshim_is_bluefield1(uint16_t device_id)
 {
   return (device_id == BLUEFIELD1_DEVICE_ID);
@@ -103,19 +106,18 @@ static bool rshim_is_bluefield2(uint16_t device_id)
 static int rshim_byte_acc_pending_wait(rshim_pcie_t *dev)
 {
   uint32_t read_value;
-  int retry = 0;
-  time_t t0, t1;
+  rshim_poll_t poll;
 
-  time(&t0);
-  do {
+  rshim_poll_init(&poll, RSHIM_LOCK_RETRY_TIME * 1000);
+  while (true) {
     read_value = readl(dev->rshim_regs +
                        (RSH_BYTE_ACC_CTL | (RSHIM_CHANNEL << 16)));
+    if (!(read_value & RSH_BYTE_ACC_PENDING))
+      break;
 
-    time(&t1);
-    if (difftime(t1, t0) > RSHIM_LOCK_RETRY_TIME)
+    if (rshim_poll_wait(&poll))
       return -ETIMEDOUT;
-
-  } while (read_value & RSH_BYTE_ACC_PENDING);
+  }
 
   return 0;
 }
@@ -124,17 +126,18 @@ static int rshim_byte_acc_pending_wait(rshim_pcie_t *dev)
 static int rshim_byte_acc_lock_acquire(rshim_pcie_t *dev)
 {
   uint32_t read_value;
-  int retry = 0;
-  time_t t0, t1;
-
-  do {
-    time(&t1);
-    if (difftime(t1, t0) > RSHIM_LOCK_RETRY_TIME)
-      return -ETIMEDOUT;
+  rshim_poll_t poll;
 
+  rshim_poll_init(&poll, RSHIM_LOCK_RETRY_TIME * 1000);
+  while (true) {
     read_value = readl(dev->rshim_regs +
                       (RSH_BYTE_ACC_INTERLOCK | (RSHIM_CHANNEL << 16)));
-  } while (!(read_value & 0x1));
+    if (read_value & 0x1)
+      break;
+
+    if (rshim_poll_wait(&poll))
+      return -ETIMEDOUT;
+  }
 
   return 0;
 }
@@ -313,6 +316,75 @@ rshim_pcie_write(rshim_backend_t *bd, int chan, int addr, uint64_t value)
   return rc;
 }
 
+/* Read a burst of words from the same RShim register. */
+static int __attribute__ ((noinline))
+rshim_pcie_read_burst(rshim_backend_t *bd, int chan, int addr,
+                      uint64_t *values, int n)
+{
+  rshim_pcie_t *dev = container_of(bd, rshim_pcie_t, bd);
+  int i, rc = 0;
+
+  if (!bd->has_rshim || !bd->has_tm)
+    return -ENODEV;
+
+  if (bd->drop_mode && !rshim_drop_mode_access(addr)) {
+    memset(values, 0, n * sizeof(*values));
+    return 0;
+  }
+
+  dev->write_count = 0;
+
+  for (i = 0; i < n; i++) {
+#ifndef __LP64__
+    rc = rshim_byte_acc_read(dev, RSH_CHANNEL_BASE(chan) + addr, &values[i]);
+    if (rc)
+      break;
+#else
+    values[i] = readq(dev->rshim_regs + (addr | (chan << 16)));
+#endif
+  }
+
+  return rc;
+}
+
+/* Write a burst of words to the same RShim register. */
+static int __attribute__ ((noinline))
+rshim_pcie_write_burst(rshim_backend_t *bd, int chan, int addr,
+                       const uint64_t *values, int n)
+{
+  rshim_pcie_t *dev = container_of(bd, rshim_pcie_t, bd);
+  bool is_bf1 = rshim_is_bluefield1(dev->pci_dev->device_id);
+  uint64_t result;
+  int i, rc = 0;
+
+  if (!bd->has_rshim || !bd->has_tm)
+    return -ENODEV;
+
+  if (bd->drop_mode && !rshim_drop_mode_access(addr))
+    return 0;
+
+  for (i = 0; i < n; i++) {
+    /* Drain the writes on BlueField-1, see rshim_pcie_write(). */
+    if (is_bf1) {
+      if (dev->write_count == 15) {
+        __sync_synchronize();
+        rshim_pcie_read(bd, chan, RSH_SCRATCHPAD, &result);
+      }
+      dev->write_count++;
+    }
+#ifndef __LP64__
+    rc = rshim_byte_acc_write(dev, RSH_CHANNEL_BASE(chan) + addr,
+                              le64toh(values[i]));
+    if (rc)
+      break;
+#else
+    writeq(le64toh(values[i]), dev->rshim_regs + (addr | (chan << 16)));
+#endif
+  }
+
+  return rc;
+}
+
 static void rshim_pcie_delete(rshim_backend_t *bd)
 {
   rshim_pcie_t *dev = container_of(bd, rshim_pcie_t, bd);
@@ -332,6 +404,39 @@ static int rshim_pcie_enable_device(rshim_backend_t *bd, bool enable)
   return rc;
 }
 
+#ifdef __linux__
+/* Look up the NUMA node and the local CPUs of the device in sysfs. */
+static void rshim_pcie_get_numa(struct pci_dev *pci_dev, rshim_backend_t *bd)
+{
+  char path[256], buf[RSHIM_CPULIST_LEN];
+  int node;
+
+  bd->has_numa = false;
+
+  snprintf(path, sizeof(path), "%s/%04x:%02x:%02x.%1u/numa_node",
+           SYS_BUS_PCI, pci_dev->domain, pci_dev->bus,
+           pci_dev->dev, pci_dev->func);
+  if (rshim_sysfs_read(path, buf, sizeof(buf)) <= 0)
+    return;
+
+  /* -1 on hosts without NUMA. */
+  node = atoi(buf);
+  if (node < 0)
+    return;
+
+  snprintf(path, sizeof(path), "%s/%04x:%02x:%02x.%1u/local_cpulist",
+           SYS_BUS_PCI, pci_dev->domain, pci_dev->bus,
+           pci_dev->dev, pci_dev->func);
+  free(bd->local_cpus);
+  bd->local_cpus = NULL;
+  if (rshim_sysfs_read(path, buf, sizeof(buf)) > 0)
+    bd->local_cpus = strdup(buf);
+
+  bd->numa_node = node;
+  bd->has_numa = true;
+}
+#endif
+
 /* Probe routine */
 static int rshim_pcie_probe(struct pci_dev *pci_dev)
 {
@@ -369,6 +474,8 @@ static int rshim_pcie_probe(struct pci_dev *pci_dev)
     strcpy(bd->dev_name, dev_name);
     bd->read_rshim = rshim_pcie_read;
     bd->write_rshim = rshim_pcie_write;
+    bd->read_rshim_burst = rshim_pcie_read_burst;
+    bd->write_rshim_burst = rshim_pcie_write_burst;
     bd->destroy = rshim_pcie_delete;
     bd->enable_device = rshim_pcie_enable_device;
     dev->write_count = 0;
@@ -385,7 +492,9 @@ static int rshim_pcie_probe(struct pci_dev *pci_dev)
     default:
       bd->ver_id = RSHIM_BLUEFIELD_1;
   }
+  pthread_mutex_lock(&rshim_pcie_pci_lock);
   bd->rev_id = pci_read_byte(pci_dev, PCI_REVISION_ID);
+  pthread_mutex_unlock(&rshim_pcie_pci_lock);
 
   /* Initialize object */
   dev->pci_dev = pci_dev;
@@ -421,6 +530,9 @@ static int rshim_pcie_probe(struct pci_dev *pci_dev)
     ret = -ENOMEM;
     goto rshim_map_failed;
   }
+
+  /* Place the buffers and the threads of the device next to it. */
+  rshim_pcie_get_numa(pci_dev, bd);
 #elif defined(__FreeBSD__)
   struct pci_bar_mmap pbm = {
     .pbm_sel.pc_func = pci_dev->func,
@@ -455,6 +567,24 @@ static int rshim_pcie_probe(struct pci_dev *pci_dev)
 #error "Platform not supported"
 #endif
 
+  /*
+   * Check the target without the global lock, which other devices probed
+   * in parallel need meanwhile. The backend isn't registered yet, so no one
+   * else uses it. The register accessors need has_rshim/has_tm for that.
+   */
+  if (!bd->registered) {
+    bd->has_rshim = 1;
+    bd->has_tm = 1;
+    rshim_unlock();
+    ret = rshim_access_check(bd);
+    rshim_lock();
+    if (ret) {
+      bd->has_rshim = 0;
+      bd->has_tm = 0;
+      goto rshim_map_failed;
+    }
+  }
+
   pthread_mutex_lock(&bd->mutex);
 
   /*
@@ -486,6 +616,11 @@ static int rshim_pcie_probe(struct pci_dev *pci_dev)
    return ret;
 }
 
+static int rshim_pcie_probe_dev(void *dev)
+{
+  return rshim_pcie_probe(dev);
+}
+
 int rshim_pcie_enable(void *dev, bool enable)
 {
 #ifdef __linux__
@@ -528,7 +663,8 @@ int rshim_pcie_init(void)
 {
   struct pci_access *pci;
   struct pci_dev *dev;
-  int rc;
+  void **devs = NULL, **p;
+  int rc, n = 0;
   bool dev_present = false;
 
   pci = pci_alloc();
@@ -552,10 +688,17 @@ int rshim_pcie_init(void)
     if (rc)
       continue;
 
-    rshim_pcie_probe(dev);
+    p = realloc(devs, (n + 1) * sizeof(*devs));
+    if (p) {
+      devs = p;
+      devs[n++] = dev;
+    }
     dev_present = true;
   }
 
+  rshim_probe_devices(rshim_pcie_probe_dev, devs, n);
+  free(devs);
+
   if (!dev_present)
 	  return -1;
 
@@ -6,6 +6,7 @@
 
 #include <sys/epoll.h>
 #include <sys/mman.h>
+#include <sys/param.h>
 #include <pci/pci.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
@@ -52,65 +53,80 @@ typedef struct {
 
   /* Keep track of number of 8-byte word writes */
   u8 write_count;
+
+  /* Hold TRIO_CR_GW_LOCK across boot FIFO bursts. */
+  bool gw_batch;
 } rshim_pcie_lf_t;
 
+/*
+ * libpci keeps the config space file of the last device accessed, serialize
+ * the config accesses of the devices, which can be probed in parallel.
+ */
+static pthread_mutex_t rshim_pcie_lf_pci_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* Mechanism to access the CR space using hidden PCI capabilities */
 static int pci_cap_read(struct pci_dev *pci_dev, int offset, uint32_t *result)
 {
   int rc;
 
+  pthread_mutex_lock(&rshim_pcie_lf_pci_lock);
+
   /*
    * Write target offset to MELLANOX_ADDR.
    * Set LSB to indicate a read operation.
    */
   rc = pci_write_long(pci_dev, MELLANOX_ADDR, offset | MELLANOX_CAP_READ);
-  if (rc < 0)
-    return rc;
+  if (rc >= 0) {
+    /* Read result from MELLANOX_DATA */
+    *result = pci_read_long(pci_dev, MELLANOX_DATA);
+    rc = 0;
+  }
 
-  /* Read result from MELLANOX_DATA */
-  *result = pci_read_long(pci_dev, MELLANOX_DATA);
+  pthread_mutex_unlock(&rshim_pcie_lf_pci_lock);
 
-  return 0;
+  return rc;
 }
 
 static int pci_cap_write(struct pci_dev *pci_dev, int offset, uint32_t value)
 {
   int rc;
 
+  pthread_mutex_lock(&rshim_pcie_lf_pci_lock);
+
   /* Write data to MELLANOX_DATA */
   rc = pci_write_long(pci_dev, MELLANOX_DATA, value);
-  if (rc < 0)
-    return rc;
 
   /*
    * Write target offset to MELLANOX_ADDR.
    * Leave LSB clear to indicate a write operation.
    */
-  rc = pci_write_long(pci_dev, MELLANOX_ADDR, offset);
-  if (rc < 0)
-    return rc;
+  if (rc >= 0)
+    rc = pci_write_long(pci_dev, MELLANOX_ADDR, offset);
 
-  return 0;
+  pthread_mutex_unlock(&rshim_pcie_lf_pci_lock);
+
+  return rc < 0 ? rc : 0;
 }
 
 /* Acquire and release the TRIO_CR_GW_LOCK. */
 static int trio_cr_gw_lock_acquire(struct pci_dev *pci_dev)
 {
   uint32_t read_value;
-  time_t t0, t1;
+  rshim_poll_t poll;
   int rc;
 
   /* Wait until TRIO_CR_GW_LOCK is free */
-  time(&t0);
-  do {
+  rshim_poll_init(&poll, RSHIM_LOCK_RETRY_TIME * 1000);
+  while (true) {
     rc = pci_cap_read(pci_dev, TRIO_CR_GW_LOCK, &read_value);
     if (rc)
       return rc;
+    if (!(read_value & TRIO_CR_GW_LOCK_ACQUIRED))
+      break;
 
-    time(&t1);
-    if (difftime(t1, t0) > RSHIM_LOCK_RETRY_TIME)
+    if (rshim_poll_wait(&poll))
       return -ETIMEDOUT;
-  } while (read_value & TRIO_CR_GW_LOCK_ACQUIRED);
+  }
 
   /* Acquire TRIO_CR_GW_LOCK */
   rc = pci_cap_write(pci_dev, TRIO_CR_GW_LOCK, TRIO_CR_GW_LOCK_ACQUIRED);
@@ -181,6 +197,35 @@ static int crspace_rsh_gw_read(struct pci_dev *pci_dev, int addr,
   return 0;
 }
 
+/* Write through the TRIO_CR_GATEWAY with TRIO_CR_GW_LOCK already held. */
+static int crspace_rsh_gw_write_locked(struct pci_dev *pci_dev, int addr,
+                                       uint32_t value)
+{
+  int rc;
+
+  /* Write 32-bit data to TRIO_CR_GW_DATA_LOWER */
+  rc = pci_cap_write(pci_dev, TRIO_CR_GW_DATA_LOWER, htonl(value));
+  if (rc)
+    return rc;
+
+  /* Write addr to TRIO_CR_GW_ADDR_LOWER */
+  rc = pci_cap_write(pci_dev, TRIO_CR_GW_ADDR_LOWER, addr);
+  if (rc)
+    return rc;
+
+  /* Set TRIO_CR_GW_WRITE_4BYTE */
+  rc = pci_cap_write(pci_dev, TRIO_CR_GW_CTL, TRIO_CR_GW_WRITE_4BYTE);
+  if (rc)
+    return rc;
+
+  /* Trigger CR gateway to write to RShim */
+  rc = pci_cap_write(pci_dev, TRIO_CR_GW_LOCK, TRIO_CR_GW_TRIGGER);
+  if (rc)
+    return rc;
+
+  return 0;
+}
+
 static int crspace_rsh_gw_write(struct pci_dev *pci_dev, int addr,
                                 uint32_t value)
 {
@@ -204,23 +249,7 @@ static int crspace_rsh_gw_write(struct pci_dev *pci_dev, int addr,
   if (rc)
     return rc;
 
-  /* Write 32-bit data to TRIO_CR_GW_DATA_LOWER */
-  rc = pci_cap_write(pci_dev, TRIO_CR_GW_DATA_LOWER, htonl(value));
-  if (rc)
-    return rc;
-
-  /* Write addr to TRIO_CR_GW_ADDR_LOWER */
-  rc = pci_cap_write(pci_dev, TRIO_CR_GW_ADDR_LOWER, addr);
-  if (rc)
-    return rc;
-
-  /* Set TRIO_CR_GW_WRITE_4BYTE */
-  rc = pci_cap_write(pci_dev, TRIO_CR_GW_CTL, TRIO_CR_GW_WRITE_4BYTE);
-  if (rc)
-    return rc;
-
-  /* Trigger CR gateway to write to RShim */
-  rc = pci_cap_write(pci_dev, TRIO_CR_GW_LOCK, TRIO_CR_GW_TRIGGER);
+  rc = crspace_rsh_gw_write_locked(pci_dev, addr, value);
   if (rc)
     return rc;
 
@@ -236,19 +265,20 @@ static int crspace_rsh_gw_write(struct pci_dev *pci_dev, int addr,
 static int rshim_byte_acc_pending_wait(struct pci_dev *pci_dev)
 {
   uint32_t read_value = 0;
-  time_t t0, t1;
+  rshim_poll_t poll;
   int rc;
 
-  time(&t0);
-  do {
+  rshim_poll_init(&poll, RSHIM_LOCK_RETRY_TIME * 1000);
+  while (true) {
     rc = crspace_rsh_gw_read(pci_dev, RSH_BYTE_ACC_CTL, &read_value);
     if (rc)
       return rc;
+    if (!(read_value & RSH_BYTE_ACC_PENDING))
+      break;
 
-    time(&t1);
-    if (difftime(t1, t0) > RSHIM_LOCK_RETRY_TIME)
+    if (rshim_poll_wait(&poll))
       return -ETIMEDOUT;
-  } while (read_value & RSH_BYTE_ACC_PENDING);
+  }
 
   return 0;
 }
@@ -257,20 +287,21 @@ static int rshim_byte_acc_pending_wait(struct pci_dev *pci_dev)
 static int rshim_byte_acc_lock_acquire(struct pci_dev *pci_dev)
 {
   uint32_t read_value = 0;
+  rshim_poll_t poll;
   int rc;
-  time_t t0, t1;
-
-  time(&t0);
-  do {
-    time(&t1);
-    if (difftime(t1, t0) > RSHIM_LOCK_RETRY_TIME)
-      return -ETIMEDOUT;
 
+  rshim_poll_init(&poll, RSHIM_LOCK_RETRY_TIME * 1000);
+  while (true) {
     rc = crspace_rsh_gw_read(pci_dev, RSH_BYTE_ACC_INTERLOCK,
                              &read_value);
     if (rc)
       return rc;
-  } while (!(read_value & 0x1));
+    if (read_value & 0x1)
+      break;
+
+    if (rshim_poll_wait(&poll))
+      return -ETIMEDOUT;
+  }
 
   return 0;
 }
@@ -420,6 +451,45 @@ static int rshim_boot_fifo_write(struct pci_dev *pci_dev, int addr,
   return 0;
 }
 
+/*
+ * Write a burst of words to the boot FIFO. On BlueField-1 every 4-byte
+ * write otherwise takes and drops the TRIO_CR_GW_LOCK, which is three of
+ * its seven config-space accesses; take it once for the whole burst.
+ */
+static int rshim_boot_fifo_write_burst(struct pci_dev *pci_dev, int addr,
+                                       const uint64_t *values, int n)
+{
+  uint64_t value;
+  int i, rc = 0;
+
+  if (pci_dev->device_id == BLUEFIELD2_DEVICE_ID) {
+    for (i = 0; i < n && !rc; i++)
+      rc = rshim_boot_fifo_write(pci_dev, addr, le64toh(values[i]));
+    return rc;
+  }
+
+  /* Acquire TRIO_CR_GW_LOCK */
+  rc = trio_cr_gw_lock_acquire(pci_dev);
+  if (rc)
+    return rc;
+
+  for (i = 0; i < n && !rc; i++) {
+    value = le64toh(values[i]);
+    rc = crspace_rsh_gw_write_locked(pci_dev, addr, (uint32_t)value);
+    if (!rc)
+      rc = crspace_rsh_gw_write_locked(pci_dev, addr,
+                                       (uint32_t)(value >> 32));
+  }
+
+  /* Release TRIO_CR_GW_LOCK, also on error so that it doesn't stay stuck. */
+  if (rc)
+    trio_cr_gw_lock_release(pci_dev);
+  else
+    rc = trio_cr_gw_lock_release(pci_dev);
+
+  return rc;
+}
+
 /* RShim read/write routines */
 static int __attribute__ ((noinline))
 rshim_pcie_read(struct rshim_backend *bd, int chan, int addr, uint64_t *result)
@@ -483,6 +553,95 @@ rshim_pcie_write(struct rshim_backend *bd, int chan, int addr, uint64_t value)
   return rc;
 }
 
+/* Read a burst of words from the same RShim register. */
+static int __attribute__ ((noinline))
+rshim_pcie_read_burst(struct rshim_backend *bd, int chan, int addr,
+                      uint64_t *values, int n)
+{
+  rshim_pcie_lf_t *dev = container_of(bd, rshim_pcie_lf_t, bd);
+  struct pci_dev *pci_dev = dev->pci_dev;
+  int i, rc = 0;
+
+  if (!bd->has_rshim || !bd->has_tm)
+    return -ENODEV;
+
+  if (bd->drop_mode && !rshim_drop_mode_access(addr)) {
+    memset(values, 0, n * sizeof(*values));
+    return 0;
+  }
+
+  dev->write_count = 0;
+
+  for (i = 0; i < n && !rc; i++)
+    rc = rshim_byte_acc_read(pci_dev, RSH_CHANNEL_BASE(chan) + addr,
+                             &values[i]);
+
+  return rc;
+}
+
+/* Write a burst of words to the same RShim register. */
+static int __attribute__ ((noinline))
+rshim_pcie_write_burst(struct rshim_backend *bd, int chan, int addr,
+                       const uint64_t *values, int n)
+{
+  rshim_pcie_lf_t *dev = container_of(bd, rshim_pcie_lf_t, bd);
+  struct pci_dev *pci_dev = dev->pci_dev;
+  bool is_boot_stream = (addr == RSH_BOOT_FIFO_DATA);
+  uint64_t result;
+  int i, m, rc = 0;
+
+  if (!bd->has_rshim || !bd->has_tm)
+    return -ENODEV;
+
+  if (bd->drop_mode && !rshim_drop_mode_access(addr))
+    return 0;
+
+  /*
+   * Push the boot stream in batches under one gateway lock. The batch
+   * stops at the BlueField-1 drain read, which needs the lock itself.
+   */
+  if (is_boot_stream && dev->gw_batch) {
+    while (n > 0 && !rc) {
+      m = n;
+      if (pci_dev->device_id == BLUEFIELD1_DEVICE_ID) {
+        if (dev->write_count >= 7) {
+          __sync_synchronize();
+          rshim_pcie_read(bd, chan, RSH_SCRATCHPAD, &result);
+        }
+        m = MIN(n, 7 - dev->write_count);
+        dev->write_count += m;
+      }
+
+      rc = rshim_boot_fifo_write_burst(pci_dev, RSH_CHANNEL_BASE(chan) + addr,
+                                       values, m);
+      values += m;
+      n -= m;
+    }
+
+    return rc;
+  }
+
+  for (i = 0; i < n && !rc; i++) {
+    /* Drain the writes on BlueField-1, see rshim_pcie_write(). */
+    if (pci_dev->device_id == BLUEFIELD1_DEVICE_ID) {
+      if (dev->write_count == 7) {
+        __sync_synchronize();
+        rshim_pcie_read(bd, chan, RSH_SCRATCHPAD, &result);
+      }
+      dev->write_count++;
+    }
+
+    if (is_boot_stream)
+      rc = rshim_boot_fifo_write(pci_dev, RSH_CHANNEL_BASE(chan) + addr,
+                                 le64toh(values[i]));
+    else
+      rc = rshim_byte_acc_write(pci_dev, RSH_CHANNEL_BASE(chan) + addr,
+                                le64toh(values[i]));
+  }
+
+  return rc;
+}
+
 static void rshim_pcie_delete(struct rshim_backend *bd)
 {
   rshim_pcie_lf_t *dev = container_of(bd, rshim_pcie_lf_t, bd);
@@ -534,6 +693,8 @@ static int rshim_pcie_probe(struct pci_dev *pci_dev)
     strcpy(bd->dev_name, dev_name);
     bd->read_rshim = rshim_pcie_read;
     bd->write_rshim = rshim_pcie_write;
+    bd->read_rshim_burst = rshim_pcie_read_burst;
+    bd->write_rshim_burst = rshim_pcie_write_burst;
     bd->destroy = rshim_pcie_delete;
     bd->enable_device = rshim_pcie_enable_device;
     dev->write_count = 0;
@@ -549,10 +710,31 @@ static int rshim_pcie_probe(struct pci_dev *pci_dev)
     default:
       bd->ver_id = RSHIM_BLUEFIELD_1;
   }
+  pthread_mutex_lock(&rshim_pcie_lf_pci_lock);
   bd->rev_id = pci_read_byte(pci_dev, PCI_REVISION_ID);
+  pthread_mutex_unlock(&rshim_pcie_lf_pci_lock);
 
   /* Initialize object */
   dev->pci_dev = pci_dev;
+  dev->gw_batch = rshim_cfg_get_int(bd, "PCIE_LF_GW_BATCH", 1);
+
+  /*
+   * Check the target without the global lock, which other devices probed
+   * in parallel need meanwhile. The backend isn't registered yet, so no one
+   * else uses it. The register accessors need has_rshim/has_tm for that.
+   */
+  if (!bd->registered) {
+    bd->has_rshim = 1;
+    bd->has_tm = 1;
+    rshim_unlock();
+    ret = rshim_access_check(bd);
+    rshim_lock();
+    if (ret) {
+      bd->has_rshim = 0;
+      bd->has_tm = 0;
+      goto rshim_map_failed;
+    }
+  }
 
   pthread_mutex_lock(&bd->mutex);
 
@@ -589,11 +771,17 @@ error:
    return ret;
 }
 
+static int rshim_pcie_probe_dev(void *dev)
+{
+  return rshim_pcie_probe(dev);
+}
+
 int rshim_pcie_lf_init(void)
 {
   struct pci_access *pci;
   struct pci_dev *dev;
-  int rc;
+  void **devs = NULL, **p;
+  int rc, n = 0;
   bool dev_present = false;
 
   pci = pci_alloc();
@@ -616,10 +804,17 @@ int rshim_pcie_lf_init(void)
     rc = rshim_pcie_enable(dev, true);
     if (rc)
       continue;
-    rshim_pcie_probe(dev);
+    p = realloc(devs, (n + 1) * sizeof(*devs));
+    if (p) {
+      devs = p;
+      devs[n++] = dev;
+    }
     dev_present = true;
   }
 
+  rshim_probe_devices(rshim_pcie_probe_dev, devs, n);
+  free(devs);
+
   if (!dev_present)
 	  return -1;
 
@@ -0,0 +1,811 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2019 Mellanox Technologies. All Rights Reserved.
+ *
+ */
+
+/*
+ * Simulated backend. The RShim registers, the TMFIFO in both directions,
+ * the boot FIFO and the scratch buffer log are emulated in memory, and a
+ * peer thread stands in for the target: it loops the console and network
+ * messages back to the host, answers the control messages and drains the
+ * boot FIFO. It's meant to measure the data paths without a BlueField.
+ */
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <time.h>
+
+#include "rshim.h"
+
+/* Number of simulated devices by default. */
+#define SIM_DEVICES           1
+
+/* TMFIFO depth in words of each direction. */
+#define SIM_FIFO_DEPTH        256
+#define SIM_FIFO_DEPTH_MIN    16
+#define SIM_FIFO_DEPTH_MAX    RSH_TM_HOST_TO_TILE_CTL__MAX_ENTRIES_RMASK
+
+/* Plain registers of the rshim channel. */
+#define SIM_REGS              (0x10000 / sizeof(uint64_t))
+
+/* Scratch buffer which holds the target log. */
+#define SIM_SCRATCH_SIZE      (RSH_SCRATCH_BUF_CTL__IDX_RMASK + 1)
+
+/* Memory words written via the indirect access widget. */
+#define SIM_MEM_WORDS         32
+
+/* Log message entry of level INFO, see rshim_log.c. */
+#define SIM_LOG_MSG(len)      ((0x04ULL << 56) | ((uint64_t)(len) << 48))
+
+/* Boot status bits of YU_BOOT, set once the firmware has booted. */
+#define SIM_YU_BOOT_DONE      (1 << 17)
+
+/* Peer-side buffering of the messages looped back, in words. */
+#define SIM_ECHO_WORDS        8192
+
+/* Peer poll period while the host side has data pending, in ns. */
+#define SIM_PEER_POLL_NS      1000000
+
+/* Default peer-side MAC address. */
+static const uint8_t rshim_sim_default_mac[6] = {
+  0x00, 0x1a, 0xca, 0xff, 0xff, 0x01
+};
+
+/* Word FIFO of the emulated device. */
+typedef struct {
+  uint64_t data[RSH_BOOT_FIFO_SIZE];
+  int head;
+  int cnt;
+  int depth;
+} rshim_sim_fifo_t;
+
+typedef struct {
+  /* RShim backend structure. */
+  rshim_backend_t bd;
+
+  /* Emulated device state. */
+  pthread_mutex_t lock;
+  uint64_t regs[SIM_REGS];
+  rshim_sim_fifo_t h2t;           /* Host to tile TMFIFO. */
+  rshim_sim_fifo_t t2h;           /* Tile to host TMFIFO. */
+  rshim_sim_fifo_t boot;          /* Boot FIFO. */
+  uint64_t scratch[SIM_SCRATCH_SIZE];
+  int scratch_idx;
+  uint64_t mem_addr[SIM_MEM_WORDS];
+  uint64_t mem_data[SIM_MEM_WORDS];
+  int mem_cnt;
+  uint64_t mem_acc_data;
+  uint64_t mem_acc_rsp_cnt;
+
+  /* Peer thread, woken up when the host fills or drains a FIFO. */
+  pthread_t peer_thread;
+  pthread_cond_t peer_cond;
+  bool peer_started;
+  volatile bool peer_run;
+
+  /* Peer state: messages being looped back and queued control replies. */
+  int msg_rem;                    /* Words left of the incoming message. */
+  bool msg_drop;                  /* Don't loop it back. */
+  uint64_t echo[SIM_ECHO_WORDS];  /* Messages to send back. */
+  int echo_head;
+  int echo_cnt;
+  int echo_rem;                   /* Words left of the outgoing message. */
+  uint64_t ctrl[8];
+  int ctrl_head;
+  int ctrl_cnt;
+  uint8_t peer_mac[6];
+  uint32_t peer_pxe_id;           /* In network order. */
+  uint16_t peer_vlan[2];          /* In network order. */
+  uint64_t boot_bytes;            /* Boot stream bytes received. */
+  uint64_t boot_drain_ns;
+
+  /* Configuration. */
+  uint32_t latency_ns;            /* Cost of each register word access. */
+  uint32_t boot_rate;             /* Boot FIFO drain rate in MB/s, or 0. */
+  bool loopback;                  /* Echo messages back, or drop them. */
+  bool input_events;              /* Notify input instead of being polled. */
+} rshim_sim_t;
+
+static void rshim_sim_fifo_reset(rshim_sim_fifo_t *fifo)
+{
+  fifo->head = 0;
+  fifo->cnt = 0;
+}
+
+static inline int rshim_sim_fifo_space(rshim_sim_fifo_t *fifo)
+{
+  return fifo->depth - fifo->cnt;
+}
+
+static inline void rshim_sim_fifo_push(rshim_sim_fifo_t *fifo, uint64_t value)
+{
+  fifo->data[(fifo->head + fifo->cnt) % fifo->depth] = value;
+  fifo->cnt++;
+}
+
+static inline uint64_t rshim_sim_fifo_pop(rshim_sim_fifo_t *fifo)
+{
+  uint64_t value = fifo->data[fifo->head];
+
+  fifo->head = (fifo->head + 1) % fifo->depth;
+  fifo->cnt--;
+  return value;
+}
+
+/* Burn the emulated access time, outside of the device lock. */
+static void rshim_sim_delay(rshim_sim_t *dev, int n)
+{
+  uint64_t ns = (uint64_t)dev->latency_ns * n, end;
+  struct timespec ts;
+
+  if (!ns)
+    return;
+
+  /* Sleep for long delays, spin for short ones to keep them accurate. */
+  if (ns >= 100000) {
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    nanosleep(&ts, NULL);
+    return;
+  }
+
+  end = rshim_get_time_ns() + ns;
+  while (rshim_get_time_ns() < end)
+    ;
+}
+
+/* Add a message to the target log, called with the lock held. */
+static void rshim_sim_log(rshim_sim_t *dev, const char *msg)
+{
+  int i, n, size = strlen(msg);
+  int len = (size + sizeof(uint64_t)) / sizeof(uint64_t);
+  uint64_t word;
+
+  if (dev->scratch_idx + 1 + len > SIM_SCRATCH_SIZE)
+    return;
+
+  dev->scratch[dev->scratch_idx++] = htole64(SIM_LOG_MSG(len));
+  for (i = 0; i < len; i++) {
+    word = 0;
+    n = size - i * (int)sizeof(word);
+    if (n > 0)
+      memcpy(&word, msg + i * sizeof(word), n < 8 ? n : 8);
+    dev->scratch[dev->scratch_idx++] = word;
+  }
+}
+
+/* Emulated SW reset. */
+static void rshim_sim_reset(rshim_sim_t *dev)
+{
+  rshim_sim_fifo_reset(&dev->h2t);
+  rshim_sim_fifo_reset(&dev->t2h);
+  rshim_sim_fifo_reset(&dev->boot);
+  dev->msg_rem = 0;
+  dev->echo_cnt = 0;
+  dev->echo_rem = 0;
+  dev->ctrl_cnt = 0;
+  dev->scratch_idx = 0;
+  dev->boot_bytes = 0;
+  rshim_sim_log(dev, "rshim sim: reset");
+  pthread_cond_signal(&dev->peer_cond);
+}
+
+/* Memory word behind the indirect access widget. */
+static uint64_t *rshim_sim_mem(rshim_sim_t *dev, uint64_t addr, bool alloc)
+{
+  int i;
+
+  for (i = 0; i < dev->mem_cnt; i++) {
+    if (dev->mem_addr[i] == addr)
+      return &dev->mem_data[i];
+  }
+
+  if (!alloc || dev->mem_cnt == SIM_MEM_WORDS)
+    return NULL;
+
+  dev->mem_addr[dev->mem_cnt] = addr;
+  dev->mem_data[dev->mem_cnt] = 0;
+  return &dev->mem_data[dev->mem_cnt++];
+}
+
+static void rshim_sim_mem_acc(rshim_sim_t *dev, uint64_t ctl)
+{
+  uint64_t addr, *mem;
+
+  if (!((ctl >> RSH_MEM_ACC_CTL__SEND_SHIFT) & RSH_MEM_ACC_CTL__SEND_RMASK))
+    return;
+
+  addr = (ctl >> RSH_MEM_ACC_CTL__ADDRESS_SHIFT) &
+         RSH_MEM_ACC_CTL__ADDRESS_RMASK;
+  if ((ctl >> RSH_MEM_ACC_CTL__WRITE_SHIFT) & RSH_MEM_ACC_CTL__WRITE_RMASK) {
+    mem = rshim_sim_mem(dev, addr, true);
+    if (mem)
+      *mem = dev->mem_acc_data;
+  } else if (addr == RSHIM_YU_BASE_ADDR + YU_BOOT) {
+    dev->mem_acc_data = SIM_YU_BOOT_DONE;
+  } else {
+    mem = rshim_sim_mem(dev, addr, false);
+    dev->mem_acc_data = mem ? *mem : 0;
+  }
+  dev->mem_acc_rsp_cnt++;
+}
+
+/* Register read, called with the lock held. */
+static uint64_t rshim_sim_reg_read(rshim_sim_t *dev, int addr)
+{
+  uint64_t *reg = &dev->regs[(addr & 0xffff) / sizeof(uint64_t)];
+  uint64_t value;
+
+  switch (addr) {
+  case RSH_TM_HOST_TO_TILE_CTL:
+    return (*reg & ~RSH_TM_HOST_TO_TILE_CTL__MAX_ENTRIES_MASK) |
+           ((uint64_t)dev->h2t.depth <<
+            RSH_TM_HOST_TO_TILE_CTL__MAX_ENTRIES_SHIFT);
+
+  case RSH_TM_HOST_TO_TILE_STS:
+    return dev->h2t.cnt;
+
+  case RSH_TM_TILE_TO_HOST_STS:
+    return dev->t2h.cnt;
+
+  case RSH_TM_TILE_TO_HOST_DATA:
+    if (!dev->t2h.cnt)
+      return 0;
+    value = rshim_sim_fifo_pop(&dev->t2h);
+    pthread_cond_signal(&dev->peer_cond);
+    return value;
+
+  case RSH_BOOT_FIFO_COUNT:
+    return dev->boot.cnt;
+
+  case RSH_SCRATCH_BUF_CTL:
+    return dev->scratch_idx;
+
+  case RSH_SCRATCH_BUF_DAT:
+    value = dev->scratch[dev->scratch_idx];
+    dev->scratch_idx = (dev->scratch_idx + 1) % SIM_SCRATCH_SIZE;
+    return value;
+
+  case RSH_SEMAPHORE0:
+    /* Reading takes the semaphore, it's free if 0 is returned. */
+    value = *reg;
+    *reg = 1;
+    return value;
+
+  case RSH_MEM_ACC_RSP_CNT:
+    return dev->mem_acc_rsp_cnt;
+
+  case RSH_MEM_ACC_DATA__FIRST_WORD:
+    return dev->mem_acc_data;
+
+  default:
+    return *reg;
+  }
+}
+
+/* Register write, called with the lock held. */
+static void rshim_sim_reg_write(rshim_sim_t *dev, int addr, uint64_t value)
+{
+  uint64_t *reg = &dev->regs[(addr & 0xffff) / sizeof(uint64_t)];
+  char msg[64];
+
+  switch (addr) {
+  case RSH_TM_HOST_TO_TILE_DATA:
+    /* Overflowing words are lost, as on the real FIFO. */
+    if (rshim_sim_fifo_space(&dev->h2t) > 0) {
+      rshim_sim_fifo_push(&dev->h2t, value);
+      pthread_cond_signal(&dev->peer_cond);
+    }
+    break;
+
+  case RSH_BOOT_FIFO_DATA:
+    if (!dev->boot_rate) {
+      dev->boot_bytes += sizeof(value);
+    } else if (rshim_sim_fifo_space(&dev->boot) > 0) {
+      rshim_sim_fifo_push(&dev->boot, value);
+      pthread_cond_signal(&dev->peer_cond);
+    }
+    break;
+
+  case RSH_BOOT_CONTROL:
+    /* Leaving the rshim boot mode completes the boot. */
+    if (*reg == RSH_BOOT_CONTROL__BOOT_MODE_VAL_NONE &&
+        value != RSH_BOOT_CONTROL__BOOT_MODE_VAL_NONE && dev->boot_bytes) {
+      snprintf(msg, sizeof(msg), "rshim sim: booted, %llu bytes",
+               (unsigned long long)dev->boot_bytes);
+      rshim_sim_log(dev, msg);
+      dev->boot_bytes = 0;
+    }
+    *reg = value;
+    break;
+
+  case RSH_SCRATCH_BUF_CTL:
+    dev->scratch_idx = (value >> RSH_SCRATCH_BUF_CTL__IDX_SHIFT) &
+                       RSH_SCRATCH_BUF_CTL__IDX_MASK;
+    break;
+
+  case RSH_SCRATCH_BUF_DAT:
+    dev->scratch[dev->scratch_idx] = value;
+    dev->scratch_idx = (dev->scratch_idx + 1) % SIM_SCRATCH_SIZE;
+    break;
+
+  case RSH_RESET_CONTROL:
+    if ((value & RSH_RESET_CONTROL__RESET_CHIP_MASK) ==
+        RSH_RESET_CONTROL__RESET_CHIP_VAL_KEY)
+      rshim_sim_reset(dev);
+    break;
+
+  case RSH_MEM_ACC_CTL:
+    rshim_sim_mem_acc(dev, value);
+    break;
+
+  case RSH_MEM_ACC_DATA__FIRST_WORD:
+    dev->mem_acc_data = value;
+    break;
+
+  default:
+    *reg = value;
+    break;
+  }
+}
+
+static int rshim_sim_read_rshim(rshim_backend_t *bd, int chan, int addr,
+                                uint64_t *value)
+{
+  rshim_sim_t *dev = container_of(bd, rshim_sim_t, bd);
+
+  if (!bd->has_rshim)
+    return -ENODEV;
+
+  rshim_sim_delay(dev, 1);
+
+  /* Only the rshim channel is emulated, others read as 0. */
+  pthread_mutex_lock(&dev->lock);
+  *value = chan == RSHIM_CHANNEL ? rshim_sim_reg_read(dev, addr) : 0;
+  pthread_mutex_unlock(&dev->lock);
+
+  return 0;
+}
+
+static int rshim_sim_write_rshim(rshim_backend_t *bd, int chan, int addr,
+                                 uint64_t value)
+{
+  rshim_sim_t *dev = container_of(bd, rshim_sim_t, bd);
+
+  if (!bd->has_rshim)
+    return -ENODEV;
+
+  rshim_sim_delay(dev, 1);
+
+  pthread_mutex_lock(&dev->lock);
+  if (chan == RSHIM_CHANNEL)
+    rshim_sim_reg_write(dev, addr, value);
+  pthread_mutex_unlock(&dev->lock);
+
+  return 0;
+}
+
+static int rshim_sim_read_burst(rshim_backend_t *bd, int chan, int addr,
+                                uint64_t *values, int n)
+{
+  rshim_sim_t *dev = container_of(bd, rshim_sim_t, bd);
+  int i;
+
+  if (!bd->has_rshim)
+    return -ENODEV;
+
+  rshim_sim_delay(dev, n);
+
+  pthread_mutex_lock(&dev->lock);
+  for (i = 0; i < n; i++)
+    values[i] = chan == RSHIM_CHANNEL ? rshim_sim_reg_read(dev, addr) : 0;
+  pthread_mutex_unlock(&dev->lock);
+
+  return 0;
+}
+
+static int rshim_sim_write_burst(rshim_backend_t *bd, int chan, int addr,
+                                 const uint64_t *values, int n)
+{
+  rshim_sim_t *dev = container_of(bd, rshim_sim_t, bd);
+  int i;
+
+  if (!bd->has_rshim)
+    return -ENODEV;
+
+  rshim_sim_delay(dev, n);
+
+  pthread_mutex_lock(&dev->lock);
+  for (i = 0; chan == RSHIM_CHANNEL && i < n; i++)
+    rshim_sim_reg_write(dev, addr, le64toh(values[i]));
+  pthread_mutex_unlock(&dev->lock);
+
+  return 0;
+}
+
+/* Queue a control message to the host, called with the lock held. */
+static void rshim_sim_peer_ctrl_reply(rshim_sim_t *dev,
+                                      rshim_tmfifo_msg_hdr_t *hdr)
+{
+  if (dev->ctrl_cnt == sizeof(dev->ctrl) / sizeof(dev->ctrl[0]))
+    return;
+
+  rshim_fifo_ctrl_update_checksum(hdr);
+  dev->ctrl[(dev->ctrl_head + dev->ctrl_cnt) % 8] = htole64(hdr->data);
+  dev->ctrl_cnt++;
+}
+
+/* Handle a control message from the host, called with the lock held. */
+static void rshim_sim_peer_ctrl(rshim_sim_t *dev, rshim_tmfifo_msg_hdr_t *hdr)
+{
+  rshim_tmfifo_msg_hdr_t reply;
+
+  switch (hdr->type) {
+  case TMFIFO_MSG_MAC_1:
+    memcpy(dev->peer_mac, hdr->mac, 3);
+    break;
+
+  case TMFIFO_MSG_MAC_2:
+    memcpy(dev->peer_mac + 3, hdr->mac, 3);
+    break;
+
+  case TMFIFO_MSG_VLAN_ID:
+    memcpy(dev->peer_vlan, hdr->vlan, sizeof(dev->peer_vlan));
+    break;
+
+  case TMFIFO_MSG_PXE_ID:
+    dev->peer_pxe_id = hdr->pxe_id;
+    break;
+
+  case TMFIFO_MSG_CTRL_REQ:
+    /* The PXE id goes last since it completes the response. */
+    reply.data = 0;
+    reply.type = TMFIFO_MSG_MAC_1;
+    memcpy(reply.mac, dev->peer_mac, 3);
+    rshim_sim_peer_ctrl_reply(dev, &reply);
+    reply.data = 0;
+    reply.type = TMFIFO_MSG_MAC_2;
+    memcpy(reply.mac, dev->peer_mac + 3, 3);
+    rshim_sim_peer_ctrl_reply(dev, &reply);
+    reply.data = 0;
+    reply.type = TMFIFO_MSG_VLAN_ID;
+    memcpy(reply.vlan, dev->peer_vlan, sizeof(reply.vlan));
+    rshim_sim_peer_ctrl_reply(dev, &reply);
+    /* Accept an MTU proposal up to the largest MTU. */
+    if (hdr->mtu) {
+      reply.data = 0;
+      reply.type = TMFIFO_MSG_MTU;
+      reply.mtu = htons(MIN(ntohs(hdr->mtu), RSHIM_NET_MTU_MAX));
+      rshim_sim_peer_ctrl_reply(dev, &reply);
+    }
+    reply.data = 0;
+    reply.type = TMFIFO_MSG_PXE_ID;
+    reply.pxe_id = dev->peer_pxe_id;
+    rshim_sim_peer_ctrl_reply(dev, &reply);
+    break;
+
+  default:
+    break;
+  }
+}
+
+/* Words of a message including the header and the padding. */
+static inline int rshim_sim_msg_words(rshim_tmfifo_msg_hdr_t *hdr)
+{
+  return 1 + (ntohs(hdr->len) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+}
+
+/*
+ * Move the host to tile FIFO into the echo queue, which stands for the
+ * buffers of the target, and send the queued messages back as far as the
+ * tile to host FIFO has room. The host FIFO is always drained since the
+ * host might be waiting for room in it instead of reading; messages that
+ * don't fit the echo queue are dropped as on a busy target. The control
+ * replies go out between messages. Called with the lock held; returns true
+ * if anything was sent to the host.
+ */
+static bool rshim_sim_peer_tmfifo(rshim_sim_t *dev)
+{
+  rshim_tmfifo_msg_hdr_t hdr;
+  bool sent = false;
+  uint64_t word;
+
+  while (dev->h2t.cnt) {
+    if (!dev->msg_rem) {
+      hdr.data = le64toh(dev->h2t.data[dev->h2t.head]);
+      if (hdr.type != VIRTIO_ID_CONSOLE && hdr.type != VIRTIO_ID_NET) {
+        rshim_sim_fifo_pop(&dev->h2t);
+        rshim_sim_peer_ctrl(dev, &hdr);
+        continue;
+      }
+
+      /* The empty sync packets aren't echoed. */
+      dev->msg_rem = rshim_sim_msg_words(&hdr);
+      dev->msg_drop = !dev->loopback || !hdr.len ||
+                      dev->echo_cnt + dev->msg_rem > SIM_ECHO_WORDS;
+    }
+
+    word = rshim_sim_fifo_pop(&dev->h2t);
+    if (!dev->msg_drop) {
+      dev->echo[(dev->echo_head + dev->echo_cnt) % SIM_ECHO_WORDS] = word;
+      dev->echo_cnt++;
+    }
+    dev->msg_rem--;
+  }
+
+  while (rshim_sim_fifo_space(&dev->t2h) > 0) {
+    if (!dev->echo_rem && dev->ctrl_cnt) {
+      rshim_sim_fifo_push(&dev->t2h, dev->ctrl[dev->ctrl_head]);
+      dev->ctrl_head = (dev->ctrl_head + 1) % 8;
+      dev->ctrl_cnt--;
+      sent = true;
+      continue;
+    }
+    if (!dev->echo_cnt)
+      break;
+
+    word = dev->echo[dev->echo_head];
+    if (!dev->echo_rem) {
+      hdr.data = le64toh(word);
+      dev->echo_rem = rshim_sim_msg_words(&hdr);
+    }
+    rshim_sim_fifo_push(&dev->t2h, word);
+    dev->echo_head = (dev->echo_head + 1) % SIM_ECHO_WORDS;
+    dev->echo_cnt--;
+    dev->echo_rem--;
+    sent = true;
+  }
+
+  return sent;
+}
+
+/*
+ * Drain the boot FIFO at the configured rate. Called with the lock held;
+ * returns true while there is boot data left.
+ */
+static bool rshim_sim_peer_boot(rshim_sim_t *dev)
+{
+  uint64_t now = rshim_get_time_ns(), words;
+
+  if (!dev->boot.cnt) {
+    dev->boot_drain_ns = now;
+    return false;
+  }
+
+  words = (now - dev->boot_drain_ns) * dev->boot_rate * 1024 * 1024 /
+          1000000000 / sizeof(uint64_t);
+  if (!words)
+    return true;
+
+  words = MIN(words, dev->boot.cnt);
+  dev->boot.head = (dev->boot.head + words) % dev->boot.depth;
+  dev->boot.cnt -= words;
+  dev->boot_bytes += words * sizeof(uint64_t);
+  dev->boot_drain_ns = now;
+
+  return dev->boot.cnt > 0;
+}
+
+/*
+ * Tell the host about new input, like the interrupt of the USB backend.
+ * The device mutex is only tried since its holder might be waiting for the
+ * peer to drain a FIFO; returns false if the host is to be kicked later.
+ */
+static bool rshim_sim_peer_notify(rshim_sim_t *dev)
+{
+  rshim_backend_t *bd = &dev->bd;
+
+  if (pthread_mutex_trylock(&bd->mutex))
+    return false;
+  if (bd->registered && bd->has_tm) {
+    pthread_mutex_lock(&bd->ringlock);
+    rshim_notify(bd, RSH_EVENT_FIFO_INPUT, 0);
+    pthread_mutex_unlock(&bd->ringlock);
+  }
+  pthread_mutex_unlock(&bd->mutex);
+
+  return true;
+}
+
+static void *rshim_sim_peer_thread(void *arg)
+{
+  rshim_sim_t *dev = arg;
+  bool boot, input, kick = false, notified;
+  struct timespec ts;
+  uint64_t ns;
+
+  pthread_mutex_lock(&dev->lock);
+  while (dev->peer_run) {
+    input = rshim_sim_peer_tmfifo(dev) || kick;
+    boot = rshim_sim_peer_boot(dev);
+    kick = false;
+
+    if (input && dev->input_events) {
+      pthread_mutex_unlock(&dev->lock);
+      notified = rshim_sim_peer_notify(dev);
+      pthread_mutex_lock(&dev->lock);
+      if (notified)
+        continue;
+      kick = true;
+    }
+
+    /* The host may have written more while the lock was dropped. */
+    if (dev->h2t.cnt)
+      continue;
+
+    /* Sleep until the host touches a FIFO, or poll while data is pending. */
+    if (!boot && !kick && !(dev->input_events && dev->t2h.cnt)) {
+      pthread_cond_wait(&dev->peer_cond, &dev->lock);
+      continue;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ns = ts.tv_nsec + (boot ? SIM_PEER_POLL_NS / 10 : SIM_PEER_POLL_NS);
+    ts.tv_sec += ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    pthread_cond_timedwait(&dev->peer_cond, &dev->lock, &ts);
+    kick = dev->t2h.cnt > 0;
+  }
+  pthread_mutex_unlock(&dev->lock);
+
+  return NULL;
+}
+
+static void rshim_sim_peer_stop(rshim_sim_t *dev)
+{
+  if (!dev->peer_started)
+    return;
+
+  pthread_mutex_lock(&dev->lock);
+  dev->peer_run = false;
+  pthread_cond_signal(&dev->peer_cond);
+  pthread_mutex_unlock(&dev->lock);
+
+  pthread_join(dev->peer_thread, NULL);
+  dev->peer_started = false;
+}
+
+static void rshim_sim_delete(rshim_backend_t *bd)
+{
+  rshim_sim_t *dev = container_of(bd, rshim_sim_t, bd);
+
+  rshim_sim_peer_stop(dev);
+  rshim_deregister(bd);
+  pthread_cond_destroy(&dev->peer_cond);
+  pthread_mutex_destroy(&dev->lock);
+  free(dev);
+}
+
+static void rshim_sim_setup(rshim_sim_t *dev)
+{
+  rshim_backend_t *bd = &dev->bd;
+  int depth;
+
+  depth = rshim_cfg_get_int(bd, "SIM_FIFO_DEPTH", SIM_FIFO_DEPTH);
+  depth = MAX(MIN(depth, SIM_FIFO_DEPTH_MAX), SIM_FIFO_DEPTH_MIN);
+  dev->h2t.depth = depth;
+  dev->t2h.depth = depth;
+  dev->boot.depth = RSH_BOOT_FIFO_SIZE;
+  dev->latency_ns = MAX(rshim_cfg_get_int(bd, "SIM_LATENCY_NS", 0), 0);
+  dev->boot_rate = MAX(rshim_cfg_get_int(bd, "SIM_BOOT_RATE", 0), 0);
+  dev->loopback = rshim_cfg_get_int(bd, "SIM_LOOPBACK", 1);
+  dev->input_events = rshim_cfg_get_int(bd, "SIM_INPUT_EVENTS", 1);
+  bd->has_input_events = dev->input_events;
+
+  memcpy(dev->peer_mac, rshim_sim_default_mac, sizeof(dev->peer_mac));
+  dev->regs[RSH_BOOT_CONTROL / sizeof(uint64_t)] =
+    RSH_BOOT_CONTROL__BOOT_MODE_VAL_EMMC;
+  rshim_sim_log(dev, "rshim sim: ready");
+}
+
+/* Probe routine */
+static int rshim_sim_probe(int index)
+{
+  char dev_name[RSHIM_DEV_NAME_LEN];
+  rshim_backend_t *bd;
+  rshim_sim_t *dev;
+  int ret;
+
+  snprintf(dev_name, sizeof(dev_name), "sim-%d", index);
+
+  if (!rshim_allow_device(dev_name))
+    return -EACCES;
+
+  RSHIM_INFO("Probing %s\n", dev_name);
+
+  rshim_lock();
+
+  bd = rshim_find_by_name(dev_name);
+  if (bd) {
+    RSHIM_INFO("found %s\n", dev_name);
+    dev = container_of(bd, rshim_sim_t, bd);
+  } else {
+    RSHIM_INFO("create rshim %s\n", dev_name);
+    dev = calloc(1, sizeof(*dev));
+    if (dev == NULL) {
+      ret = -ENOMEM;
+      goto error;
+    }
+
+    bd = &dev->bd;
+    strcpy(bd->dev_name, dev_name);
+    bd->read_rshim = rshim_sim_read_rshim;
+    bd->write_rshim = rshim_sim_write_rshim;
+    bd->read_rshim_burst = rshim_sim_read_burst;
+    bd->write_rshim_burst = rshim_sim_write_burst;
+    bd->destroy = rshim_sim_delete;
+    bd->has_fast_reset = 1;
+    bd->ver_id = RSHIM_BLUEFIELD_2;
+    bd->rev_id = 1;
+    pthread_mutex_init(&bd->mutex, NULL);
+    pthread_mutex_init(&dev->lock, NULL);
+    pthread_cond_init(&dev->peer_cond, NULL);
+    rshim_sim_setup(dev);
+  }
+
+  rshim_ref(bd);
+
+  pthread_mutex_lock(&bd->mutex);
+  bd->has_rshim = 1;
+  bd->has_tm = 1;
+  ret = rshim_register(bd);
+  if (ret) {
+    pthread_mutex_unlock(&bd->mutex);
+    goto register_failed;
+  }
+
+  /* Notify that the device is attached */
+  ret = rshim_notify(bd, RSH_EVENT_ATTACH, 0);
+  pthread_mutex_unlock(&bd->mutex);
+  if (ret)
+    goto register_failed;
+
+  /* The target side comes up once the host side is ready. */
+  if (!dev->peer_started) {
+    dev->peer_run = true;
+    ret = -pthread_create(&dev->peer_thread, NULL, rshim_sim_peer_thread, dev);
+    if (ret) {
+      RSHIM_ERR("%s: failed to create the peer thread\n", dev_name);
+      goto register_failed;
+    }
+    dev->peer_started = true;
+  }
+
+  rshim_unlock();
+  return 0;
+
+ register_failed:
+   rshim_deref(bd);
+ error:
+   rshim_unlock();
+   return ret;
+}
+
+static int rshim_sim_probe_dev(void *dev)
+{
+  return rshim_sim_probe((int)(intptr_t)dev);
+}
+
+int rshim_sim_init(void)
+{
+  void **devs;
+  int i, n;
+
+  n = MAX(rshim_cfg_get_int(NULL, "SIM_DEVICES", SIM_DEVICES), 0);
+  if (!n)
+    return -ENODEV;
+
+  devs = calloc(n, sizeof(*devs));
+  if (!devs)
+    return -ENOMEM;
+
+  for (i = 0; i < n; i++)
+    devs[i] = (void *)(intptr_t)i;
+
+  rshim_probe_devices(rshim_sim_probe_dev, devs, n);
+  free(devs);
+
+  return 0;
+}
@@ -0,0 +1,459 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2019 Mellanox Technologies. All Rights Reserved.
+ *
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "rshim.h"
+
+/* Default interval in seconds to rewrite the STATS_FILE. */
+#define RSHIM_STATS_INTERVAL  10
+
+/*
+ * Register accesses are counted only if asked for, as the wrappers add two
+ * clock reads and a few atomics to each one. The trace build records the
+ * register events in them, so it has them on by default.
+ */
+#ifdef HAVE_RSHIM_TRACE
+#define RSHIM_STATS_REG       1
+#else
+#define RSHIM_STATS_REG       0
+#endif
+
+/* Names of the stats counters, also used as the exported metric names. */
+static const char * const rshim_stats_names[RSH_STAT_NUM] = {
+  [RSH_STAT_REG_READS] = "reg_reads",
+  [RSH_STAT_REG_WRITES] = "reg_writes",
+  [RSH_STAT_REG_ERRORS] = "reg_errors",
+  [RSH_STAT_FIFO_FULL] = "fifo_full",
+  [RSH_STAT_DROPS] = "drops",
+  [RSH_STAT_CONS_RESETS] = "cons_resets",
+  [RSH_STAT_USB_READ_RETRIES] = "usb_read_retries",
+  [RSH_STAT_USB_WRITE_RETRIES] = "usb_write_retries",
+  [RSH_STAT_TIMEOUTS] = "timeouts",
+  [RSH_STAT_BOOT_BYTES] = "boot_bytes",
+};
+
+static const char * const rshim_stats_help[RSH_STAT_NUM] = {
+  [RSH_STAT_REG_READS] = "Register words read.",
+  [RSH_STAT_REG_WRITES] = "Register words written.",
+  [RSH_STAT_REG_ERRORS] = "Failed register accesses.",
+  [RSH_STAT_FIFO_FULL] = "Polls of a full FIFO while writing.",
+  [RSH_STAT_DROPS] = "Received packets dropped.",
+  [RSH_STAT_CONS_RESETS] = "Received packets dropped for a closed console.",
+  [RSH_STAT_USB_READ_RETRIES] = "USB read or interrupt urbs resubmitted.",
+  [RSH_STAT_USB_WRITE_RETRIES] = "USB write urbs resubmitted.",
+  [RSH_STAT_TIMEOUTS] = "FIFO or boot writes timed out.",
+  [RSH_STAT_BOOT_BYTES] = "Boot stream bytes written.",
+};
+
+static const char * const rshim_stats_chan[TMFIFO_MAX_CHAN] = {
+  [TMFIFO_CONS_CHAN] = "console",
+  [TMFIFO_NET_CHAN] = "net",
+};
+
+/* Add a latency sample. */
+void rshim_hist_add(rshim_hist_t *hist, uint64_t ns)
+{
+  uint64_t us = ns / 1000, max, old;
+  int i = 0;
+
+  while (us && i < RSH_HIST_BUCKETS - 1) {
+    us >>= 1;
+    i++;
+  }
+
+  __sync_fetch_and_add(&hist->bucket[i], 1);
+  __sync_fetch_and_add(&hist->count, 1);
+  __sync_fetch_and_add(&hist->sum_ns, ns);
+  /* Samples come from several threads; don't let a smaller one win. */
+  max = hist->max_ns;
+  while (ns > max) {
+    old = __sync_val_compare_and_swap(&hist->max_ns, max, ns);
+    if (old == max)
+      break;
+    max = old;
+  }
+}
+
+/* Upper bound in us of the bucket holding the given percentile. */
+static uint64_t rshim_hist_pct(rshim_hist_t *hist, int pct)
+{
+  uint64_t sum = 0, target = (hist->count * pct + 99) / 100;
+  int i;
+
+  if (!hist->count)
+    return 0;
+
+  for (i = 0; i < RSH_HIST_BUCKETS - 1; i++) {
+    sum += hist->bucket[i];
+    if (sum >= target)
+      break;
+  }
+
+  return 1ULL << i;
+}
+
+static void rshim_stats_reg_done(rshim_backend_t *bd, int stat, int n,
+                                 uint64_t start_ns, int rc)
+{
+  rshim_stats_add(bd, stat, n);
+  if (rc < 0)
+    rshim_stats_add(bd, RSH_STAT_REG_ERRORS, 1);
+  rshim_hist_add(&bd->stats.reg_lat, rshim_get_time_ns() - start_ns);
+}
+
+static int rshim_stats_read_rshim(rshim_backend_t *bd, int chan, int addr,
+                                  uint64_t *value)
+{
+  uint64_t start_ns = rshim_get_time_ns();
+  int rc;
+
+  rc = bd->stats.read_rshim(bd, chan, addr, value);
+  rshim_stats_reg_done(bd, RSH_STAT_REG_READS, 1, start_ns, rc);
+
+  return rc;
+}
+
+static int rshim_stats_write_rshim(rshim_backend_t *bd, int chan, int addr,
+                                   uint64_t value)
+{
+  uint64_t start_ns = rshim_get_time_ns();
+  int rc;
+
+  rc = bd->stats.write_rshim(bd, chan, addr, value);
+  rshim_stats_reg_done(bd, RSH_STAT_REG_WRITES, 1, start_ns, rc);
+
+  return rc;
+}
+
+static int rshim_stats_read_rshim_burst(rshim_backend_t *bd, int chan,
+                                        int addr, uint64_t *values, int n)
+{
+  uint64_t start_ns = rshim_get_time_ns();
+  int rc;
+
+  rc = bd->stats.read_rshim_burst(bd, chan, addr, values, n);
+  rshim_stats_reg_done(bd, RSH_STAT_REG_READS, n, start_ns, rc);
+  RSHIM_TRACE(bd, RSH_TRACE_REG_READ, chan, n);
+
+  return rc;
+}
+
+static int rshim_stats_write_rshim_burst(rshim_backend_t *bd, int chan,
+                                         int addr, const uint64_t *values,
+                                         int n)
+{
+  uint64_t start_ns = rshim_get_time_ns();
+  int rc;
+
+  rc = bd->stats.write_rshim_burst(bd, chan, addr, values, n);
+  rshim_stats_reg_done(bd, RSH_STAT_REG_WRITES, n, start_ns, rc);
+  RSHIM_TRACE(bd, RSH_TRACE_REG_WRITE, chan, n);
+
+  return rc;
+}
+
+/*
+ * Put the counting accessors in front of the backend ones if REG_STATS is
+ * set. Called once from rshim_register() before the default bursts are
+ * filled in, which go through the single accessors and are counted there.
+ */
+void rshim_stats_attach(rshim_backend_t *bd)
+{
+  rshim_stats_t *stats = &bd->stats;
+
+  if (stats->attached || !rshim_cfg_get_int(bd, "REG_STATS", RSHIM_STATS_REG))
+    return;
+
+  stats->read_rshim = bd->read_rshim;
+  bd->read_rshim = rshim_stats_read_rshim;
+  stats->write_rshim = bd->write_rshim;
+  bd->write_rshim = rshim_stats_write_rshim;
+
+  if (bd->read_rshim_burst) {
+    stats->read_rshim_burst = bd->read_rshim_burst;
+    bd->read_rshim_burst = rshim_stats_read_rshim_burst;
+  }
+  if (bd->write_rshim_burst) {
+    stats->write_rshim_burst = bd->write_rshim_burst;
+    bd->write_rshim_burst = rshim_stats_write_rshim_burst;
+  }
+
+  stats->attached = true;
+}
+
+/* Start a boot session, called when the boot device is opened. */
+void rshim_stats_boot_start(rshim_backend_t *bd)
+{
+  bd->stats.boot_bytes = 0;
+  bd->stats.boot_start_ns = rshim_get_time_ns();
+  bd->stats.boot_end_ns = bd->stats.boot_start_ns;
+}
+
+/* Account boot stream bytes, called with the mutex held. */
+void rshim_stats_boot(rshim_backend_t *bd, size_t bytes)
+{
+  rshim_stats_add(bd, RSH_STAT_BOOT_BYTES, bytes);
+  bd->stats.boot_bytes += bytes;
+  bd->stats.boot_end_ns = rshim_get_time_ns();
+}
+
+/* Boot rate of the last session in bytes per second. */
+static double rshim_stats_boot_rate(rshim_stats_t *stats)
+{
+  uint64_t ns = stats->boot_end_ns - stats->boot_start_ns;
+
+  return ns ? (double)stats->boot_bytes * 1000000000 / ns : 0;
+}
+
+static int rshim_stats_show_hist(char *buf, int size, const char *name,
+                                 rshim_hist_t *hist)
+{
+  return snprintf(buf, size,
+                  "%-16s%llu/%llu/%llu/%llu (us, avg/p50/p99/max of %llu)\n",
+                  name,
+                  (unsigned long long)(hist->count ?
+                    hist->sum_ns / hist->count / 1000 : 0),
+                  (unsigned long long)rshim_hist_pct(hist, 50),
+                  (unsigned long long)rshim_hist_pct(hist, 99),
+                  (unsigned long long)hist->max_ns / 1000,
+                  (unsigned long long)hist->count);
+}
+
+/* Display the counters in the misc output. */
+int rshim_stats_show(rshim_backend_t *bd, char *buf, int size)
+{
+  rshim_stats_t *stats = &bd->stats;
+  char *p = buf;
+  int i, n;
+
+  n = snprintf(p, size, "%-16s%llu/%llu/%llu (read/write/error)\n",
+               "REG_ACCESS",
+               (unsigned long long)stats->cnt[RSH_STAT_REG_READS],
+               (unsigned long long)stats->cnt[RSH_STAT_REG_WRITES],
+               (unsigned long long)stats->cnt[RSH_STAT_REG_ERRORS]);
+  p += n;
+  size -= n;
+
+  n = rshim_stats_show_hist(p, size, "REG_LATENCY", &stats->reg_lat);
+  p += n;
+  size -= n;
+
+  n = rshim_stats_show_hist(p, size, "WORK_LATENCY", &stats->work_lat);
+  p += n;
+  size -= n;
+
+  for (i = 0; i < TMFIFO_MAX_CHAN; i++) {
+    n = snprintf(p, size, "%-16s%llu/%llu tx, %llu/%llu rx (bytes/msgs)\n",
+                 i == TMFIFO_NET_CHAN ? "FIFO_NET" : "FIFO_CONSOLE",
+                 (unsigned long long)stats->tx_bytes[i],
+                 (unsigned long long)stats->tx_msgs[i],
+                 (unsigned long long)stats->rx_bytes[i],
+                 (unsigned long long)stats->rx_msgs[i]);
+    p += n;
+    size -= n;
+  }
+
+  n = snprintf(p, size, "%-16s%llu/%llu/%llu (full/drop/console reset)\n",
+               "FIFO_EVENTS",
+               (unsigned long long)stats->cnt[RSH_STAT_FIFO_FULL],
+               (unsigned long long)stats->cnt[RSH_STAT_DROPS],
+               (unsigned long long)stats->cnt[RSH_STAT_CONS_RESETS]);
+  p += n;
+  size -= n;
+
+  n = snprintf(p, size, "%-16s%llu/%llu/%llu (usb read/usb write/timeout)\n",
+               "RETRIES",
+               (unsigned long long)stats->cnt[RSH_STAT_USB_READ_RETRIES],
+               (unsigned long long)stats->cnt[RSH_STAT_USB_WRITE_RETRIES],
+               (unsigned long long)stats->cnt[RSH_STAT_TIMEOUTS]);
+  p += n;
+  size -= n;
+
+  n = snprintf(p, size, "%-16s%llu/%llu (bytes, total/last) at %.1f MB/s\n",
+               "BOOT_STATS",
+               (unsigned long long)stats->cnt[RSH_STAT_BOOT_BYTES],
+               (unsigned long long)stats->boot_bytes,
+               rshim_stats_boot_rate(stats) / (1024 * 1024));
+  p += n;
+
+  return p - buf;
+}
+
+static void rshim_stats_export_hist(FILE *fp, rshim_backend_t **list, int num,
+                                    const char *name, const char *help,
+                                    size_t offset)
+{
+  rshim_hist_t *hist;
+  uint64_t sum;
+  int i, j;
+
+  fprintf(fp, "# HELP rshim_%s_seconds %s\n", name, help);
+  fprintf(fp, "# TYPE rshim_%s_seconds histogram\n", name);
+  for (i = 0; i < num; i++) {
+    hist = (rshim_hist_t *)((char *)&list[i]->stats + offset);
+    for (j = 0, sum = 0; j < RSH_HIST_BUCKETS - 1; j++) {
+      sum += hist->bucket[j];
+      fprintf(fp, "rshim_%s_seconds_bucket{device=\"%s\",le=\"%g\"} %llu\n",
+              name, list[i]->dev_name, (double)(1ULL << j) / 1000000,
+              (unsigned long long)sum);
+    }
+    fprintf(fp, "rshim_%s_seconds_bucket{device=\"%s\",le=\"+Inf\"} %llu\n",
+            name, list[i]->dev_name, (unsigned long long)hist->count);
+    fprintf(fp, "rshim_%s_seconds_sum{device=\"%s\"} %.9f\n",
+            name, list[i]->dev_name, (double)hist->sum_ns / 1000000000);
+    fprintf(fp, "rshim_%s_seconds_count{device=\"%s\"} %llu\n",
+            name, list[i]->dev_name, (unsigned long long)hist->count);
+  }
+}
+
+static void rshim_stats_export_chan(FILE *fp, rshim_backend_t **list, int num,
+                                    const char *name, const char *help,
+                                    size_t offset)
+{
+  uint64_t *cnt;
+  int i, j;
+
+  fprintf(fp, "# HELP rshim_fifo_%s_total %s\n", name, help);
+  fprintf(fp, "# TYPE rshim_fifo_%s_total counter\n", name);
+  for (i = 0; i < num; i++) {
+    cnt = (uint64_t *)((char *)&list[i]->stats + offset);
+    for (j = 0; j < TMFIFO_MAX_CHAN; j++)
+      fprintf(fp, "rshim_fifo_%s_total{device=\"%s\",chan=\"%s\"} %llu\n",
+              name, list[i]->dev_name, rshim_stats_chan[j],
+              (unsigned long long)cnt[j]);
+  }
+}
+
+/*
+ * Write the counters of all devices in the Prometheus text format. The
+ * STATS_FILE directory may be writable by the exporter's user, so the
+ * temporary file is created exclusively by mkstemp() and made readable
+ * by others only once it is ours.
+ */
+static int rshim_stats_export(const char *path)
+{
+  rshim_backend_t **list;
+  char tmp[PATH_MAX];
+  FILE *fp;
+  int i, j, n, fd, rc = 0;
+
+  if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp))
+    return -ENAMETOOLONG;
+
+  n = rshim_devs_get(&list);
+  if (n < 0)
+    return n;
+
+  fd = mkstemp(tmp);
+  if (fd < 0) {
+    rc = -errno;
+    goto done;
+  }
+  if (fchmod(fd, 0644) == -1) {
+    rc = -errno;
+    close(fd);
+    unlink(tmp);
+    goto done;
+  }
+  fp = fdopen(fd, "w");
+  if (!fp) {
+    rc = -errno;
+    close(fd);
+    unlink(tmp);
+    goto done;
+  }
+
+  for (i = 0; i < RSH_STAT_NUM; i++) {
+    fprintf(fp, "# HELP rshim_%s_total %s\n", rshim_stats_names[i],
+            rshim_stats_help[i]);
+    fprintf(fp, "# TYPE rshim_%s_total counter\n", rshim_stats_names[i]);
+    for (j = 0; j < n; j++)
+      fprintf(fp, "rshim_%s_total{device=\"%s\"} %llu\n",
+              rshim_stats_names[i], list[j]->dev_name,
+              (unsigned long long)list[j]->stats.cnt[i]);
+  }
+
+  rshim_stats_export_chan(fp, list, n, "tx_bytes", "TMFIFO payload bytes sent.",
+                          offsetof(rshim_stats_t, tx_bytes));
+  rshim_stats_export_chan(fp, list, n, "tx_msgs", "TMFIFO messages sent.",
+                          offsetof(rshim_stats_t, tx_msgs));
+  rshim_stats_export_chan(fp, list, n, "rx_bytes",
+                          "TMFIFO payload bytes received.",
+                          offsetof(rshim_stats_t, rx_bytes));
+  rshim_stats_export_chan(fp, list, n, "rx_msgs", "TMFIFO messages received.",
+                          offsetof(rshim_stats_t, rx_msgs));
+
+  fprintf(fp, "# HELP rshim_boot_rate_bytes_per_second "
+          "Boot stream rate of the last boot.\n");
+  fprintf(fp, "# TYPE rshim_boot_rate_bytes_per_second gauge\n");
+  for (j = 0; j < n; j++)
+    fprintf(fp, "rshim_boot_rate_bytes_per_second{device=\"%s\"} %.0f\n",
+            list[j]->dev_name, rshim_stats_boot_rate(&list[j]->stats));
+
+  rshim_stats_export_hist(fp, list, n, "reg_latency",
+                          "Register access latency.",
+                          offsetof(rshim_stats_t, reg_lat));
+  rshim_stats_export_hist(fp, list, n, "work_latency",
+                          "Work handler wake-up to service latency.",
+                          offsetof(rshim_stats_t, work_lat));
+
+  if (fclose(fp) == EOF)
+    rc = -errno;
+  else if (rename(tmp, path) == -1)
+    rc = -errno;
+  if (rc)
+    unlink(tmp);
+
+done:
+  rshim_devs_put(list, n);
+  return rc;
+}
+
+static void *rshim_stats_thread(void *arg)
+{
+  const char *path = arg;
+  int interval, rc, last_rc = 0;
+
+  interval = MAX(rshim_cfg_get_int(NULL, "STATS_INTERVAL",
+                                   RSHIM_STATS_INTERVAL), 1);
+
+  while (true) {
+    rc = rshim_stats_export(path);
+    if (rc && rc != last_rc)
+      RSHIM_WARN("failed to write %s, err %d\n", path, rc);
+    last_rc = rc;
+    sleep(interval);
+  }
+
+  return NULL;
+}
+
+/* Start rewriting the STATS_FILE periodically, if configured. */
+void rshim_stats_init(void)
+{
+  const char *value = rshim_cfg_get(NULL, "STATS_FILE");
+  pthread_t thread;
+  char *path;
+
+  if (!value || !*value)
+    return;
+
+  path = strdup(value);
+  if (!path)
+    return;
+
+  if (pthread_create(&thread, NULL, rshim_stats_thread, path)) {
+    RSHIM_ERR("failed to create the stats thread\n");
+    free(path);
+    return;
+  }
+  pthread_detach(thread);
+}
@@ -0,0 +1,250 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2019 Mellanox Technologies. All Rights Reserved.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/param.h>
+#include <unistd.h>
+#include "rshim.h"
+
+/* Default file written on SIGUSR1. */
+#define RSHIM_TRACE_FILE  "/var/log/rshim.trace"
+
+/* Events shown in the misc output, which has room for a few only. */
+#define RSHIM_TRACE_SHOW  32
+
+static const char * const rshim_trace_names[RSH_TRACE_NUM] = {
+  [RSH_TRACE_REG_READ] = "reg_read",
+  [RSH_TRACE_REG_WRITE] = "reg_write",
+  [RSH_TRACE_FIFO_INPUT] = "fifo_input",
+  [RSH_TRACE_FIFO_READ] = "fifo_read",
+  [RSH_TRACE_FIFO_WRITE] = "fifo_write",
+  [RSH_TRACE_FIFO_OUTPUT] = "fifo_output",
+  [RSH_TRACE_WORK_SIGNAL] = "work_signal",
+  [RSH_TRACE_WORK_RUN] = "work_run",
+  [RSH_TRACE_URB_SUBMIT] = "urb_submit",
+  [RSH_TRACE_URB_DONE] = "urb_done",
+};
+
+static const char * const rshim_trace_urbs[] = {
+  [RSH_TRACE_URB_READ] = "read",
+  [RSH_TRACE_URB_INTR] = "intr",
+  [RSH_TRACE_URB_WRITE] = "write",
+  [RSH_TRACE_URB_BOOT] = "boot",
+};
+
+/* Dump request, written from the signal handler. */
+static int rshim_trace_fd = -1;
+static rshim_epoll_t rshim_trace_ep;
+
+/*
+ * Copy out record i of the ring. Fails if the record has not been written
+ * yet, or was overwritten before or while being copied.
+ */
+static bool rshim_trace_get(rshim_trace_t *trace, uint64_t i,
+                            rshim_trace_ev_t *out)
+{
+  rshim_trace_ev_t *ev = &trace->ev[i & (RSH_TRACE_SIZE - 1)];
+  uint32_t seq = (uint32_t)(i + 1);
+
+  if (__atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE) != seq)
+    return false;
+
+  out->ns = ev->ns;
+  out->event = ev->event;
+  out->a = ev->a;
+  out->b = ev->b;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+  return __atomic_load_n(&ev->seq, __ATOMIC_RELAXED) == seq &&
+         out->event < RSH_TRACE_NUM;
+}
+
+/* Format the arguments of an event. */
+static int rshim_trace_args(char *buf, int size, rshim_trace_ev_t *ev)
+{
+  const char *urb = ev->a < sizeof(rshim_trace_urbs) / sizeof(char *) ?
+                    rshim_trace_urbs[ev->a] : "?";
+
+  switch (ev->event) {
+  case RSH_TRACE_REG_READ:
+  case RSH_TRACE_REG_WRITE:
+    return snprintf(buf, size, "chan=%d words=%llu", ev->a,
+                    (unsigned long long)ev->b);
+
+  case RSH_TRACE_FIFO_INPUT:
+  case RSH_TRACE_FIFO_READ:
+  case RSH_TRACE_FIFO_WRITE:
+  case RSH_TRACE_FIFO_OUTPUT:
+    return snprintf(buf, size, "chan=%d head=%u tail=%u", ev->a,
+                    (uint32_t)(ev->b >> 32), (uint32_t)ev->b);
+
+  case RSH_TRACE_URB_SUBMIT:
+    return snprintf(buf, size, "type=%s len=%llu", urb,
+                    (unsigned long long)ev->b);
+
+  case RSH_TRACE_URB_DONE:
+    return snprintf(buf, size, "type=%s status=%d len=%u", urb,
+                    (int32_t)(ev->b >> 32), (uint32_t)ev->b);
+  }
+
+  if (size > 0)
+    *buf = 0;
+  return 0;
+}
+
+/* Show the last events of the device in the misc output. */
+int rshim_trace_show(rshim_backend_t *bd, char *buf, int size)
+{
+  uint64_t idx = __atomic_load_n(&bd->trace.idx, __ATOMIC_ACQUIRE), i, last;
+  rshim_trace_ev_t ev;
+  char args[64];
+  char *p = buf;
+  int n;
+
+  if (size <= 0)
+    return 0;
+
+  i = idx > RSHIM_TRACE_SHOW ? idx - RSHIM_TRACE_SHOW : 0;
+  last = 0;
+
+  n = snprintf(p, size, "%-16s%llu events, last %d (us, since previous)\n",
+               "TRACE", (unsigned long long)idx, (int)(idx - i));
+  p += n;
+  size -= n;
+
+  for (; i < idx && size > 0; i++) {
+    if (!rshim_trace_get(&bd->trace, i, &ev))
+      continue;
+    rshim_trace_args(args, sizeof(args), &ev);
+    n = snprintf(p, size, "%10.3f  %-12s%s\n",
+                 last ? (double)(ev.ns - last) / 1000 : 0.0,
+                 rshim_trace_names[ev.event], args);
+    if (n >= size)
+      break;
+    p += n;
+    size -= n;
+    last = ev.ns;
+  }
+
+  return p - buf;
+}
+
+static void rshim_trace_write(FILE *fp, rshim_backend_t *bd)
+{
+  uint64_t idx = __atomic_load_n(&bd->trace.idx, __ATOMIC_ACQUIRE), i;
+  rshim_trace_ev_t ev;
+  char args[64];
+
+  fprintf(fp, "# %s: %llu events\n", bd->dev_name, (unsigned long long)idx);
+
+  for (i = idx > RSH_TRACE_SIZE ? idx - RSH_TRACE_SIZE : 0; i < idx; i++) {
+    if (!rshim_trace_get(&bd->trace, i, &ev))
+      continue;
+    rshim_trace_args(args, sizeof(args), &ev);
+    fprintf(fp, "%llu.%09llu %s %-12s%s\n",
+            (unsigned long long)(ev.ns / 1000000000),
+            (unsigned long long)(ev.ns % 1000000000),
+            bd->dev_name, rshim_trace_names[ev.event], args);
+  }
+}
+
+/*
+ * Write the trace rings of all devices into the TRACE_FILE. The temporary
+ * file gets a new unique name, which mkstemp() creates exclusively, so a
+ * file or link someone else left under that name is never written through.
+ */
+void rshim_trace_dump(void)
+{
+  const char *path = rshim_cfg_get(NULL, "TRACE_FILE");
+  rshim_backend_t **list;
+  char tmp[PATH_MAX];
+  FILE *fp;
+  int i, n, fd, rc = 0;
+
+  if (!path || !*path)
+    path = RSHIM_TRACE_FILE;
+
+  if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp)) {
+    RSHIM_WARN("trace file name %s too long\n", path);
+    return;
+  }
+
+  n = rshim_devs_get(&list);
+  if (n < 0)
+    return;
+
+  fd = mkstemp(tmp);
+  if (fd < 0) {
+    rc = -errno;
+    goto done;
+  }
+  fp = fdopen(fd, "w");
+  if (!fp) {
+    rc = -errno;
+    close(fd);
+    unlink(tmp);
+    goto done;
+  }
+
+  for (i = 0; i < n; i++)
+    rshim_trace_write(fp, list[i]);
+
+  if (fclose(fp) == EOF)
+    rc = -errno;
+  else if (rename(tmp, path) == -1)
+    rc = -errno;
+  if (rc)
+    unlink(tmp);
+
+done:
+  rshim_devs_put(list, n);
+  if (rc)
+    RSHIM_WARN("failed to write %s, err %d\n", path, rc);
+  else
+    RSHIM_INFO("trace of %d device(s) written to %s\n", n, path);
+}
+
+/* Ask the main loop for a dump, safe to call from a signal handler. */
+void rshim_trace_signal(void)
+{
+  uint64_t one = 1;
+
+  if (rshim_trace_fd >= 0 && write(rshim_trace_fd, &one, sizeof(one)) < 0)
+    return;
+}
+
+/* Register the dump request fd in the main loop. */
+int rshim_trace_init(int epoll_fd)
+{
+  struct epoll_event event;
+  int rc;
+
+  rshim_trace_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (rshim_trace_fd < 0) {
+    rc = -errno;
+    RSHIM_ERR("eventfd failed: %m\n");
+    return rc;
+  }
+
+  memset(&event, 0, sizeof(event));
+  rshim_trace_ep.fd = rshim_trace_fd;
+  rshim_trace_ep.kind = RSH_EPOLL_TRACE;
+  rshim_trace_ep.bd = NULL;
+  event.data.ptr = &rshim_trace_ep;
+  event.events = EPOLLIN;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, rshim_trace_fd, &event) == -1) {
+    rc = -errno;
+    RSHIM_ERR("epoll_ctl failed: %m\n");
+    close(rshim_trace_fd);
+    rshim_trace_fd = -1;
+    return rc;
+  }
+
+  return 0;
+}
@@ -8,6 +8,7 @@
 #include <string.h>
 #include <poll.h>
 #include <sys/epoll.h>
+#include <sys/param.h>
 #include <pthread.h>
 
 #include "rshim.h"
@@ -21,6 +22,22 @@
 #define WRITE_RETRIES      5
 #define RSHIM_USB_TIMEOUT  20000
 
+/* Max number of bulk-in urbs kept queued in multi-read mode. */
+#define RSHIM_USB_MAX_READ_URBS  16
+
+/* Limits of the asynchronous boot stream. */
+#define RSHIM_USB_BOOT_ASYNC_MIN       (4 * 1024)
+#define RSHIM_USB_BOOT_ASYNC_MAX       (4 * 1024 * 1024)
+#define RSHIM_USB_BOOT_QUEUE_DEFAULT   4
+#define RSHIM_USB_MAX_BOOT_QUEUE       16
+
+/* States of the urbs in the read pool. */
+enum {
+  RSH_USB_URB_IDLE,               /* Free, to be submitted. */
+  RSH_USB_URB_BUSY,               /* Submitted. */
+  RSH_USB_URB_DONE                /* Completed, waiting to be consumed. */
+};
+
 /* Structure to hold all of our device specific stuff. */
 typedef struct {
   /* RShim backend structure. */
@@ -39,9 +56,39 @@ typedef struct {
   int read_or_intr_retries;
   int read_urb_is_intr;
 
-  /* Write urb and retries. */
-  struct libusb_transfer *write_urb;
-  int write_retries;
+  /*
+   * Pool of bulk-in urbs and buffers for multi-read mode. They are
+   * submitted and consumed in ring order, so data is fed to the FIFO
+   * layer in the order it came off the wire.
+   */
+  int read_urb_cnt;
+  int read_urb_size;
+  int read_urb_head;              /* Next one to consume. */
+  int read_urb_tail;              /* Next one to submit. */
+  struct libusb_transfer *read_urbs[RSHIM_USB_MAX_READ_URBS];
+  uint8_t *read_urb_bufs[RSHIM_USB_MAX_READ_URBS];
+  int read_urb_state[RSHIM_USB_MAX_READ_URBS];
+
+  /* Write urbs and retries, one per write buffer of the backend. */
+  struct libusb_transfer *write_urbs[RSHIM_MAX_WRITE_BUFS];
+  int write_retries[RSHIM_MAX_WRITE_BUFS];
+
+  /*
+   * Asynchronous boot stream. Boot data is gathered into large buffers
+   * which are queued on the boot endpoint in ring order; boot_fill is
+   * the one being filled. Protected by boot_lock.
+   */
+  pthread_mutex_t boot_lock;
+  pthread_cond_t boot_cond;
+  int boot_async_size;
+  int boot_queue_depth;
+  int boot_fill;
+  int boot_fill_len;
+  int boot_busy_cnt;
+  int boot_err;
+  struct libusb_transfer *boot_urbs[RSHIM_USB_MAX_BOOT_QUEUE];
+  uint8_t *boot_bufs[RSHIM_USB_MAX_BOOT_QUEUE];
+  bool boot_busy[RSHIM_USB_MAX_BOOT_QUEUE];
 
   /* The address of the boot FIFO endpoint. */
   uint8_t boot_fifo_ep;
@@ -57,16 +104,55 @@ static libusb_context *rshim_usb_ctx;
 static int rshim_usb_epoll_fd;
 static bool rshim_usb_need_probe;
 
+/*
+ * Devices which left, disconnected from the main loop rather than from the
+ * hotplug callback since that has to wait for their transfers to call back.
+ */
+#define RSHIM_USB_MAX_GONE 16
+static libusb_device *rshim_usb_gone[RSHIM_USB_MAX_GONE];
+static int rshim_usb_gone_cnt;
+
+/* Epoll handler records of the libusb fds. */
+#define RSHIM_USB_MAX_FDS 64
+static rshim_epoll_t rshim_usb_epoll[RSHIM_USB_MAX_FDS];
+
 static int rshim_usb_product_ids[] = {
   USB_BLUEFIELD_1_PRODUCT_ID,
   USB_BLUEFIELD_2_PRODUCT_ID
 };
 
+static void rshim_usb_read_pool_free(rshim_usb_t *dev)
+{
+  int i;
+
+  for (i = 0; i < RSHIM_USB_MAX_READ_URBS; i++) {
+    libusb_free_transfer(dev->read_urbs[i]);
+    dev->read_urbs[i] = NULL;
+    free(dev->read_urb_bufs[i]);
+    dev->read_urb_bufs[i] = NULL;
+  }
+  dev->read_urb_size = 0;
+}
+
+static void rshim_usb_boot_queue_free(rshim_usb_t *dev)
+{
+  int i;
+
+  for (i = 0; i < RSHIM_USB_MAX_BOOT_QUEUE; i++) {
+    libusb_free_transfer(dev->boot_urbs[i]);
+    dev->boot_urbs[i] = NULL;
+    free(dev->boot_bufs[i]);
+    dev->boot_bufs[i] = NULL;
+  }
+}
+
 static void rshim_usb_delete(rshim_backend_t *bd)
 {
   rshim_usb_t *dev = container_of(bd, rshim_usb_t, bd);
 
   rshim_deregister(bd);
+  rshim_usb_read_pool_free(dev);
+  rshim_usb_boot_queue_free(dev);
   RSHIM_INFO("rshim %s deleted\n", bd->dev_name);
   if (dev->handle) {
     libusb_close(dev->handle);
@@ -144,14 +230,258 @@ static int rshim_usb_write_rshim(rshim_backend_t *bd, int chan, int addr,
   return rc >= 0 ? (rc > sizeof(dev->ctrl_data) ? -EINVAL : -ENXIO) : rc;
 }
 
+/*
+ * Write a burst of words to the same register. Control transfers only carry
+ * one word each, but the boot FIFO data can be pushed via the bulk endpoint
+ * which is the same path used by rshim_usb_boot_write(). The words are
+ * already in the byte order of the stream, so they go out as they are.
+ */
+static int rshim_usb_write_rshim_burst(rshim_backend_t *bd, int chan, int addr,
+                                       const uint64_t *values, int n)
+{
+  rshim_usb_t *dev = container_of(bd, rshim_usb_t, bd);
+  int i, cnt, rc, transferred;
+
+  if (!bd->has_rshim)
+    return -ENODEV;
+
+  if (chan != RSHIM_CHANNEL || addr != RSH_BOOT_FIFO_DATA) {
+    for (i = 0; i < n; i++) {
+      rc = rshim_usb_write_rshim(bd, chan, addr, le64toh(values[i]));
+      if (rc)
+        return rc;
+    }
+    return 0;
+  }
+
+  while (n > 0) {
+    cnt = (n < RSH_BOOT_FIFO_SIZE) ? n : RSH_BOOT_FIFO_SIZE;
+    rc = libusb_bulk_transfer(dev->handle, dev->boot_fifo_ep,
+                              (unsigned char *)values, cnt * sizeof(*values),
+                              &transferred, RSHIM_USB_TIMEOUT);
+    if (rc)
+      return rc;
+    if (transferred != cnt * sizeof(*values))
+      return -ENXIO;
+
+    values += cnt;
+    n -= cnt;
+  }
+
+  return 0;
+}
+
+/* Trace a urb submission and its completion. */
+#define trace_urb_submit(bd, type, urb) \
+  RSHIM_TRACE(bd, RSH_TRACE_URB_SUBMIT, type, (urb)->length)
+#define trace_urb_done(bd, type, urb) \
+  RSHIM_TRACE(bd, RSH_TRACE_URB_DONE, type, \
+              ((uint64_t)(uint32_t)(urb)->status << 32) | \
+              (uint32_t)(urb)->actual_length)
+#define trace_urb_type(dev) \
+  ((dev)->read_urb_is_intr ? RSH_TRACE_URB_INTR : RSH_TRACE_URB_READ)
+
 /* Boot routines */
 
+static void rshim_usb_boot_write_callback(struct libusb_transfer *urb)
+{
+  rshim_usb_t *dev = urb->user_data;
+  int i;
+
+  trace_urb_done(&dev->bd, RSH_TRACE_URB_BOOT, urb);
+
+  pthread_mutex_lock(&dev->boot_lock);
+
+  for (i = 0; i < dev->boot_queue_depth; i++)
+    if (dev->boot_urbs[i] == urb)
+      break;
+
+  if (i < dev->boot_queue_depth && dev->boot_busy[i]) {
+    dev->boot_busy[i] = false;
+    dev->boot_busy_cnt--;
+  }
+
+  /* The first error is reported to the next write or flush. */
+  if ((urb->status != LIBUSB_TRANSFER_COMPLETED ||
+       urb->actual_length != urb->length) && !dev->boot_err) {
+    RSHIM_ERR("boot_write_callback: status %d, %d/%d bytes\n",
+              urb->status, urb->actual_length, urb->length);
+    dev->boot_err = urb->status == LIBUSB_TRANSFER_TIMED_OUT ?
+                    -ETIMEDOUT : -EIO;
+  }
+
+  pthread_cond_broadcast(&dev->boot_cond);
+  pthread_mutex_unlock(&dev->boot_lock);
+}
+
+/* Set up the boot queue on first use. Called with boot_lock held. */
+static int rshim_usb_boot_queue_init(rshim_usb_t *dev)
+{
+  rshim_backend_t *bd = &dev->bd;
+  int i, size, depth;
+
+  if (dev->boot_urbs[0])
+    return 0;
+  if (dev->boot_async_size < 0)
+    return -ENOTSUP;
+
+  size = rshim_cfg_get_int(bd, "USB_BOOT_ASYNC_SIZE", 0);
+  if (size <= 0) {
+    dev->boot_async_size = -1;
+    return -ENOTSUP;
+  }
+  size = MAX(size, RSHIM_USB_BOOT_ASYNC_MIN);
+  size = MIN(size, RSHIM_USB_BOOT_ASYNC_MAX) & ~(RSHIM_USB_BOOT_ASYNC_MIN - 1);
+
+  depth = rshim_cfg_get_int(bd, "USB_BOOT_QUEUE_DEPTH",
+                            RSHIM_USB_BOOT_QUEUE_DEFAULT);
+  depth = MAX(depth, 1);
+  depth = MIN(depth, RSHIM_USB_MAX_BOOT_QUEUE);
+
+  for (i = 0; i < depth; i++) {
+    dev->boot_urbs[i] = libusb_alloc_transfer(0);
+    dev->boot_bufs[i] = malloc(size);
+    if (!dev->boot_urbs[i] || !dev->boot_bufs[i]) {
+      RSHIM_ERR("can't allocate boot queue\n");
+      rshim_usb_boot_queue_free(dev);
+      return -ENOMEM;
+    }
+    dev->boot_busy[i] = false;
+  }
+
+  RSHIM_INFO("%s: async boot, %d x %d bytes\n", bd->dev_name, depth, size);
+  dev->boot_async_size = size;
+  dev->boot_queue_depth = depth;
+  dev->boot_fill = 0;
+  dev->boot_fill_len = 0;
+  dev->boot_busy_cnt = 0;
+  dev->boot_err = 0;
+
+  return 0;
+}
+
+/* Queue the buffer being filled. Called with boot_lock held. */
+static int rshim_usb_boot_submit(rshim_usb_t *dev)
+{
+  int i = dev->boot_fill, rc;
+  struct libusb_transfer *urb = dev->boot_urbs[i];
+
+  libusb_fill_bulk_transfer(urb, dev->handle, dev->boot_fifo_ep,
+                            dev->boot_bufs[i], dev->boot_fill_len,
+                            rshim_usb_boot_write_callback,
+                            dev, RSHIM_USB_TIMEOUT);
+  trace_urb_submit(&dev->bd, RSH_TRACE_URB_BOOT, urb);
+  rc = libusb_submit_transfer(urb);
+  if (rc) {
+    RSHIM_ERR("boot_write: failed to submit urb, error %d\n", rc);
+    return rc;
+  }
+
+  dev->boot_busy[i] = true;
+  dev->boot_busy_cnt++;
+  dev->boot_fill = (i + 1) % dev->boot_queue_depth;
+  dev->boot_fill_len = 0;
+
+  return 0;
+}
+
+/* Wait for the buffer to be filled to be free. Called with boot_lock held. */
+static int rshim_usb_boot_wait(rshim_usb_t *dev, bool all)
+{
+  struct timespec ts;
+
+  while (all ? dev->boot_busy_cnt : dev->boot_busy[dev->boot_fill]) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += RSHIM_USB_TIMEOUT / 1000;
+    if (pthread_cond_timedwait(&dev->boot_cond, &dev->boot_lock, &ts))
+      return -ETIMEDOUT;
+  }
+
+  return 0;
+}
+
+/*
+ * Gather boot data into the queue buffers and return as soon as it's been
+ * copied. Only waits when the whole queue is on the wire.
+ */
+static ssize_t rshim_usb_boot_write_async(rshim_usb_t *dev, const char *buf,
+                                          size_t count)
+{
+  size_t done = 0, n;
+  int rc = 0;
+
+  pthread_mutex_lock(&dev->boot_lock);
+
+  while (done < count) {
+    if (dev->boot_err) {
+      rc = dev->boot_err;
+      dev->boot_err = 0;
+      break;
+    }
+
+    if (dev->boot_busy[dev->boot_fill]) {
+      rc = rshim_usb_boot_wait(dev, false);
+      if (rc)
+        break;
+      continue;
+    }
+
+    n = MIN(count - done, (size_t)(dev->boot_async_size - dev->boot_fill_len));
+    memcpy(dev->boot_bufs[dev->boot_fill] + dev->boot_fill_len, buf + done, n);
+    dev->boot_fill_len += n;
+    done += n;
+
+    if (dev->boot_fill_len == dev->boot_async_size) {
+      rc = rshim_usb_boot_submit(dev);
+      if (rc)
+        break;
+    }
+  }
+
+  pthread_mutex_unlock(&dev->boot_lock);
+
+  /* A timeout with nothing copied is handled by rshim_boot_write(). */
+  if (done || rc == -ETIMEDOUT)
+    return done;
+  return rc;
+}
+
+static int rshim_usb_backend_flush(rshim_backend_t *bd, int devtype)
+{
+  rshim_usb_t *dev = container_of(bd, rshim_usb_t, bd);
+  int rc = 0;
+
+  if (devtype != RSH_DEV_TYPE_BOOT)
+    return 0;
+
+  pthread_mutex_lock(&dev->boot_lock);
+  if (dev->boot_urbs[0]) {
+    if (dev->boot_fill_len && !dev->boot_busy[dev->boot_fill])
+      rc = rshim_usb_boot_submit(dev);
+    if (!rc)
+      rc = rshim_usb_boot_wait(dev, true);
+    if (!rc)
+      rc = dev->boot_err;
+    dev->boot_fill_len = 0;
+    dev->boot_err = 0;
+  }
+  pthread_mutex_unlock(&dev->boot_lock);
+
+  return rc;
+}
+
 static ssize_t rshim_usb_boot_write(rshim_usb_t *dev, const char *buf,
                                     size_t count)
 {
   int transferred;
   int rc;
 
+  pthread_mutex_lock(&dev->boot_lock);
+  rc = rshim_usb_boot_queue_init(dev);
+  pthread_mutex_unlock(&dev->boot_lock);
+  if (!rc)
+    return rshim_usb_boot_write_async(dev, buf, count);
+
   rc = libusb_bulk_transfer(dev->handle,
                             dev->boot_fifo_ep,
                             (void *)buf, count,
@@ -175,6 +505,8 @@ static void rshim_usb_fifo_read_callback(struct libusb_transfer *urb)
             dev->read_urb_is_intr ? "interrupt" : "read",
             urb->status, urb->actual_length, (int)*dev->intr_buf);
 
+  trace_urb_done(bd, trace_urb_type(dev), urb);
+
   pthread_mutex_lock(&bd->ringlock);
 
   bd->spin_flags &= ~RSH_SFLG_READING;
@@ -192,6 +524,7 @@ static void rshim_usb_fifo_read_callback(struct libusb_transfer *urb)
       *dev->intr_buf = 0;
       bd->read_buf_bytes = urb->actual_length;
       bd->read_buf_next = 0;
+      bd->read_buf_gen++;
     }
 
     /* Process any data we got, and launch another I/O if needed. */
@@ -220,6 +553,8 @@ static void rshim_usb_fifo_read_callback(struct libusb_transfer *urb)
       int rc;
 
       dev->read_or_intr_retries++;
+      rshim_stats_add(bd, RSH_STAT_USB_READ_RETRIES, 1);
+      trace_urb_submit(bd, trace_urb_type(dev), urb);
       rc = libusb_submit_transfer(urb);
       if (rc) {
         RSHIM_DBG("fifo_read_callback: resubmitted urb but got error %d\n", rc);
@@ -254,14 +589,141 @@ static void rshim_usb_fifo_read_callback(struct libusb_transfer *urb)
   pthread_mutex_unlock(&bd->ringlock);
 }
 
-static void rshim_usb_fifo_read(rshim_usb_t *dev, char *buffer, size_t count)
+static void rshim_usb_fifo_read_multi_callback(struct libusb_transfer *urb)
+{
+  rshim_usb_t *dev = urb->user_data;
+  rshim_backend_t *bd = &dev->bd;
+  int i;
+
+  RSHIM_DBG("fifo_read_multi_callback: urb completed, status %d, "
+            "actual length %d\n", urb->status, urb->actual_length);
+
+  trace_urb_done(bd, RSH_TRACE_URB_READ, urb);
+
+  pthread_mutex_lock(&bd->ringlock);
+
+  for (i = 0; i < dev->read_urb_cnt; i++)
+    if (dev->read_urbs[i] == urb)
+      break;
+
+  /*
+   * Failed urbs are completed as empty instead of being retried in place,
+   * since a resubmitted urb would go behind the others in the queue. A
+   * timed-out one keeps what the device sent before the timeout.
+   */
+  if (urb->status != LIBUSB_TRANSFER_COMPLETED &&
+      urb->status != LIBUSB_TRANSFER_TIMED_OUT)
+    urb->actual_length = 0;
+  if (i < dev->read_urb_cnt)
+    dev->read_urb_state[i] = RSH_USB_URB_DONE;
+
+  switch (urb->status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    /* Process any data we got, and resubmit the consumed urbs. */
+    rshim_notify(bd, RSH_EVENT_FIFO_INPUT, 0);
+    break;
+
+  case LIBUSB_TRANSFER_NO_DEVICE:
+  case LIBUSB_TRANSFER_CANCELLED:
+    break;
+
+  case LIBUSB_TRANSFER_TIMED_OUT:
+    /* Consume whatever came in, then queue it again. */
+    rshim_notify(bd, RSH_EVENT_FIFO_INPUT, 0);
+    break;
+
+  default:
+    RSHIM_DBG("fifo_read_multi_callback: urb completed abnormally, "
+              "error %d\n", urb->status);
+    rshim_notify(bd, RSH_EVENT_FIFO_ERR,
+                 urb->status > 0 ? -urb->status : urb->status);
+    break;
+  }
+
+  pthread_mutex_unlock(&bd->ringlock);
+}
+
+/* Allocate the read pool with buffers of 'size' bytes. */
+static int rshim_usb_read_pool_alloc(rshim_usb_t *dev, int size)
+{
+  int i;
+
+  for (i = 0; i < dev->read_urb_cnt; i++) {
+    dev->read_urbs[i] = libusb_alloc_transfer(0);
+    dev->read_urb_bufs[i] = malloc(size);
+    if (!dev->read_urbs[i] || !dev->read_urb_bufs[i]) {
+      RSHIM_ERR("can't allocate read urbs\n");
+      rshim_usb_read_pool_free(dev);
+      return -ENOMEM;
+    }
+    dev->read_urb_state[i] = RSH_USB_URB_IDLE;
+  }
+
+  dev->read_urb_size = size;
+  dev->read_urb_head = dev->read_urb_tail = 0;
+
+  return 0;
+}
+
+/*
+ * Multi-read mode. Copy the oldest completed urb into 'buffer', then keep
+ * all the free urbs queued on the bulk-in endpoint. Called with ringlock
+ * held; returns the number of bytes copied.
+ */
+static ssize_t rshim_usb_fifo_read_multi(rshim_usb_t *dev, char *buffer,
+                                         size_t count)
+{
+  struct libusb_transfer *urb;
+  ssize_t len = 0;
+  int i, rc;
+
+  if (!dev->read_urb_size && rshim_usb_read_pool_alloc(dev, count))
+    return 0;
+
+  /* Consume in order, skipping urbs which completed empty. */
+  while (!len &&
+         dev->read_urb_state[dev->read_urb_head] == RSH_USB_URB_DONE) {
+    i = dev->read_urb_head;
+    urb = dev->read_urbs[i];
+    len = MIN((size_t)urb->actual_length, count);
+    if (len)
+      memcpy(buffer, dev->read_urb_bufs[i], len);
+    dev->read_urb_state[i] = RSH_USB_URB_IDLE;
+    dev->read_urb_head = (i + 1) % dev->read_urb_cnt;
+  }
+
+  while (dev->read_urb_state[dev->read_urb_tail] == RSH_USB_URB_IDLE) {
+    i = dev->read_urb_tail;
+    urb = dev->read_urbs[i];
+    libusb_fill_bulk_transfer(urb, dev->handle, dev->tm_fifo_in_ep,
+                              dev->read_urb_bufs[i], dev->read_urb_size,
+                              rshim_usb_fifo_read_multi_callback,
+                              dev, RSHIM_USB_TIMEOUT);
+    trace_urb_submit(&dev->bd, RSH_TRACE_URB_READ, urb);
+    rc = libusb_submit_transfer(urb);
+    if (rc) {
+      RSHIM_ERR("usb_fifo_read: failed to submit read urb, error %d\n", rc);
+      break;
+    }
+    dev->read_urb_state[i] = RSH_USB_URB_BUSY;
+    dev->read_urb_tail = (i + 1) % dev->read_urb_cnt;
+  }
+
+  return len;
+}
+
+static ssize_t rshim_usb_fifo_read(rshim_usb_t *dev, char *buffer,
+                                   size_t count)
 {
   rshim_backend_t *bd = &dev->bd;
   struct libusb_transfer *urb;
   int rc;
 
   if (!bd->has_rshim || !bd->has_tm || bd->drop_mode)
-    return;
+    return 0;
+
+  if (dev->read_urb_cnt > 1)
+    return rshim_usb_fifo_read_multi(dev, buffer, count);
 
   if ((int) *dev->intr_buf || bd->read_buf_bytes) {
     /* We're doing a read. */
@@ -277,6 +739,7 @@ static void rshim_usb_fifo_read(rshim_usb_t *dev, char *buffer, size_t count)
     dev->read_or_intr_retries = 0;
 
     /* Submit the urb. */
+    trace_urb_submit(bd, RSH_TRACE_URB_READ, urb);
     rc = libusb_submit_transfer(urb);
     if (rc) {
       dev->bd.spin_flags &= ~RSH_SFLG_READING;
@@ -305,6 +768,7 @@ static void rshim_usb_fifo_read(rshim_usb_t *dev, char *buffer, size_t count)
     dev->read_or_intr_retries = 0;
 
     /* Submit the urb */
+    trace_urb_submit(bd, RSH_TRACE_URB_INTR, urb);
     rc = libusb_submit_transfer(urb);
     if (rc) {
       dev->bd.spin_flags &= ~RSH_SFLG_READING;
@@ -312,19 +776,30 @@ static void rshim_usb_fifo_read(rshim_usb_t *dev, char *buffer, size_t count)
     }
     RSHIM_DBG("usb_fifo_read: submit interrupt urb\n");
   }
+
+  return 0;
 }
 
 static void rshim_usb_fifo_write_callback(struct libusb_transfer *urb)
 {
   rshim_usb_t *dev = urb->user_data;
   rshim_backend_t *bd = &dev->bd;
+  int i;
 
   RSHIM_DBG("usb_fifo_write_callback: urb completed, status %d, "
             "actual length %d, intr buf %d\n",
             urb->status, urb->actual_length, (int) *dev->intr_buf);
 
+  trace_urb_done(bd, RSH_TRACE_URB_WRITE, urb);
+
+  for (i = 0; i < RSHIM_MAX_WRITE_BUFS - 1; i++)
+    if (dev->write_urbs[i] == urb)
+      break;
+
   pthread_mutex_lock(&bd->ringlock);
 
+  if (bd->write_inflight > 0)
+    bd->write_inflight--;
   bd->spin_flags &= ~RSH_SFLG_WRITING;
 
   switch (urb->status) {
@@ -343,19 +818,26 @@ static void rshim_usb_fifo_write_callback(struct libusb_transfer *urb)
      */
     break;
 
+  case LIBUSB_TRANSFER_CANCELLED:
+    break;
+
   case LIBUSB_TRANSFER_TIMED_OUT:
   case LIBUSB_TRANSFER_STALL:
   case LIBUSB_TRANSFER_OVERFLOW:
-    if (dev->write_retries < WRITE_RETRIES && urb->actual_length == 0) {
+    if (dev->write_retries[i] < WRITE_RETRIES && urb->actual_length == 0 &&
+        bd->write_inflight <= 0) {
       /*
        * We got an error which could benefit from being retried.
-       * Just submit the same urb again.  Note that we don't
-       * handle partial writes; it's hard, and we haven't really
-       * seen them.
+       * Just submit the same urb again, unless other writes are
+       * queued behind it which it would then be reordered with.
+       * Note that we don't handle partial writes; it's hard, and
+       * we haven't really seen them.
        */
       int rc;
 
-      dev->write_retries++;
+      dev->write_retries[i]++;
+      rshim_stats_add(bd, RSH_STAT_USB_WRITE_RETRIES, 1);
+      trace_urb_submit(bd, RSH_TRACE_URB_WRITE, urb);
       rc = libusb_submit_transfer(urb);
       if (rc) {
         RSHIM_ERR("usb_fifo_write_callback: resubmitted urb but "
@@ -366,22 +848,30 @@ static void rshim_usb_fifo_write_callback(struct libusb_transfer *urb)
          */
         rshim_notify(bd, RSH_EVENT_FIFO_ERR, rc > 0 ? -rc : rc);
       } else {
-        bd->spin_flags |= RSH_SFLG_WRITING;
+        if (++bd->write_inflight >= bd->write_buf_cnt)
+          bd->spin_flags |= RSH_SFLG_WRITING;
       }
       break;
     }
-
-  case LIBUSB_TRANSFER_CANCELLED:
-    break;
+    /* Fall through. */
 
   default:
     /*
      * We got some error we don't know how to handle, or we got
      * too many errors.  Either way we don't retry any more,
-     * but we signal the error to upper layers.
+     * but we signal the error to upper layers.  The writes
+     * queued behind this one would leave a hole in the stream,
+     * so cancel them too.
      */
     RSHIM_ERR("usb_fifo_write_callback: urb completed abnormally %d\n",
               urb->status);
+    if (bd->write_inflight > 0) {
+      int j;
+
+      for (j = 0; j < bd->write_buf_cnt; j++)
+        if (dev->write_urbs[j] != urb)
+          libusb_cancel_transfer(dev->write_urbs[j]);
+    }
     rshim_notify(bd, RSH_EVENT_FIFO_ERR,
                  urb->status > 0 ? -urb->status : urb->status);
     break;
@@ -394,7 +884,7 @@ static int rshim_usb_fifo_write(rshim_usb_t *dev, const char *buffer,
                                 size_t count)
 {
   rshim_backend_t *bd = &dev->bd;
-  int rc;
+  int i, rc;
 
   if (!bd->has_rshim || !bd->has_tm)
     return -ENODEV;
@@ -405,22 +895,31 @@ static int rshim_usb_fifo_write(rshim_usb_t *dev, const char *buffer,
   if (count % 8)
     RSHIM_WARN("rshim write %d is not multiple of 8 bytes\n", (int)count);
 
+  /* Each write buffer has its own urb. */
+  for (i = 0; i < bd->write_buf_cnt - 1; i++)
+    if ((const char *)bd->write_bufs[i] == buffer)
+      break;
+
   /* Initialize the urb properly. */
-  libusb_fill_bulk_transfer(dev->write_urb,  dev->handle,
+  libusb_fill_bulk_transfer(dev->write_urbs[i],  dev->handle,
                             dev->tm_fifo_out_ep, (uint8_t *)buffer,
                             count, rshim_usb_fifo_write_callback,
                             dev, RSHIM_USB_TIMEOUT);
-  dev->write_retries = 0;
+  dev->write_retries[i] = 0;
 
   /* Send the data out the bulk port. */
-  rc = libusb_submit_transfer(dev->write_urb);
+  trace_urb_submit(bd, RSH_TRACE_URB_WRITE, dev->write_urbs[i]);
+  rc = libusb_submit_transfer(dev->write_urbs[i]);
   if (rc) {
-    bd->spin_flags &= ~RSH_SFLG_WRITING;
+    if (bd->write_inflight < bd->write_buf_cnt)
+      bd->spin_flags &= ~RSH_SFLG_WRITING;
     RSHIM_DBG("usb_fifo_write: failed submitting write urb, error %d\n", rc);
     return -1;
   }
 
-  bd->spin_flags |= RSH_SFLG_WRITING;
+  /* Stop the FIFO layer from filling more once all of them are queued. */
+  if (++bd->write_inflight >= bd->write_buf_cnt)
+    bd->spin_flags |= RSH_SFLG_WRITING;
   return 0;
 }
 
@@ -445,8 +944,7 @@ static ssize_t rshim_usb_backend_read(rshim_backend_t *bd, int devtype,
 
   switch (devtype) {
   case RSH_DEV_TYPE_TMFIFO:
-    rshim_usb_fifo_read(dev, buf, count);
-    return 0;
+    return rshim_usb_fifo_read(dev, buf, count);
 
   default:
     RSHIM_ERR("bad devtype %d\n", devtype);
@@ -476,13 +974,20 @@ static void rshim_usb_backend_cancel_req(rshim_backend_t *bd, int devtype,
                                          bool is_write)
 {
   rshim_usb_t *dev = container_of(bd, rshim_usb_t, bd);
+  int i;
 
   switch (devtype) {
   case RSH_DEV_TYPE_TMFIFO:
-    if (is_write)
-      libusb_cancel_transfer(dev->write_urb);
-    else
+    if (is_write) {
+      for (i = 0; i < bd->write_buf_cnt; i++)
+        libusb_cancel_transfer(dev->write_urbs[i]);
+    } else if (dev->read_urb_cnt > 1) {
+      for (i = 0; i < dev->read_urb_cnt; i++)
+        if (dev->read_urb_state[i] == RSH_USB_URB_BUSY)
+          libusb_cancel_transfer(dev->read_urbs[i]);
+    } else {
       libusb_cancel_transfer(dev->read_or_intr_urb);
+    }
     break;
 
   default:
@@ -588,11 +1093,26 @@ static int rshim_usb_probe_one(libusb_context *ctx, libusb_device *usb_dev,
     bd->read = rshim_usb_backend_read;
     bd->write = rshim_usb_backend_write;
     bd->cancel = rshim_usb_backend_cancel_req;
+    bd->flush = rshim_usb_backend_flush;
     bd->destroy = rshim_usb_delete;
     bd->read_rshim = rshim_usb_read_rshim;
     bd->write_rshim = rshim_usb_write_rshim;
+    bd->write_rshim_burst = rshim_usb_write_rshim_burst;
     bd->has_reprobe = 1;
+    bd->has_input_events = 1;
     pthread_mutex_init(&bd->mutex, NULL);
+    pthread_mutex_init(&dev->boot_lock, NULL);
+    pthread_cond_init(&dev->boot_cond, NULL);
+
+    /* Pipelined writes with several urbs in flight. */
+    bd->write_buf_cnt = rshim_cfg_get_int(bd, "USB_WRITE_URBS", 1);
+    if (bd->write_buf_cnt > RSHIM_MAX_WRITE_BUFS) {
+      RSHIM_WARN("USB_WRITE_URBS %d adjusted to %d\n", bd->write_buf_cnt,
+                 RSHIM_MAX_WRITE_BUFS);
+      bd->write_buf_cnt = RSHIM_MAX_WRITE_BUFS;
+    } else if (bd->write_buf_cnt < 1) {
+      bd->write_buf_cnt = 1;
+    }
   }
 
   rshim_ref(bd);
@@ -616,14 +1136,28 @@ static int rshim_usb_probe_one(libusb_context *ctx, libusb_device *usb_dev,
   if (!dev->read_or_intr_urb)
     dev->read_or_intr_urb = libusb_alloc_transfer(0);
 
-  if (!dev->write_urb)
-    dev->write_urb = libusb_alloc_transfer(0);
+  for (i = 0; i < bd->write_buf_cnt; i++) {
+    if (!dev->write_urbs[i])
+      dev->write_urbs[i] = libusb_alloc_transfer(0);
+    if (!dev->write_urbs[i])
+      break;
+  }
 
-  if (!dev->read_or_intr_urb || !dev->write_urb) {
+  if (!dev->read_or_intr_urb || i < bd->write_buf_cnt) {
     RSHIM_ERR("can't allocate buffers or urbs\n");
     goto error;
   }
 
+  /* Multi-read mode; the pool is allocated on the first read. */
+  if (!dev->read_urb_size) {
+    dev->read_urb_cnt = rshim_cfg_get_int(bd, "USB_READ_URBS", 1);
+    if (dev->read_urb_cnt > RSHIM_USB_MAX_READ_URBS) {
+      RSHIM_WARN("USB_READ_URBS %d adjusted to %d\n", dev->read_urb_cnt,
+                 RSHIM_USB_MAX_READ_URBS);
+      dev->read_urb_cnt = RSHIM_USB_MAX_READ_URBS;
+    }
+  }
+
   pthread_mutex_lock(&bd->mutex);
 
   for (i = 0; i < config->bNumInterfaces; i++) {
@@ -727,8 +1261,10 @@ error:
     libusb_free_transfer(dev->read_or_intr_urb);
     dev->read_or_intr_urb = NULL;
 
-    libusb_free_transfer(dev->write_urb);
-    dev->write_urb = NULL;
+    for (i = 0; i < RSHIM_MAX_WRITE_BUFS; i++) {
+      libusb_free_transfer(dev->write_urbs[i]);
+      dev->write_urbs[i] = NULL;
+    }
 
     free(dev->intr_buf);
     dev->intr_buf = NULL;
@@ -740,10 +1276,53 @@ error:
   return rc;
 }
 
-static void rshim_usb_disconnect(struct libusb_device *usb_dev)
+/* Check for transfers which haven't called back yet. */
+static bool rshim_usb_busy(rshim_usb_t *dev)
+{
+  rshim_backend_t *bd = &dev->bd;
+  bool busy;
+  int i;
+
+  pthread_mutex_lock(&bd->ringlock);
+  busy = bd->write_inflight > 0;
+  for (i = 0; i < dev->read_urb_cnt; i++)
+    if (dev->read_urbs[i] && dev->read_urb_state[i] == RSH_USB_URB_BUSY)
+      busy = true;
+  pthread_mutex_unlock(&bd->ringlock);
+
+  pthread_mutex_lock(&dev->boot_lock);
+  if (dev->boot_busy_cnt > 0)
+    busy = true;
+  pthread_mutex_unlock(&dev->boot_lock);
+
+  return busy;
+}
+
+/*
+ * Wait for the cancelled transfers to call back, so none of them completes
+ * into a closed handle or freed buffer. Handles the libusb events itself,
+ * thus can't be called from a libusb callback or with the locks the
+ * transfer callbacks take.
+ */
+static void rshim_usb_drain(rshim_usb_t *dev)
+{
+  struct timeval tv = {0, 100000};
+  int tries = RSHIM_USB_TIMEOUT / 100;
+
+  while (rshim_usb_busy(dev)) {
+    if (!tries--) {
+      RSHIM_WARN("%s: urbs not cancelled\n", dev->bd.dev_name);
+      break;
+    }
+    libusb_handle_events_timeout_completed(rshim_usb_ctx, &tv, NULL);
+  }
+}
+
+static void rshim_usb_disconnect(struct libusb_device *usb_dev, bool drain)
 {
   rshim_backend_t *bd;
   rshim_usb_t *dev;
+  int i;
 
   rshim_lock();
 
@@ -792,8 +1371,20 @@ static void rshim_usb_disconnect(struct libusb_device *usb_dev)
 
   libusb_cancel_transfer(dev->read_or_intr_urb);
   dev->read_or_intr_urb = NULL;
-  libusb_cancel_transfer(dev->write_urb);
-  dev->write_urb = NULL;
+  for (i = 0; i < dev->read_urb_cnt; i++)
+    if (dev->read_urbs[i] && dev->read_urb_state[i] == RSH_USB_URB_BUSY)
+      libusb_cancel_transfer(dev->read_urbs[i]);
+  for (i = 0; i < RSHIM_MAX_WRITE_BUFS; i++) {
+    if (dev->write_urbs[i])
+      libusb_cancel_transfer(dev->write_urbs[i]);
+    dev->write_urbs[i] = NULL;
+  }
+
+  pthread_mutex_lock(&dev->boot_lock);
+  for (i = 0; i < dev->boot_queue_depth; i++)
+    if (dev->boot_busy[i])
+      libusb_cancel_transfer(dev->boot_urbs[i]);
+  pthread_mutex_unlock(&dev->boot_lock);
 
   free(dev->intr_buf);
   dev->intr_buf = NULL;
@@ -805,15 +1396,72 @@ static void rshim_usb_disconnect(struct libusb_device *usb_dev)
 
   pthread_mutex_unlock(&bd->mutex);
 
+  if (drain)
+    rshim_usb_drain(dev);
+
   if (dev->handle) {
     libusb_close(dev->handle);
     dev->handle = NULL;
   }
 
+  /*
+   * Whatever is still queued was detached from the handle by libusb and
+   * won't call back, so the read ring can start over on the next probe.
+   */
+  pthread_mutex_lock(&bd->ringlock);
+  for (i = 0; i < dev->read_urb_cnt; i++)
+    dev->read_urb_state[i] = RSH_USB_URB_IDLE;
+  dev->read_urb_head = dev->read_urb_tail = 0;
+  bd->write_inflight = 0;
+  bd->spin_flags &= ~RSH_SFLG_WRITING;
+  pthread_mutex_unlock(&bd->ringlock);
+
+  pthread_mutex_lock(&dev->boot_lock);
+  for (i = 0; i < dev->boot_queue_depth; i++)
+    dev->boot_busy[i] = false;
+  dev->boot_busy_cnt = 0;
+  dev->boot_fill_len = 0;
+  pthread_mutex_unlock(&dev->boot_lock);
+
   rshim_deref(bd);
   rshim_unlock();
 }
 
+/* Get the epoll record of a libusb fd, or a free one. */
+static rshim_epoll_t *rshim_usb_epoll_get(int fd)
+{
+  rshim_epoll_t *ep = NULL;
+  int i;
+
+  for (i = 0; i < RSHIM_USB_MAX_FDS; i++) {
+    if (rshim_usb_epoll[i].fd == fd)
+      return &rshim_usb_epoll[i];
+    if (!ep && rshim_usb_epoll[i].fd < 0)
+      ep = &rshim_usb_epoll[i];
+  }
+
+  if (ep) {
+    ep->fd = fd;
+    ep->kind = RSH_EPOLL_USB;
+    ep->bd = NULL;
+  }
+
+  return ep;
+}
+
+static void rshim_usb_pollfd_removed(int fd, void *user_data)
+{
+  int i;
+
+  for (i = 0; i < RSHIM_USB_MAX_FDS; i++) {
+    if (rshim_usb_epoll[i].fd == fd) {
+      epoll_ctl(rshim_usb_epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+      rshim_usb_epoll[i].fd = -1;
+      break;
+    }
+  }
+}
+
 static int rshim_usb_add_poll(libusb_context *ctx)
 {
   const struct libusb_pollfd **usb_pollfd = libusb_get_pollfds(ctx);
@@ -826,8 +1474,13 @@ static int rshim_usb_add_poll(libusb_context *ctx)
   memset(&event, 0, sizeof(event));
 
   while (usb_pollfd[i]) {
-    event.data.fd = usb_pollfd[i]->fd;
+    event.data.ptr = rshim_usb_epoll_get(usb_pollfd[i]->fd);
     event.events = 0;
+    if (!event.data.ptr) {
+      RSHIM_ERR("too many libusb fds\n");
+      rc = -ENOMEM;
+      break;
+    }
 
 #define	RSHIM_CONVERT(flag) do { \
   if (usb_pollfd[i]->events & flag) \
@@ -881,7 +1534,10 @@ static int rshim_hotplug_callback(struct libusb_context *ctx,
 
   case LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT:
     RSHIM_INFO("USB device leaving\n");
-    rshim_usb_disconnect(dev);
+    if (rshim_usb_gone_cnt < RSHIM_USB_MAX_GONE)
+      rshim_usb_gone[rshim_usb_gone_cnt++] = libusb_ref_device(dev);
+    else
+      rshim_usb_disconnect(dev, false);
     break;
 
   default:
@@ -948,6 +1604,9 @@ int rshim_usb_init(int epoll_fd)
 
   rshim_usb_ctx = ctx;
   rshim_usb_epoll_fd = epoll_fd;
+  for (i = 0; i < RSHIM_USB_MAX_FDS; i++)
+    rshim_usb_epoll[i].fd = -1;
+  libusb_set_pollfd_notifiers(ctx, NULL, rshim_usb_pollfd_removed, NULL);
 
 #if LIBUSB_API_VERSION >= 0x01000102
   num = sizeof(rshim_usb_product_ids) / sizeof(rshim_usb_product_ids[0]);
@@ -995,17 +1654,59 @@ int rshim_usb_init(int epoll_fd)
   return 0;
 }
 
-void rshim_usb_poll(void)
+/*
+ * Milliseconds until rshim_usb_poll(true) is needed for libusb timeouts,
+ * or -1 if libusb reports them through its own timer fd or has none.
+ */
+int rshim_usb_timeout(void)
+{
+  struct timeval tv;
+
+  if (!rshim_usb_ctx || libusb_pollfds_handle_timeouts(rshim_usb_ctx))
+    return -1;
+
+  if (libusb_get_next_timeout(rshim_usb_ctx, &tv) != 1)
+    return -1;
+
+  return tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+}
+
+/* Disconnect the devices which left. */
+static void rshim_usb_gone_run(void)
+{
+  libusb_device *dev;
+
+  while (rshim_usb_gone_cnt > 0) {
+    dev = rshim_usb_gone[--rshim_usb_gone_cnt];
+    rshim_usb_disconnect(dev, true);
+    libusb_unref_device(dev);
+  }
+}
+
+void rshim_usb_poll(bool timeout)
 {
   struct timeval tv = {0, 0};
 
   if (!rshim_usb_ctx)
     return;
 
+  rshim_usb_gone_run();
+
   if (rshim_usb_need_probe) {
     rshim_usb_need_probe = false;
     rshim_usb_probe();
   }
 
+  /* Timeouts are reported via fd if libusb uses timerfd. */
+  if (timeout && libusb_pollfds_handle_timeouts(rshim_usb_ctx))
+    return;
+
   libusb_handle_events_timeout_completed(rshim_usb_ctx, &tv, NULL);
+  rshim_usb_gone_run();
+
+  /* Probe the newly arrived device right away. */
+  if (rshim_usb_need_probe) {
+    rshim_usb_need_probe = false;
+    rshim_usb_probe();
+  }
 }